@@ -0,0 +1,179 @@
+// -*- C++ -*-
+// Bump allocation for the parse tree.
+// Copyright (C) 2017 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <vector>
+
+// Hands out memory from large chunks, which are only returned to the
+// system all at once.  This suits the many small objects of the parse
+// tree, which mostly live as long as the session does.  Objects that
+// are deleted early go on a free list for their size, for the next of
+// that size to reuse.  Not thread-safe.
+
+class bump_arena
+{
+public:
+  bump_arena (size_t chunk_size = 256 * 1024):
+    next(NULL), end(NULL), chunk_size(chunk_size),
+    bytes_used(0), bytes_allocated(0) { live().push_back (this); }
+  ~bump_arena ()
+  {
+    release ();
+    live().erase (std::find (live().begin(), live().end(), this));
+  }
+
+  void *allocate (size_t size)
+  {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    size_t i = size / alignment;
+    if (i < free_lists.size() && free_lists[i])
+      {
+        free_block *b = free_lists[i];
+        free_lists[i] = b->next;
+        bytes_used += size;
+        return b;
+      }
+    if (size > (size_t)(end - next))
+      return allocate_slow (size);
+    void *p = next;
+    next += size;
+    bytes_used += size;
+    return p;
+  }
+
+  // Take back an object of the given size, as passed to allocate().
+  void deallocate (void *p, size_t size)
+  {
+    size = (size + alignment - 1) & ~(alignment - 1);
+    size_t i = size / alignment;
+    if (i >= free_lists.size())
+      free_lists.resize (i + 1);
+    free_block *b = (free_block *) p;
+    b->next = free_lists[i];
+    free_lists[i] = b;
+    bytes_used -= size;
+  }
+
+  // Free everything at once.  Nothing allocated here may be used again.
+  void release ()
+  {
+    for (chunk_map::iterator it = chunks.begin(); it != chunks.end(); ++it)
+      std::free (it->first);
+    chunks.clear();
+    free_lists.clear();
+    next = end = NULL;
+    bytes_used = bytes_allocated = 0;
+  }
+
+  bool owns (const void *p) const
+  {
+    chunk_map::const_iterator it = chunks.upper_bound ((char *) p);
+    if (it == chunks.begin())
+      return false;
+    --it;
+    return (const char *) p < it->first + it->second;
+  }
+
+  // The live arena that P came from, if any.
+  static bump_arena *owner (const void *p)
+  {
+    for (size_t i = 0; i < live().size(); ++i)
+      if (live()[i]->owns (p))
+        return live()[i];
+    return NULL;
+  }
+
+  size_t used () const { return bytes_used; }
+  size_t allocated () const { return bytes_allocated; }
+  size_t chunk_count () const { return chunks.size(); }
+
+private:
+  static const size_t alignment = alignof(std::max_align_t);
+
+  struct free_block { free_block *next; };
+  typedef std::map<char*, size_t> chunk_map; // start -> length
+
+  bump_arena (const bump_arena&);
+  bump_arena& operator= (const bump_arena&);
+
+  static std::vector<bump_arena*>& live ()
+  {
+    static std::vector<bump_arena*> arenas;
+    return arenas;
+  }
+
+  void *allocate_slow (size_t size)
+  {
+    // Big objects get a chunk of their own, leaving the current one be.
+    bool own_chunk = size > chunk_size / 4;
+    size_t length = own_chunk ? size : chunk_size;
+    char *chunk = (char *) std::malloc (length);
+    if (!chunk)
+      throw std::bad_alloc();
+    chunks[chunk] = length;
+    bytes_allocated += length;
+    bytes_used += size;
+    if (own_chunk)
+      return chunk;
+    next = chunk + size;
+    end = chunk + length;
+    return chunk;
+  }
+
+  chunk_map chunks;
+  std::vector<free_block*> free_lists; // by size / alignment
+  char *next, *end;
+  size_t chunk_size;
+  size_t bytes_used, bytes_allocated;
+};
+
+
+// Classes deriving from this are allocated from the current arena, as
+// set by the session, and freed along with it.  Deleting one of them
+// hands its memory back to the arena it came from for reuse.  With no
+// arena, they come from the heap and go back to it when deleted.
+//
+// A deleted object's size must be its allocated size, so any class
+// deleted through a pointer to one of its bases needs a virtual
+// destructor, as it would anyway.
+
+struct arena_allocated
+{
+  static bump_arena *&current_arena ()
+  {
+    static bump_arena *arena = NULL;
+    return arena;
+  }
+
+  static void *operator new (size_t size)
+  {
+    bump_arena *arena = current_arena();
+    return arena ? arena->allocate (size) : ::operator new (size);
+  }
+
+  static void operator delete (void *p, size_t size)
+  {
+    bump_arena *arena = bump_arena::owner (p);
+    if (arena)
+      arena->deallocate (p, size);
+    else
+      ::operator delete (p);
+  }
+};
+
+#endif // ARENA_H
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
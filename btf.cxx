@@ -0,0 +1,480 @@
+// Kernel BTF type information, for resolving @cast without debuginfo.
+// Copyright (C) 2017 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#include "config.h"
+#include "btf.h"
+#include "session.h"
+#include "util.h"
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+extern "C" {
+#include <sys/time.h>
+#include <sys/utsname.h>
+}
+
+using namespace std;
+
+
+// The on-disk format, as in <linux/btf.h>, which we don't require.
+
+#define STAP_BTF_MAGIC 0xeB9F
+
+struct stap_btf_header
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t hdr_len;
+  uint32_t type_off;
+  uint32_t type_len;
+  uint32_t str_off;
+  uint32_t str_len;
+};
+
+struct stap_btf_type
+{
+  uint32_t name_off;
+  uint32_t info;                // vlen:16, kind:5 @24, kind_flag @31
+  uint32_t size_type;
+};
+
+struct stap_btf_array
+{
+  uint32_t type;
+  uint32_t index_type;
+  uint32_t nelems;
+};
+
+struct stap_btf_member
+{
+  uint32_t name_off;
+  uint32_t type;
+  uint32_t offset;
+};
+
+
+bool
+btf_info::usable (systemtap_session& s)
+{
+  // The BTF in /sys describes the kernel we're running on, so it's no
+  // good for cross-compiling, compile servers or remote targets.
+  struct utsname buf;
+  if (uname (&buf) != 0)
+    return false;
+  return (s.sysroot.empty() && s.remote_uris.empty() && !s.client_options
+          && s.kernel_release == buf.release
+          && s.architecture == normalize_machine (buf.machine));
+}
+
+
+btf_info::btf_info (btf_info *base):
+  base(base), strings(NULL), strings_len(0),
+  first_id(base ? base->first_id + base->types.size() : 0),
+  ptr_size(base ? base->ptr_size : sizeof(long))
+{
+}
+
+
+btf_info *
+btf_info::load (systemtap_session& s, const string& path, btf_info *base)
+{
+  struct timeval tv_before;
+  gettimeofday (&tv_before, NULL);
+
+  btf_info *btf = new btf_info (base);
+  if (!btf->parse (s, path))
+    {
+      delete btf;
+      return NULL;
+    }
+
+  if (s.verbose > 2)
+    {
+      struct timeval tv_after;
+      gettimeofday (&tv_after, NULL);
+      clog << _F("Pass 2: loaded %zu BTF types from %s in %ld ms",
+                 btf->types.size(), path.c_str(),
+                 (long)((tv_after.tv_sec - tv_before.tv_sec) * 1000
+                        + (tv_after.tv_usec - tv_before.tv_usec) / 1000))
+           << endl;
+    }
+  return btf;
+}
+
+
+bool
+btf_info::parse (systemtap_session& s, const string& path)
+{
+  ifstream in (path.c_str(), ios::binary);
+  if (!in)
+    return false;
+  ostringstream contents;
+  contents << in.rdbuf();
+  data = contents.str();
+
+  stap_btf_header hdr;
+  if (data.size() < sizeof(hdr))
+    return false;
+  memcpy (&hdr, data.data(), sizeof(hdr));
+  if (hdr.magic != STAP_BTF_MAGIC || hdr.version != 1
+      || hdr.hdr_len < sizeof(hdr) || hdr.hdr_len > data.size()
+      || (uint64_t) hdr.type_off + hdr.type_len > data.size() - hdr.hdr_len
+      || (uint64_t) hdr.str_off + hdr.str_len > data.size() - hdr.hdr_len
+      || hdr.str_len == 0
+      || data[hdr.hdr_len + hdr.str_off + hdr.str_len - 1] != '\0')
+    {
+      if (s.verbose > 1)
+        clog << _F("Pass 2: ignoring invalid BTF in %s", path.c_str()) << endl;
+      return false;
+    }
+
+  strings = data.data() + hdr.hdr_len + hdr.str_off;
+  strings_len = hdr.str_len;
+
+  // Type ids start at 1 in the kernel, with 0 being void.
+  if (!base)
+    {
+      btf_type none = btf_type();
+      none.name = "";
+      types.push_back (none);
+    }
+
+  const char *p = data.data() + hdr.hdr_len + hdr.type_off;
+  const char *end = p + hdr.type_len;
+  while (p < end)
+    {
+      stap_btf_type raw;
+      if (end - p < (ptrdiff_t) sizeof(raw))
+        return false;
+      memcpy (&raw, p, sizeof(raw));
+      p += sizeof(raw);
+
+      btf_type t = btf_type();
+      unsigned vlen = raw.info & 0xffff;
+      t.kind = (raw.info >> 24) & 0x1f;
+      t.kind_flag = raw.info >> 31;
+      t.name = string_at (raw.name_off);
+      t.size = t.type = raw.size_type;
+
+      size_t extra;
+      switch (t.kind)
+        {
+        case btf_type::kind_int:
+        case btf_type::kind_var:
+        case btf_type::kind_decl_tag:
+          extra = 4;
+          break;
+        case btf_type::kind_array:
+          extra = sizeof(stap_btf_array);
+          break;
+        case btf_type::kind_struct:
+        case btf_type::kind_union:
+        case btf_type::kind_datasec:
+        case btf_type::kind_enum64:
+          extra = 12 * vlen;
+          break;
+        case btf_type::kind_enum:
+        case btf_type::kind_func_proto:
+          extra = 8 * vlen;
+          break;
+        case btf_type::kind_ptr:
+        case btf_type::kind_fwd:
+        case btf_type::kind_typedef:
+        case btf_type::kind_volatile:
+        case btf_type::kind_const:
+        case btf_type::kind_restrict:
+        case btf_type::kind_func:
+        case btf_type::kind_float:
+        case btf_type::kind_type_tag:
+          extra = 0;
+          break;
+        default:
+          if (s.verbose > 1)
+            clog << _F("Pass 2: unknown BTF kind %u in %s",
+                       t.kind, path.c_str()) << endl;
+          return false;
+        }
+      if ((size_t)(end - p) < extra)
+        return false;
+
+      if (t.kind == btf_type::kind_int)
+        {
+          uint32_t encoding;
+          memcpy (&encoding, p, sizeof(encoding));
+          t.int_signed = (encoding >> 24) & 1;
+          t.int_offset = (encoding >> 16) & 0xff;
+          t.int_bits = encoding & 0xff;
+        }
+      else if (t.kind == btf_type::kind_array)
+        {
+          stap_btf_array array;
+          memcpy (&array, p, sizeof(array));
+          t.type = array.type;
+          t.nelems = array.nelems;
+        }
+      else if (t.kind == btf_type::kind_struct
+               || t.kind == btf_type::kind_union)
+        {
+          t.members.resize (vlen);
+          for (unsigned i = 0; i < vlen; ++i)
+            {
+              stap_btf_member member;
+              memcpy (&member, p + i * sizeof(member), sizeof(member));
+              t.members[i].name = string_at (member.name_off);
+              t.members[i].type = member.type;
+              if (t.kind_flag)
+                {
+                  t.members[i].bit_offset = member.offset & 0xffffff;
+                  t.members[i].bitfield_size = member.offset >> 24;
+                }
+              else
+                {
+                  t.members[i].bit_offset = member.offset;
+                  t.members[i].bitfield_size = 0;
+                }
+            }
+        }
+      p += extra;
+
+      uint32_t id = first_id + types.size();
+      types.push_back (t);
+
+      if (!*t.name)
+        continue;
+      switch (t.kind)
+        {
+        case btf_type::kind_struct:
+          add_name ("struct " + string(t.name), id);
+          break;
+        case btf_type::kind_union:
+          add_name ("union " + string(t.name), id);
+          break;
+        case btf_type::kind_enum:
+        case btf_type::kind_enum64:
+          add_name ("enum " + string(t.name), id);
+          break;
+        case btf_type::kind_int:
+          if (!strcmp (t.name, "long int"))
+            ptr_size = t.size;
+          /* fallthrough */
+        case btf_type::kind_typedef:
+        case btf_type::kind_float:
+          add_name (string(t.name), id);
+          break;
+        }
+    }
+
+  return true;
+}
+
+
+// Name a type, unless the name is taken already.  BTF can carry several
+// types of the same name, when deduplication couldn't merge them, and
+// then an empty struct or union shouldn't shadow a complete one.
+void
+btf_info::add_name (const string& name, uint32_t id)
+{
+  auto res = names.insert (make_pair (name, id));
+  if (res.second)
+    return;
+
+  const btf_type *old = type (res.first->second);
+  const btf_type *t = type (id);
+  if ((t->kind == btf_type::kind_struct || t->kind == btf_type::kind_union)
+      && old->members.empty() && !t->members.empty())
+    res.first->second = id;
+}
+
+
+const char *
+btf_info::string_at (uint32_t offset) const
+{
+  if (base)
+    {
+      if (offset < base->strings_len)
+        return base->string_at (offset);
+      offset -= base->strings_len;
+    }
+  return offset < strings_len ? strings + offset : "";
+}
+
+
+const btf_type *
+btf_info::type (uint32_t id) const
+{
+  if (id < first_id)
+    return base ? base->type (id) : NULL;
+  if (id == 0 || id - first_id >= types.size())
+    return NULL;
+  return &types[id - first_id];
+}
+
+
+uint32_t
+btf_info::strip (uint32_t id) const
+{
+  // Bound the walk, in case of a malformed loop.
+  for (unsigned depth = 0; depth < 64; ++depth)
+    {
+      const btf_type *t = type (id);
+      if (!t)
+        return 0;
+      switch (t->kind)
+        {
+        case btf_type::kind_typedef:
+        case btf_type::kind_volatile:
+        case btf_type::kind_const:
+        case btf_type::kind_restrict:
+        case btf_type::kind_type_tag:
+          id = t->type;
+          break;
+
+        case btf_type::kind_fwd:
+          {
+            // kind_flag marks a forward union
+            uint32_t def = find ((t->kind_flag ? "union " : "struct ")
+                                 + string(t->name));
+            return def ? def : id;
+          }
+
+        default:
+          return id;
+        }
+    }
+  return 0;
+}
+
+
+uint32_t
+btf_info::find (const string& name) const
+{
+  auto it = names.find (name);
+  if (it != names.end())
+    return it->second;
+  return base ? base->find (name) : 0;
+}
+
+
+bool
+btf_info::find_member (uint32_t id, const string& name,
+                       btf_member& member) const
+{
+  const btf_type *t = type (strip (id));
+  if (!t || (t->kind != btf_type::kind_struct
+             && t->kind != btf_type::kind_union))
+    return false;
+
+  for (unsigned i = 0; i < t->members.size(); ++i)
+    {
+      const btf_member& m = t->members[i];
+      if (name == m.name)
+        {
+          member = m;
+          return true;
+        }
+
+      // Need to recurse for anonymous structs/unions.
+      if (!*m.name && find_member (m.type, name, member))
+        {
+          member.bit_offset += m.bit_offset;
+          return true;
+        }
+    }
+  return false;
+}
+
+
+void
+btf_info::get_members (uint32_t id, set<string>& names) const
+{
+  const btf_type *t = type (strip (id));
+  if (!t || (t->kind != btf_type::kind_struct
+             && t->kind != btf_type::kind_union))
+    return;
+
+  for (unsigned i = 0; i < t->members.size(); ++i)
+    {
+      const btf_member& m = t->members[i];
+      if (*m.name)
+        names.insert (m.name);
+      else
+        get_members (m.type, names);
+    }
+}
+
+
+uint64_t
+btf_info::size_of (uint32_t id, unsigned depth) const
+{
+  // Bound the recursion, like strip(), in case of a malformed loop.
+  const btf_type *t = type (strip (id));
+  if (!t || depth >= 64)
+    return 0;
+  switch (t->kind)
+    {
+    case btf_type::kind_int:
+    case btf_type::kind_enum:
+    case btf_type::kind_enum64:
+    case btf_type::kind_struct:
+    case btf_type::kind_union:
+    case btf_type::kind_float:
+      return t->size;
+    case btf_type::kind_ptr:
+      return ptr_size;
+    case btf_type::kind_array:
+      return t->nelems * size_of (t->type, depth + 1);
+    default:
+      return 0;
+    }
+}
+
+
+string
+btf_info::type_name (uint32_t id, unsigned depth) const
+{
+  const btf_type *t = type (id);
+  if (!t)
+    return "void";
+  if (depth >= 64)
+    return "...";
+
+  string name = *t->name ? t->name : "<anonymous>";
+  switch (t->kind)
+    {
+    case btf_type::kind_struct:
+      return "struct " + name;
+    case btf_type::kind_union:
+      return "union " + name;
+    case btf_type::kind_enum:
+    case btf_type::kind_enum64:
+      return "enum " + name;
+    case btf_type::kind_fwd:
+      return (t->kind_flag ? "union " : "struct ") + name;
+    case btf_type::kind_ptr:
+      return type_name (t->type, depth + 1) + "*";
+    case btf_type::kind_array:
+      return type_name (t->type, depth + 1) + "[" + lex_cast (t->nelems) + "]";
+    case btf_type::kind_const:
+      return type_name (t->type, depth + 1) + " const";
+    case btf_type::kind_volatile:
+      return type_name (t->type, depth + 1) + " volatile";
+    case btf_type::kind_restrict:
+      return type_name (t->type, depth + 1) + " restrict";
+    case btf_type::kind_type_tag:
+      return type_name (t->type, depth + 1);
+    default:
+      return name;
+    }
+}
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
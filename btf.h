@@ -0,0 +1,109 @@
+// -*- C++ -*-
+// Kernel BTF type information, for resolving @cast without debuginfo.
+// Copyright (C) 2017 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef BTF_H
+#define BTF_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+struct systemtap_session;
+
+struct btf_member
+{
+  const char *name;             // "" if anonymous
+  uint32_t type;
+  uint32_t bit_offset;
+  uint32_t bitfield_size;       // 0 unless a bit field
+};
+
+struct btf_type
+{
+  // The kinds of types, as numbered in <linux/btf.h>
+  enum
+    {
+      kind_unknown, kind_int, kind_ptr, kind_array, kind_struct,
+      kind_union, kind_enum, kind_fwd, kind_typedef, kind_volatile,
+      kind_const, kind_restrict, kind_func, kind_func_proto, kind_var,
+      kind_datasec, kind_float, kind_decl_tag, kind_type_tag, kind_enum64,
+      kind_max = kind_enum64
+    };
+
+  unsigned kind;
+  bool kind_flag;
+  const char *name;             // "" if anonymous
+  uint32_t size;                // int, enum, struct, union, float
+  uint32_t type;                // ptr, array, typedef, qualifiers
+
+  uint32_t nelems;              // array
+  bool int_signed;              // int
+  uint32_t int_offset;          // int
+  uint32_t int_bits;            // int
+
+  std::vector<btf_member> members; // struct, union
+};
+
+
+// The types of the running kernel, from /sys/kernel/btf/vmlinux, or of
+// one of its modules, whose type ids and strings extend the kernel's.
+
+class btf_info
+{
+public:
+  // Whether the session is for the running kernel, whose BTF we can use.
+  static bool usable (systemtap_session& s);
+
+  // Returns NULL if PATH isn't readable BTF.
+  static btf_info *load (systemtap_session& s, const std::string& path,
+                         btf_info *base = NULL);
+
+  const btf_type *type (uint32_t id) const; // NULL for void or a bad id
+
+  // Skip past typedefs and qualifiers, and forward declarations to
+  // their definition if there is one.
+  uint32_t strip (uint32_t id) const;
+
+  // Look up a type by "struct NAME", "union NAME", "enum NAME", or a
+  // bare typedef or base type NAME.  Returns 0 if none.
+  uint32_t find (const std::string& name) const;
+
+  // Look up a member of a struct or union, including those of its
+  // anonymous structs and unions, with the bit offset from the start.
+  bool find_member (uint32_t id, const std::string& name,
+                    btf_member& member) const;
+  void get_members (uint32_t id, std::set<std::string>& names) const;
+
+  uint64_t size_of (uint32_t id, unsigned depth = 0) const; // 0 if unsized
+  uint32_t pointer_size () const { return ptr_size; }
+  std::string type_name (uint32_t id, unsigned depth = 0) const;
+
+private:
+  btf_info (btf_info *base);
+
+  bool parse (systemtap_session& s, const std::string& path);
+  void add_name (const std::string& name, uint32_t id);
+  const char *string_at (uint32_t offset) const;
+
+  btf_info *base;
+  std::string data;
+  const char *strings;
+  uint32_t strings_len;
+  uint32_t first_id;            // the id of types[0]
+  uint32_t ptr_size;
+  std::vector<btf_type> types;
+  std::unordered_map<std::string, uint32_t> names;
+};
+
+#endif // BTF_H
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
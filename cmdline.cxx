@@ -60,5 +60,6 @@ struct option stap_long_options[] = {
   { "target-namespaces",           required_argument, NULL, LONG_OPT_TARGET_NAMESPACES },
   { "monitor",                     optional_argument, NULL, LONG_OPT_MONITOR },
   { "interactive",                 no_argument,       NULL, LONG_OPT_INTERACTIVE},
+  { "dwarf-cache-limit",           required_argument, NULL, LONG_OPT_DWARF_CACHE_LIMIT },
   { NULL, 0, NULL, 0 }
 };
@@ -64,6 +64,7 @@ enum {
   LONG_OPT_TARGET_NAMESPACES,
   LONG_OPT_MONITOR,
   LONG_OPT_INTERACTIVE,
+  LONG_OPT_DWARF_CACHE_LIMIT,
 };
 
 // NB: when adding new options, consider very carefully whether they
@@ -74,9 +74,11 @@ static string TOK_KERNEL("kernel");
 
 dwflpp::dwflpp(systemtap_session & session, const string& name, bool kernel_p):
   sess(session), module(NULL), module_bias(0), mod_info(NULL),
-  module_start(0), module_end(0), cu(NULL), dwfl(NULL),
-  module_dwarf(NULL), function(NULL), blacklist_func(), blacklist_func_ret(),
-  blacklist_file(),  blacklist_enabled(false)
+  module_start(0), module_end(0), cu(NULL), dwfl(NULL), prefetcher(NULL),
+  module_dwarf(NULL), function(NULL), cu_cache_bytes(0),
+  cu_cache_peak_bytes(0), cu_cache_peak_cus(0), cu_cache_evictions(0),
+  cu_iteration_depth(0), cu_cache_current(NULL), blacklist_func(),
+  blacklist_func_ret(), blacklist_file(),  blacklist_enabled(false)
 {
   if (kernel_p)
     setup_kernel(name, session);
@@ -91,8 +93,10 @@ dwflpp::dwflpp(systemtap_session & session, const string& name, bool kernel_p):
 dwflpp::dwflpp(systemtap_session & session, const vector<string>& names,
 	       bool kernel_p):
   sess(session), module(NULL), module_bias(0), mod_info(NULL),
-  module_start(0), module_end(0), cu(NULL), dwfl(NULL),
-  module_dwarf(NULL), function(NULL), blacklist_enabled(false)
+  module_start(0), module_end(0), cu(NULL), dwfl(NULL), prefetcher(NULL),
+  module_dwarf(NULL), function(NULL), cu_cache_bytes(0),
+  cu_cache_peak_bytes(0), cu_cache_peak_cus(0), cu_cache_evictions(0),
+  cu_iteration_depth(0), cu_cache_current(NULL), blacklist_enabled(false)
 {
   if (kernel_p)
     setup_kernel(names);
@@ -102,6 +106,11 @@ dwflpp::dwflpp(systemtap_session & session, const vector<string>& names,
 
 dwflpp::~dwflpp()
 {
+  if (sess.verbose > 1 && cu_cache_peak_bytes)
+    clog << _F("Pass 2: peak per-CU DWARF caches %zuKiB in %zu CUs, "
+               "%u evicted", cu_cache_peak_bytes >> 10, cu_cache_peak_cus,
+               cu_cache_evictions) << endl;
+
   delete_map(module_cu_cache);
   delete_map(cu_function_cache);
   delete_map(mod_function_cache);
@@ -115,6 +124,7 @@ dwflpp::~dwflpp()
 
   delete_map(cu_entry_pc_cache);
 
+  delete prefetcher;
   if (dwfl)
     dwfl_end(dwfl);
   // NB: don't "delete mod_info;", as that may be shared
@@ -132,6 +142,8 @@ module_cache::~module_cache ()
 void
 dwflpp::get_module_dwarf(bool required, bool report)
 {
+  if (prefetcher)
+    prefetcher->wait(module);
   module_dwarf = dwfl_module_getdwarf(module, &module_bias);
   mod_info->dwarf_status = (module_dwarf ? info_present : info_absent);
   if (!module_dwarf && report)
@@ -197,6 +209,7 @@ dwflpp::focus_on_cu(Dwarf_Die * c)
   assert(module);
 
   cu = c;
+  touch_cu_cache(c);
 
   // Reset existing pointers and names
   function_name.clear();
@@ -353,6 +366,9 @@ dwflpp::setup_kernel(const string& name, systemtap_session & s, bool debuginfo_n
     }
 
   build_kernel_blacklist();
+
+  if (debuginfo_needed)
+    prefetcher = debuginfo_prefetcher::start(sess, dwfl, vector<string>(1, name));
 }
 
 void
@@ -379,6 +395,9 @@ dwflpp::setup_kernel(const vector<string> &names, bool debuginfo_needed)
     }
 
   build_kernel_blacklist();
+
+  if (debuginfo_needed)
+    prefetcher = debuginfo_prefetcher::start(sess, dwfl, names);
 }
 
 
@@ -396,6 +415,26 @@ dwflpp::setup_user(const vector<string>& modules, bool debuginfo_needed)
                            dwfl);
 
   build_user_blacklist();
+
+  if (dwfl && debuginfo_needed)
+    prefetcher = debuginfo_prefetcher::start(sess, dwfl, modules);
+}
+
+// Wait for each module's prefetch before the callback gets to see it.
+struct prefetched_modules_data
+{
+  debuginfo_prefetcher *prefetcher;
+  int (*callback)(Dwfl_Module*, void**, const char*, Dwarf_Addr, void*);
+  void *data;
+};
+
+static int
+prefetched_module_callback(Dwfl_Module *mod, void **userdata,
+                           const char *name, Dwarf_Addr base, void *arg)
+{
+  prefetched_modules_data *pd = (prefetched_modules_data *) arg;
+  pd->prefetcher->wait(mod);
+  return pd->callback(mod, userdata, name, base, pd->data);
 }
 
 template<> void
@@ -406,7 +445,13 @@ dwflpp::iterate_over_modules<void>(int (*callback)(Dwfl_Module*,
                                                    void*),
                                    void *data)
 {
-  dwfl_getmodules (dwfl, callback, data, 0);
+  if (prefetcher)
+    {
+      prefetched_modules_data pd = { prefetcher, callback, data };
+      dwfl_getmodules (dwfl, &prefetched_module_callback, &pd, 0);
+    }
+  else
+    dwfl_getmodules (dwfl, callback, data, 0);
 
   // Don't complain if we exited dwfl_getmodules early.
   // This could be a $target variable error that will be
@@ -472,12 +517,107 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
       module_tus_read.insert(dw);
     }
 
+  // Nested iterations may run from a callback that's still using the
+  // caches of its own cu, so only the outermost trims them.
+  save_and_restore<unsigned> depth(&cu_iteration_depth, cu_iteration_depth + 1);
   for (auto i = v->begin(); i != v->end(); ++i)
     {
       int rc = (*callback)(&*i, data);
       assert_no_interrupts();
       if (rc != DWARF_CB_OK)
         break;
+      if (cu_iteration_depth == 1)
+        trim_cu_caches();
+    }
+}
+
+
+// Erase the cache for cu_addr from one of the per-cu maps.
+template <class M> static void
+erase_cu_cache(M& caches, void *cu_addr)
+{
+  auto it = caches.find(cu_addr);
+  if (it != caches.end())
+    {
+      delete it->second;
+      caches.erase(it);
+    }
+}
+
+
+void
+dwflpp::note_cu_cache(Dwarf_Die *c, size_t bytes)
+{
+  auto it = cu_cache_usages.find(c->addr);
+  if (it == cu_cache_usages.end())
+    {
+      cu_cache_usage usage;
+      usage.bytes = 0;
+      usage.lru = cu_cache_lru.insert(cu_cache_lru.begin(), c->addr);
+      it = cu_cache_usages.insert(make_pair(c->addr, usage)).first;
+    }
+  it->second.bytes += bytes;
+  cu_cache_bytes += bytes;
+
+  cu_cache_peak_bytes = max(cu_cache_peak_bytes, cu_cache_bytes);
+  cu_cache_peak_cus = max(cu_cache_peak_cus, cu_cache_usages.size());
+}
+
+
+void
+dwflpp::touch_cu_cache(Dwarf_Die *c)
+{
+  // NB: cu may be on the caller's stack, so just remember its addr.
+  cu_cache_current = c->addr;
+  auto it = cu_cache_usages.find(c->addr);
+  if (it != cu_cache_usages.end())
+    cu_cache_lru.splice(cu_cache_lru.begin(), cu_cache_lru, it->second.lru);
+}
+
+
+void
+dwflpp::evict_cu_caches(void *cu_addr)
+{
+  auto it = cu_cache_usages.find(cu_addr);
+  if (it == cu_cache_usages.end())
+    return;
+  cu_cache_bytes -= it->second.bytes;
+  cu_cache_lru.erase(it->second.lru);
+  cu_cache_usages.erase(it);
+  ++cu_cache_evictions;
+
+  erase_cu_cache(cu_function_cache, cu_addr);
+  erase_cu_cache(cu_die_parent_cache, cu_addr);
+  erase_cu_cache(cu_entry_pc_cache, cu_addr);
+
+  auto lines = cu_lines_cache.find(cu_addr);
+  if (lines != cu_lines_cache.end())
+    {
+      delete_map(*lines->second);
+      delete lines->second;
+      cu_lines_cache.erase(lines);
+    }
+}
+
+
+// Called between cus, to bring the per-cu caches back under
+// --dwarf-cache-limit.  Only the current cu's caches are sure to stay.
+void
+dwflpp::trim_cu_caches()
+{
+  if (!sess.dwarf_cache_limit)
+    return;
+
+  size_t limit = sess.dwarf_cache_limit << 20;
+  while (cu_cache_bytes > limit && !cu_cache_lru.empty())
+    {
+      void *victim = cu_cache_lru.back();
+      if (victim == cu_cache_current)
+        break;
+      if (sess.verbose > 4)
+        clog << _F("evicting per-CU caches of %s:%p", module_name.c_str(),
+                   victim) << endl;
+      evict_cu_caches(victim);
     }
 }
 
@@ -656,6 +796,8 @@ dwflpp::get_die_parents()
       if (sess.verbose > 4)
         clog << _F("die parent cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), parents->size()) << endl;
+      note_cu_cache(cu, parents->size() * (sizeof(*parents->begin())
+                                           + 2 * sizeof(void*)));
     }
   return parents;
 }
@@ -983,6 +1125,7 @@ dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), v->size()) << endl;
       mod_info->update_symtab(v);
+      note_cu_cache(cu, v->size() * (sizeof(*v->begin()) + 2 * sizeof(void*)));
     }
 
   auto range = v->equal_range(function);
@@ -1532,11 +1675,11 @@ dwflpp::get_cu_lines_sorted_by_lineno(const char *srcfile)
 {
   assert(cu);
 
-  srcfile_lines_cache_t *srcfile_lines = cu_lines_cache[cu];
+  srcfile_lines_cache_t *srcfile_lines = cu_lines_cache[cu->addr];
   if (!srcfile_lines)
     {
       srcfile_lines = new srcfile_lines_cache_t();
-      cu_lines_cache[cu] = srcfile_lines;
+      cu_lines_cache[cu->addr] = srcfile_lines;
     }
 
   lines_t *lines = (*srcfile_lines)[srcfile];
@@ -1561,6 +1704,8 @@ dwflpp::get_cu_lines_sorted_by_lineno(const char *srcfile)
 
       if (lines->size() > 1)
         sort(lines->begin(), lines->end(), compare_lines);
+      note_cu_cache(cu, strlen(srcfile) + sizeof(*lines)
+                        + lines->capacity() * sizeof(Dwarf_Line*));
 
       if (sess.verbose > 3)
         {
@@ -4705,6 +4850,8 @@ dwflpp::check_cu_entry_pc (Dwarf_Die *cu, Dwarf_Addr pc)
       entry_pcs = new entry_pc_cache_t;
       pair<dwflpp&, entry_pc_cache_t&> data (*this, *entry_pcs);
       int rc = iterate_over_functions (cu_entry_pc_caching_callback, &data, "*");
+      note_cu_cache(cu, entry_pcs->size() * (sizeof(Dwarf_Addr)
+                                             + 2 * sizeof(void*)));
       if (rc != DWARF_CB_OK)
         return false;
     }
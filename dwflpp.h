@@ -20,6 +20,7 @@
 
 #include <cstring>
 #include <iostream>
+#include <list>
 #include <map>
 #include <set>
 #include <string>
@@ -102,6 +103,20 @@ typedef std::vector<func_info> func_info_map_t;
 typedef std::vector<inline_instance_info> inline_instance_map_t;
 
 
+// A probe from a module's .note.stapsdt, with its addresses as found in
+// the note, i.e. not yet adjusted for .stapsdt.base or the module bias.
+struct
+sdt_note
+{
+  std::string provider;
+  std::string name;
+  std::string args;
+  Dwarf_Addr pc;
+  Dwarf_Addr base_ref;
+  Dwarf_Addr semaphore;
+};
+
+
 struct
 module_info
 {
@@ -118,6 +133,11 @@ module_info
   std::set<interned_string> plt_funcs;
   std::set<std::pair<std::string,std::string> > marks; /* <provider,name> */
 
+  info_status sdt_notes_status; // .note.stapsdt indexed?
+  std::vector<sdt_note> sdt_notes;
+  std::map<std::pair<std::string,std::string>,
+           std::vector<unsigned> > sdt_note_index; /* <provider,name> -> sdt_notes */
+
   void get_symtab();
   void update_symtab(cu_function_cache_t *funcs);
 
@@ -128,7 +148,8 @@ module_info
     bias(0),
     sym_table(NULL),
     dwarf_status(info_unknown),
-    symtab_status(info_unknown)
+    symtab_status(info_unknown),
+    sdt_notes_status(info_unknown)
   {}
 
   ~module_info();
@@ -485,6 +506,7 @@ struct dwflpp
 
 private:
   Dwfl * dwfl;
+  debuginfo_prefetcher * prefetcher;
 
   // These are "current" values we focus on.
   Dwarf * module_dwarf;
@@ -514,6 +536,29 @@ private:
   cu_entry_pc_cache_t cu_entry_pc_cache;
   bool check_cu_entry_pc(Dwarf_Die *cu, Dwarf_Addr pc);
 
+  // The function, die parent, lines and entry_pc caches above are
+  // tracked per cu in LRU order, so that with --dwarf-cache-limit the
+  // least recently used can be dropped between cus as we stream
+  // through a module.  (The inline cache is indexed by abstract origin,
+  // which may be in another cu, so it stays.)
+  struct cu_cache_usage
+  {
+    size_t bytes;
+    std::list<void*>::iterator lru;
+  };
+  std::list<void*> cu_cache_lru; // most recently used first
+  std::unordered_map<void*, cu_cache_usage> cu_cache_usages;
+  size_t cu_cache_bytes;
+  size_t cu_cache_peak_bytes;
+  size_t cu_cache_peak_cus;
+  unsigned cu_cache_evictions;
+  unsigned cu_iteration_depth;
+  void *cu_cache_current;
+  void note_cu_cache(Dwarf_Die *c, size_t bytes);
+  void touch_cu_cache(Dwarf_Die *c);
+  void evict_cu_caches(void *cu_addr);
+  void trim_cu_caches();
+
   Dwarf_Die* get_parent_scope(Dwarf_Die* die);
 
   /* The global alias cache is used to resolve any DIE found in a
@@ -1441,6 +1441,216 @@ semantic_pass_stats (systemtap_session & sess)
 
 // ------------------------------------------------------------------------
 
+// A probe that prints out a global array and then empties it, as in
+//
+//   foreach (k in m) printf (...)
+//   delete m
+//
+// holds m's lock for as long as all that takes, stalling each probe
+// that updates m meanwhile.  Instead, have it swap m with an empty
+// spare array, letting go of m's lock right after, then iterate and
+// delete the spare, which no other probe touches.
+//
+// A loop that errors out leaves the rest of its rows in the spare
+// rather than in m.  So pairs whose error could be caught or outlived
+// are left alone: those inside a try block, or when handler errors
+// don't end the session.  Pairs inside loops are left alone as well,
+// since m's lock is only let go of once per run of the probe.
+//
+// XXX: The retired spare is still printed and deleted by the probe
+// itself.  Serializing it in binary to user space from process
+// context, possibly as deltas against the previous snapshot, would
+// need a new opt-in facility, and is yet to be done.
+
+struct symbol_renamer: public traversing_visitor
+{
+  vardecl *from, *to;
+  symbol_renamer (vardecl *f, vardecl *t): from(f), to(t) {}
+
+  void visit_symbol (symbol* e)
+  {
+    if (e->referent == from)
+      {
+        e->referent = to;
+        e->name = to->name;
+      }
+  }
+};
+
+
+// Whether a statement may end the probe early, skipping what follows.
+struct probe_exit_finder: public functioncall_traversing_visitor
+{
+  bool found;
+  probe_exit_finder (): found(false) {}
+
+  void visit_next_statement (next_statement*) { found = true; }
+  void visit_embeddedcode (embeddedcode* s)
+  {
+    if (s->code.find("STAP_NEXT;") != string::npos)
+      found = true;
+  }
+};
+
+
+struct snapshot_array_finder: public traversing_visitor
+{
+  systemtap_session& session;
+  derived_probe* current_probe;
+  unsigned count;
+  unsigned loop_depth, try_depth;
+
+  snapshot_array_finder (systemtap_session& s):
+    session(s), current_probe(0), count(0), loop_depth(0), try_depth(0) {}
+
+  void visit_block (block* b);
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_try_block (try_block* s);
+  bool swap_out (foreach_loop* f, delete_statement* d, vardecl* live);
+};
+
+
+void
+snapshot_array_finder::visit_block (block* b)
+{
+  for (size_t i = 0; !loop_depth && !try_depth
+                     && i + 1 < b->statements.size(); ++i)
+    {
+      foreach_loop* f = dynamic_cast<foreach_loop*> (b->statements[i]);
+      delete_statement* d = dynamic_cast<delete_statement*> (b->statements[i+1]);
+      if (!f || !d || f->snapshot_of)
+        continue;
+
+      symbol *array = NULL, *deleted = NULL;
+      hist_op *hist = NULL;
+      classify_indexable (f->base, array, hist);
+      if (!array || !d->value->is_symbol (deleted)
+          || deleted->referent != array->referent)
+        continue;
+
+      vardecl* live = array->referent;
+      if (find (session.globals.begin(), session.globals.end(), live)
+          == session.globals.end())
+        continue;
+
+      if (swap_out (f, d, live) && session.verbose > 2)
+        clog << _F("swapping out array %s for foreach at %s",
+                   live->unmangled_name.to_string().c_str(),
+                   lex_cast(*f->tok).c_str()) << endl;
+    }
+
+  traversing_visitor::visit_block (b);
+}
+
+
+void
+snapshot_array_finder::visit_for_loop (for_loop* s)
+{
+  loop_depth++;
+  traversing_visitor::visit_for_loop (s);
+  loop_depth--;
+}
+
+
+void
+snapshot_array_finder::visit_foreach_loop (foreach_loop* s)
+{
+  loop_depth++;
+  traversing_visitor::visit_foreach_loop (s);
+  loop_depth--;
+}
+
+
+void
+snapshot_array_finder::visit_try_block (try_block* s)
+{
+  try_depth++;
+  if (s->try_block)
+    s->try_block->visit (this);
+  try_depth--;
+  if (s->catch_error_var)
+    s->catch_error_var->visit (this);
+  if (s->catch_block)
+    s->catch_block->visit (this);
+}
+
+
+bool
+snapshot_array_finder::swap_out (foreach_loop* f, delete_statement* d,
+                                 vardecl* live)
+{
+  // The delete has to follow the loop for the swap to be invisible.
+  probe_exit_finder pef;
+  f->visit (&pef);
+  if (pef.found)
+    return false;
+
+  vardecl* spare = new vardecl;
+  spare->tok = live->tok;
+  spare->name = "__global___snapshot_" + lex_cast(count);
+  spare->unmangled_name = "__snapshot_" + lex_cast(count);
+  spare->type = live->type;
+  spare->maxsize = live->maxsize;
+  spare->wrap = live->wrap;
+  spare->synthetic = true;
+  spare->set_arity (live->arity, live->tok);
+  spare->index_types = live->index_types;
+
+  symbol_renamer to_spare (live, spare);
+  f->visit (&to_spare);
+  d->visit (&to_spare);
+
+  // If the probe still uses the live array elsewhere, it would need
+  // its lock anyway, so there is nothing to gain.
+  varuse_collecting_visitor vut (session);
+  current_probe->body->visit (&vut);
+  if (vut.read.count (live) || vut.written.count (live))
+    {
+      symbol_renamer to_live (spare, live);
+      f->visit (&to_live);
+      d->visit (&to_live);
+      delete spare;
+      return false;
+    }
+
+  if (live->type == pe_stats)
+    session.stat_decls[spare->name] = session.stat_decls[live->name];
+  session.globals.push_back (spare);
+
+  f->snapshot_of = new symbol;
+  f->snapshot_of->tok = f->tok;
+  f->snapshot_of->name = live->name;
+  f->snapshot_of->referent = live;
+  count++;
+  return true;
+}
+
+
+static void
+semantic_pass_snapshot_arrays (systemtap_session& s)
+{
+  // With handler errors suppressed or allowed for, a probe goes on
+  // running after its loop errors out.
+  unsigned long maxerrors = 0;
+  if (s.suppress_handler_errors)
+    return;
+  for (unsigned i = 0; i < s.c_macros.size(); i++)
+    if (s.c_macros[i] == "MAXERRORS" || startswith (s.c_macros[i], "MAXERRORS="))
+      if (!c_macro_value (s, "MAXERRORS", maxerrors) || maxerrors != 0)
+        return;
+
+  snapshot_array_finder saf (s);
+  for (unsigned i = 0; i < s.probes.size(); ++i)
+    if (s.probes[i]->needs_global_locks ())
+      {
+        saf.current_probe = s.probes[i];
+        s.probes[i]->body->visit (&saf);
+      }
+}
+
+// ------------------------------------------------------------------------
+
 // Enforce variable-related invariants: no modification of
 // a foreach()-iterated array.
 static int
@@ -2155,22 +2365,32 @@ static void gen_monitor_data(systemtap_session& s)
   fd->formal_args.push_back(v);
   ec = new embeddedcode;
   string code;
-  code = "/* unprivileged */ /* pure */"
+  // "sampling" is how many hits there are for each that runs, which is
+  // more than 1 while the overload governor is holding a probe back.
+  code = "/* unprivileged */"
          "const struct stap_probe *const p = &stap_probes[STAP_ARG_index];\n"
+         "#ifdef STP_OVERLOAD_GOVERNOR\n"
+         "unsigned sampling = _stp_overload_sampling (p);\n"
+         "#else\n"
+         "unsigned sampling = 1;\n"
+         "#endif\n"
          "if (likely (probe_timing(STAP_ARG_index))) {\n"
          "struct stat_data *stats = _stp_stat_get (probe_timing(STAP_ARG_index), 0);\n"
          "if (stats->count) {\n"
          "int64_t avg = _stp_div64 (NULL, stats->sum, stats->count);\n"
          "snprintf(_monitor_buf, STAP_MONITOR_READ,\n"
          "\"\\\"index\\\": %zu, \\\"state\\\": \\\"%s\\\", \\\"hits\\\": %lld, "
-         "\\\"min\\\": %lld, \\\"avg\\\": %lld, \\\"max\\\": %lld, \",\n"
+         "\\\"min\\\": %lld, \\\"avg\\\": %lld, \\\"max\\\": %lld, "
+         "\\\"sampling\\\": %u, \",\n"
          "p->index, p->cond_enabled ? \"on\" : \"off\", (long long) stats->count,\n"
-         "(long long) stats->min, (long long) avg, (long long) stats->max);\n"
+         "(long long) stats->min, (long long) avg, (long long) stats->max,\n"
+         "sampling);\n"
          "} else {\n"
          "snprintf(_monitor_buf, STAP_MONITOR_READ,\n"
          "\"\\\"index\\\": %zu, \\\"state\\\": \\\"%s\\\", \\\"hits\\\": %d, "
-         "\\\"min\\\": %d, \\\"avg\\\": %d, \\\"max\\\": %d, \",\n"
-         "p->index, p->cond_enabled ? \"on\" : \"off\", 0, 0, 0, 0);}}\n"
+         "\\\"min\\\": %d, \\\"avg\\\": %d, \\\"max\\\": %d, "
+         "\\\"sampling\\\": %u, \",\n"
+         "p->index, p->cond_enabled ? \"on\" : \"off\", 0, 0, 0, 0, sampling);}}\n"
          "STAP_RETURN(_monitor_buf);\n";
   ec->code = code;
   fd->body = ec;
@@ -2199,6 +2419,37 @@ static void gen_monitor_data(systemtap_session& s)
   dp->body->visit (&sym);
 }
 
+// Add a procfs read probe at PATH, whose BODY builds up $value.  An
+// error, like $value overflowing MAXSIZE, is warned about as WHAT.
+static void monitor_mode_read_probe(systemtap_session& s, const string& path,
+                                    unsigned long maxsize, const string& body,
+                                    const string& what = "JSON construction error")
+{
+  stringstream code;
+  code << "probe procfs(" << lex_cast_qstring(path) << ").read.maxsize("
+       << maxsize << ") {" << endl;
+  code << "try {"; // absorb .= overflows!
+  code << body;
+  code << "} catch(ex) { warn(" << lex_cast_qstring(what + ": ") << " . ex) }" << endl;
+  code << "}" << endl;
+  probe* p = parse_synthetic_probe(s, code, 0);
+  if (!p)
+    throw SEMANTIC_ERROR (_("can't create procfs probe"), 0);
+
+  vector<derived_probe*> dps;
+  derive_probes (s, p, dps);
+
+  derived_probe* dp = dps[0];
+  s.probes.push_back (dp);
+  dp->join_group (s);
+
+  // Repopulate symbol info
+  symresolution_info sym (s);
+  sym.current_function = 0;
+  sym.current_probe = dp;
+  dp->body->visit (&sym);
+}
+
 static void monitor_mode_read(systemtap_session& s)
 {
   if (!s.monitor) return;
@@ -2207,12 +2458,6 @@ static void monitor_mode_read(systemtap_session& s)
 
   stringstream code;
 
-  unsigned long rough_max_json_size = 100 +
-    s.globals.size() * 100 +
-    s.probes.size() * 200;
-  
-  code << "probe procfs(\"monitor_status\").read.maxsize(" << rough_max_json_size << ") {" << endl;
-  code << "try {"; // absorb .= overflows!
   code << "elapsed = (jiffies()-__monitor_module_start)/HZ()" << endl;
   code << "hrs = elapsed/3600; mins = elapsed%3600/60; secs = elapsed%3600%60;" << endl;
   code << "$value .= sprintf(\"{\\n\")" << endl;
@@ -2243,6 +2488,7 @@ static void monitor_mode_read(systemtap_session& s)
         code << "$value .= sprintf(\"\\\"[%d]\\\"\", " << (*it)->maxsize << ")" << endl;
     }
   code << "$value .= sprintf(\"\\n},\\n\")" << endl;
+  string head = code.str();
 
   code << "$value .= sprintf(\"\\\"probe_list\\\": [\\n\")" << endl;
   for (auto it = s.probes.cbegin(); it != s.probes.cend(); ++it)
@@ -2266,26 +2512,17 @@ static void monitor_mode_read(systemtap_session& s)
 
   code << "$value .= sprintf(\"}\\n\")" << endl;
 
-  code << "} catch(ex) { warn(\"JSON construction error: \" . ex) }" << endl;
-  code << "}" << endl;
-  probe* p = parse_synthetic_probe(s, code, 0);
-  if (!p)
-    throw SEMANTIC_ERROR (_("can't create procfs probe"), 0);
-
-  vector<derived_probe*> dps;
-  derive_probes (s, p, dps);
-
-  derived_probe* dp = dps[0];
-  s.probes.push_back (dp);
-  dp->join_group (s);
+  unsigned long rough_max_json_size = 100 +
+    s.globals.size() * 100 +
+    s.probes.size() * 200;
+  monitor_mode_read_probe (s, "monitor_status", rough_max_json_size, code.str());
 
-  // Repopulate symbol info
-  symresolution_info sym (s);
-  sym.current_function = 0;
-  sym.current_probe = dp;
-  dp->body->visit (&sym);
+  // stapio reads the probes from the binary monitor_stats instead when
+  // it can, and just the rest from monitor_globals.
+  monitor_mode_read_probe (s, "monitor_globals", 100 + s.globals.size() * 100,
+                           head + "$value .= sprintf(\"\\\"probe_list\\\": []\\n}\\n\")\n");
 
-  // Resolve types for variables used in the new procfs probe
+  // Resolve types for variables used in the new procfs probes
   semantic_pass_types(s);
 }
 
@@ -2399,6 +2636,51 @@ static void monitor_mode_write(systemtap_session& s)
   dp->body->visit (&sym);
 }
 
+// With -t, add /proc/systemtap/MODULE/lock_stats, with a line for each
+// global of how probes waited for its lock (see probe_lock.h).
+static void lock_stats_read(systemtap_session& s)
+{
+  if (!s.timing || s.runtime_usermode_p() || s.globals.empty()
+      || !pr_contains (pr_privileged, s.privilege))
+    return;
+
+  functiondecl* fd = new functiondecl;
+  fd->synthetic = true;
+  fd->unmangled_name = fd->name = "__private___lock_stats_line";
+  fd->type = pe_string;
+  vardecl* v = new vardecl;
+  v->type = pe_long;
+  v->unmangled_name = v->name = "index";
+  fd->formal_args.push_back(v);
+  embeddedcode* ec = new embeddedcode;
+  ec->code = "/* unprivileged */"
+             "long i;\n"
+             "STAP_RETVALUE[0] = '\\0';\n"
+             "for (i = 0; stp_lock_globals[i].name; i++)\n"
+             "if (i == STAP_ARG_index) {\n"
+             "stp_lock_stats_format(&stp_lock_globals[i], STAP_RETVALUE, MAXSTRINGLEN);\n"
+             "break;\n"
+             "}\n";
+  fd->body = ec;
+  s.functions[fd->name] = fd;
+
+  // Each line is at most what the function above can return.
+  unsigned long maxstringlen = 512;
+  c_macro_value (s, "MAXSTRINGLEN", maxstringlen);
+
+  stringstream code;
+  code << "$value = \"# global waits retries skips wait_cycles waits_by_log2_cycles...\\n\"" << endl;
+  code << "for (i = 0; ; i++) {" << endl;
+  code << "line = __private___lock_stats_line(i)" << endl;
+  code << "if (line == \"\") break" << endl;
+  code << "$value .= line" << endl;
+  code << "}" << endl;
+  monitor_mode_read_probe (s, "lock_stats", 100 + s.globals.size() * maxstringlen,
+                           code.str(), "lock_stats");
+
+  semantic_pass_types(s);
+}
+
 static void setup_timeout(systemtap_session& s)
 {
   if (!s.timeout) return;
@@ -2449,6 +2731,9 @@ semantic_pass (systemtap_session& s)
       if (rc == 0) rc = semantic_pass_optimize2 (s);
       if (rc == 0) rc = semantic_pass_vars (s);
       if (rc == 0) rc = semantic_pass_stats (s);
+      if (rc == 0 && !s.unoptimized) semantic_pass_snapshot_arrays (s);
+      // after the snapshot spares join the globals and thus the lock table
+      if (rc == 0) lock_stats_read(s);
       if (rc == 0) embeddedcode_info_pass (s);
     }
   catch (const semantic_error& e)
@@ -2968,22 +3253,317 @@ symresolution_info::collect_functions(void)
 // optimization
 
 
+// The variables one probe or function body reads and writes, and the
+// functions it calls, not counting what those functions do in turn.
+
+struct body_varuse
+{
+  set<vardecl*> read;
+  set<vardecl*> written;
+  set<functiondecl*> callees;
+};
+
+
+// A varuse_collecting_visitor that notes function calls rather than
+// following them, so each body need only be visited once.
+struct body_varuse_visitor: public varuse_collecting_visitor
+{
+  set<functiondecl*> callees;
+
+  body_varuse_visitor(systemtap_session& s): varuse_collecting_visitor(s) {}
+
+  void enter_functioncall (functioncall* e)
+    {
+      callees.insert (e->referents.begin(), e->referents.end());
+    }
+};
+
+
+// The optimizer repeats its passes until none of them changes anything.
+// Rather than revisiting every body each time, this tracks the bodies
+// changed in the last round, and those whose optimization depends on
+// them, so the next round need only look at those.  A round after one
+// that changed nothing still goes over every body, so that we stop at
+// the same fixpoint as before.
+
+struct opt_worklist
+{
+  systemtap_session& s;
+  bool full; // this round visits every body
+
+  // Unless full, the bodies to visit this round.
+  set<derived_probe*> probes;
+  set<functiondecl*> functions;
+
+  // Those bodies changed so far this round.
+  set<derived_probe*> changed_probes;
+  set<functiondecl*> changed_functions;
+
+  // The variables read and written anywhere, as of the last collect_varuse.
+  set<vardecl*> read;
+  set<vardecl*> written;
+
+  unsigned rounds, full_rounds;
+  size_t revisited; // bodies visited in rounds that weren't full
+
+  opt_worklist(systemtap_session& s):
+    s(s), full(true), rounds(0), full_rounds(0), revisited(0) {}
+
+  bool queued (derived_probe* p) const { return full || probes.count(p); }
+  bool queued (functiondecl* f) const { return full || functions.count(f); }
+
+  // Note what one pass did to a body, given a flag it started with true.
+  void note (derived_probe* p, bool body_relaxed_p, bool& relaxed_p);
+  void note (functiondecl* f, bool body_relaxed_p, bool& relaxed_p);
+
+  const body_varuse& varuse (derived_probe* p);
+  const body_varuse& varuse (functiondecl* f);
+  void forget (functiondecl* f) { function_uses.erase (f); }
+  void collect_varuse ();
+
+  void start_round ();
+  void finish_round (bool& relaxed_p);
+
+private:
+  map<derived_probe*, body_varuse> probe_uses;
+  map<functiondecl*, body_varuse> function_uses;
+};
+
+
+void
+opt_worklist::note (derived_probe* p, bool body_relaxed_p, bool& relaxed_p)
+{
+  if (!body_relaxed_p)
+    {
+      relaxed_p = false;
+      changed_probes.insert (p);
+    }
+}
+
+
+void
+opt_worklist::note (functiondecl* f, bool body_relaxed_p, bool& relaxed_p)
+{
+  if (!body_relaxed_p)
+    {
+      relaxed_p = false;
+      changed_functions.insert (f);
+    }
+}
+
+
+const body_varuse&
+opt_worklist::varuse (derived_probe* p)
+{
+  map<derived_probe*, body_varuse>::iterator it = probe_uses.find (p);
+  if (it != probe_uses.end())
+    return it->second;
+
+  body_varuse_visitor vut (s);
+  p->body->visit (& vut);
+  if (p->sole_location()->condition)
+    p->sole_location()->condition->visit (& vut);
+
+  body_varuse& u = probe_uses[p];
+  u.read.swap (vut.read);
+  u.written.swap (vut.written);
+  u.callees.swap (vut.callees);
+  return u;
+}
+
+
+const body_varuse&
+opt_worklist::varuse (functiondecl* f)
+{
+  map<functiondecl*, body_varuse>::iterator it = function_uses.find (f);
+  if (it != function_uses.end())
+    return it->second;
+
+  body_varuse_visitor vut (s);
+  vut.current_function = f;
+  f->body->visit (& vut);
+
+  body_varuse& u = function_uses[f];
+  u.read.swap (vut.read);
+  u.written.swap (vut.written);
+  u.callees.swap (vut.callees);
+  return u;
+}
+
+
+// Gather the variables used by all probes and the functions they call,
+// as a varuse_collecting_visitor traversing every probe would.  This
+// assumes that opt1 has already pruned the uncalled functions.
+void
+opt_worklist::collect_varuse ()
+{
+  read.clear ();
+  written.clear ();
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      const body_varuse& u = varuse (s.probes[i]);
+      read.insert (u.read.begin(), u.read.end());
+      written.insert (u.written.begin(), u.written.end());
+    }
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    {
+      const body_varuse& u = varuse (it->second);
+      read.insert (u.read.begin(), u.read.end());
+      written.insert (u.written.begin(), u.written.end());
+    }
+}
+
+
+void
+opt_worklist::start_round ()
+{
+  changed_probes.clear ();
+  changed_functions.clear ();
+  rounds++;
+  if (full)
+    {
+      // Start afresh, in case anything changed behind our back.
+      full_rounds++;
+      probe_uses.clear ();
+      function_uses.clear ();
+    }
+  else
+    revisited += probes.size() + functions.size();
+}
+
+
+void
+opt_worklist::finish_round (bool& relaxed_p)
+{
+  if (relaxed_p && full)
+    return; // done
+
+  // Without the other passes, there's little to gain from tracking uses.
+  if (s.unoptimized)
+    {
+      full = true;
+      return;
+    }
+
+  bool partial_relaxed_p = relaxed_p;
+  full = false;
+  probes.clear ();
+  functions.clear ();
+
+  if (!relaxed_p)
+    {
+      // The bodies that changed need another look, with fresh varuse.
+      for (set<derived_probe*>::iterator it = changed_probes.begin();
+           it != changed_probes.end(); it++)
+        {
+          probe_uses.erase (*it);
+          probes.insert (*it);
+        }
+      for (set<functiondecl*>::iterator it = changed_functions.begin();
+           it != changed_functions.end(); it++)
+        {
+          function_uses.erase (*it);
+          functions.insert (*it);
+        }
+
+      // Assignments to variables that are no longer read are now dead.
+      // Functions that have gone uncalled are left to opt1.
+      set<vardecl*> old_read;
+      old_read.swap (read);
+      collect_varuse ();
+      set<vardecl*> unread;
+      for (set<vardecl*>::iterator it = old_read.begin(); it != old_read.end(); it++)
+        if (read.find (*it) == read.end())
+          unread.insert (*it);
+
+      map<functiondecl*, vector<derived_probe*> > probe_callers;
+      map<functiondecl*, vector<functiondecl*> > function_callers;
+      for (map<derived_probe*, body_varuse>::iterator it = probe_uses.begin();
+           it != probe_uses.end(); it++)
+        {
+          const body_varuse& u = it->second;
+          for (set<vardecl*>::iterator v = u.written.begin(); v != u.written.end(); v++)
+            if (unread.count (*v))
+              {
+                probes.insert (it->first);
+                break;
+              }
+          for (set<functiondecl*>::iterator f = u.callees.begin(); f != u.callees.end(); f++)
+            probe_callers[*f].push_back (it->first);
+        }
+      for (map<functiondecl*, body_varuse>::iterator it = function_uses.begin();
+           it != function_uses.end(); it++)
+        {
+          const body_varuse& u = it->second;
+          for (set<vardecl*>::iterator v = u.written.begin(); v != u.written.end(); v++)
+            if (unread.count (*v))
+              {
+                functions.insert (it->first);
+                break;
+              }
+          for (set<functiondecl*>::iterator f = u.callees.begin(); f != u.callees.end(); f++)
+            function_callers[*f].push_back (it->first);
+        }
+
+      // Callers of changed functions, however indirect, may now find
+      // their calls free of side-effects, or of next statements.
+      vector<functiondecl*> pending (changed_functions.begin(),
+                                     changed_functions.end());
+      set<functiondecl*> propagated (changed_functions);
+      while (!pending.empty())
+        {
+          functiondecl* f = pending.back();
+          pending.pop_back();
+          vector<derived_probe*>& pc = probe_callers[f];
+          probes.insert (pc.begin(), pc.end());
+          vector<functiondecl*>& fc = function_callers[f];
+          for (unsigned i=0; i<fc.size(); i++)
+            if (propagated.insert (fc[i]).second)
+              {
+                functions.insert (fc[i]);
+                pending.push_back (fc[i]);
+              }
+        }
+    }
+
+  // If that round found nothing more to do, or there's nothing
+  // obviously left, confirm it with a full round.
+  if (partial_relaxed_p || (probes.empty() && functions.empty()))
+    {
+      full = true;
+      relaxed_p = false;
+    }
+}
+
+
 // Do away with functiondecls that are never (transitively) called
 // from probes.
-void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
-  functioncall_traversing_visitor ftv;
+  set<functiondecl*> seen;
+  vector<functiondecl*> pending;
   for (unsigned i=0; i<s.probes.size(); i++)
     {
-      s.probes[i]->body->visit (& ftv);
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& ftv);
+      const body_varuse& u = wl.varuse (s.probes[i]);
+      for (set<functiondecl*>::iterator it = u.callees.begin(); it != u.callees.end(); it++)
+        if (seen.insert (*it).second)
+          pending.push_back (*it);
+    }
+  while (!pending.empty())
+    {
+      functiondecl* fd = pending.back();
+      pending.pop_back();
+      const body_varuse& u = wl.varuse (fd);
+      for (set<functiondecl*>::iterator it = u.callees.begin(); it != u.callees.end(); it++)
+        if (seen.insert (*it).second)
+          pending.push_back (*it);
     }
   vector<functiondecl*> new_unused_functions;
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       functiondecl* fd = it->second;
-      if (ftv.seen.find(fd) == ftv.seen.end())
+      if (seen.find(fd) == seen.end())
         {
           if (! fd->synthetic && s.is_user_file(fd->tok->location.file->name))
             s.print_warning (_F("Eliding unused function '%s'",
@@ -2999,6 +3579,7 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
       map<string,functiondecl*>::iterator where = s.functions.find (new_unused_functions[i]->name);
       assert (where != s.functions.end());
       s.functions.erase (where);
+      wl.forget (new_unused_functions[i]);
       if (s.tapset_compile_coverage)
         s.unused_functions.push_back (new_unused_functions[i]);
     }
@@ -3009,27 +3590,16 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
 
 // Do away with local & global variables that are never
 // written nor read.
-void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations)
+void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations,
+                         opt_worklist& wl)
 {
-  varuse_collecting_visitor vut(s);
+  // NB: This only needs to revisit bodies changed since the last
+  // time, and relies on _opt1 above having pruned uncalled functions.
+  wl.collect_varuse ();
+  const set<vardecl*>& read = wl.read;
+  const set<vardecl*>& written = wl.written;
 
-  for (unsigned i=0; i<s.probes.size(); i++)
-    {
-      s.probes[i]->body->visit (& vut);
-
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& vut);
-    }
-
-  // NB: Since varuse_collecting_visitor also traverses down
-  // actually called functions, we don't need to explicitly
-  // iterate over them.  Uncalled ones should have been pruned
-  // in _opt1 above.
-  //
-  // for (unsigned i=0; i<s.functions.size(); i++)
-  //   s.functions[i]->body->visit (& vut);
-
-  // Now in vut.read/written, we have a mixture of all locals, globals
+  // Now in read/written, we have a mixture of all locals, globals
 
   for (unsigned i=0; i<s.probes.size(); i++)
     for (unsigned j=0; j<s.probes[i]->locals.size(); /* see below */)
@@ -3039,8 +3609,8 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
         // skip over "special" locals
         if (l->synthetic) { j++; continue; }
 
-        if (vut.read.find (l) == vut.read.end() &&
-            vut.written.find (l) == vut.written.end())
+        if (read.find (l) == read.end() &&
+            written.find (l) == written.end())
           {
             if (!l->tok->location.file->synthetic && s.is_user_file(l->tok->location.file->name))
               s.print_warning (_F("Eliding unused variable '%s'",
@@ -3056,7 +3626,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
           }
         else
           {
-            if (vut.written.find (l) == vut.written.end())
+            if (written.find (l) == written.end())
               if (iterations == 0 && ! s.suppress_warnings)
                 {
                   set<string> vars;
@@ -3086,8 +3656,8 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
       for (unsigned j=0; j<fd->locals.size(); /* see below */)
         {
           vardecl* l = fd->locals[j];
-          if (vut.read.find (l) == vut.read.end() &&
-              vut.written.find (l) == vut.written.end())
+          if (read.find (l) == read.end() &&
+              written.find (l) == written.end())
             {
               if (!l->tok->location.file->synthetic && s.is_user_file(l->tok->location.file->name))
                 s.print_warning (_F("Eliding unused variable '%s'",
@@ -3102,7 +3672,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
             }
           else
             {
-              if (vut.written.find (l) == vut.written.end())
+              if (written.find (l) == written.end())
                 if (iterations == 0 && ! s.suppress_warnings)
                   {
                     set<string> vars;
@@ -3131,8 +3701,8 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
   for (unsigned i=0; i<s.globals.size(); /* see below */)
     {
       vardecl* l = s.globals[i];
-      if (vut.read.find (l) == vut.read.end() &&
-          vut.written.find (l) == vut.written.end())
+      if (read.find (l) == read.end() &&
+          written.find (l) == written.end())
         {
           if (!l->tok->location.file->synthetic && s.is_user_file(l->tok->location.file->name))
             s.print_warning (_F("Eliding unused variable '%s'",
@@ -3147,7 +3717,7 @@ void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterati
         }
       else
         {
-          if (vut.written.find (l) == vut.written.end() && ! l->init) // no initializer
+          if (written.find (l) == written.end() && ! l->init) // no initializer
             if (iterations == 0 && ! s.suppress_warnings)
               {
                 // check if it was initialized on the command line via
@@ -3192,11 +3762,11 @@ struct dead_assignment_remover: public update_visitor
 {
   systemtap_session& session;
   bool& relaxed_p;
-  const varuse_collecting_visitor& vut;
+  const set<vardecl*>& read; // variables read anywhere
 
   dead_assignment_remover(systemtap_session& s, bool& r,
-                          const varuse_collecting_visitor& v):
-    update_visitor(s.verbose), session(s), relaxed_p(r), vut(v) {}
+                          const set<vardecl*>& rd):
+    update_visitor(s.verbose), session(s), relaxed_p(r), read(rd) {}
 
   void visit_assignment (assignment* e);
   void visit_try_block (try_block *s);
@@ -3275,7 +3845,7 @@ dead_assignment_remover::visit_assignment (assignment* e)
   if (left) // not unresolved $target, so intended sideeffect may be elided
     {
       vardecl* leftvar = left->referent;
-      if (vut.read.find(leftvar) == vut.read.end()) // var never read?
+      if (read.find(leftvar) == read.end()) // var never read?
         {
           // NB: Not so fast!  The left side could be an array whose
           // index expressions may have side-effects.  This would be
@@ -3325,7 +3895,7 @@ dead_assignment_remover::visit_try_block (try_block *s)
   if (s->catch_error_var)
     {
       vardecl* errvar = s->catch_error_var->referent;
-      if (vut.read.find(errvar) == vut.read.end()) // never read?
+      if (read.find(errvar) == read.end()) // never read?
         {
           if (session.verbose>2)
             clog << _F("Eliding unused error string catcher %s at %s",
@@ -3343,23 +3913,29 @@ dead_assignment_remover::visit_try_block (try_block *s)
 // rewrite "(foo = expr)" as "(expr)".  This makes foo a candidate to
 // be optimized away as an unused variable, and expr a candidate to be
 // removed as a side-effect-free statement expression.  Wahoo!
-void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
-  // Recompute the varuse data, which will probably match the opt2
-  // copy of the computation, except for those totally unused
-  // variables that opt2 removed.
-  varuse_collecting_visitor vut(s);
-  for (unsigned i=0; i<s.probes.size(); i++)
-    s.probes[i]->body->visit (& vut); // includes reachable functions too
-
-  dead_assignment_remover dar (s, relaxed_p, vut);
+  // Reuse the varuse data from opt2, which only removed variables
+  // that nobody used at all.
+  bool body_relaxed_p;
+  dead_assignment_remover dar (s, body_relaxed_p, wl.read);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    dar.replace (s.probes[i]->body);
+    if (wl.queued (s.probes[i]))
+      {
+        body_relaxed_p = true;
+        dar.replace (s.probes[i]->body);
+        wl.note (s.probes[i], body_relaxed_p, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    dar.replace (it->second->body);
+    if (wl.queued (it->second))
+      {
+        body_relaxed_p = true;
+        dar.replace (it->second->body);
+        wl.note (it->second, body_relaxed_p, relaxed_p);
+      }
   // The rewrite operation is performed within the visitor.
 
   // XXX: we could also zap write-only globals here
@@ -3594,13 +4170,14 @@ dead_stmtexpr_remover::visit_expr_statement (expr_statement *s)
 }
 
 
-void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
   // Finally, let's remove some statement-expressions that have no
   // side-effect.  These should be exactly those whose private varuse
   // visitors come back with an empty "written" and "embedded" lists.
 
-  dead_stmtexpr_remover duv (s, relaxed_p);
+  bool body_relaxed_p;
+  dead_stmtexpr_remover duv (s, body_relaxed_p);
   // This instance may be reused for multiple probe/function body trims.
 
   for (unsigned i=0; i<s.probes.size(); i++)
@@ -3608,6 +4185,9 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
       assert_no_interrupts();
 
       derived_probe* p = s.probes[i];
+      if (!wl.queued (p))
+        continue;
+      body_relaxed_p = true;
 
       duv.focal_vars.clear ();
       duv.focal_vars.insert (s.globals.begin(),
@@ -3626,12 +4206,16 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
 
           // XXX: possible duplicate warnings; see below
         }
+      wl.note (p, body_relaxed_p, relaxed_p);
     }
   for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
     {
       assert_no_interrupts();
 
       functiondecl* fn = it->second;
+      if (!wl.queued (fn))
+        continue;
+      body_relaxed_p = true;
       duv.focal_vars.clear ();
       duv.focal_vars.insert (fn->locals.begin(),
                              fn->locals.end());
@@ -3655,6 +4239,7 @@ void semantic_pass_opt4 (systemtap_session& s, bool& relaxed_p)
           // only after the relaxation iterations.
           // XXX: or else see bug #6469.
         }
+      wl.note (fn, body_relaxed_p, relaxed_p);
     }
 }
 
@@ -4093,20 +4678,31 @@ void_statement_reducer::visit_defined_op (defined_op* e)
   provide (e);
 }
 
-void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p)
+void semantic_pass_opt5 (systemtap_session& s, bool& relaxed_p, opt_worklist& wl)
 {
   // Let's simplify statements with unused computed values.
 
-  void_statement_reducer vuv (s, relaxed_p);
+  bool body_relaxed_p;
+  void_statement_reducer vuv (s, body_relaxed_p);
   // This instance may be reused for multiple probe/function body trims.
 
   vuv.focal_vars.insert (s.globals.begin(), s.globals.end());
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    vuv.replace (s.probes[i]->body);
+    if (wl.queued (s.probes[i]))
+      {
+        body_relaxed_p = true;
+        vuv.replace (s.probes[i]->body);
+        wl.note (s.probes[i], body_relaxed_p, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    vuv.replace (it->second->body);
+    if (wl.queued (it->second))
+      {
+        body_relaxed_p = true;
+        vuv.replace (it->second->body);
+        wl.note (it->second, body_relaxed_p, relaxed_p);
+      }
 }
 
 
@@ -4649,7 +5245,7 @@ const_folder::visit_defined_op (defined_op* e)
     }
   else
   */
-  if (collapse_defines_p && relaxed_p)
+  if (collapse_defines_p && relaxed_p && others_relaxed_p)
     {
       if (session.verbose>2)
         clog << _("Collapsing untouched @defined check ") << *e->tok << endl;
@@ -4712,7 +5308,8 @@ const_folder::visit_target_symbol (target_symbol* e)
 }
 
 static int initial_typeres_pass(systemtap_session& s);
-static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
+static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p,
+                                     opt_worklist& wl)
 {
   // attempt an initial type resolution pass to see if there are any type
   // mismatches before we starting whisking away vars that get switched out
@@ -4727,14 +5324,29 @@ static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
     }
 
   // Let's simplify statements with constant values.
-  const_folder cf (s, relaxed_p, true /* collapse remaining @defined()->0 now */ );
+  bool body_relaxed_p;
+  const_folder cf (s, body_relaxed_p, true /* collapse remaining @defined()->0 now */ );
   // This instance may be reused for multiple probe/function body trims.
 
+  // Only collapse @defined in a round over everything, once nothing
+  // else anywhere has changed, as when every round was full.
   for (unsigned i=0; i<s.probes.size(); i++)
-    cf.replace (s.probes[i]->body);
+    if (wl.queued (s.probes[i]))
+      {
+        body_relaxed_p = true;
+        cf.others_relaxed_p = relaxed_p && wl.full;
+        cf.replace (s.probes[i]->body);
+        wl.note (s.probes[i], body_relaxed_p, relaxed_p);
+      }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    cf.replace (it->second->body);
+    if (wl.queued (it->second))
+      {
+        body_relaxed_p = true;
+        cf.others_relaxed_p = relaxed_p && wl.full;
+        cf.replace (it->second->body);
+        wl.note (it->second, body_relaxed_p, relaxed_p);
+      }
   return 0;
 }
 
@@ -4778,18 +5390,36 @@ void dead_control_remover::visit_block (block* b)
 }
 
 
-static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p)
+static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p,
+                                        opt_worklist& wl)
 {
   // Let's remove code that follow unconditional control statements
 
-  dead_control_remover dc (s, relaxed_p);
+  bool body_relaxed_p;
+  dead_control_remover dc (s, body_relaxed_p);
 
   for (unsigned i=0; i<s.probes.size(); i++)
-    s.probes[i]->body->visit(&dc);
+    if (wl.queued (s.probes[i]))
+      {
+        body_relaxed_p = true;
+        s.probes[i]->body->visit(&dc);
+        wl.note (s.probes[i], body_relaxed_p, relaxed_p);
+      }
 
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    it->second->body->visit(&dc);
+    if (wl.queued (it->second))
+      {
+        body_relaxed_p = true;
+        it->second->body->visit(&dc);
+        wl.note (it->second, body_relaxed_p, relaxed_p);
+      }
+}
+
+static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p)
+{
+  opt_worklist everything (s);
+  semantic_pass_dead_control (s, relaxed_p, everything);
 }
 
 
@@ -4860,7 +5490,8 @@ void dead_overload_remover::visit_functioncall(functioncall *e)
     }
 }
 
-static void semantic_pass_overload(systemtap_session& s, bool& relaxed_p)
+static void semantic_pass_overload(systemtap_session& s, bool& relaxed_p,
+                                   opt_worklist& wl)
 {
   set<functiondecl*> function_next;
   function_next_check fnc;
@@ -4868,20 +5499,30 @@ static void semantic_pass_overload(systemtap_session& s, bool& relaxed_p)
   for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
     {
       functiondecl* fn = it->second;
+      if (!wl.queued (fn))
+        continue;
       fnc.current_function = fn;
       fn->body->visit(&fnc);
     }
 
   for (auto it = s.probes.begin(); it != s.probes.end(); ++it)
     {
-      dead_overload_remover ovr(s, relaxed_p);
+      if (!wl.queued (*it))
+        continue;
+      bool body_relaxed_p = true;
+      dead_overload_remover ovr(s, body_relaxed_p);
       (*it)->body->visit(&ovr);
+      wl.note (*it, body_relaxed_p, relaxed_p);
     }
 
   for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
     {
-      dead_overload_remover ovr(s, relaxed_p);
+      if (!wl.queued (it->second))
+        continue;
+      bool body_relaxed_p = true;
+      dead_overload_remover ovr(s, body_relaxed_p);
       it->second->body->visit(&ovr);
+      wl.note (it->second, body_relaxed_p, relaxed_p);
     }
 }
 
@@ -5355,11 +5996,13 @@ semantic_pass_optimize1 (systemtap_session& s)
 
   bool relaxed_p = false;
   unsigned iterations = 0;
+  opt_worklist wl (s);
   while (! relaxed_p)
     {
       assert_no_interrupts();
 
       relaxed_p = true; // until proven otherwise
+      wl.start_round ();
 
       // If the verbosity is high enough, always print warnings (overrides -w),
       // or if not, always suppress warnings for every itteration after the first.
@@ -5370,11 +6013,11 @@ semantic_pass_optimize1 (systemtap_session& s)
 
       if (!s.unoptimized)
         {
-          semantic_pass_opt1 (s, relaxed_p);
-          semantic_pass_opt2 (s, relaxed_p, iterations); // produce some warnings only on iteration=0
-          semantic_pass_opt3 (s, relaxed_p);
-          semantic_pass_opt4 (s, relaxed_p);
-          semantic_pass_opt5 (s, relaxed_p);
+          semantic_pass_opt1 (s, relaxed_p, wl);
+          semantic_pass_opt2 (s, relaxed_p, iterations, wl); // produce some warnings only on iteration=0
+          semantic_pass_opt3 (s, relaxed_p, wl);
+          semantic_pass_opt4 (s, relaxed_p, wl);
+          semantic_pass_opt5 (s, relaxed_p, wl);
         }
 
       // For listing mode, we need const-folding regardless of optimization so
@@ -5382,17 +6025,31 @@ semantic_pass_optimize1 (systemtap_session& s)
       // We also want it in case variables are used in if/case expressions,
       // so enable always.  PR11366
       // rc is incremented if there is an error that got reported.
-      rc += semantic_pass_const_fold (s, relaxed_p);
+      int fold_rc = semantic_pass_const_fold (s, relaxed_p, wl);
+      rc += fold_rc;
 
       if (!s.unoptimized)
-        semantic_pass_dead_control (s, relaxed_p);
+        semantic_pass_dead_control (s, relaxed_p, wl);
 
       if (!s.unoptimized)
-        semantic_pass_overload (s, relaxed_p);
+        semantic_pass_overload (s, relaxed_p, wl);
+
+      // Pick the bodies for the next round.  After an error, just go
+      // around again over everything if anything still changed.
+      if (fold_rc)
+        wl.full = true;
+      else
+        wl.finish_round (relaxed_p);
 
       iterations ++;
     }
 
+  if (s.verbose > 1)
+    clog << _F("Pass 2: optimized in %u rounds, %u over all %zu probes and functions, "
+               "revisiting %zu in the others",
+               wl.rounds, wl.full_rounds, s.probes.size() + s.functions.size(),
+               wl.revisited) << endl;
+
   return rc;
 }
 
@@ -461,10 +461,11 @@ struct const_folder: public update_visitor
   systemtap_session& session;
   bool& relaxed_p;
   bool collapse_defines_p;
+  bool others_relaxed_p; // when folding one body at a time, nothing else changed
   
   const_folder(systemtap_session& s, bool& r, bool collapse_defines = false):
     update_visitor(s.verbose), session(s), relaxed_p(r), collapse_defines_p(collapse_defines),
-    last_number(0), last_string(0), last_target_symbol(0) {}
+    others_relaxed_p(true), last_number(0), last_string(0), last_target_symbol(0) {}
 
   literal_number* last_number;
   literal_number* get_number(expression*& e);
@@ -333,6 +333,46 @@ find_tracequery_hash (systemtap_session& s, const string& header)
 }
 
 
+string
+find_tracepoint_catalog_hash (systemtap_session& s, const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The catalog describes the debuginfo with this build-id
+  h.add("Kernel Build ID: ", build_id);
+
+  // Get the directory path to store our cached catalog
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("tpcatalog_hash"), h.get_parms(), result,
+                  hashdir + "/tpcatalog_" + result + "_hash.log");
+  return hashdir + "/tpcatalog_" + result + ".list";
+}
+
+
+string
+find_sdt_notes_hash (systemtap_session& s, const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The index describes the module with this build-id
+  h.add("Module Build ID: ", build_id);
+
+  // Get the directory path to store our cached index
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("sdtnotes_hash"), h.get_parms(), result,
+                  hashdir + "/sdtnotes_" + result + "_hash.log");
+  return hashdir + "/sdtnotes_" + result + ".list";
+}
+
+
 string
 find_typequery_hash (systemtap_session& s, const string& name)
 {
@@ -8,6 +8,10 @@ void find_script_hash (systemtap_session& s, const std::string& script);
 void find_stapconf_hash (systemtap_session& s);
 std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
+std::string find_tracepoint_catalog_hash (systemtap_session& s,
+                                         const std::string& build_id);
+std::string find_sdt_notes_hash (systemtap_session& s,
+                                const std::string& build_id);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
 std::string find_uprobes_hash (systemtap_session& s);
 
@@ -972,6 +972,11 @@ passes_0_4 (systemtap_session &s)
          << TIMESPRINT
          << endl;
   }
+  if (s.verbose > 1)
+    clog << _F("Pass 2: parse tree arena %zuKiB used, %zuKiB in %zu chunks",
+               s.ast_arena.used() / 1024, s.ast_arena.allocated() / 1024,
+               s.ast_arena.chunk_count())
+         << endl;
 
   missing_rpm_list_print(s, "-debuginfo");
 
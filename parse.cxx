@@ -3021,6 +3021,7 @@ parser::parse_foreach_loop ()
   s->sort_aggr = sc_none;
   s->value = NULL;
   s->limit = NULL;
+  s->snapshot_of = NULL;
 
   t = next ();
   if (! (t->type == tok_operator && t->content == "("))
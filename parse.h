@@ -16,6 +16,7 @@
 #include <iostream>
 #include <stdexcept>
 #include "stringtable.h"
+#include "arena.h"
 
 
 struct systemtap_session;
@@ -56,7 +57,7 @@ enum token_junk_type
   };
 
 
-struct token
+struct token: public arena_allocated
 {
   source_loc location;
   interned_string content;
@@ -34,6 +34,11 @@ atomic_t busy;
    Used in warning/error messages and accessible by pp() tapset function.  */
 const char *probe_point;
 
+/* The stap_probe whose handler is running.  Setup by
+   common_probe_entryfn_prologue.  Used by a handler shared by several
+   probes to reach the current probe's own thunks.  */
+const struct stap_probe *probe;
+
 /* The script-level probe point associated with a currently running probe
    handler, including  wild-card expansion effects as per 'stap -l'.
    Guarded by STP_NEED_PROBE_NAME as setup in pn() tapset function.  */
@@ -165,6 +170,12 @@ cycles_t cycles_base;
 cycles_t cycles_sum;
 #endif
 
+/* The part of cycles_sum spent in each probe, for the governor in
+   overload.h to find the costliest.  */
+#ifdef STP_OVERLOAD_GOVERNOR
+cycles_t overload_cycles[STP_PROBE_COUNT];
+#endif
+
 /* Current state of the unwinder (as used in the unwind.c dwarf unwinder). */
 #if defined(STP_NEED_UNWIND_DATA)
 struct unwind_cache uwcache_user;
@@ -160,6 +160,12 @@ static inline struct _stp_transport_session_data *stp_transport_data(void)
 			__value, (void)0));				\
 	__value; })
 
+// NB: Only for the maps and stats that global_set handles.
+#define global_swap(a, b)	({					\
+	typeof(global(a)) __a = global(a);				\
+	global_set(a, global(b));					\
+	global_set(b, __a); })
+
 #define global_lock(name)	(&_global_raw(name ## _lock))
 #define global_lock_init(name)	\
 	stp_pthread_rwlock_init_shared(global_lock(name))
@@ -20,6 +20,8 @@ struct pmap {
 	int bit_shift;    /* scale factor for integer arithmetic */
 	int stat_ops;     /* related statistical operators */
 	offptr_t oagg;    /* aggregation map */
+	unsigned long agg_gen; /* _stp_pmap_gen() when oagg was made */
+	int agg_valid;    /* whether oagg is a full aggregation */
 	offptr_t omap[];  /* per-cpu maps */
 };
 
@@ -137,6 +139,15 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size,
 	return m;
 }
 
+/* The maps live in shared memory, where a private scratch heap would
+ * be meaningless to other processes, so _stp_map_sortn() always takes
+ * its list-based path here.  */
+static int
+_stp_map_new_sort_heap(MAP m __attribute__((unused)))
+{
+	return 0;
+}
+
 static PMAP
 _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 {
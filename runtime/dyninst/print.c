@@ -47,6 +47,12 @@ static inline void _stp_print_flush(void)
 	return;
 }
 
+static inline void _stp_print_flush_batched(void)
+{
+	/* The transport thread already batches writes. */
+	_stp_print_flush();
+}
+
 static void * _stp_reserve_bytes (int numbytes)
 {
 	return _stp_dyninst_transport_reserve_bytes(numbytes);
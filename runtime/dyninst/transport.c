@@ -17,8 +17,10 @@
 #include <spawn.h>
 
 #include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <search.h>
 #include <signal.h>
@@ -31,40 +33,53 @@
 //
 // Each context structure has a '_stp_transport_context_data'
 // structure (described in more detail later) in it, which contains
-// that context's print and log (warning/error) buffers. There is a
-// session-wide double-buffered queue (stored in the
-// '_stp_transport_session_data' structure) where each probe can send
+// that context's print and log (warning/error) buffers, plus a
+// single-producer/single-consumer queue where each probe can send
 // print/control messages to a fairly simple consumer thread (see
 // _stp_dyninst_transport_thread_func() for details). The consumer
-// thread swaps the read/write queues, then handles each request.
+// thread drains every context's queue, then handles each request.
+// Every item carries a session-wide sequence number, and the consumer
+// merges the queues by it, so that output still comes out in the
+// order it was queued across all threads, as with a single queue.
 //
 // Note that there is as little as possible data copying going on. A
 // probe adds data to a print/log buffer stored in shared memory, then
 // the consumer queue outputs the data from that same buffer.
 //
+// Also note that nothing on the probe side takes a lock. A context
+// is only ever used by the one probe which has it locked, so every
+// context buffer and queue has exactly one producer and one consumer.
+//
 //
 // QUEUE OVERVIEW
 //
-// See the session-wide queue's definition in transport.h. It is
-// composed of the '_stp_transport_queue_item', '_stp_transport_queue'
-// and '_stp_transport_session_data' structures.
+// See the context-specific queue's definition in transport.h. It is
+// composed of the '_stp_transport_queue_item' and
+// '_stp_transport_queue' structures.
+//
+// The queue is a ring stored in shared memory. Probes take the next
+// sequence number from the session's 'seq', fill the slot at 'head',
+// then publish it by advancing 'head' (with release semantics). The
+// consumer thread notes the newest item in any queue, then takes
+// every slot from each 'tail' up to that item's sequence number, and
+// processes them in sequence order (the OOB items first, as before),
+// then advances each 'tail'. Anything queued before that newest item
+// is sure to be seen by then, even in a queue looked at earlier.
 //
-// The queue is double-buffered and stored in shared memory. Because
-// it is session-wide, and multiple threads can be trying to add data
-// to it simultaneously, the 'queue_mutex' is used to serialize
-// access.  Probes write to the write queue. When the consumer thread
-// realizes data is available, it swaps the read/write queues (by
-// changing the 'write_queue' value) and then processes each
-// '_stp_transport_queue_item' on the read queue.
+// If the queue is full, probes will wait on the context's
+// 'space_seq' futex for more space. The consumer bumps 'space_seq'
+// whenever it frees space in a context, but only issues a
+// FUTEX_WAKE when the context's 'producer_waiting' flag is set.
 //
-// If the queue is full, probes will wait on the 'queue_space_avail'
-// condition variable for more space. The consumer thread sets
-// 'queue_space_avail' when it swaps the read/write queues.
+// When the consumer thread finds every queue empty, it sets the
+// session's 'consumer_idle' flag and waits on the 'wake_seq'
+// futex. Probes only bump 'wake_seq' and issue a FUTEX_WAKE when
+// they find 'consumer_idle' set, so a busy consumer costs probes no
+// system calls at all.
 //
-// The consumer thread waits on the 'queue_data_avail' condition
-// variable to know when more items are available. When probes add
-// items to the queue (using __stp_dyninst_transport_queue_add()),
-// 'queue_data_avail' gets set.
+// Session-wide control requests (STP_DYN_EXIT and
+// STP_DYN_REQUEST_EXIT) don't belong to any context, so they are
+// set as bits in the session's 'control' word instead.
 //
 // 
 // LOG BUFFER OVERVIEW
@@ -80,14 +95,10 @@
 // circular, and the indices use an extra most significant bit to
 // indicate wrapping.
 //
-// Only the consumer thread removes items from the log buffer.  The
-// log buffer is circular, and the indices use an extra most
-// significant bit to indicate wrapping.
+// Only the consumer thread removes items from the log buffer.
 //
-// If the log buffer is full, probes will wait on the
-// 'log_space_avail' condition variable for more space. The consumer
-// thread sets 'log_space_avail' after finishing with a particular log
-// buffer chunk.
+// If the log buffer is full, probes will wait on the 'space_seq'
+// futex for more space, just like a full queue.
 //
 // Note that the read index 'log_start' is only written to by the
 // consumer thread and that the write index 'log_end' is only written
@@ -115,14 +126,14 @@
 //
 // If the print buffer doesn't have enough bytes available, probes
 // will flush any reserved bytes earlier than normal, then wait on the
-// 'print_space_avail' condition variable for more space to become
-// available. The consumer thread sets 'print_space_avail' after
-// finishing with a particular print buffer segment.
+// 'space_seq' futex for more space to become available.
 //
 // Note that the read index 'read_offset' is only written to by the
-// consumer thread and that the write index 'write_offset' (and number
-// of bytes to write 'write_bytes) is only written to by the probes
-// (with a locked context).
+// consumer thread (with the one exception of resetting an empty
+// buffer, see _stp_dyninst_transport_reserve_bytes()) and that the
+// write index 'write_offset' (and number of bytes to write
+// 'write_bytes) is only written to by the probes (with a locked
+// context).
 //
 ////////////////////////////////////////
 
@@ -151,9 +162,8 @@ static int _stp_transport_thread_started = 0;
 #define _STP_D_T_PRINT_ADD(offset, increment) \
 	__STP_D_T_ADD((offset), (increment), _STP_DYNINST_BUFFER_SIZE)
 
-// Return a pointer to the session's current write queue.
-#define _STP_D_T_WRITE_QUEUE(sess_data) \
-	(&((sess_data)->queues[(sess_data)->write_queue]))
+// Convert a free-running queue index into a slot number.
+#define _STP_D_T_QUEUE_NORM(x)	((x) & (STP_DYNINST_QUEUE_ITEMS - 1))
 
 // Limit remembered strings in __stp_d_t_eliminate_duplicate_warnings
 #define MAX_STORED_WARNINGS 1024
@@ -179,31 +189,114 @@ static void _stp_transport_err (const char *fmt, ...)
 #endif
 
 
+// Note that the futex words live in shared memory, used by multiple
+// processes, so these can't use the FUTEX_PRIVATE_FLAG variants.
+static inline int
+__stp_d_t_futex_wait(int *uaddr, int val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static inline void
+__stp_d_t_futex_wake(int *uaddr)
+{
+	(void)syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Called by producers after publishing something for the consumer
+// thread. Only pays for a system call if the consumer is idle.
 static void
-__stp_dyninst_transport_queue_add(unsigned type, int data_index,
-				  size_t offset, size_t bytes)
+__stp_d_t_wake_consumer(struct _stp_transport_session_data *sess_data)
+{
+	// Pairs with the fence in the consumer's idle path: either we
+	// see 'consumer_idle', or the consumer sees our new data.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sess_data->consumer_idle, __ATOMIC_RELAXED)
+	    && __atomic_exchange_n(&sess_data->consumer_idle, 0,
+				   __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&sess_data->wake_seq, 1, __ATOMIC_SEQ_CST);
+		__stp_d_t_futex_wake(&sess_data->wake_seq);
+	}
+}
+
+// Called by the consumer thread after it has freed some space (log,
+// print, or queue) in a context. Only pays for a system call if a
+// producer is waiting.
+static void
+__stp_d_t_wake_producer(struct _stp_transport_context_data *data)
+{
+	__atomic_add_fetch(&data->space_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&data->producer_waiting, __ATOMIC_SEQ_CST))
+		__stp_d_t_futex_wake(&data->space_seq);
+}
+
+// Wait for the consumer thread to free some space in a context. The
+// caller must have sampled 'space_seq' (with
+// __stp_d_t_space_seq()) *before* it last found that there wasn't
+// enough space, so that a concurrent wakeup can't be missed.
+static void
+__stp_d_t_wait_for_space(struct _stp_transport_context_data *data, int seq,
+			 const struct timespec *timeout)
+{
+	__atomic_store_n(&data->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	__stp_d_t_futex_wait(&data->space_seq, seq, timeout);
+	__atomic_store_n(&data->producer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+static inline int
+__stp_d_t_space_seq(struct _stp_transport_context_data *data)
+{
+	return __atomic_load_n(&data->space_seq, __ATOMIC_ACQUIRE);
+}
+
+static void
+__stp_dyninst_transport_queue_add(struct _stp_transport_context_data *data,
+				  unsigned type, size_t offset, size_t bytes)
 {
 	struct _stp_transport_session_data *sess_data = stp_transport_data();
 
 	if (sess_data == NULL)
 		return;
 
-	pthread_mutex_lock(&(sess_data->queue_mutex));
-	// While the write queue is full, wait.
-	while (_STP_D_T_WRITE_QUEUE(sess_data)->items
-	       == (STP_DYNINST_QUEUE_ITEMS - 1)) {
-		pthread_cond_wait(&(sess_data->queue_space_avail),
-				  &(sess_data->queue_mutex));
+	// Note that the context is locked, so we're the only producer
+	// for this queue, and only we write 'head'.
+	struct _stp_transport_queue *q = &data->queue;
+	size_t head = q->head;
+
+	// While the queue is full, wait.
+	for (;;) {
+		int seq = __stp_d_t_space_seq(data);
+		if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)
+		    < STP_DYNINST_QUEUE_ITEMS)
+			break;
+		__stp_d_t_wake_consumer(sess_data);
+		__stp_d_t_wait_for_space(data, seq, NULL);
 	}
-	struct _stp_transport_queue *q = _STP_D_T_WRITE_QUEUE(sess_data);
-	struct _stp_transport_queue_item *item = &(q->queue[q->items]);
-	q->items++;
+
+	struct _stp_transport_queue_item *item
+		= &(q->queue[_STP_D_T_QUEUE_NORM(head)]);
 	item->type = type;
-	item->data_index = data_index;
 	item->offset = offset;
 	item->bytes = bytes;
-        pthread_cond_signal(&(sess_data->queue_data_avail));
-	pthread_mutex_unlock(&(sess_data->queue_mutex));
+	// The acquire/release makes anything published before this
+	// number was taken visible to whoever sees a later number.
+	item->seq = __atomic_fetch_add(&sess_data->seq, 1, __ATOMIC_ACQ_REL);
+
+	// Publish the item, then let the consumer know (if it cares).
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	__stp_d_t_wake_consumer(sess_data);
+}
+
+static void
+__stp_dyninst_transport_control_add(unsigned type)
+{
+	struct _stp_transport_session_data *sess_data = stp_transport_data();
+
+	if (sess_data == NULL)
+		return;
+
+	__atomic_or_fetch(&sess_data->control, type, __ATOMIC_RELEASE);
+	__stp_d_t_wake_consumer(sess_data);
 }
 
 /* Handle duplicate warning elimination. Returns 0 if we've seen this
@@ -325,16 +418,255 @@ stap_strfloctime(char *buf, size_t max, const char *fmt, time_t t)
 	return (int)ret;
 }
 
+// Output one OOB (warning/error or system command) item.
+static void
+__stp_d_t_handle_oob(struct _stp_transport_context_data *data,
+		     struct _stp_transport_queue_item *item, int err_fd)
+{
+	int write_data = 1;
+	void *read_ptr = data->log_buf + item->offset;
+
+	switch (item->type) {
+	case STP_DYN_OOB_DATA:
+		_stp_transport_debug(
+			"STP_DYN_OOB_DATA (%ld bytes at offset %ld)\n",
+			item->bytes, item->offset);
+
+		/* Note that "WARNING:" should not be
+		 * translated, since it is part of the
+		 * module cmd protocol. */
+		if (strncmp(read_ptr, "WARNING:", 7) == 0) {
+			if (stp_session_attributes()->suppress_warnings) {
+				write_data = 0;
+			}
+			/* If we're not verbose, eliminate
+			 * duplicate warning messages. */
+			else if (stp_session_attributes()->log_level
+				 == 0) {
+				write_data = __stp_d_t_eliminate_duplicate_warnings(read_ptr, item->bytes);
+			}
+		}
+		/* "ERROR:" also should not be translated.  */
+		else if (strncmp(read_ptr, "ERROR:", 5) == 0) {
+			if (_stp_exit_status == 0)
+				_stp_exit_status = 1;
+		}
+
+		if (! write_data) {
+			break;
+		}
+
+		if (_stp_write_retry(err_fd, read_ptr, item->bytes) < 0)
+			_stp_transport_err(
+				"couldn't write %ld bytes OOB data: %s\n",
+				(long)item->bytes, strerror(errno));
+		break;
+
+	case STP_DYN_SYSTEM:
+		_stp_transport_debug("STP_DYN_SYSTEM (%.*s) %d bytes\n",
+			(int)item->bytes, (char *)read_ptr,
+			(int)item->bytes);
+		/*
+		 * Note that the null character is
+		 * already included in the system
+		 * string.
+		 */
+		__stp_d_t_run_command(read_ptr);
+		break;
+	default:
+		_stp_transport_err(
+			"Error - unknown OOB item type %d\n",
+			item->type);
+		break;
+	}
+
+	// We're finished with this log buffer chunk.
+	__atomic_store_n(&data->log_start,
+			 _STP_D_T_LOG_INC(data->log_start),
+			 __ATOMIC_RELEASE);
+}
+
+// Output one print data item.
+static void
+__stp_d_t_handle_data(struct _stp_transport_context_data *data,
+		      struct _stp_transport_queue_item *item, int out_fd)
+{
+	void *read_ptr;
+
+	switch (item->type) {
+	case STP_DYN_NORMAL_DATA:
+		_stp_transport_debug("STP_DYN_NORMAL_DATA"
+			" (%ld bytes at offset %ld)\n",
+			item->bytes, item->offset);
+		read_ptr = (data->print_buf
+			    + _STP_D_T_PRINT_NORM(item->offset));
+		if (_stp_write_retry(out_fd, read_ptr, item->bytes) < 0)
+			_stp_transport_err(
+				"couldn't write %ld bytes data: %s\n",
+				(long)item->bytes, strerror(errno));
+
+		// Now we need to update the read pointer.
+		// Note that we're doing this without the
+		// context locked; the probe side only reads
+		// 'read_offset'.
+		__atomic_store_n(&data->read_offset,
+				 _STP_D_T_PRINT_ADD(item->offset,
+						    item->bytes),
+				 __ATOMIC_RELEASE);
+
+		_stp_transport_debug(
+			"STP_DYN_NORMAL_DATA flushed,"
+			" read_offset %ld, write_offset %ld)\n",
+			data->read_offset, data->write_offset);
+		break;
+
+	default:
+		_stp_transport_err("Error - unknown item type %d\n",
+				   item->type);
+		break;
+	}
+}
+
+// One context's part of a consumer batch: its queue slots from
+// 'tail' up to 'end', and how far each pass has gotten ('pos').
+struct __stp_d_t_cursor {
+	struct context *c;
+	size_t tail, pos, end;
+};
+
+static inline int
+__stp_d_t_seq_before(unsigned long a, unsigned long b)
+{
+	return (long)(a - b) < 0;
+}
+
+static inline struct _stp_transport_queue_item *
+__stp_d_t_cursor_item(struct __stp_d_t_cursor *cur)
+{
+	return &cur->c->transport_data.queue.queue[_STP_D_T_QUEUE_NORM(cur->pos)];
+}
+
+// Process a batch of what is queued on every context, in the order it
+// was queued. Like a single queue, the OOB items go first, then the
+// print data. Returns the number of items processed.
+static size_t
+__stp_d_t_drain(struct __stp_d_t_cursor *cursors, int out_fd, int err_fd)
+{
+	unsigned long last = 0;
+	int have_last = 0, i, k, n = 0, pass;
+	size_t items = 0;
+
+	// Find the newest item queued anywhere...
+	for (i = 0; i < _stp_runtime_num_contexts; i++) {
+		struct context *c = stp_session_context(i);
+		struct _stp_transport_queue *q;
+		size_t head;
+		unsigned long seq;
+
+		if (c == NULL)
+			continue;
+		q = &c->transport_data.queue;
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (head == q->tail)
+			continue;
+		seq = q->queue[_STP_D_T_QUEUE_NORM(head - 1)].seq;
+		if (! have_last || __stp_d_t_seq_before(last, seq)) {
+			last = seq;
+			have_last = 1;
+		}
+	}
+	if (! have_last)
+		return 0;
+
+	// ... and take everything queued up to it. Each queue's items
+	// are in sequence order, so that is a run from its 'tail'.
+	// Note that we're the only writer of 'tail'.
+	for (i = 0; i < _stp_runtime_num_contexts; i++) {
+		struct context *c = stp_session_context(i);
+		struct _stp_transport_queue *q;
+		size_t head, end;
+
+		if (c == NULL)
+			continue;
+		q = &c->transport_data.queue;
+		head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		for (end = q->tail; end != head; end++)
+			if (__stp_d_t_seq_before(last, q->queue[_STP_D_T_QUEUE_NORM(end)].seq))
+				break;
+		if (end == q->tail)
+			continue;
+		cursors[n].c = c;
+		cursors[n].tail = q->tail;
+		cursors[n].end = end;
+		n++;
+	}
+
+	// Merge the queues, first for the OOB items, then the rest.
+	for (pass = 0; pass < 2; pass++) {
+		for (k = 0; k < n; k++)
+			cursors[k].pos = cursors[k].tail;
+		for (;;) {
+			struct __stp_d_t_cursor *next = NULL;
+
+			for (k = 0; k < n; k++) {
+				struct __stp_d_t_cursor *cur = &cursors[k];
+				while (cur->pos != cur->end
+				       && (!(__stp_d_t_cursor_item(cur)->type
+					     & STP_DYN_OOB_DATA_MASK)) != pass)
+					cur->pos++;
+				if (cur->pos == cur->end)
+					continue;
+				if (next == NULL
+				    || __stp_d_t_seq_before(__stp_d_t_cursor_item(cur)->seq,
+							    __stp_d_t_cursor_item(next)->seq))
+					next = cur;
+			}
+			if (next == NULL)
+				break;
+			if (pass == 0)
+				__stp_d_t_handle_oob(&next->c->transport_data,
+						     __stp_d_t_cursor_item(next),
+						     err_fd);
+			else
+				__stp_d_t_handle_data(&next->c->transport_data,
+						      __stp_d_t_cursor_item(next),
+						      out_fd);
+			next->pos++;
+		}
+	}
+
+	// We're now finished with these queue slots. Free them up,
+	// and signal more space available to any waiter (once per
+	// batch).
+	for (k = 0; k < n; k++) {
+		struct _stp_transport_context_data *data
+			= &cursors[k].c->transport_data;
+		__atomic_store_n(&data->queue.tail, cursors[k].end,
+				 __ATOMIC_RELEASE);
+		__stp_d_t_wake_producer(data);
+		items += cursors[k].end - cursors[k].tail;
+	}
+	return items;
+}
+
 static void *
 _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 {
 	int stopping = 0;
 	int out_fd, err_fd;
+	int i;
 	struct _stp_transport_session_data *sess_data = stp_transport_data();
+	struct __stp_d_t_cursor *cursors;
 
 	if (sess_data == NULL)
 		return NULL;
 
+	cursors = calloc(_stp_runtime_num_contexts, sizeof(*cursors));
+	if (cursors == NULL) {
+		_stp_transport_err("ERROR: Couldn't allocate transport cursors\n");
+		return NULL;
+	}
+
 	if (strlen(stp_session_attributes()->outfile_name)) {
 		char buf[PATH_MAX];
 		int rc;
@@ -344,185 +676,70 @@ _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 				      time(NULL));
 		if (rc < 0) {
 			_stp_transport_err("Invalid FILE name format\n");
+			free(cursors);
 			return NULL;
 		}
 		out_fd = open (buf, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0666);
 		if (out_fd < 0) {
 			_stp_transport_err("ERROR: Couldn't open output file %s: %s\n",
 					   buf, strerror(rc));
+			free(cursors);
 			return NULL;
 		}
 	}
 	else
 		out_fd = STDOUT_FILENO;
 	err_fd = STDERR_FILENO;
-	if (out_fd < 0 || err_fd < 0)
-		return NULL;
 
 	while (! stopping) {
-		struct _stp_transport_queue *q;
-		struct _stp_transport_queue_item *item;
-		struct context *c;
-		struct _stp_transport_context_data *data;
-		void *read_ptr;
-
-		pthread_mutex_lock(&(sess_data->queue_mutex));
-		// While there are no queue entries, wait.
-		q = _STP_D_T_WRITE_QUEUE(sess_data);
-		while (q->items == 0) {
-			// Mutex is locked. It is automatically
-			// unlocked while we are waiting.
-			pthread_cond_wait(&(sess_data->queue_data_avail),
-					  &(sess_data->queue_mutex));
-			// Mutex is locked again.
-		}
+		size_t items = 0;
+		unsigned control;
 
-		// We've got data. Swap the queues and let any waiters
-		// know there is more space available.
-		sess_data->write_queue ^= 1;
-		pthread_cond_broadcast(&(sess_data->queue_space_avail));
-		pthread_mutex_unlock(&(sess_data->queue_mutex));
-
-		// Note that we're processing the read queue with no
-		// locking. This is possible since no other thread
-		// will be accessing it until we're finished with it
-		// (and we make it the write queue).
-
-		// Process the queue twice. First handle the OOB data types.
-		for (size_t i = 0; i < q->items; i++) {
-			int write_data = 1;
-			item = &(q->queue[i]);
-			if (! (item->type & STP_DYN_OOB_DATA_MASK))
-				continue;
-
-			c = stp_session_context(item->data_index);
-			data = &c->transport_data;
-			read_ptr = data->log_buf + item->offset;
-
-			switch (item->type) {
-			case STP_DYN_OOB_DATA:
-				_stp_transport_debug(
-                                        "STP_DYN_OOB_DATA (%ld bytes at offset %ld)\n",
-					item->bytes, item->offset);
-
-				/* Note that "WARNING:" should not be
-				 * translated, since it is part of the
-				 * module cmd protocol. */
-				if (strncmp(read_ptr, "WARNING:", 7) == 0) {
-					if (stp_session_attributes()->suppress_warnings) {
-						write_data = 0;
-					}
-					/* If we're not verbose, eliminate
-					 * duplicate warning messages. */
-					else if (stp_session_attributes()->log_level
-						 == 0) {
-						write_data = __stp_d_t_eliminate_duplicate_warnings(read_ptr, item->bytes);
-					}
-				}
-				/* "ERROR:" also should not be translated.  */
-				else if (strncmp(read_ptr, "ERROR:", 5) == 0) {
-					if (_stp_exit_status == 0)
-						_stp_exit_status = 1;
-				}
-
-				if (! write_data) {
-					break;
-				}
-
-				if (_stp_write_retry(err_fd, read_ptr, item->bytes) < 0)
-					_stp_transport_err(
-						"couldn't write %ld bytes OOB data: %s\n",
-						(long)item->bytes, strerror(errno));
-				break;
+		// Grab any pending control requests first, so that
+		// all the data queued before them gets drained below.
+		control = __atomic_exchange_n(&sess_data->control, 0,
+					      __ATOMIC_ACQUIRE);
 
-			case STP_DYN_SYSTEM:
-				_stp_transport_debug("STP_DYN_SYSTEM (%.*s) %d bytes\n",
-					(int)item->bytes, (char *)read_ptr,
-					(int)item->bytes);
-				/*
-				 * Note that the null character is
-				 * already included in the system
-				 * string.
-				 */
-				__stp_d_t_run_command(read_ptr);
-				break;
-			default:
-				_stp_transport_err(
-					"Error - unknown OOB item type %d\n",
-					item->type);
-				break;
-			}
+		items = __stp_d_t_drain(cursors, out_fd, err_fd);
 
-			// Signal there is a log buffer available to
-			// any waiters.
-			data->log_start = _STP_D_T_LOG_INC(data->log_start);
-			pthread_mutex_lock(&(data->log_mutex));
-			pthread_cond_signal(&(data->log_space_avail));
-			pthread_mutex_unlock(&(data->log_mutex));
+		if (control & STP_DYN_REQUEST_EXIT) {
+			_stp_transport_debug("STP_DYN_REQUEST_EXIT\n");
+			__stp_d_t_request_exit();
 		}
-
-		// Handle the non-OOB data.
-		for (size_t i = 0; i < q->items; i++) {
-			item = &(q->queue[i]);
-
-			switch (item->type) {
-			case STP_DYN_NORMAL_DATA:
-				_stp_transport_debug("STP_DYN_NORMAL_DATA"
-					" (%ld bytes at offset %ld)\n",
-					item->bytes, item->offset);
-				c = stp_session_context(item->data_index);
-				data = &c->transport_data;
-				read_ptr = (data->print_buf
-					    + _STP_D_T_PRINT_NORM(item->offset));
-				if (_stp_write_retry(out_fd, read_ptr, item->bytes) < 0)
-					_stp_transport_err(
-						"couldn't write %ld bytes data: %s\n",
-						(long)item->bytes, strerror(errno));
-
-				pthread_mutex_lock(&(data->print_mutex));
-
-				// Now we need to update the read
-				// pointer, using the data_index we
-				// received. Note that we're doing
-				// this with or without that context
-				// locked, but the print_mutex is
-				// locked.
-				data->read_offset = _STP_D_T_PRINT_ADD(item->offset, item->bytes);
-
-				// Signal more bytes available to any waiters.
-				pthread_cond_signal(&(data->print_space_avail));
-				pthread_mutex_unlock(&(data->print_mutex));
-
-				_stp_transport_debug(
-					"STP_DYN_NORMAL_DATA flushed,"
-					" read_offset %ld, write_offset %ld)\n",
-					data->read_offset, data->write_offset);
-				break;
-
-			case STP_DYN_EXIT:
-				_stp_transport_debug("STP_DYN_EXIT\n");
-				stopping = 1;
-				break;
-
-			case STP_DYN_REQUEST_EXIT:
-				_stp_transport_debug("STP_DYN_REQUEST_EXIT\n");
-				__stp_d_t_request_exit();
-				break;
-
-			default:
-				if (! (item->type & STP_DYN_OOB_DATA_MASK)) {
-					_stp_transport_err(
-						"Error - unknown item type"
-						" %d\n", item->type);
-				}
-				break;
-			}
+		if (control & STP_DYN_EXIT) {
+			_stp_transport_debug("STP_DYN_EXIT\n");
+			stopping = 1;
 		}
+		if (items != 0 || control != 0)
+			continue;
 
-		// We're now finished with the read queue. Clear it
-		// out.
-		q->items = 0;
+		// Everything is empty. Let the producers know we're
+		// about to sleep, then recheck everything, so that an
+		// item published concurrently can't be missed.
+		int seq = __atomic_load_n(&sess_data->wake_seq,
+					  __ATOMIC_ACQUIRE);
+		__atomic_store_n(&sess_data->consumer_idle, 1,
+				 __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		int idle = (__atomic_load_n(&sess_data->control,
+					    __ATOMIC_RELAXED) == 0);
+		for (i = 0; idle && i < _stp_runtime_num_contexts; i++) {
+			struct context *c = stp_session_context(i);
+			struct _stp_transport_queue *q;
+			if (c == NULL)
+				continue;
+			q = &c->transport_data.queue;
+			if (__atomic_load_n(&q->head, __ATOMIC_RELAXED)
+			    != q->tail)
+				idle = 0;
+		}
+		if (idle)
+			__stp_d_t_futex_wait(&sess_data->wake_seq, seq, NULL);
+		__atomic_store_n(&sess_data->consumer_idle, 0,
+				 __ATOMIC_RELAXED);
 	}
+	free(cursors);
 	return NULL;
 }
 
@@ -547,80 +764,51 @@ static int _stp_ctl_send(int type, void *data, unsigned len)
 
 	memcpy(buffer, data, len);
 	size_t offset = buffer - c->transport_data.log_buf;
-	__stp_dyninst_transport_queue_add(STP_DYN_SYSTEM,
-					  c->data_index, offset, len);
+	__stp_dyninst_transport_queue_add(&c->transport_data, STP_DYN_SYSTEM,
+					  offset, len);
 	return len;
 }
 
 static void _stp_dyninst_transport_signal_exit(void)
 {
-	__stp_dyninst_transport_queue_add(STP_DYN_EXIT, 0, 0, 0);
+	__stp_dyninst_transport_control_add(STP_DYN_EXIT);
 }
 
 static void _stp_dyninst_transport_request_exit(void)
 {
-	__stp_dyninst_transport_queue_add(STP_DYN_REQUEST_EXIT, 0, 0, 0);
+	__stp_dyninst_transport_control_add(STP_DYN_REQUEST_EXIT);
 }
 
 static int _stp_dyninst_transport_session_init(void)
 {
-	int rc;
-
-	// Set up the transport session data.
+	// Set up the transport session data. Note that there aren't
+	// any locks to initialize, just the futex words and indices.
 	struct _stp_transport_session_data *sess_data = stp_transport_data();
 	if (sess_data != NULL) {
-		rc = stp_pthread_mutex_init_shared(&(sess_data->queue_mutex));
-		if (rc != 0) {
-			_stp_error("transport queue mutex initialization"
-				   " failed");
-			return rc;
-		}
-		rc = stp_pthread_cond_init_shared(&(sess_data->queue_space_avail));
-		if (rc != 0) {
-			_stp_error("transport queue space avail cond variable"
-				   " initialization failed");
-			return rc;
-		}
-		rc = stp_pthread_cond_init_shared(&(sess_data->queue_data_avail));
-		if (rc != 0) {
-			_stp_error("transport queue empty cond variable"
-				   " initialization failed");
-			return rc;
-		}
+		sess_data->wake_seq = 0;
+		sess_data->consumer_idle = 0;
+		sess_data->control = 0;
+		sess_data->seq = 0;
 	}
 
 	// Set up each context's transport data.
 	int i;
-	for_each_possible_cpu(i) {
+	for (i = 0; i < _stp_runtime_num_contexts; i++) {
 		struct context *c;
 		struct _stp_transport_context_data *data;
 		c = stp_session_context(i);
 		if (c == NULL)
 			continue;
 		data = &c->transport_data;
-		rc = stp_pthread_mutex_init_shared(&(data->print_mutex));
-		if (rc != 0) {
-			_stp_error("transport mutex initialization failed");
-			return rc;
-		}
-
-		rc = stp_pthread_cond_init_shared(&(data->print_space_avail));
-		if (rc != 0) {
-			_stp_error("transport cond variable initialization failed");
-			return rc;
-		}
-
-		rc = stp_pthread_mutex_init_shared(&(data->log_mutex));
-		if (rc != 0) {
-			_stp_error("transport log mutex initialization failed");
-			return rc;
-		}
-
-		rc = stp_pthread_cond_init_shared(&(data->log_space_avail));
-		if (rc != 0) {
-			_stp_error("transport log cond variable initialization failed");
-			return rc;
-		}
+		data->queue.head = 0;
+		data->queue.tail = 0;
+		data->space_seq = 0;
+		data->producer_waiting = 0;
+		data->read_offset = 0;
+		data->write_offset = 0;
+		data->write_bytes = 0;
+		data->log_start = 0;
+		data->log_end = 0;
 	}
 
 	return 0;
@@ -650,8 +838,8 @@ _stp_dyninst_transport_write_oob_data(char *buffer, size_t bytes)
 		return EINVAL;
 
 	size_t offset = buffer - c->transport_data.log_buf;
-	__stp_dyninst_transport_queue_add(STP_DYN_OOB_DATA,
-					  c->data_index, offset, bytes);
+	__stp_dyninst_transport_queue_add(&c->transport_data, STP_DYN_OOB_DATA,
+					  offset, bytes);
 	return 0;
 }
 
@@ -686,8 +874,7 @@ static int _stp_dyninst_transport_write(void)
 	// 0).
 	data->write_offset = _STP_D_T_PRINT_ADD(data->write_offset, bytes);
 
-	__stp_dyninst_transport_queue_add(STP_DYN_NORMAL_DATA,
-					  c->data_index,
+	__stp_dyninst_transport_queue_add(data, STP_DYN_NORMAL_DATA,
 					  saved_write_offset, bytes);
 	return 0;
 }
@@ -706,28 +893,8 @@ static void _stp_dyninst_transport_shutdown(void)
 	pthread_join(_stp_transport_thread, NULL);
 	_stp_transport_thread_started = 0;
 
-	// Tear down the transport session data.
-	struct _stp_transport_session_data *sess_data = stp_transport_data();
-	if (sess_data != NULL) {
-		pthread_mutex_destroy(&(sess_data->queue_mutex));
-		pthread_cond_destroy(&(sess_data->queue_space_avail));
-		pthread_cond_destroy(&(sess_data->queue_data_avail));
-	}
-
-	// Tear down each context's transport data.
-	int i;
-	for_each_possible_cpu(i) {
-		struct context *c;
-		struct _stp_transport_context_data *data;
-		c = stp_session_context(i);
-		if (c == NULL)
-			continue;
-		data = &c->transport_data;
-		pthread_mutex_destroy(&(data->print_mutex));
-		pthread_cond_destroy(&(data->print_space_avail));
-		pthread_mutex_destroy(&(data->log_mutex));
-		pthread_cond_destroy(&(data->log_space_avail));
-	}
+	// Note that there's nothing else to tear down, since the
+	// transport doesn't use any locks.
 }
 
 static int
@@ -735,7 +902,8 @@ _stp_dyninst_transport_log_buffer_full(struct _stp_transport_context_data *data)
 {
 	// This inverts the most significant bit of 'log_start' before
 	// comparison.
-	return (data->log_end == (data->log_start ^ _STP_LOG_BUF_ENTRIES));
+	size_t log_start = __atomic_load_n(&data->log_start, __ATOMIC_ACQUIRE);
+	return (data->log_end == (log_start ^ _STP_LOG_BUF_ENTRIES));
 }
 
 
@@ -751,13 +919,11 @@ static char *_stp_dyninst_transport_log_buffer(void)
 	struct _stp_transport_context_data *data = &c->transport_data;
 
 	// If there isn't an available log buffer, wait.
-	if (_stp_dyninst_transport_log_buffer_full(data)) {
-		pthread_mutex_lock(&(data->log_mutex));
-		while (_stp_dyninst_transport_log_buffer_full(data)) {
-			pthread_cond_wait(&(data->log_space_avail),
-					  &(data->log_mutex));
-		}
-		pthread_mutex_unlock(&(data->log_mutex));
+	for (;;) {
+		int seq = __stp_d_t_space_seq(data);
+		if (! _stp_dyninst_transport_log_buffer_full(data))
+			break;
+		__stp_d_t_wait_for_space(data, seq, NULL);
 	}
 
 	// Note that we're taking 'log_end' and normalizing it to start
@@ -827,99 +993,65 @@ static void *_stp_dyninst_transport_reserve_bytes(int numbytes)
 	size_t space_before, space_after, read_offset;
 
 recheck:
-	pthread_mutex_lock(&(data->print_mutex));
-
 	// If the buffer is empty, reset everything to the
-	// beginning. This cuts down on fragmentation.
-	if (data->write_bytes == 0 && data->read_offset == data->write_offset
-	    && data->read_offset != 0) {
-		data->read_offset = 0;
+	// beginning. This cuts down on fragmentation. Note that this
+	// is safe without any locking: if everything we've flushed
+	// has been consumed, the consumer thread won't touch
+	// 'read_offset' again until we queue more data.
+	read_offset = __atomic_load_n(&data->read_offset, __ATOMIC_ACQUIRE);
+	if (data->write_bytes == 0 && read_offset == data->write_offset
+	    && read_offset != 0) {
+		__atomic_store_n(&data->read_offset, 0, __ATOMIC_RELAXED);
 		data->write_offset = 0;
+		read_offset = 0;
 	}
+
 	// We cache the read_offset value to get a consistent view of
 	// the buffer (between calls to get the space before/after).
-        read_offset = data->read_offset;
-	pthread_mutex_unlock(&(data->print_mutex));
-
 	space_before = __stp_d_t_space_before(data, read_offset);
 	space_after = __stp_d_t_space_after(data, read_offset);
 
 	// If we don't have enough space, try to get more space by
 	// flushing and/or waiting.
 	if (space_before < numbytes && space_after < numbytes) {
-		// First, lock the mutex.
-		pthread_mutex_lock(&(data->print_mutex));
-
-		// There is a race condition here. We've checked for
-		// available free space, then locked the mutex. It is
-		// possible for more free space to have become
-		// available between the time we checked and the time
-		// we locked the mutex. Recheck the available free
-		// space.
-		read_offset = data->read_offset;
-		space_before = __stp_d_t_space_before(data, read_offset);
-		space_after = __stp_d_t_space_after(data, read_offset);
-
-		// If we still don't have enough space and we have
-		// data we haven't flushed, go ahead and flush to free
-		// up space.
-		if (space_before < numbytes && space_after < numbytes
-		    && data->write_bytes != 0) {
-			// Flush the buffer. We have to do this while
-			// the mutex is locked, so that we can't miss
-			// the condition change. (If we did flush
-			// without the mutex locked, it would be
-			// possible for the consumer thread to signal
-			// the condition variable before we were
-			// waiting on it.)
-			_stp_dyninst_transport_write();
+		struct timespec deadline, now, timeout;
+		int seq;
 
-			// Mutex is locked. It is automatically
-			// unlocked while we are waiting.
-			pthread_cond_wait(&(data->print_space_avail),
-					  &(data->print_mutex));
-			// Mutex is locked again.
+		// If we have data we haven't flushed, go ahead and
+		// flush to free up space.
+		if (data->write_bytes != 0)
+			_stp_dyninst_transport_write();
 
-			// Recheck available free space.
-			read_offset = data->read_offset;
+		// Wait (for up to STP_DYNINST_TIMEOUT_SECS seconds)
+		// for the consumer thread to free up enough bytes.
+		// This might fail if there isn't anything in the queue
+		// for this context structure.
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += STP_DYNINST_TIMEOUT_SECS;
+		for (;;) {
+			// Note that 'space_seq' has to be sampled
+			// before the space is rechecked, so that we
+			// can't miss a wakeup in between.
+			seq = __stp_d_t_space_seq(data);
+			read_offset = __atomic_load_n(&data->read_offset,
+						      __ATOMIC_ACQUIRE);
 			space_before = __stp_d_t_space_before(data,
 							      read_offset);
 			space_after = __stp_d_t_space_after(data, read_offset);
-		}
+			if (space_before >= numbytes || space_after >= numbytes)
+				break;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			_stp_timespec_sub(&deadline, &now, &timeout);
+			if (timeout.tv_sec < 0)
+				break;
 
-		// If we don't have enough bytes available, do a timed
-		// wait for more bytes to become available. This might
-		// fail if there isn't anything in the queue for this
-		// context structure.
-		if (space_before < numbytes && space_after < numbytes) {
 			_stp_transport_debug(
 				"waiting for more space, numbytes %d,"
 				" before %ld, after %ld\n",
 				numbytes, space_before, space_after);
-
-			// Setup a timeout for
-			// STP_DYNINST_TIMEOUT_SECS seconds into the
-			// future.
-			struct timespec ts;
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_sec += STP_DYNINST_TIMEOUT_SECS;
-
-			// Mutex is locked. It is automatically
-			// unlocked while we are waiting.
-			pthread_cond_timedwait(&(data->print_space_avail),
-					       &(data->print_mutex),
-					       &ts);
-			// When pthread_cond_timedwait() returns, the
-			// mutex has been (re)locked.
-
-			// Now see if we've got more bytes available.
-			read_offset = data->read_offset;
-			space_before = __stp_d_t_space_before(data,
-							      read_offset);
-			space_after = __stp_d_t_space_after(data, read_offset);
+			__stp_d_t_wait_for_space(data, seq, &timeout);
 		}
-		// We're finished with the mutex.
-		pthread_mutex_unlock(&(data->print_mutex));
 
 		// If we *still* don't have enough space available,
 		// quit. We've done all we can do.
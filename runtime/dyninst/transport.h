@@ -45,20 +45,20 @@
 // The total size of the log buffer
 #define _STP_DYNINST_LOG_BUF_LEN (STP_LOG_BUF_LEN * _STP_LOG_BUF_ENTRIES)
 
-// The maximum number of queue items each transport queue can
-// hold.
+// The maximum number of queue items each context's transport queue
+// can hold. Note that it must be a power of 2, since the queue
+// indices are free-running and masked on use.
 #ifndef STP_DYNINST_QUEUE_ITEMS
 #define STP_DYNINST_QUEUE_ITEMS 64
 #endif
+#if (STP_DYNINST_QUEUE_ITEMS & (STP_DYNINST_QUEUE_ITEMS - 1)) != 0
+#error "STP_DYNINST_QUEUE_ITEMS must be a power of 2"
+#endif
 
 struct _stp_transport_queue_item {
 	// The type variable lets the thread know what it needs to do.
 	unsigned type;
 
-	// 'data_index' indicates which context structure we're
-	// working on. */
-	int data_index;
-
 	// When 'type' indicates that normal or oob data needs to be
 	// output, this is the data offset.
 	size_t offset;
@@ -66,33 +66,57 @@ struct _stp_transport_queue_item {
 	// When 'type' indicates that normal or oob data needs to be
 	// output, this is the number of bytes to output.
 	size_t bytes;
+
+	// Where this item falls among those of every context, from the
+	// session's 'seq'.
+	unsigned long seq;
 };
 
+// A single-producer/single-consumer ring. The producer is whichever
+// probe has the owning context locked; the consumer is the transport
+// thread. 'head' is only written by the producer and 'tail' is only
+// written by the consumer. Both are free-running counters.
 struct _stp_transport_queue {
-	size_t items;
+	size_t head;
+	size_t tail;
 	struct _stp_transport_queue_item queue[STP_DYNINST_QUEUE_ITEMS];
 };
 
 // This structure is stored in the session data.
 struct _stp_transport_session_data {
-	unsigned write_queue;
-	struct _stp_transport_queue queues[2];
-	pthread_mutex_t queue_mutex;
-	pthread_cond_t queue_space_avail;
-	pthread_cond_t queue_data_avail;
+	// Futex word the consumer thread sleeps on. Producers bump it
+	// (and wake the consumer) only when 'consumer_idle' is set.
+	int wake_seq;
+	int consumer_idle;
+
+	// Pending STP_DYN_EXIT / STP_DYN_REQUEST_EXIT requests. These
+	// don't belong to any context, so they bypass the rings.
+	unsigned control;
+
+	// The next queue item's sequence number, so that the consumer
+	// can output items of all contexts in the order they were
+	// queued.
+	unsigned long seq;
 };
 
 // This structure is stored in every context structure.
 struct _stp_transport_context_data {
+	/* The queue of pending print/log items for this context. */
+	struct _stp_transport_queue queue;
+
+	/*
+	 * Futex word that producers wait on for print, log, or queue
+	 * space. The consumer bumps it after freeing space, and only
+	 * issues a wakeup when 'producer_waiting' is set.
+	 */
+	int space_seq;
+	int producer_waiting;
+
 	/* The buffer and variables used for print messages */
 	size_t read_offset;
 	size_t write_offset;
 	size_t write_bytes;
 	char print_buf[_STP_DYNINST_BUFFER_SIZE];
-	/* The condition variable is used to signal our thread. */
-	pthread_cond_t print_space_avail;
-	/* The lock for this print state. */
-	pthread_mutex_t print_mutex;
 
 	/*
 	 * The buffer and variables used for log (warn/error)
@@ -103,10 +127,6 @@ struct _stp_transport_context_data {
 	size_t log_start;		/* index of oldest entry */
 	size_t log_end;			/* where to write new entry */
 	char log_buf[_STP_DYNINST_LOG_BUF_LEN];
-	/* The condition variable is used to signal space available. */
-	pthread_cond_t log_space_avail;
-	/* The lock for 'log_space_avail'. */
-	pthread_mutex_t log_mutex;
 };
 
 static int _stp_dyninst_transport_session_init(void);
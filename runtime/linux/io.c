@@ -20,6 +20,7 @@
 
 #define WARN_STRING "WARNING: "
 #define ERR_STRING "ERROR: "
+#define INFO_STRING "INFO: "
 #if (STP_LOG_BUF_LEN < 10) /* sizeof(WARN_STRING) */
 #error "STP_LOG_BUF_LEN is too short"
 #endif
@@ -47,6 +48,10 @@ static void _stp_vlog (enum code type, const char *func, int line, const char *f
 		 * is > sizeof(ERR_STRING) (which is < sizeof(WARN_STRING). */
 		strcpy (buf, ERR_STRING);
 		start = sizeof(ERR_STRING) - 1;
+	} else if (type == INFO) {
+		/* Likewise for INFO_STRING. */
+		strcpy (buf, INFO_STRING);
+		start = sizeof(INFO_STRING) - 1;
 	}
 
 	num = vscnprintf (buf + start, STP_LOG_BUF_LEN - start - 1, fmt, args);
@@ -89,6 +94,21 @@ static void _stp_warn (const char *fmt, ...)
 	va_end(args);
 }
 
+/** Prints an informational message.
+ * This function sends a message about the module's own workings, such
+ * as how long it took to register its probes, immediately to staprun,
+ * which only shows it in verbose mode.  If the last character is not a
+ * newline, then one is added.
+ * @param fmt A variable number of args.
+ */
+static void _stp_info (const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	_stp_vlog (INFO, NULL, 0, fmt, args);
+	va_end(args);
+}
+
 /** Exits and unloads the module.
  * This function sends a signal to staprun to tell it to
  * unload the module and exit. The module will not be 
@@ -18,6 +18,7 @@
 
 #include <linux/kprobes.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
 
 #ifdef DEBUG_KPROBES
 #define dbug_stapkp(args...) do {					\
@@ -92,6 +93,16 @@ struct stap_kprobe_probe {
 };
 
 
+// Entry of the symbol name index emitted by the translator alongside the
+// probes, sorted by name (by strcmp order), for those probes that use
+// symbol_name+offset.  For module probes, the name is the part of
+// symbol_name after the "module:" prefix, as kallsyms reports it.
+struct stap_kprobe_symbol {
+   const char *name;
+   unsigned idx;			/* index into the probes array */
+};
+
+
 // Forward declare the master entry functions (stap-generated)
 static int
 enter_kprobe_probe(struct kprobe *inst,
@@ -376,6 +387,32 @@ stapkp_add_missed(struct stap_kprobe_probe *skp)
 }
 
 
+// Free what stapkp_prepare_k[ret]probe() allocated and clear the
+// k[ret]probe struct, after unregistering it or failing to register it.
+static void
+stapkp_reset_probe(struct stap_kprobe_probe *skp)
+{
+   struct stap_kprobe *sk = skp->kprobe;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+   if (skp->symbol_name != NULL) {
+      if (skp->return_p) {
+	 if (sk->u.krp.kp.symbol_name != NULL)
+	    kfree(sk->u.krp.kp.symbol_name);
+      }
+      else {
+	 if (sk->u.kp.symbol_name != NULL)
+	    kfree(sk->u.kp.symbol_name);
+      }
+   }
+#endif
+
+   // PR16861: kprobes may have left some things in the k[ret]probe struct.
+   // Let's reset it to be sure it's safe for re-use.
+   memset(sk, 0, sizeof(struct stap_kprobe));
+}
+
+
 static void
 stapkp_unregister_probe(struct stap_kprobe_probe *skp)
 {
@@ -409,22 +446,7 @@ stapkp_unregister_probe(struct stap_kprobe_probe *skp)
 
    stapkp_add_missed(skp);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
-   if (skp->symbol_name != NULL) {
-      if (skp->return_p) {
-	 if (sk->u.krp.kp.symbol_name != NULL)
-	    kfree(sk->u.krp.kp.symbol_name);
-      }
-      else {
-	 if (sk->u.kp.symbol_name != NULL)
-	    kfree(sk->u.kp.symbol_name);
-      }
-   }
-#endif
-
-   // PR16861: kprobes may have left some things in the k[ret]probe struct.
-   // Let's reset it to be sure it's safe for re-use.
-   memset(sk, 0, sizeof(struct stap_kprobe));
+   stapkp_reset_probe(skp);
 }
 
 
@@ -506,22 +528,7 @@ stapkp_batch_unregister_probes(struct stap_kprobe_probe *probes,
 
       stapkp_add_missed(skp);
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
-      if (skp->symbol_name != NULL) {
-	 if (skp->return_p) {
-	    if (skp->kprobe->u.krp.kp.symbol_name != NULL)
-	       kfree(skp->kprobe->u.krp.kp.symbol_name);
-	 }
-	 else {
-	    if (skp->kprobe->u.kp.symbol_name != NULL)
-	       kfree(skp->kprobe->u.kp.symbol_name);
-	 }
-      }
-#endif
-
-      // PR16861: kprobes may have left some things in the k[ret]probe struct.
-      // Let's reset it to be sure it's safe for re-use.
-      memset(skp->kprobe, 0, sizeof(struct stap_kprobe));
+      stapkp_reset_probe(skp);
    }
 }
 
@@ -644,12 +651,34 @@ stapkp_refresh_probe(struct stap_kprobe_probe *skp)
 #ifdef STAPCONF_KALLSYMS_ON_EACH_SYMBOL
 struct stapkp_symbol_data {
    struct stap_kprobe_probe *probes;
-   size_t nprobes;			/* number of probes in "probes" */
+   const struct stap_kprobe_symbol *symbols;
+   size_t nsymbols;			/* number of entries in "symbols" */
    size_t probe_max;			/* number of probes to process */
    const char *modname;
 };
 
 
+// Return the index of the first entry of the sorted symbol index that
+// is named 'name', or nsymbols if there is none.
+static size_t
+stapkp_symbol_lookup(const struct stap_kprobe_symbol *symbols,
+		     size_t nsymbols, const char *name)
+{
+   size_t lo = 0, hi = nsymbols;
+
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (strcmp(symbols[mid].name, name) < 0)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+   if (lo < nsymbols && strcmp(symbols[lo].name, name) == 0)
+      return lo;
+   return nsymbols;
+}
+
+
 static int
 stapkp_symbol_callback(void *data, const char *name,
 		       struct module *mod, unsigned long addr)
@@ -661,25 +690,21 @@ stapkp_symbol_callback(void *data, const char *name,
        || (!mod && sd->modname))
       return 0;
 
-   for (i = 0; i < sd->nprobes; i++) {
-      struct stap_kprobe_probe *skp = &sd->probes[i];
+   // This gets called for every symbol of the kernel and its modules,
+   // with module_mutex held and preemption disabled, so only look at
+   // the probes on symbols of this name.
+   for (i = stapkp_symbol_lookup(sd->symbols, sd->nsymbols, name);
+	i < sd->nsymbols && strcmp(sd->symbols[i].name, name) == 0; i++) {
+      struct stap_kprobe_probe *skp = &sd->probes[sd->symbols[i].idx];
       int update_addr = 0;
 
-      if (! skp->symbol_name)
-	 continue;
-
-      // If (1) We're probing a module symbol and we're in that module
-      // and the names match; or (2) we're probing a symbol in the
-      // kernel and the names match, then update the k[ret]probe
-      // address.
-      if (mod && skp->module && strcmp(mod->name, skp->module) == 0) {
-	 char *colon = strchr(skp->symbol_name, ':');
-
-	 if (colon != NULL && strcmp(name, colon+1) == 0)
-	    update_addr = 1;
-      }
-      else if (!mod && (skp->module == NULL || skp->module[0] == '\0')
-	       && strcmp(name, skp->symbol_name) == 0)
+      // If (1) We're probing a module symbol and we're in that module;
+      // or (2) we're probing a symbol in the kernel, then update the
+      // k[ret]probe address.  (The names match by construction of the
+      // index.)
+      if (mod && skp->module && strcmp(mod->name, skp->module) == 0)
+	 update_addr = 1;
+      else if (!mod && (skp->module == NULL || skp->module[0] == '\0'))
 	 update_addr = 1;
       if (update_addr) {
 
@@ -702,31 +727,165 @@ stapkp_symbol_callback(void *data, const char *name,
 #endif
 
 
+// Register one probe, warning about the failure unless it's expected.
+static int
+stapkp_register_probe_warn(struct stap_kprobe_probe *skp)
+{
+   int rc = stapkp_register_probe(skp);
+   if (rc == 1) // failed to relocate addr?
+      return rc; // don't fuss about it, module probably not loaded
+
+   // NB: We keep going even if a probe failed to register (PR6749). We only
+   // warn about it if it wasn't optional and isn't in a module.
+   if (rc && !skp->optional_p
+       && ((skp->module == NULL) || skp->module[0] == '\0'
+	   || strcmp(skp->module, "kernel") == 0)) {
+      if (skp->symbol_name)
+	 _stp_warn("probe %s (%s+%u) registration error (rc %d)",
+		   skp->probe->pp, skp->symbol_name, skp->offset, rc);
+      else
+	 _stp_warn("probe %s (address 0x%lx) registration error (rc %d)",
+		   skp->probe->pp, stapkp_relocate_addr(skp), rc);
+   }
+   return rc;
+}
+
+
+#if defined(STAPCONF_REGISTER_KPROBES) && !defined(__ia64__)
+
+// Number of probes handed to register_k[ret]probes() at once.  Since
+// these are all-or-nothing, a batch with a bad probe in it gets rolled
+// back and registered again one by one, so this shouldn't be too large.
+#ifndef STP_KPROBES_BATCH
+#define STP_KPROBES_BATCH 64
+#endif
+
+static void *stap_reg_kprobes[STP_KPROBES_BATCH];
+static void *stap_reg_addrs[STP_KPROBES_BATCH];
+static struct stap_kprobe_probe *stap_reg_probes[STP_KPROBES_BATCH];
+
+static size_t
+stapkp_batch_register(size_t n, int return_p)
+{
+   size_t i, registered = 0;
+   int rc;
+
+   if (n == 0)
+      return 0;
+
+   rc = return_p
+      ? register_kretprobes((struct kretprobe **)stap_reg_kprobes, n)
+      : register_kprobes((struct kprobe **)stap_reg_kprobes, n);
+   if (rc == 0) {
+      dbug_stapkp("+k%sprobe * %zd\n", return_p ? "ret" : "", n);
+      for (i = 0; i < n; i++)
+	 stap_reg_probes[i]->registered_p = 1;
+      return n;
+   }
+
+   // The kernel has unregistered the part of the batch that did get
+   // registered.  Start over with each probe, from the address it was
+   // prepared with (for symbol probes, it came from kallsyms), so that
+   // the one(s) that failed get the usual warning.
+   dbug_stapkp("k%sprobe batch of %zd failed (rc %d)\n",
+	       return_p ? "ret" : "", n, rc);
+   for (i = 0; i < n; i++) {
+      struct stap_kprobe_probe *skp = stap_reg_probes[i];
+
+      stapkp_reset_probe(skp);
+      if (skp->symbol_name) {
+	 if (return_p)
+	    skp->kprobe->u.krp.kp.addr = stap_reg_addrs[i];
+	 else
+	    skp->kprobe->u.kp.addr = stap_reg_addrs[i];
+      }
+      if (stapkp_register_probe_warn(skp) == 0)
+	 registered++;
+   }
+   return registered;
+}
+
+
+static size_t
+stapkp_register_probes(struct stap_kprobe_probe *probes,
+		       size_t nprobes)
+{
+   size_t i, n, registered = 0;
+   int return_p;
+
+   // Every register_k[ret]probe() call synchronizes on kprobe_mutex (and
+   // text_mutex to arm the probe), so hand them to the kernel in
+   // batches, kprobes first.
+   for (return_p = 0; return_p <= 1; return_p++) {
+      n = 0;
+      for (i = 0; i < nprobes; i++) {
+	 struct stap_kprobe_probe *skp = &probes[i];
+	 struct kprobe *kp;
+	 int rc;
+
+	 if (skp->return_p != return_p || skp->registered_p)
+	    continue;
+
+	 rc = return_p ? stapkp_prepare_kretprobe(skp)
+		       : stapkp_prepare_kprobe(skp);
+	 if (rc != 0)
+	    continue; // module probably not loaded
+
+	 kp = return_p ? &skp->kprobe->u.krp.kp : &skp->kprobe->u.kp;
+	 stap_reg_kprobes[n] = return_p ? (void *)&skp->kprobe->u.krp
+					: (void *)kp;
+	 stap_reg_addrs[n] = kp->addr;
+	 stap_reg_probes[n] = skp;
+	 if (++n == STP_KPROBES_BATCH) {
+	    registered += stapkp_batch_register(n, return_p);
+	    n = 0;
+	 }
+      }
+      registered += stapkp_batch_register(n, return_p);
+   }
+   return registered;
+}
+
+#else
+
+static size_t
+stapkp_register_probes(struct stap_kprobe_probe *probes,
+		       size_t nprobes)
+{
+   // We'll have to register them one by one
+   size_t i, registered = 0;
+
+   for (i = 0; i < nprobes; i++)
+      if (stapkp_register_probe_warn(&probes[i]) == 0)
+	 registered++;
+   return registered;
+}
+
+#endif /* STAPCONF_REGISTER_KPROBES && !__ia64__ */
+
+
 static int
 stapkp_init(struct stap_kprobe_probe *probes,
-            size_t nprobes)
+            size_t nprobes,
+            const struct stap_kprobe_symbol *symbols,
+            size_t nsymbols)
 {
-   size_t i;
+   size_t registered, lookups = 0;
+   ktime_t start = ktime_get();
+   s64 lookup_ns = 0;
 
 #ifdef STAPCONF_KALLSYMS_ON_EACH_SYMBOL
    // If we have any symbol_name+offset probes, we need to try to
    // convert those into address-based probes.
-   size_t probe_max = 0;
-   for (i = 0; i < nprobes; i++) {
-      struct stap_kprobe_probe *skp = &probes[i];
-
-      if (! skp->symbol_name)
-	 continue;
-      ++probe_max;
-   }
-   if (probe_max > 0) {
+   if (nsymbols > 0) {
       // Here we're going to try to convert any symbol_name+offset
       // probes into address probes.
       struct stapkp_symbol_data sd;
-      dbug_stapkp("looking up %lu probes\n", probe_max);
+      dbug_stapkp("looking up %lu probes\n", nsymbols);
       sd.probes = probes;
-      sd.nprobes = nprobes;
-      sd.probe_max = probe_max;
+      sd.symbols = symbols;
+      sd.nsymbols = nsymbols;
+      sd.probe_max = nsymbols;
       sd.modname = NULL;
       mutex_lock(&module_mutex);
       preempt_disable();
@@ -734,31 +893,19 @@ stapkp_init(struct stap_kprobe_probe *probes,
       preempt_enable();
       mutex_unlock(&module_mutex);
       dbug_stapkp("found %lu probes\n", sd.probe_max);
+      lookups = nsymbols;
+      lookup_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
    }
 #endif
 
-   for (i = 0; i < nprobes; i++) {
-      struct stap_kprobe_probe *skp = &probes[i];
-      int rc = 0;
-
-      rc = stapkp_register_probe(skp);
-      if (rc == 1) // failed to relocate addr?
-         continue; // don't fuss about it, module probably not loaded
-
-      // NB: We keep going even if a probe failed to register (PR6749). We only
-      // warn about it if it wasn't optional and isn't in a module.
-      if (rc && !skp->optional_p
-	  && ((skp->module == NULL) || skp->module[0] == '\0'
-	      || strcmp(skp->module, "kernel") == 0)) {
-	 if (skp->symbol_name)
-	    _stp_warn("probe %s (%s+%u) registration error (rc %d)",
-		      skp->probe->pp, skp->symbol_name, skp->offset, rc);
-	 else
-	    _stp_warn("probe %s (address 0x%lx) registration error (rc %d)",
-		      skp->probe->pp, stapkp_relocate_addr(skp), rc);
-      }
-   }
+   registered = stapkp_register_probes(probes, nprobes);
+   _stp_probes_unregistered += nprobes - registered;
 
+   _stp_info("registered %zu of %zu kprobes in %lld us"
+	     " (%zu symbol lookups in %lld us)",
+	     registered, nprobes,
+	     (long long)ktime_to_ns(ktime_sub(ktime_get(), start)) / NSEC_PER_USEC,
+	     lookups, (long long)lookup_ns / NSEC_PER_USEC);
    return 0;
 }
 
@@ -769,7 +916,9 @@ stapkp_init(struct stap_kprobe_probe *probes,
 static void
 stapkp_refresh(const char *modname,
                struct stap_kprobe_probe *probes,
-               size_t nprobes)
+               size_t nprobes,
+               const struct stap_kprobe_symbol *symbols,
+               size_t nsymbols)
 {
    size_t i;
 
@@ -793,7 +942,8 @@ stapkp_refresh(const char *modname,
       if (probe_max > 0) {
 	 struct stapkp_symbol_data sd;
 	 sd.probes = probes;
-	 sd.nprobes = nprobes;
+	 sd.symbols = symbols;
+	 sd.nsymbols = nsymbols;
 	 sd.probe_max = probe_max;
 	 sd.modname = modname;
 	 mutex_lock(&module_mutex);
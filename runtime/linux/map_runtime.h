@@ -20,6 +20,8 @@ struct pmap {
 	int bit_shift;	/* scale factor for integer arithmetic */
 	int stat_ops;	/* related statistical operators */
 	MAP agg;	/* aggregation map */
+	unsigned long agg_gen;	/* _stp_pmap_gen() when agg was made */
+	int agg_valid;	/* whether agg is a full aggregation */
 	MAP map[];	/* per-cpu maps */
 };
 
@@ -62,6 +64,12 @@ static void _stp_map_del(MAP map)
 	if (map->node_mem)
 		_stp_vfree(map->node_mem);
 
+	if (map->str_arena)
+		_stp_vfree(map->str_arena);
+
+	if (map->sort_heap)
+		_stp_vfree(map->sort_heap);
+
 	_stp_vfree(map);
 }
 
@@ -152,6 +160,41 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 	return m;
 }
 
+/** Give a map an arena for its out-of-line strings.
+ * Used by maps instantiated with MAP_STRING_VARLEN, see map-str.c.
+ * @param strings number of strings in each node
+ * @return 0 on success, -1 on failure.
+ */
+
+static int
+_stp_map_new_str_arena(MAP m, unsigned strings, void (*node_free)(MAP, struct map_node *))
+{
+	size_t size = (size_t)m->maxnum * strings * MAP_STRING_ARENA_AVG;
+
+	m->str_arena = _stp_map_vzalloc(sizeof(struct _stp_map_arena) + size, -1);
+	if (m->str_arena == NULL)
+		return -1;
+	m->str_arena->size = size;
+	m->node_free = node_free;
+	return 0;
+}
+
+/** Give a map a scratch heap for _stp_map_sortn().
+ * @return 0 on success, -1 on failure.
+ */
+
+static int
+_stp_map_new_sort_heap(MAP m)
+{
+	unsigned n = min_t(unsigned, m->maxnum, MAP_SORTN_MAX);
+
+	m->sort_heap = _stp_map_vzalloc(n * sizeof(struct _stp_map_sort_ent), -1);
+	if (m->sort_heap == NULL)
+		return -1;
+	m->sort_heap_size = n;
+	return 0;
+}
+
 static PMAP
 _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 {
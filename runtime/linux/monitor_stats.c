@@ -0,0 +1,231 @@
+/* -*- linux-c -*-
+ * Binary stats for --monitor mode
+ * Copyright (C) 2017 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STAPLINUX_MONITOR_STATS_C_
+#define _STAPLINUX_MONITOR_STATS_C_
+
+#include <linux/mm.h>
+#include <linux/timer.h>
+#include <linux/vmalloc.h>
+
+/* The layout is in transport_msgs.h, shared with stapio's monitor.c.  */
+
+#ifndef STP_MONITOR_STATS_INTERVAL
+#define STP_MONITOR_STATS_INTERVAL (HZ / 2)
+#endif
+
+/* A probe the stats cover, as listed by the translator (terminated by
+   a NULL name).  */
+struct _stp_monitor_probe_info {
+	size_t index;
+	const char *name;
+};
+
+/* A global whose lock the stats report on, as listed by the translator
+   (terminated by a NULL name).  */
+struct _stp_monitor_global_info {
+	const char *name;
+	struct stp_lock_stats __percpu **stats;
+};
+
+static struct _stp_monitor_stats *_stp_monitor_stats;
+static const struct _stp_monitor_global_info *_stp_monitor_global_list;
+static unsigned long _stp_monitor_stats_start;
+static atomic_t _stp_monitor_stats_opens = ATOMIC_INIT(0);
+static struct timer_list _stp_monitor_stats_timer;
+
+
+/* Sum up each probe's STP_TIMING stats over all cpus, without taking
+   the aggregate that the monitor_status and -t reports use.  A probe
+   running meanwhile may leave a cpu's numbers slightly off, which is
+   fine for a display.  */
+static void _stp_monitor_stats_refresh(void)
+{
+	struct _stp_monitor_stats *ms = _stp_monitor_stats;
+	struct _stp_monitor_probe *mp = (void *) ms + ms->probe_offset;
+	struct _stp_monitor_global *mg = (void *) ms + ms->global_offset;
+	size_t i;
+	int cpu;
+
+	ms->seq++;
+	smp_wmb();
+
+	for (i = 0; i < ms->probe_count; i++) {
+		const struct stap_probe *p = &stap_probes[mp[i].index];
+		Stat st = probe_timing(mp[i].index);
+		uint64_t hits = 0;
+		int64_t sum = 0, min = 0, max = 0;
+
+		if (likely(st))
+			for_each_possible_cpu(cpu) {
+				stat_data *sd = _stp_stat_per_cpu_ptr(st, cpu);
+				if (!sd->count)
+					continue;
+				if (!hits || sd->min < min)
+					min = sd->min;
+				if (!hits || sd->max > max)
+					max = sd->max;
+				hits += sd->count;
+				sum += sd->sum;
+			}
+
+		mp[i].hits = hits;
+		mp[i].min = min;
+		mp[i].avg = hits ? _stp_div64(NULL, sum, hits) : 0;
+		mp[i].max = max;
+		mp[i].enabled = p->cond_enabled;
+#ifdef STP_OVERLOAD_GOVERNOR
+		mp[i].sampling = _stp_overload_sampling(p);
+#else
+		mp[i].sampling = 1;
+#endif
+	}
+
+	for (i = 0; i < ms->global_count; i++) {
+		struct stp_lock_stats ls;
+		stp_lock_stats_sum(*_stp_monitor_global_list[i].stats, &ls);
+		mg[i].contention = ls.retries;
+		mg[i].skipped = ls.skips;
+	}
+
+	ms->uptime_ms = jiffies_to_msecs(jiffies - _stp_monitor_stats_start);
+	ms->error_count = atomic_read(error_count());
+	ms->skipped_count = atomic_read(skipped_count());
+	ms->skipped_lowstack = atomic_read(skipped_count_lowstack());
+	ms->skipped_reentrant = atomic_read(skipped_count_reentrant());
+
+	smp_wmb();
+	ms->seq++;
+}
+
+
+/* Refreshes only go on while someone has the file open.  */
+static void _stp_monitor_stats_timer_fn(unsigned long data)
+{
+	_stp_monitor_stats_refresh();
+	if (atomic_read(&_stp_monitor_stats_opens))
+		mod_timer(&_stp_monitor_stats_timer,
+			  jiffies + STP_MONITOR_STATS_INTERVAL);
+}
+
+
+static int _stp_monitor_stats_open(struct inode *inode, struct file *filp)
+{
+	if (filp->f_mode & FMODE_WRITE)
+		return -EPERM;
+	if (atomic_inc_return(&_stp_monitor_stats_opens) == 1)
+		mod_timer(&_stp_monitor_stats_timer, jiffies);
+	return 0;
+}
+
+
+static int _stp_monitor_stats_release(struct inode *inode, struct file *filp)
+{
+	atomic_dec(&_stp_monitor_stats_opens);
+	return 0;
+}
+
+
+/* The pages stay with the mapping if it outlives the module, since
+   remap_vmalloc_range takes a reference on each.  */
+static int _stp_monitor_stats_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, _stp_monitor_stats, vma->vm_pgoff);
+}
+
+
+static struct file_operations _stp_monitor_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= _stp_monitor_stats_open,
+	.release	= _stp_monitor_stats_release,
+	.mmap		= _stp_monitor_stats_mmap,
+};
+
+
+/* Lay out the stats of PROBES and GLOBALS, and create their procfs
+   file.  */
+static int _stp_monitor_stats_init(const struct _stp_monitor_probe_info *probes,
+				   const struct _stp_monitor_global_info *globals)
+{
+	struct _stp_monitor_stats *ms;
+	struct _stp_monitor_probe *mp;
+	struct _stp_monitor_global *mg;
+	size_t nprobes = 0, nglobals = 0, size, i;
+	char *names;
+	int rc;
+
+	size = sizeof(*ms);
+	for (i = 0; probes[i].name; i++, nprobes++)
+		size += sizeof(*mp) + strlen(probes[i].name) + 1;
+	for (i = 0; globals[i].name; i++, nglobals++)
+		size += sizeof(*mg) + strlen(globals[i].name) + 1;
+	size = PAGE_ALIGN(size);
+
+	ms = vmalloc_user(size);
+	if (ms == NULL)
+		return -ENOMEM;
+
+	ms->magic = STP_MONITOR_STATS_MAGIC;
+	ms->version = STP_MONITOR_STATS_VERSION;
+	ms->size = size;
+	ms->probe_count = nprobes;
+	ms->probe_offset = sizeof(*ms);
+	ms->global_count = nglobals;
+	ms->global_offset = ms->probe_offset + nprobes * sizeof(*mp);
+
+	mp = (void *) ms + ms->probe_offset;
+	mg = (void *) ms + ms->global_offset;
+	names = (void *) (mg + nglobals);
+	for (i = 0; i < nprobes; i++) {
+		mp[i].index = probes[i].index;
+		mp[i].name = names - (char *) ms;
+		strcpy(names, probes[i].name);
+		names += strlen(names) + 1;
+	}
+	for (i = 0; i < nglobals; i++) {
+		mg[i].name = names - (char *) ms;
+		strcpy(names, globals[i].name);
+		names += strlen(names) + 1;
+	}
+
+	_stp_monitor_stats = ms;
+	_stp_monitor_global_list = globals;
+	_stp_monitor_stats_start = jiffies;
+	_stp_monitor_stats_refresh();
+
+	init_timer(&_stp_monitor_stats_timer);
+	_stp_monitor_stats_timer.function = _stp_monitor_stats_timer_fn;
+	_stp_monitor_stats_timer.data = 0;
+
+	rc = _stp_create_procfs("monitor_stats", &_stp_monitor_stats_fops,
+				0400, NULL);
+	if (rc) {
+		vfree(ms);
+		_stp_monitor_stats = NULL;
+	}
+	return rc;
+}
+
+
+/* After _stp_close_procfs, so there are no more opens.  */
+static void _stp_monitor_stats_exit(void)
+{
+	if (_stp_monitor_stats == NULL)
+		return;
+	atomic_set(&_stp_monitor_stats_opens, 0);
+	del_timer_sync(&_stp_monitor_stats_timer);
+	vfree(_stp_monitor_stats);
+	_stp_monitor_stats = NULL;
+}
+
+#endif /* _STAPLINUX_MONITOR_STATS_C_ */
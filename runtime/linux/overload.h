@@ -0,0 +1,116 @@
+/* -*- linux-c -*-
+ * Overload governor
+ * Copyright (C) 2017 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STAPLINUX_OVERLOAD_H
+#define _STAPLINUX_OVERLOAD_H
+
+#ifdef STP_OVERLOAD_GOVERNOR
+
+#include <linux/jiffies.h>
+
+/* When some probe was last sampled more often again.  */
+static unsigned long _stp_overload_relaxed_at;
+
+
+/* Whether to skip this hit of probe P, which is sampled at one hit in
+   2^sample_shift.  Hashing the cycle count at entry is random enough
+   for that, and needs no state of its own.  */
+static inline int
+_stp_overload_skip(const struct stap_probe *p, cycles_t now)
+{
+	unsigned shift = atomic_read(&p->sample_shift);
+	if (likely(shift == 0))
+		return 0;
+	return ((uint32_t) now * 2654435761U) >> (32 - shift) != 0;
+}
+
+
+/* How many hits of probe P there are for each one that runs.  */
+static inline unsigned
+_stp_overload_sampling(const struct stap_probe *p)
+{
+	return 1U << atomic_read(&p->sample_shift);
+}
+
+
+/* Sample every sampled probe twice as often, at most once a second,
+   and only while this cpu spends less than half the threshold in
+   probes.  */
+static void
+_stp_overload_relax(void)
+{
+	unsigned long then = _stp_overload_relaxed_at;
+	size_t i;
+
+	if (time_before(jiffies, then + HZ)
+	    || cmpxchg(&_stp_overload_relaxed_at, then, jiffies) != then)
+		return;
+
+	for (i = 0; i < STP_PROBE_COUNT; i++) {
+		atomic_t *shift = &stap_probes[i].sample_shift;
+		int old = atomic_read(shift);
+		if (old > 0)
+			atomic_cmpxchg(shift, old, old - 1);
+	}
+}
+
+
+/* Called at the end of each STP_OVERLOAD_INTERVAL on this cpu, of
+   which it spent c->cycles_sum in probes, c->overload_cycles[i] in
+   stap_probes[i].  If that is over STP_OVERLOAD_THRESHOLD, the
+   costliest of those probes is sampled half as often, and again,
+   until it would have been under.  Returns nonzero if that isn't
+   possible, with the probes already sampled as little as
+   STP_OVERLOAD_MAX_SHIFT allows, so the session must end.  */
+static int
+_stp_overload_govern(struct context *c)
+{
+	int64_t excess = (int64_t) c->cycles_sum - STP_OVERLOAD_THRESHOLD;
+	int rc = 0;
+	size_t i;
+
+	if (c->cycles_sum < STP_OVERLOAD_THRESHOLD / 2)
+		_stp_overload_relax();
+
+	while (excess > 0) {
+		size_t worst = STP_PROBE_COUNT;
+		atomic_t *shift;
+		int old;
+
+		for (i = 0; i < STP_PROBE_COUNT; i++)
+			if (c->overload_cycles[i]
+			    && atomic_read(&stap_probes[i].sample_shift) < STP_OVERLOAD_MAX_SHIFT
+			    && (worst == STP_PROBE_COUNT
+				|| c->overload_cycles[i] > c->overload_cycles[worst]))
+				worst = i;
+		if (worst == STP_PROBE_COUNT) {
+			rc = 1;
+			break;
+		}
+
+		shift = &stap_probes[worst].sample_shift;
+		old = atomic_read(shift);
+		if (atomic_cmpxchg(shift, old, old + 1) != old)
+			continue; /* another cpu got there first; look again */
+		if (old == 0)
+			_stp_warn("probe %s overloaded, sampling its hits\n",
+				  stap_probes[worst].pp);
+
+		excess -= c->overload_cycles[worst] / 2;
+		c->overload_cycles[worst] /= 2;
+	}
+
+	memset(c->overload_cycles, 0, sizeof(c->overload_cycles));
+	return rc;
+}
+
+#endif /* STP_OVERLOAD_GOVERNOR */
+
+#endif /* _STAPLINUX_OVERLOAD_H */
@@ -32,15 +32,60 @@
  *
  * This function is called automatically when the print buffer is full.
  * It MUST also be called at the end of every probe that prints something.
+ *
+ * The print buffers are allocated on each cpu's own NUMA node.  Their
+ * size may be tuned with -DSTP_BUFFER_SIZE=N.
+ *
+ * By default, every probe handler flushes its output when it returns.
+ * If STP_PRINT_FLUSH_INTERVAL is set (in milliseconds), probe handlers
+ * call _stp_print_flush_batched() instead, which leaves output in the
+ * print buffer until it is at least STP_PRINT_FLUSH_THRESHOLD bytes
+ * full, or has been waiting for STP_PRINT_FLUSH_INTERVAL.  A per-cpu
+ * timer picks up anything left behind on idle cpus.
+ *
+ * With STP_DEFERRED_PRINTF, and a stapio that offers to, compiled
+ * printfs write just their format number and arguments, and stapio
+ * formats them.  Everything in the print buffer is then framed: text
+ * accumulates after the last frame as usual, and is put in a frame of
+ * its own when a printf record is written or the buffer is flushed.
  * @{
  */
 
+#ifndef STP_PRINT_FLUSH_INTERVAL
+#define STP_PRINT_FLUSH_INTERVAL 0
+#endif
+#ifndef STP_PRINT_FLUSH_THRESHOLD
+#define STP_PRINT_FLUSH_THRESHOLD (STP_BUFFER_SIZE / 2)
+#endif
+
+/* Batched flushing needs cpu-pinned timers and cross-cpu calls. */
+#if STP_PRINT_FLUSH_INTERVAL > 0 \
+    && defined(STAPCONF_ADD_TIMER_ON) \
+    && (defined(STAPCONF_SMPCALL_5ARGS) || defined(STAPCONF_SMPCALL_4ARGS))
+#define STP_PRINT_BATCHED 1
+#endif
+
 typedef struct __stp_pbuf {
 	uint32_t len;			/* bytes used in the buffer */
+#ifdef STP_PRINT_BATCHED
+	unsigned long flush_time;	/* jiffies of the last flush */
+	struct timer_list timer;	/* flushes output left on idle cpus */
+#endif
+#ifdef STP_DEFERRED_PRINTF
+	uint32_t text_start;		/* start of the text not yet framed */
+	/* with room to frame that text when flushing a full buffer */
+	char buf[STP_BUFFER_SIZE + sizeof(struct _stp_frame)];
+#else
 	char buf[STP_BUFFER_SIZE];
+#endif
 } _stp_pbuf;
 
-static void *Stp_pbuf = NULL;
+static _stp_pbuf *Stp_pbuf[NR_CPUS] = { NULL };
+
+static inline _stp_pbuf *_stp_print_buf(void)
+{
+	return Stp_pbuf[smp_processor_id()];
+}
 
 /** private buffer for _stp_vlog() */
 #ifndef STP_LOG_BUF_LEN
@@ -50,36 +95,179 @@ static void *Stp_pbuf = NULL;
 typedef char _stp_lbuf[STP_LOG_BUF_LEN];
 static void *Stp_lbuf = NULL;
 
+#ifdef STP_DEFERRED_PRINTF
+/* Put a text frame header in front of the text written since the last
+ * frame, if any. */
+static void _stp_deferred_close_text(_stp_pbuf *pb)
+{
+	struct _stp_frame f;
+	uint32_t text_len = pb->len - pb->text_start;
+
+	if (text_len == 0)
+		return;
+
+	f.len = text_len;
+	f.type = STP_FRAME_TEXT;
+	f.id = 0;
+	memmove(pb->buf + pb->text_start + sizeof(f),
+		pb->buf + pb->text_start, text_len);
+	memcpy(pb->buf + pb->text_start, &f, sizeof(f));
+	pb->len += sizeof(f);
+	pb->text_start = pb->len;
+}
+#endif
+
+#include "print_flush.c"
+
+#ifdef STP_PRINT_BATCHED
+#define STP_PRINT_FLUSH_JIFFIES \
+	max_t(unsigned long, msecs_to_jiffies(STP_PRINT_FLUSH_INTERVAL), 1)
+
+/* Called on the buffer's own cpu, from its timer or as an IPI. */
+static void __stp_print_flush_cpu(void *info)
+{
+	_stp_pbuf *pb = _stp_print_buf();
+	struct context* __restrict__ c = NULL;
+
+	/* If we can't get the context, a probe handler owns the print
+	 * buffer right now, and will flush it on its own. */
+	c = _stp_runtime_entryfn_get_context();
+	if (c != NULL) {
+		if (pb->len)
+			stp_print_flush(pb);
+		pb->flush_time = jiffies;
+		_stp_runtime_entryfn_put_context(c);
+	}
+}
+
+static void __stp_print_timer_callback(unsigned long val)
+{
+	int cpu = (int) val;
+	_stp_pbuf *pb = Stp_pbuf[cpu];
+
+	/* Timers may have been migrated away by cpu hotplug, in which
+	 * case someone else's buffer is not ours to flush. */
+	if (likely(cpu == smp_processor_id())
+	    && time_after_eq(jiffies, pb->flush_time + STP_PRINT_FLUSH_JIFFIES))
+		__stp_print_flush_cpu(NULL);
+
+	if (likely(atomic_read(session_state()) != STAP_SESSION_STOPPED)) {
+		pb->timer.expires = jiffies + STP_PRINT_FLUSH_JIFFIES;
+		add_timer_on(&pb->timer, cpu);
+	}
+}
+#endif /* STP_PRINT_BATCHED */
+
 /* create percpu print and io buffers */
 static int _stp_print_init (void)
 {
-	Stp_pbuf = _stp_alloc_percpu(sizeof(_stp_pbuf));
-	if (unlikely(Stp_pbuf == 0))
-		return -1;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		/* Module init, so in user context, safe to use
+		 * "sleeping" allocation. */
+		_stp_pbuf *pb = _stp_vzalloc_node(sizeof(_stp_pbuf),
+						  cpu_to_node(cpu));
+		if (unlikely(pb == NULL))
+			goto err;
+		Stp_pbuf[cpu] = pb;
+	}
 
 	/* now initialize IO buffer used in io.c */
 	Stp_lbuf = _stp_alloc_percpu(sizeof(_stp_lbuf));
-	if (unlikely(Stp_lbuf == 0)) {
-		_stp_free_percpu(Stp_pbuf);
-		return -1;
+	if (unlikely(Stp_lbuf == 0))
+		goto err;
+
+#ifdef STP_PRINT_BATCHED
+	for_each_online_cpu(cpu) {
+		_stp_pbuf *pb = Stp_pbuf[cpu];
+		pb->flush_time = jiffies;
+		init_timer(&pb->timer);
+		pb->timer.expires = jiffies + STP_PRINT_FLUSH_JIFFIES;
+		pb->timer.function = __stp_print_timer_callback;
+		pb->timer.data = (unsigned long) cpu;
+		add_timer_on(&pb->timer, cpu);
 	}
+#endif
 	return 0;
+
+err:
+	for_each_possible_cpu(cpu) {
+		if (Stp_pbuf[cpu]) {
+			_stp_vfree(Stp_pbuf[cpu]);
+			Stp_pbuf[cpu] = NULL;
+		}
+	}
+	return -1;
 }
 
 static void _stp_print_cleanup (void)
 {
-	if (Stp_pbuf)
-		_stp_free_percpu(Stp_pbuf);
+	int cpu;
+
+#ifdef STP_PRINT_BATCHED
+	for_each_possible_cpu(cpu) {
+		if (Stp_pbuf[cpu] && Stp_pbuf[cpu]->timer.function)
+			del_timer_sync(&Stp_pbuf[cpu]->timer);
+	}
+#endif
+	for_each_possible_cpu(cpu) {
+		if (Stp_pbuf[cpu]) {
+			_stp_vfree(Stp_pbuf[cpu]);
+			Stp_pbuf[cpu] = NULL;
+		}
+	}
 	if (Stp_lbuf)
 		_stp_free_percpu(Stp_lbuf);
 }
 
-#include "print_flush.c"
-
 static inline void _stp_print_flush(void)
 {
-	stp_print_flush(per_cpu_ptr(Stp_pbuf, smp_processor_id()));
+	stp_print_flush(_stp_print_buf());
 }
+
+/** Flush the print buffer at the end of a probe handler.
+ * Unless STP_PRINT_FLUSH_INTERVAL is set, this is the same as
+ * _stp_print_flush().  Otherwise, output is only sent once enough of
+ * it has accumulated, or it has been waiting for long enough.  Note
+ * that output is only deferred while the session is running, so
+ * "begin" and "end" probes always flush right away.
+ */
+static inline void _stp_print_flush_batched(void)
+{
+#ifdef STP_PRINT_BATCHED
+	_stp_pbuf *pb = _stp_print_buf();
+
+	if (likely(atomic_read(session_state()) == STAP_SESSION_RUNNING)
+	    && pb->len < STP_PRINT_FLUSH_THRESHOLD
+	    && time_before(jiffies, pb->flush_time + STP_PRINT_FLUSH_JIFFIES))
+		return;
+	pb->flush_time = jiffies;
+#endif
+	_stp_print_flush();
+}
+
+/** Flush the print buffers of all cpus.
+ * This is called in user context during module shutdown, after the
+ * session has left the running state, so that batched output is sent
+ * before that of any "end" probes.
+ */
+static void _stp_print_flush_all(void)
+{
+#ifdef STP_PRINT_BATCHED
+	int cpu;
+
+	might_sleep();
+	for_each_online_cpu(cpu) {
+		(void) smp_call_function_single (cpu, &__stp_print_flush_cpu, NULL,
+#ifdef STAPCONF_SMPCALL_5ARGS
+						 1, /* nonatomic */
+#endif
+						 1); /* wait */
+	}
+#endif
+}
+
 #ifndef STP_MAXBINARYARGS
 #define STP_MAXBINARYARGS 127
 #endif
@@ -89,7 +277,7 @@ static inline void _stp_print_flush(void)
  */
 static void * _stp_reserve_bytes (int numbytes)
 {
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 	int size = STP_BUFFER_SIZE - pb->len;
 	void * ret;
 
@@ -105,9 +293,158 @@ static void * _stp_reserve_bytes (int numbytes)
 }
 
 
+#ifdef STP_DEFERRED_PRINTF
+/** Reserves space in the output buffer for the arguments of deferred
+ * printf number @id.  Returns NULL if they would never fit, in which
+ * case the printf should be formatted here instead.
+ */
+static void * _stp_deferred_reserve_bytes (unsigned id, int numbytes)
+{
+	_stp_pbuf *pb = _stp_print_buf();
+	struct _stp_frame f;
+	int hdr = sizeof(f);
+	int size = STP_BUFFER_SIZE - pb->len;
+	void * ret;
+
+	/* Leave room for both this record's frame and the text's. */
+	if (unlikely(numbytes < 0 || numbytes > STP_BUFFER_SIZE - 2 * hdr))
+		return NULL;
+
+	if (pb->len > pb->text_start)
+		size -= hdr;
+	if (unlikely(numbytes + hdr > size))
+		_stp_print_flush();
+	_stp_deferred_close_text(pb);
+
+	f.len = numbytes;
+	f.type = STP_FRAME_PRINTF;
+	f.id = id;
+	memcpy(pb->buf + pb->len, &f, sizeof(f));
+	ret = pb->buf + pb->len + sizeof(f);
+	pb->len += sizeof(f) + numbytes;
+	pb->text_start = pb->len;
+	return ret;
+}
+
+/* A deferred printf format, as emitted by the translator. */
+struct _stp_deferred_printf_spec {
+	struct _stp_deferred_spec spec;
+	const char *literal;
+};
+
+struct _stp_deferred_printf_format {
+	const struct _stp_deferred_printf_spec *specs;
+	unsigned nspecs;
+};
+
+/* The module's deferred printf formats, once it has started. */
+static const struct _stp_deferred_printf_format *_stp_deferred_formats = NULL;
+static unsigned _stp_deferred_nformats = 0;
+
+/** Send a sync frame and all the deferred printf formats to stapio,
+ * which needs them before any of their records.  Called when the
+ * module starts, and again whenever a stapio attaches to it later.
+ * The print lock is held throughout, so no other cpu's output can
+ * come between the sync and the last format.
+ */
+static int _stp_deferred_printf_sync(void)
+{
+	struct context* __restrict__ c;
+	struct _stp_deferred_sync sync = { STP_DEFERRED_SYNC_MAGIC };
+	struct _stp_frame f;
+	unsigned long flags;
+	_stp_pbuf *pb;
+	unsigned i, j;
+	int rc = 0;
+
+	if (!_stp_deferred_printf || _stp_deferred_formats == NULL)
+		return 0;
+
+	c = _stp_runtime_entryfn_get_context();
+	if (c == NULL)
+		return -EBUSY;
+	pb = _stp_print_buf();
+
+	/* Anything this cpu had buffered goes out ahead of the sync. */
+	stp_print_flush(pb);
+	if (unlikely(_stp_transport_get_state() != STP_TRANSPORT_RUNNING)) {
+		_stp_runtime_entryfn_put_context(c);
+		return 0;
+	}
+
+	stp_spin_lock_irqsave(&_stp_print_lock, flags);
+	f.len = sizeof(sync);
+	f.type = STP_FRAME_SYNC;
+	f.id = 0;
+	memcpy(pb->buf, &f, sizeof(f));
+	memcpy(pb->buf + sizeof(f), &sync, sizeof(sync));
+	pb->len = sizeof(f) + sizeof(sync);
+
+	for (i = 0; i < _stp_deferred_nformats && rc == 0; i++) {
+		const struct _stp_deferred_printf_format *format
+			= &_stp_deferred_formats[i];
+		struct _stp_deferred_format df;
+		char *p;
+
+		f.len = sizeof(df);
+		for (j = 0; j < format->nspecs; j++)
+			f.len += sizeof(struct _stp_deferred_spec)
+				 + format->specs[j].spec.literal_len;
+		if (f.len > STP_BUFFER_SIZE - sizeof(f)) {
+			rc = -E2BIG;
+			break;
+		}
+		if (f.len + sizeof(f) > STP_BUFFER_SIZE - pb->len) {
+			_stp_print_write_locked(pb->buf, pb->len);
+			pb->len = 0;
+		}
+
+		f.type = STP_FRAME_FORMAT;
+		f.id = i;
+		df.bufsize = STP_BUFFER_SIZE;
+		df.nspecs = format->nspecs;
+		p = pb->buf + pb->len;
+		memcpy(p, &f, sizeof(f));
+		p += sizeof(f);
+		memcpy(p, &df, sizeof(df));
+		p += sizeof(df);
+		for (j = 0; j < format->nspecs; j++) {
+			const struct _stp_deferred_printf_spec *s = &format->specs[j];
+			memcpy(p, &s->spec, sizeof(s->spec));
+			p += sizeof(s->spec);
+			memcpy(p, s->literal, s->spec.literal_len);
+			p += s->spec.literal_len;
+		}
+		pb->len = p - pb->buf;
+	}
+	_stp_print_write_locked(pb->buf, pb->len);
+	pb->len = 0;
+	pb->text_start = 0;
+	stp_spin_unlock_irqrestore(&_stp_print_lock, flags);
+	_stp_runtime_entryfn_put_context(c);
+
+	if (rc == -E2BIG)
+		_stp_error("deferred printf format %u is too large"
+			   " for STP_BUFFER_SIZE", i);
+	return rc;
+}
+
+/** Send the deferred printf formats to stapio, and keep them to send
+ * again to any stapio that attaches later.  Called once from module
+ * initialization, before any probes are registered.
+ */
+static int _stp_deferred_printf_send(const struct _stp_deferred_printf_format *formats,
+				     unsigned nformats)
+{
+	_stp_deferred_formats = formats;
+	_stp_deferred_nformats = nformats;
+	return _stp_deferred_printf_sync();
+}
+#endif /* STP_DEFERRED_PRINTF */
+
 static void _stp_unreserve_bytes (int numbytes)
 {
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 
 	if (unlikely(numbytes == 0 || numbytes > pb->len))
 		return;
@@ -160,7 +497,7 @@ static void _stp_printf (const char *fmt, ...)
 
 static void _stp_print (const char *str)
 {
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 	char *end = pb->buf + STP_BUFFER_SIZE;
 	char *ptr = pb->buf + pb->len;
 	char *instr = (char *)str;
@@ -184,7 +521,7 @@ static void _stp_print (const char *str)
 
 static void _stp_print_char (const char c)
 {
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 	int size = STP_BUFFER_SIZE - pb->len;
 	if (unlikely(1 >= size))
 		_stp_print_flush();
@@ -1,5 +1,5 @@
 /* probe locking header file
- * Copyright (C) 2009-2010 Red Hat Inc.
+ * Copyright (C) 2009-2017 Red Hat Inc.
  *
  * This file is part of systemtap, and is free software.  You can
  * redistribute it and/or modify it under the terms of the GNU General
@@ -11,16 +11,48 @@
 #define _STAPLINUX_PROBE_LOCK_H
 
 #include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
 
 // XXX: old 2.6 kernel hack
 #ifndef read_trylock
 #define read_trylock(x) ({ read_lock(x); 1; })
 #endif
 
+#ifdef STP_TIMING
+
+/* Waits are binned by the log2 of the cycles they took: the first bin
+   has those under 2^STP_LOCK_WAIT_SHIFT cycles, the last those of
+   2^(STP_LOCK_WAIT_SHIFT + STP_LOCK_WAIT_BUCKETS - 2) or more.  */
+#ifndef STP_LOCK_WAIT_SHIFT
+#define STP_LOCK_WAIT_SHIFT 10
+#endif
+#ifndef STP_LOCK_WAIT_BUCKETS
+#define STP_LOCK_WAIT_BUCKETS 16
+#endif
+
+/* How one cpu has waited for one global's lock.  Only that cpu writes
+   it, from probe context, so it needs no atomics.  */
+struct stp_lock_stats {
+	unsigned long waits;	/* times the lock was busy at first */
+	unsigned long retries;	/* failed trylocks */
+	unsigned long skips;	/* times a probe gave up on it */
+	unsigned long long wait_cycles;
+	unsigned long wait_hist[STP_LOCK_WAIT_BUCKETS];
+};
+
+/* A global's name and lock stats, as listed by the translator in
+   stp_lock_globals[] (terminated by a NULL name).  */
+struct stp_lock_global {
+	const char *name;
+	struct stp_lock_stats __percpu **stats;
+};
+
+#endif /* STP_TIMING */
+
 struct stp_probe_lock {
 	#ifdef STP_TIMING
-	atomic_t *skipped;
-	atomic_t *contention;
+	struct stp_lock_stats __percpu **stats;
 	#endif
 	rwlock_t *lock;
 	unsigned write_p;
@@ -40,40 +72,176 @@ stp_unlock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 }
 
 
+#ifdef STP_TIMING
+
+static int
+stp_lock_stats_alloc(struct stp_lock_stats __percpu **stats)
+{
+	*stats = _stp_alloc_percpu(sizeof(struct stp_lock_stats));
+	return *stats ? 0 : -ENOMEM;
+}
+
+
+static void
+stp_lock_stats_free(struct stp_lock_stats __percpu **stats)
+{
+	if (*stats)
+		_stp_free_percpu(*stats);
+	*stats = NULL;
+}
+
+
+/* Record that this cpu waited for LOCK through RETRIES failed trylocks
+   over CYCLES, and then took it or, if SKIPPED, gave up.  */
+static void
+stp_lock_stats_wait(const struct stp_probe_lock *lock, unsigned retries,
+		    cycles_t cycles, int skipped)
+{
+	struct stp_lock_stats *ls = per_cpu_ptr(*lock->stats,
+						smp_processor_id());
+	unsigned bucket = 0;
+
+	if (cycles >> STP_LOCK_WAIT_SHIFT)
+		bucket = min_t(unsigned, ilog2(cycles) - STP_LOCK_WAIT_SHIFT + 1,
+			       STP_LOCK_WAIT_BUCKETS - 1);
+	ls->waits++;
+	ls->retries += retries;
+	ls->skips += skipped;
+	ls->wait_cycles += cycles;
+	ls->wait_hist[bucket]++;
+}
+
+
+/* Add up all cpus' stats for one global.  Probes may be counting
+   meanwhile, which can leave the sum a little off.  */
+static void
+stp_lock_stats_sum(struct stp_lock_stats __percpu *stats,
+		   struct stp_lock_stats *sum)
+{
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	if (stats == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		const struct stp_lock_stats *ls = per_cpu_ptr(stats, cpu);
+		sum->waits += ls->waits;
+		sum->retries += ls->retries;
+		sum->skips += ls->skips;
+		sum->wait_cycles += ls->wait_cycles;
+		for (i = 0; i < STP_LOCK_WAIT_BUCKETS; i++)
+			sum->wait_hist[i] += ls->wait_hist[i];
+	}
+}
+
+
+/* Format global G's stats as a line of procfs lock_stats: its name,
+   waits, retries, skips and wait cycles, then the histogram.  */
+static void
+stp_lock_stats_format(const struct stp_lock_global *g, char *buf, size_t len)
+{
+	struct stp_lock_stats sum;
+	size_t n;
+	int i;
+
+	stp_lock_stats_sum(*g->stats, &sum);
+	n = snprintf(buf, len, "%s %lu %lu %lu %llu", g->name, sum.waits,
+		     sum.retries, sum.skips, sum.wait_cycles);
+	for (i = 0; i < STP_LOCK_WAIT_BUCKETS && n < len; i++)
+		n += snprintf(buf + n, len - n, " %lu", sum.wait_hist[i]);
+	if (n < len)
+		snprintf(buf + n, len - n, "\n");
+}
+
+
+/* The -t report of each contended global's lock.  */
+static void
+stp_lock_stats_report(const struct stp_lock_global *globals)
+{
+	const struct stp_lock_global *g;
+	struct stp_lock_stats sum;
+	int i;
+
+	for (g = globals; g->name; g++) {
+		stp_lock_stats_sum(*g->stats, &sum);
+		if (!sum.waits)
+			continue;
+		_stp_printf("'%s' lock contention occurred %lu times, "
+			    "waiting %lu times for %llu cycles avg\n",
+			    g->name, sum.retries, sum.waits,
+			    (unsigned long long) _stp_div64(NULL, sum.wait_cycles,
+							    sum.waits));
+		_stp_printf("'%s' lock waits by cycles:", g->name);
+		for (i = 0; i < STP_LOCK_WAIT_BUCKETS; i++)
+			if (sum.wait_hist[i])
+				_stp_printf(" %s%llu: %lu", i ? ">=" : "<",
+					    1ULL << (STP_LOCK_WAIT_SHIFT + (i ? i - 1 : 0)),
+					    sum.wait_hist[i]);
+		_stp_printf("\n");
+	}
+}
+
+
+/* Warn of each global whose lock made probes skip.  */
+static void
+stp_lock_stats_warn_skipped(const struct stp_lock_global *globals)
+{
+	const struct stp_lock_global *g;
+	struct stp_lock_stats sum;
+
+	for (g = globals; g->name; g++) {
+		stp_lock_stats_sum(*g->stats, &sum);
+		if (sum.skips)
+			_stp_warn("Skipped due to global '%s' lock timeout: %lu\n",
+				  g->name, sum.skips);
+	}
+}
+
+#endif /* STP_TIMING */
+
+
+static inline int
+stp_trylock_probe(const struct stp_probe_lock *lock)
+{
+	return lock->write_p ? write_trylock(lock->lock) : read_trylock(lock->lock);
+}
+
+
 static unsigned
 stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
 	unsigned i, retries = 0;
+#ifdef STP_TIMING
+	unsigned waited = 0;
+	cycles_t start = 0;
+#endif
 	for (i = 0; i < num_locks; ++i) {
-		if (locks[i].write_p)
-			while (!write_trylock(locks[i].lock)) {
-#if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
+#ifdef STP_TIMING
+		waited = 0;
+#endif
+		while (!stp_trylock_probe(&locks[i])) {
+#ifdef STP_TIMING
+			if (!waited++)
+				start = get_cycles();
 #endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
-		else
-			while (!read_trylock(locks[i].lock)) {
 #if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
+			if (++retries > MAXTRYLOCK)
+				goto skip;
+#endif
+			udelay (TRYLOCKDELAY);
+		}
+#ifdef STP_TIMING
+		if (waited)
+			stp_lock_stats_wait(&locks[i], waited,
+					    get_cycles() - start, 0);
 #endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
 	}
 	return 1;
 
 skip:
 	atomic_inc(skipped_count());
 #ifdef STP_TIMING
-	atomic_inc(locks[i].skipped);
+	stp_lock_stats_wait(&locks[i], waited, get_cycles() - start, 1);
 #endif
 	stp_unlock_probe(locks, i);
 	return 0;
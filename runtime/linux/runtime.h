@@ -23,6 +23,7 @@
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
 #include <linux/random.h>
 #include <linux/spinlock.h>
 #include <linux/hardirq.h>
@@ -83,6 +84,7 @@ typedef typeof(&udelay_simple) udelay_simple_fn;
 static void _stp_dbug (const char *func, int line, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
 static void _stp_error (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 static void _stp_warn (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+static void _stp_info (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
 static void _stp_exit(void);
 
@@ -159,6 +161,10 @@ static const char *privilege_to_text (int p) {
 /* atomic globals */
 static atomic_t _stp_transport_failures = ATOMIC_INIT (0);
 
+/* Probes that failed to register at startup without failing the module
+   (PR6749), for the registration summary.  */
+static unsigned long _stp_probes_unregistered = 0;
+
 static struct
 {
 	atomic_t ____cacheline_aligned_in_smp seq;
@@ -4,6 +4,8 @@
 #include "stp_utrace.c"
 
 #include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
 #include <linux/binfmts.h>
 #include <linux/mount.h>
 #ifndef STAPCONF_TASK_UID
@@ -77,8 +79,12 @@ struct stap_task_finder_target {
 	struct list_head list;		/* __stp_task_finder_list linkage */
 	struct list_head callback_list_head;
 	struct list_head callback_list;
+	struct hlist_node hlist;	/* __stp_tf_target_table linkage */
+	struct list_head any_list;	/* __stp_tf_any_target_list linkage */
 	struct utrace_engine_ops ops;
 	size_t pathlen;
+	const char *basename;		/* last component of procname */
+	size_t baselen;
 	unsigned engine_attached:1;
 	unsigned mmap_events:1;
 	unsigned munmap_events:1;
@@ -94,6 +100,31 @@ struct stap_task_finder_target {
 	stap_task_finder_mprotect_callback mprotect_callback;
 };
 
+/*
+ * On every exec and clone, the task finder needs the targets matching
+ * the task's executable.  So that the (many) tasks running something
+ * no target is interested in can be passed over cheaply, procname
+ * targets are hashed by the last component of their path, which can be
+ * compared against the name of the executable's dentry without
+ * building the path.  Only when that matches is the path resolved, in
+ * a preallocated per-cpu buffer.  Targets for all threads go on
+ * __stp_tf_any_target_list.  Both are only written to as targets are
+ * registered, before the task finder starts.
+ */
+#define __STP_TF_TARGET_HASH_BITS 8
+#define __STP_TF_TARGET_TABLE_SIZE (1 << __STP_TF_TARGET_HASH_BITS)
+
+static struct hlist_head __stp_tf_target_table[__STP_TF_TARGET_TABLE_SIZE];
+static LIST_HEAD(__stp_tf_any_target_list);
+static void *__stp_tf_path_buf;		/* per-cpu, PATH_MAX bytes */
+
+static inline struct hlist_head *
+__stp_tf_target_bucket(const void *name, size_t len)
+{
+	u32 hash = jhash(name, len, 0);
+	return &__stp_tf_target_table[hash_32(hash, __STP_TF_TARGET_HASH_BITS)];
+}
+
 static LIST_HEAD(__stp_tf_task_work_list);
 static STP_DEFINE_SPINLOCK(__stp_tf_task_work_list_lock);
 struct __stp_tf_task_work {
@@ -289,6 +320,20 @@ stap_register_task_finder_target(struct stap_task_finder_target *new_tgt)
 		INIT_LIST_HEAD(&new_tgt->callback_list_head);
 		list_add(&new_tgt->list, &__stp_task_finder_list);
 		tgt = new_tgt;
+
+		// Index it for __stp_tf_find_path_target().
+		if (new_tgt->pathlen > 0) {
+			const char *slash = strrchr(new_tgt->procname, '/');
+			new_tgt->basename = (slash ? slash + 1
+					     : new_tgt->procname);
+			new_tgt->baselen = strlen(new_tgt->basename);
+			hlist_add_head(&new_tgt->hlist,
+				       __stp_tf_target_bucket(new_tgt->basename,
+							      new_tgt->baselen));
+		}
+		else if (new_tgt->pid == 0)
+			list_add_tail(&new_tgt->any_list,
+				      &__stp_tf_any_target_list);
 	}
 
 	// Add this target to the callback list for this task.
@@ -801,12 +846,109 @@ __stp_call_mprotect_callbacks(struct stap_task_finder_target *tgt,
 	}
 }
 
+// Look up the procname target for the executable of 'mm' (there's at
+// most one per path, since stap_register_task_finder_target() merges
+// duplicates).  Returns NULL if no target is interested in it, or an
+// ERR_PTR() if its path couldn't be resolved.
+static struct stap_task_finder_target *
+__stp_tf_find_path_target(struct mm_struct *mm)
+{
+	struct file *vm_file;
+	struct dentry *dentry;
+	struct hlist_head *head;
+	struct hlist_node *node;
+	struct stap_task_finder_target *tgt;
+	struct stap_task_finder_target *found = NULL;
+	int candidate = 0;
+	char *mmpath;
+	size_t mmpathlen;
+
+	vm_file = stap_find_exe_file(mm);
+	if (vm_file == NULL)
+		return ERR_PTR(-ENOENT);
+#ifdef STAPCONF_DPATH_PATH
+	dentry = vm_file->f_path.dentry;
+#else
+	dentry = vm_file->f_dentry;
+#endif
+
+	// First see if any target has the executable's name at all.
+	// This is the common case, and needs no path.
+	spin_lock(&dentry->d_lock);
+	head = __stp_tf_target_bucket(dentry->d_name.name,
+				      dentry->d_name.len);
+	stap_hlist_for_each_entry(tgt, node, head, hlist) {
+		if (tgt->baselen == dentry->d_name.len
+		    && memcmp(tgt->basename, dentry->d_name.name,
+			      tgt->baselen) == 0) {
+			candidate = 1;
+			break;
+		}
+	}
+	spin_unlock(&dentry->d_lock);
+	if (! candidate)
+		goto out;
+
+	// It might be interesting, so compare the full path.
+	mmpath = per_cpu_ptr(__stp_tf_path_buf, get_cpu());
+#ifdef STAPCONF_DPATH_PATH
+	mmpath = d_path(&(vm_file->f_path), mmpath, PATH_MAX);
+#else
+	mmpath = d_path(vm_file->f_dentry, vm_file->f_vfsmnt,
+			mmpath, PATH_MAX);
+#endif
+	if (mmpath == NULL || IS_ERR(mmpath)) {
+		found = (mmpath ? (void *)mmpath : ERR_PTR(-ENOENT));
+	}
+	else {
+		mmpathlen = strlen(mmpath);
+		stap_hlist_for_each_entry(tgt, node, head, hlist) {
+			if (tgt->pathlen == mmpathlen
+			    && strcmp(tgt->procname, mmpath) == 0) {
+				found = tgt;
+				break;
+			}
+		}
+	}
+	put_cpu();
+out:
+	fput(vm_file);
+	return found;
+}
+
+// Attach to 'tsk' on behalf of 'tgt'.  Returns non-zero if attaching
+// failed badly enough that no other targets should be tried.
+static inline int
+__stp_utrace_attach_match_target(struct task_struct *tsk,
+				 struct stap_task_finder_target *tgt,
+				 uid_t tsk_euid)
+{
+	int rc;
+
+#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
+    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
+	/* Make sure unprivileged users only probe their own threads. */
+	if (_stp_uid != tsk_euid)
+		return 0;
+#endif
+
+	// Set up events we need for attached tasks. We won't
+	// actually call the callbacks here - we'll call them
+	// when the thread gets quiesced.
+	rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
+				 __STP_ATTACHED_TASK_EVENTS,
+				 UTRACE_STOP);
+	if (rc != 0 && rc != EPERM)
+		return rc;
+	tgt->engine_attached = 1;
+	return 0;
+}
+
 static inline void
-__stp_utrace_attach_match_filename(struct task_struct *tsk,
-				   const char * const filename,
-				   int process_p)
+__stp_utrace_attach_match_targets(struct task_struct *tsk,
+				  struct stap_task_finder_target *path_tgt,
+				  int process_p)
 {
-	size_t filelen;
 	struct list_head *tgt_node;
 	struct stap_task_finder_target *tgt;
 	uid_t tsk_euid;
@@ -820,55 +962,24 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 	tsk_euid = task_euid(tsk);
 #endif
 #endif
-	filelen = strlen(filename);
-	list_for_each(tgt_node, &__stp_task_finder_list) {
-		int rc;
-
+	// If we've got a matching procname or we're probing all
+	// threads, we've got a match.  We've got to keep matching
+	// since a single thread could match a procname and match an
+	// "all thread" probe.  Pid-based targets were handled at
+	// startup.
+	if (path_tgt != NULL
+	    && __stp_utrace_attach_match_target(tsk, path_tgt, tsk_euid) != 0)
+		return;
+	list_for_each(tgt_node, &__stp_tf_any_target_list) {
 		tgt = list_entry(tgt_node, struct stap_task_finder_target,
-				 list);
-		// If we've got a matching procname or we're probing
-		// all threads, we've got a match.  We've got to keep
-		// matching since a single thread could match a
-		// procname and match an "all thread" probe.
-		if (tgt == NULL)
-			continue;
-		else if (tgt->pathlen > 0
-			 && (tgt->pathlen != filelen
-			     || strcmp(tgt->procname, filename) != 0))
-			continue;
-		/* Ignore pid-based target, they were handled at startup. */
-		else if (tgt->pid != 0)
-			continue;
-		/* Notice that "pid == 0" (which means to probe all
-		 * threads) falls through. */
-
-#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
-    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
-		/* Make sure unprivileged users only probe their own threads. */
-		if (_stp_uid != tsk_euid) {
-			if (tgt->pid != 0) {
-				_stp_warn("Process %d does not belong to unprivileged user %d",
-					  tsk->pid, _stp_uid);
-			}
-			continue;
-		}
-#endif
-
-
-		// Set up events we need for attached tasks. We won't
-		// actually call the callbacks here - we'll call them
-		// when the thread gets quiesced.
-		rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
-					 __STP_ATTACHED_TASK_EVENTS,
-					 UTRACE_STOP);
-		if (rc != 0 && rc != EPERM)
+				 any_list);
+		if (__stp_utrace_attach_match_target(tsk, tgt, tsk_euid) != 0)
 			break;
-		tgt->engine_attached = 1;
 	}
 }
 
-// This function handles the details of getting a task's associated
-// procname, and calling __stp_utrace_attach_match_filename() to
+// This function handles the details of looking up a task's associated
+// procname target, and calling __stp_utrace_attach_match_targets() to
 // attach to it if we find the procname "interesting".  So, what's the
 // difference between path_tsk and match_tsk?  Normally they are the
 // same, except in one case.  In an UTRACE_EVENT(EXEC), we need to
@@ -881,8 +992,7 @@ __stp_utrace_attach_match_tsk(struct task_struct *path_tsk,
 			      struct task_struct *match_tsk, int process_p)
 {
 	struct mm_struct *mm;
-	char *mmpath_buf;
-	char *mmpath;
+	struct stap_task_finder_target *tgt;
 
 #if 0
 	printk(KERN_ERR "%s:%d entry\n", __FUNCTION__, __LINE__);
@@ -903,33 +1013,19 @@ __stp_utrace_attach_match_tsk(struct task_struct *path_tsk,
 		return;
 	}
 
-	// Allocate space for a path
-	mmpath_buf = _stp_kmalloc(PATH_MAX);
-	if (mmpath_buf == NULL) {
-		_stp_error("Unable to allocate space for path");
-		return;
-	}
-
-	// Grab the path associated with the new task
-	mmpath = __stp_get_mm_path(mm, mmpath_buf, PATH_MAX);
-	if (mmpath == NULL || IS_ERR(mmpath)) {
-		int rc = -PTR_ERR(mmpath);
+	// Find the target for the new task's path.
+	tgt = __stp_tf_find_path_target(mm);
+	if (IS_ERR(tgt)) {
+		int rc = -PTR_ERR(tgt);
 		if (rc != ENOENT)
 			_stp_error("Unable to get path (error %d) for pid %d",
 				   rc, (int)path_tsk->pid);
+		return;
 	}
-	else {
-#if 0
-		_stp_dbug(__FUNCTION__, __LINE__,
-			  "calling __stp_utrace_attach_match_filename(%p, %s, %d, %d)\n",
-			  match_tsk, mmpath, register_p, process_p);
-#endif
-		__stp_utrace_attach_match_filename(match_tsk, mmpath,
-						   process_p);
-	}
+	if (tgt == NULL && list_empty(&__stp_tf_any_target_list))
+		return;
 
-	_stp_kfree(mmpath_buf);
-	return;
+	__stp_utrace_attach_match_targets(match_tsk, tgt, process_p);
 }
 
 static void
@@ -1627,11 +1723,22 @@ stap_start_task_finder(void)
 		return EBUSY;
 	}
 
+	/* Preallocate the buffers __stp_tf_find_path_target() uses,
+	 * so that exec and clone events don't have to. */
+	__stp_tf_path_buf = _stp_alloc_percpu(PATH_MAX);
+	if (__stp_tf_path_buf == NULL) {
+		atomic_dec(&__stp_task_finder_state);
+		_stp_error("Unable to allocate space for path");
+		return ENOMEM;
+	}
+
 	rc = utrace_init();
         if (rc != 0) { /* PR14781, handle utrace alloc failure. */
                 /* Decrement this back down to UNITIALIZED, to keep
                    a stap_stop_task_finder() from trying to clean up. */
 		atomic_dec(&__stp_task_finder_state);
+		_stp_free_percpu(__stp_tf_path_buf);
+		__stp_tf_path_buf = NULL;
 		_stp_error("Failed to initialize utrace hooks");
                 return ENOMEM; /* XXX: or some other one. */
         }
@@ -1902,6 +2009,10 @@ stap_stop_task_finder(void)
 	 * run. So, now would be a great time to actually free
 	 * everything. */
 	__stp_tf_free_all_task_work();
+	if (__stp_tf_path_buf) {
+		_stp_free_percpu(__stp_tf_path_buf);
+		__stp_tf_path_buf = NULL;
+	}
 
 #ifdef DEBUG_TASK_FINDER
 	printk(KERN_ERR "%s:%d - exit\n", __FUNCTION__, __LINE__);
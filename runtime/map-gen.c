@@ -45,10 +45,17 @@
 #define VALTYPE char*
 #define VSTYPE char*
 #define VALNAME str
+#ifdef MAP_STRING_VARLEN
+#define VALN v
+#define VALSTOR char *value
+#define MAP_GET_VAL(node) ((node)->value)
+#define MAP_SET_VAL(map,node,val,add,s1,s2,s3,s4,s5) _new_map_set_vstr(map,&MAP_GET_VAL(node),val,add)
+#else
 #define VALN s
 #define VALSTOR char value[MAP_STRING_LENGTH]
 #define MAP_GET_VAL(node) ((node)->value)
 #define MAP_SET_VAL(map,node,val,add,s1,s2,s3,s4,s5) _new_map_set_str(map,MAP_GET_VAL(node),val,add)
+#endif
 #define MAP_COPY_VAL(map,node,val,add) MAP_SET_VAL(map,node,val,add,0,0,0,0,0)
 #define NULLRET ""
 #elif VALUE_TYPE == INT64
@@ -124,10 +131,17 @@
 #define KEY_ARITY 1
 #if KEY1_TYPE == STRING
 #define KEY1TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY1NAME vstr
+#define KEY1N v
+#define KEY1STOR char *key1
+#define KEY1CPY(m) _stp_map_str_set(map, &m->key1, key1)
+#else
 #define KEY1NAME str
 #define KEY1N s
 #define KEY1STOR char key1[MAP_STRING_LENGTH]
 #define KEY1CPY(m) str_copy(m->key1, key1)
+#endif
 #define KEY1_HASH MURMUR_STRING(key1)
 #else
 #define KEY1TYPE int64_t
@@ -156,10 +170,17 @@
 #define KEY_ARITY 2
 #if KEY2_TYPE == STRING
 #define KEY2TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY2NAME vstr
+#define KEY2N v
+#define KEY2STOR char *key2
+#define KEY2CPY(m) _stp_map_str_set(map, &m->key2, key2)
+#else
 #define KEY2NAME str
 #define KEY2N s
 #define KEY2STOR char key2[MAP_STRING_LENGTH]
 #define KEY2CPY(m) str_copy(m->key2, key2)
+#endif
 #define KEY2_HASH MURMUR_STRING(key2)
 #else
 #define KEY2TYPE int64_t
@@ -177,10 +198,17 @@
 #define KEY_ARITY 3
 #if KEY3_TYPE == STRING
 #define KEY3TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY3NAME vstr
+#define KEY3N v
+#define KEY3STOR char *key3
+#define KEY3CPY(m) _stp_map_str_set(map, &m->key3, key3)
+#else
 #define KEY3NAME str
 #define KEY3N s
 #define KEY3STOR char key3[MAP_STRING_LENGTH]
 #define KEY3CPY(m) str_copy(m->key3, key3)
+#endif
 #define KEY3_HASH MURMUR_STRING(key3)
 #else
 #define KEY3TYPE int64_t
@@ -198,10 +226,17 @@
 #define KEY_ARITY 4
 #if KEY4_TYPE == STRING
 #define KEY4TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY4NAME vstr
+#define KEY4N v
+#define KEY4STOR char *key4
+#define KEY4CPY(m) _stp_map_str_set(map, &m->key4, key4)
+#else
 #define KEY4NAME str
 #define KEY4N s
 #define KEY4STOR char key4[MAP_STRING_LENGTH]
 #define KEY4CPY(m) str_copy(m->key4, key4)
+#endif
 #define KEY4_HASH MURMUR_STRING(key4)
 #else
 #define KEY4TYPE int64_t
@@ -219,10 +254,17 @@
 #define KEY_ARITY 5
 #if KEY5_TYPE == STRING
 #define KEY5TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY5NAME vstr
+#define KEY5N v
+#define KEY5STOR char *key5
+#define KEY5CPY(m) _stp_map_str_set(map, &m->key5, key5)
+#else
 #define KEY5NAME str
 #define KEY5N s
 #define KEY5STOR char key5[MAP_STRING_LENGTH]
 #define KEY5CPY(m) str_copy(m->key5, key5)
+#endif
 #define KEY5_HASH MURMUR_STRING(key5)
 #else
 #define KEY5TYPE int64_t
@@ -240,10 +282,17 @@
 #define KEY_ARITY 6
 #if KEY6_TYPE == STRING
 #define KEY6TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY6NAME vstr
+#define KEY6N v
+#define KEY6STOR char *key6
+#define KEY6CPY(m) _stp_map_str_set(map, &m->key6, key6)
+#else
 #define KEY6NAME str
 #define KEY6N s
 #define KEY6STOR char key6[MAP_STRING_LENGTH]
 #define KEY6CPY(m) str_copy(m->key6, key6)
+#endif
 #define KEY6_HASH MURMUR_STRING(key6)
 #else
 #define KEY6TYPE int64_t
@@ -261,10 +310,17 @@
 #define KEY_ARITY 7
 #if KEY7_TYPE == STRING
 #define KEY7TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY7NAME vstr
+#define KEY7N v
+#define KEY7STOR char *key7
+#define KEY7CPY(m) _stp_map_str_set(map, &m->key7, key7)
+#else
 #define KEY7NAME str
 #define KEY7N s
 #define KEY7STOR char key7[MAP_STRING_LENGTH]
 #define KEY7CPY(m) str_copy(m->key7, key7)
+#endif
 #define KEY7_HASH MURMUR_STRING(key7)
 #else
 #define KEY7TYPE int64_t
@@ -282,10 +338,17 @@
 #define KEY_ARITY 8
 #if KEY8_TYPE == STRING
 #define KEY8TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY8NAME vstr
+#define KEY8N v
+#define KEY8STOR char *key8
+#define KEY8CPY(m) _stp_map_str_set(map, &m->key8, key8)
+#else
 #define KEY8NAME str
 #define KEY8N s
 #define KEY8STOR char key8[MAP_STRING_LENGTH]
 #define KEY8CPY(m) str_copy(m->key8, key8)
+#endif
 #define KEY8_HASH MURMUR_STRING(key8)
 #else
 #define KEY8TYPE int64_t
@@ -303,10 +366,17 @@
 #define KEY_ARITY 9
 #if KEY9_TYPE == STRING
 #define KEY9TYPE char*
+#ifdef MAP_STRING_VARLEN
+#define KEY9NAME vstr
+#define KEY9N v
+#define KEY9STOR char *key9
+#define KEY9CPY(m) _stp_map_str_set(map, &m->key9, key9)
+#else
 #define KEY9NAME str
 #define KEY9N s
 #define KEY9STOR char key9[MAP_STRING_LENGTH]
 #define KEY9CPY(m) str_copy(m->key9, key9)
+#endif
 #define KEY9_HASH MURMUR_STRING(key9)
 #else
 #define KEY9TYPE int64_t
@@ -391,12 +461,26 @@
 		&& KEY7_EQ_P(m->key7,key7) && KEY8_EQ_P(m->key8,key8) && KEY9_EQ_P(m->key9,key9))
 #endif
 
+#ifdef MAP_STRING_VARLEN
+/* Out-of-line strings are a cache miss away, so such nodes also keep
+ * their full hash to weed out mismatches before comparing keys.  */
+#define MAP_NODE_HASH_EQ_P(m,h) ((m)->hash == (h))
+#define MAP_NODE_HASH_SET(m,h) ((m)->hash = (h))
+#else
+#define MAP_NODE_HASH_EQ_P(m,h) 1
+#define MAP_NODE_HASH_SET(m,h) do { } while (0)
+#endif
+
 /* */
 
 struct KEYSYM(map_node) {
 	/* common node bits */
 	struct map_node node;
 
+#ifdef MAP_STRING_VARLEN
+	uint32_t hash;
+#endif
+
 	KEY1STOR;
 #if KEY_ARITY > 1
 	KEY2STOR;
@@ -532,6 +616,69 @@ static key_data KEYSYM(map_get_key) (struct map_node *mn, int n, int *type)
 	return ptr;
 }
 
+#ifdef MAP_STRING_VARLEN
+/* Number of strings in each node, to size the string arena.  */
+static unsigned KEYSYM(map_nstrings) (void)
+{
+	unsigned n = (VALUE_TYPE == STRING);
+
+	n += (type_to_enum(KEY1TYPE) == STRING);
+#if KEY_ARITY > 1
+	n += (type_to_enum(KEY2TYPE) == STRING);
+#if KEY_ARITY > 2
+	n += (type_to_enum(KEY3TYPE) == STRING);
+#if KEY_ARITY > 3
+	n += (type_to_enum(KEY4TYPE) == STRING);
+#if KEY_ARITY > 4
+	n += (type_to_enum(KEY5TYPE) == STRING);
+#if KEY_ARITY > 5
+	n += (type_to_enum(KEY6TYPE) == STRING);
+#if KEY_ARITY > 6
+	n += (type_to_enum(KEY7TYPE) == STRING);
+#if KEY_ARITY > 7
+	n += (type_to_enum(KEY8TYPE) == STRING);
+#if KEY_ARITY > 8
+	n += (type_to_enum(KEY9TYPE) == STRING);
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+	return n;
+}
+
+/* Did all string keys of a new node get their arena copy?  */
+static int KEYSYM(map_node_keys_ok) (struct map_node *mn)
+{
+	int i, type;
+
+	for (i = 1; i <= KEY_ARITY; i++)
+		if (KEYSYM(map_get_key)(mn, i, &type).strp == NULL
+		    && type == STRING)
+			return 0;
+	return 1;
+}
+
+/* The map's node_free hook: return a node's strings to the arena,
+ * leaving the node zeroed for its next use.  */
+static void KEYSYM(map_node_free) (MAP map, struct map_node *mn)
+{
+	struct KEYSYM(map_node) *n = KEYSYM(get_map_node)(mn);
+	key_data k;
+	int i, type;
+
+	for (i = 0; i <= KEY_ARITY; i++) {
+		k = KEYSYM(map_get_key)(mn, i, &type);
+		if (type == STRING)
+			_stp_map_str_free(map->str_arena, k.strp);
+	}
+	memset(&n->key1, 0, sizeof(*n) - offsetof(struct KEYSYM(map_node), key1));
+}
+#endif /* MAP_STRING_VARLEN */
+
 /** Return an int64 key from a map node.
  * This function will return an int64 key from a map_node.
  * @param mn pointer to the map_node.
@@ -708,7 +855,7 @@ static uint32_t KEYSYM(hash) (ALLKEYSD(key)) /* NB: unscaled! */
  */
 static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 {
-	int max_entries=0, wrap=0;
+	int max_entries=0, wrap=0, sortn=0;
 	int arg = first_arg;
 	MAP m;
 	va_list ap;
@@ -722,6 +869,9 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 		break;
+		case KEY_SORTN:
+			sortn = 1;
+			break;
 		default:
 			_stp_warn ("Unknown argument %d\n", arg);
 		}
@@ -732,6 +882,17 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 
 	m = _stp_map_new (max_entries, wrap,
 	                  sizeof(struct KEYSYM(map_node)), -1);
+#ifdef MAP_STRING_VARLEN
+	if (m && _stp_map_new_str_arena (m, KEYSYM(map_nstrings)(),
+	                                 KEYSYM(map_node_free))) {
+		_stp_map_del (m);
+		m = NULL;
+	}
+#endif
+	if (m && sortn && _stp_map_new_sort_heap (m)) {
+		_stp_map_del (m);
+		m = NULL;
+	}
 	return m;
 }
 #else
@@ -746,7 +907,7 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 {
 
 	int start=0, stop=0, interval=0, bit_shift=0;
-	int max_entries=0, wrap=0, htype=0;
+	int max_entries=0, wrap=0, htype=0, sortn=0;
 	int arg = first_arg;
 	MAP m;
 	va_list ap;
@@ -760,6 +921,9 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 			break;
+		case KEY_SORTN:
+			sortn = 1;
+			break;
 		case KEY_HIST_TYPE:
 			htype = va_arg(ap, int);
 			if (htype == HIST_LINEAR) {
@@ -794,6 +958,10 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		m = NULL;
 	}
 
+	if (m && sortn && _stp_map_new_sort_heap (m)) {
+		_stp_map_del (m);
+		m = NULL;
+	}
 	return m;
 }
 
@@ -801,6 +969,7 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 
 static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add, int s1, int s2, int s3, int s4, int s5)
 {
+	uint32_t h;
 	unsigned int hv;
 	struct mhlist_head *head;
 	struct mhlist_node *e;
@@ -812,20 +981,46 @@ static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -2;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
+	map->gen++;
+	h = KEYSYM(hash) (ALLKEYS(key));
+	hv = h & map->hash_table_mask;
 	head = &map->hashes[hv];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (MAP_NODE_HASH_EQ_P(n, h) && KEY_EQ_P(n)) {
+#ifdef MAP_STRING_VARLEN
+			/* a wrapping map makes room in its string arena
+			   by dropping old entries, as it does for nodes */
+			while (MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5))
+				if (!_new_map_evict(map, &n->node))
+					return -1;
+			return 0;
+#else
 			return MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5);
+#endif
 		}
 	}
 	/* key not found */
 	n = KEYSYM(get_map_node)(_new_map_create (map, head));
 	if (n == NULL)
 		return -1;
+	MAP_NODE_HASH_SET(n, h);
+#ifdef MAP_STRING_VARLEN
+	/* the string arena may be exhausted; see above */
+	for (;;) {
+		KEYCPY(n);
+		if (KEYSYM(map_node_keys_ok)(&n->node)
+		    && !MAP_SET_VAL(map, n, val, 0, s1, s2, s3, s4, s5))
+			return 0;
+		if (!_new_map_evict(map, &n->node)) {
+			_new_map_del_node(map, &n->node);
+			return -1;
+		}
+	}
+#else
 	KEYCPY(n);
 	return MAP_SET_VAL(map, n, val, 0, s1, s2, s3, s4, s5);
+#endif
 }
 
 static int KEYSYM(_stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val)
@@ -841,6 +1036,7 @@ static int KEYSYM(_stp_map_add) (MAP map, ALLKEYSD(key), VSTYPE val)
 
 static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 {
+	uint32_t h;
 	unsigned int hv;
 	struct mhlist_head *head;
 	struct mhlist_node *e;
@@ -849,11 +1045,12 @@ static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 	if (map == NULL)
 		return NULLRET;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
+	h = KEYSYM(hash) (ALLKEYS(key));
+	hv = h & map->hash_table_mask;
 	head = &map->hashes[hv];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (MAP_NODE_HASH_EQ_P(n, h) && KEY_EQ_P(n)) {
 			return MAP_GET_VAL(n);
 		}
 	}
@@ -863,6 +1060,7 @@ static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 
 static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 {
+	uint32_t h;
 	unsigned int hv;
 	struct mhlist_head *head;
 	struct mhlist_node *e;
@@ -874,11 +1072,12 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -1;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
+	h = KEYSYM(hash) (ALLKEYS(key));
+	hv = h & map->hash_table_mask;
 	head = &map->hashes[hv];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (MAP_NODE_HASH_EQ_P(n, h) && KEY_EQ_P(n)) {
 			_new_map_del_node(map, &n->node);
 			return 0;
 		}
@@ -910,6 +1109,7 @@ static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
 
 static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 {
+	uint32_t h;
 	unsigned int hv;
 	struct mhlist_head *head;
 	struct mhlist_node *e;
@@ -918,11 +1118,12 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 	if (map == NULL)
 		return 0;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
+	h = KEYSYM(hash) (ALLKEYS(key));
+	hv = h & map->hash_table_mask;
 	head = &map->hashes[hv];
 
 	mhlist_for_each_entry(n, e, head, node.hnode) {
-		if (KEY_EQ_P(n)) {
+		if (MAP_NODE_HASH_EQ_P(n, h) && KEY_EQ_P(n)) {
 			return 1;
 		}
 	}
@@ -1015,6 +1216,8 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEYCPY
 #undef KEYSYM
 #undef KEY_EQ_P
+#undef MAP_NODE_HASH_EQ_P
+#undef MAP_NODE_HASH_SET
 
 #undef VALUE_TYPE
 #undef VALNAME
@@ -0,0 +1,170 @@
+/* -*- linux-c -*-
+ * Variable-length map strings
+ * Copyright (C) 2017 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _MAP_STR_C_
+#define _MAP_STR_C_
+
+/** @file map-str.c
+ * @brief Out-of-line string storage for maps
+ *
+ * Maps normally hold their string keys and values inline, reserving
+ * MAP_STRING_LENGTH bytes for each however short the strings are.
+ * Maps instantiated with MAP_STRING_VARLEN hold a pointer instead, to a
+ * length-prefixed copy in a per-map arena.  The arena is preallocated
+ * with the map, MAP_STRING_ARENA_AVG bytes for each string of each
+ * node, and handed out in power-of-two chunks with a free list per
+ * chunk size.  Like the rest of the map code, this relies on the
+ * caller holding the map's lock.
+ *
+ * Since nodes hold plain pointers, this is for the kernel runtime only;
+ * the dyninst maps live in a shared memory area that may move.
+ */
+
+struct _stp_map_str_free {
+	struct _stp_map_str_free *next;
+};
+
+static struct _stp_map_str _stp_map_str_empty = { MAP_STR_ORDERS, 0, "" };
+
+static inline struct _stp_map_str *_stp_map_str_hdr(char *str)
+{
+	return container_of(str, struct _stp_map_str, data[0]);
+}
+
+/* Get a chunk of at least MAP_STR_MIN << order bytes: preferably an
+ * exact fit from the free list, else fresh arena space, else a free
+ * chunk of a larger size.  */
+static struct _stp_map_str *__stp_map_str_get(struct _stp_map_arena *a,
+					      unsigned order)
+{
+	struct _stp_map_str *s;
+	struct _stp_map_str_free *f;
+	size_t size = (size_t)MAP_STR_MIN << order;
+
+	if (a->free[order] == NULL && a->size - a->used >= size) {
+		s = (struct _stp_map_str *)(a->mem + a->used);
+		a->used += size;
+		s->order = order;
+		return s;
+	}
+	for (; order < MAP_STR_ORDERS; order++) {
+		f = a->free[order];
+		if (f) {
+			a->free[order] = f->next;
+			s = (struct _stp_map_str *)f;
+			s->order = order; /* overwritten by the free list */
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/** Copy the concatenation of s1 and s2 (either may be NULL) into the
+ * arena, truncated to MAP_STRING_LENGTH like inline map strings.
+ * @returns the copy, or NULL if the arena is exhausted.
+ */
+static char *_stp_map_str_alloc(struct _stp_map_arena *a,
+				const char *s1, const char *s2)
+{
+	struct _stp_map_str *s;
+	unsigned len1 = s1 ? strnlen(s1, MAP_STRING_LENGTH - 1) : 0;
+	unsigned len2 = s2 ? strnlen(s2, MAP_STRING_LENGTH - 1 - len1) : 0;
+	size_t need = offsetof(struct _stp_map_str, data) + len1 + len2 + 1;
+	unsigned order = 0;
+
+	if (len1 + len2 == 0)
+		return _stp_map_str_empty.data;
+
+	while (((size_t)MAP_STR_MIN << order) < need)
+		order++;
+	if (order >= MAP_STR_ORDERS)
+		return NULL;
+
+	s = __stp_map_str_get(a, order);
+	if (s == NULL)
+		return NULL;
+	s->len = len1 + len2;
+	if (len1)
+		memcpy(s->data, s1, len1);
+	if (len2)
+		memcpy(s->data + len1, s2, len2);
+	s->data[s->len] = '\0';
+	return s->data;
+}
+
+/** Return a string from _stp_map_str_alloc() to its arena. */
+static void _stp_map_str_free(struct _stp_map_arena *a, char *str)
+{
+	struct _stp_map_str_free *f;
+	unsigned order;
+
+	if (str == NULL)
+		return;
+	order = _stp_map_str_hdr(str)->order;
+	if (order >= MAP_STR_ORDERS) /* the shared empty string */
+		return;
+	f = (struct _stp_map_str_free *)_stp_map_str_hdr(str);
+	f->next = a->free[order];
+	a->free[order] = f;
+}
+
+/** Forget all strings of an arena at once, as when clearing its map. */
+static void _stp_map_str_reset(struct _stp_map_arena *a)
+{
+	unsigned o;
+
+	a->used = 0;
+	for (o = 0; o < MAP_STR_ORDERS; o++)
+		a->free[o] = NULL;
+}
+
+/** Replace the arena string at *dst by a copy of src.
+ * @returns 0 on success, or -1 (leaving *dst alone) if the arena is
+ * exhausted.
+ */
+static int _stp_map_str_set(MAP map, char **dst, char *src)
+{
+	char *str = _stp_map_str_alloc(map->str_arena, src, NULL);
+
+	if (str == NULL)
+		return -1;
+	_stp_map_str_free(map->str_arena, *dst);
+	*dst = str;
+	return 0;
+}
+
+/* Compare an arena string to a key.  The stored length bounds the
+ * comparison; a key that is longer only matches if the stored string
+ * was truncated, just as with inline strings.  */
+static int vstr_eq_p (char *key1, char *key2)
+{
+	unsigned len = _stp_map_str_hdr(key1)->len;
+
+	if (strncmp(key1, key2, len) != 0)
+		return 0;
+	return key2[len] == '\0' || len == MAP_STRING_LENGTH - 1;
+}
+
+static int _new_map_set_vstr (MAP map, char **dst, char *val, int add)
+{
+	char *str;
+
+	if (!add)
+		return _stp_map_str_set(map, dst, val);
+
+	str = _stp_map_str_alloc(map->str_arena, *dst, val);
+	if (str == NULL)
+		return -1;
+	_stp_map_str_free(map->str_arena, *dst);
+	*dst = str;
+	return 0;
+}
+
+#endif /* _MAP_STR_C_ */
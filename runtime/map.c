@@ -17,6 +17,7 @@
 
 #include "stat-common.c"
 #include "map-stat.c"
+#include "map-str.c"
 
 static int int64_eq_p (int64_t key1, int64_t key2)
 {
@@ -104,10 +105,14 @@ static void _stp_map_clear(MAP map)
 	struct map_node *m;
 
 	map->num = 0;
+	map->gen++;
 
 	while (!mlist_empty(&map->head)) {
 		m = mlist_map_node(mlist_next(&map->head));
 
+		if (map->node_free)
+			(*map->node_free)(map, m);
+
 		/* remove node from old hash list */
 		mhlist_del_init(&m->hnode);
 
@@ -117,6 +122,10 @@ static void _stp_map_clear(MAP map)
 		/* add to free pool */
 		mlist_add(&m->lnode, &map->pool);
 	}
+
+	/* defragment the string arena too */
+	if (map->str_arena)
+		_stp_map_str_reset(map->str_arena);
 }
 
 static void _stp_pmap_clear(PMAP pmap)
@@ -138,54 +147,69 @@ static void _stp_pmap_clear(PMAP pmap)
 #define SORT_MAX   -2
 #define SORT_AVG   -1
 
-/* comparison function for sorts. */
-static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
-		     int keynum, int dir, map_get_key_fn get_key)
+/* Fetch the sort key of a node.  */
+static void _stp_map_sort_key (struct map_node *mn, int keynum,
+			       map_get_key_fn get_key,
+			       struct _stp_map_sort_ent *e)
 {
-	int64_t a = 0, b = 0;
 	int type = END;
-	key_data k1 = (*get_key)(mlist_map_node(h1), keynum, &type);
-	key_data k2 = (*get_key)(mlist_map_node(h2), keynum, NULL);
+	key_data k = (*get_key)(mn, keynum, &type);
+
+	e->v = 0;
+	e->s = NULL;
 	if (type == INT64) {
-		a = k1.val;
-		b = k2.val;
+		e->v = k.val;
 	} else if (type == STRING) {
-		a = strcmp(k1.strp, k2.strp);
-		b = 0;
+		e->s = k.strp;
 	} else if (type == STAT) {
-		stat_data *sd1 = k1.statp;
-		stat_data *sd2 = k2.statp;
+		stat_data *sd = k.statp;
 		switch (keynum) {
 		case SORT_COUNT:
-			a = sd1->count;
-			b = sd2->count;
+			e->v = sd->count;
 			break;
 		case SORT_SUM:
-			a = sd1->sum;
-			b = sd2->sum;
+			e->v = sd->sum;
 			break;
 		case SORT_MIN:
-			a = sd1->min;
-			b = sd2->min;
+			e->v = sd->min;
 			break;
 		case SORT_MAX:
-			a = sd1->max;
-			b = sd2->max;
+			e->v = sd->max;
 			break;
 		case SORT_AVG:
-			a = _stp_div64 (NULL, sd1->sum, sd1->count);
-			b = _stp_div64 (NULL, sd2->sum, sd2->count);
+			e->v = _stp_div64 (NULL, sd->sum, sd->count);
 			break;
 		default:
 			/* should never happen */
-			a = b = 0;
+			break;
 		}
 	}
+}
+
+/* Does e1 sort after e2?  */
+static int _stp_sort_after (struct _stp_map_sort_ent *e1,
+			    struct _stp_map_sort_ent *e2, int dir)
+{
+	int64_t a = e1->v, b = e2->v;
+	if (e1->s) {
+		a = strcmp(e1->s, e2->s);
+		b = 0;
+	}
 	if ((a < b && dir > 0) || (a > b && dir < 0))
 		return 1;
 	return 0;
 }
 
+/* comparison function for sorts. */
+static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
+		     int keynum, int dir, map_get_key_fn get_key)
+{
+	struct _stp_map_sort_ent e1, e2;
+	_stp_map_sort_key(mlist_map_node(h1), keynum, get_key, &e1);
+	_stp_map_sort_key(mlist_map_node(h2), keynum, get_key, &e2);
+	return _stp_sort_after(&e1, &e2, dir);
+}
+
 /* swap function for bubble sort */
 static inline void _stp_swap (struct mlist_head *a, struct mlist_head *b)
 {
@@ -259,16 +283,99 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
  * would be too time-consuming and you are only interested in the
  * highest or lowest values.
  *
+ * Maps created with KEY_SORTN have a heap for limits up to
+ * MAP_SORTN_MAX, see _stp_map_sortn_heap().
+ *
  * @param map Map
  * @param n Top (or bottom) number of elements. 0 sorts the entire array.
  * @param keynum 0 for the value, or a positive number for the key number to sort on.
  * @param dir Sort Direction. -1 for low-to-high. 1 for high-to-low.
  * @sa _stp_map_sort()
  */
+/* Heap order for _stp_map_sortn_heap: is e1 a worse pick than e2?
+ * Ties go to the earlier node, as with the stable merge sort.  */
+static int _stp_sort_worse (struct _stp_map_sort_ent *e1,
+			    struct _stp_map_sort_ent *e2, int dir)
+{
+	if (_stp_sort_after(e1, e2, dir))
+		return 1;
+	if (_stp_sort_after(e2, e1, dir))
+		return 0;
+	return e1->seq > e2->seq;
+}
+
+static void _stp_sort_sift_down (struct _stp_map_sort_ent *heap,
+				 unsigned i, unsigned num, int dir)
+{
+	struct _stp_map_sort_ent tmp;
+	unsigned c;
+
+	while ((c = 2 * i + 1) < num) {
+		if (c + 1 < num && _stp_sort_worse(&heap[c + 1], &heap[c], dir))
+			c++;
+		if (!_stp_sort_worse(&heap[c], &heap[i], dir))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+/* Select the top n nodes with a heap of the n best seen so far, whose
+ * root is the worst of them, fetching each node's key just once.  Then
+ * heapsort them and move them to the front of the list, in order.
+ * This takes O(num log n) rather than O(num log num) comparisons.  */
+static void _stp_map_sortn_heap (MAP map, int n, int keynum, int dir,
+				 map_get_key_fn get_key)
+{
+	struct _stp_map_sort_ent *heap = map->sort_heap;
+	struct _stp_map_sort_ent e, tmp;
+	struct mlist_head *head = &map->head, *p, *prev;
+	unsigned num = 0, seq = 0, i, c;
+
+	for (p = mlist_next(head); p != head; p = mlist_next(p)) {
+		_stp_map_sort_key(mlist_map_node(p), keynum, get_key, &e);
+		e.node = mlist_map_node(p);
+		e.seq = seq++;
+		if (num < n) {
+			/* sift up */
+			for (i = num++; i > 0; i = c) {
+				c = (i - 1) / 2;
+				if (!_stp_sort_worse(&e, &heap[c], dir))
+					break;
+				heap[i] = heap[c];
+			}
+			heap[i] = e;
+		} else if (_stp_sort_worse(&heap[0], &e, dir)) {
+			heap[0] = e;
+			_stp_sort_sift_down(heap, 0, num, dir);
+		}
+	}
+
+	/* heapsort, leaving the best first */
+	for (i = num; i > 1; i--) {
+		tmp = heap[0];
+		heap[0] = heap[i - 1];
+		heap[i - 1] = tmp;
+		_stp_sort_sift_down(heap, 0, i - 1, dir);
+	}
+
+	prev = head;
+	for (i = 0; i < num; i++) {
+		p = &heap[i].node->lnode;
+		mlist_del(p);
+		mlist_add(p, prev);
+		prev = p;
+	}
+}
+
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 			   map_get_key_fn get_key)
 {
-	if (n == 0 || n > 30) {
+	if (n > 0 && n <= map->sort_heap_size) {
+		_stp_map_sortn_heap(map, n, keynum, dir, get_key);
+	} else if (n == 0 || n > 30) {
 		_stp_map_sort(map, keynum, dir, get_key);
 	} else {
 		struct mlist_head *head = &map->head;
@@ -325,9 +432,33 @@ static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
 	return aptr;
 }
 
+/** The sum of the generations of a pmap's per-cpu maps.
+ * Since each one only ever grows, the sum changes whenever any of
+ * the maps does.  Reading it is much cheaper than walking the maps.
+ */
+static unsigned long _stp_pmap_gen (PMAP pmap)
+{
+	unsigned long gen = 0;
+	int i;
+
+	for_each_possible_cpu(i)
+		gen += _stp_pmap_get_map (pmap, i)->gen;
+	return gen;
+}
+
+/** Whether a pmap's aggregate is still up to date.
+ * @param gen _stp_pmap_gen() of the pmap.
+ */
+static inline int _stp_pmap_agg_current (PMAP pmap, unsigned long gen)
+{
+	return pmap->agg_valid && pmap->agg_gen == gen;
+}
+
 /** Aggregate per-cpu maps.
  * This function aggregates the per-cpu maps into an aggregated
- * map. A pointer to that aggregated map is returned.
+ * map. A pointer to that aggregated map is returned.  If none of
+ * the per-cpu maps changed since the last aggregation, that is
+ * returned as is.
  * 
  * A write lock must be held on the map during this function.
  *
@@ -342,8 +473,12 @@ static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
 	struct mhlist_head *head, *ahead;
 	struct mhlist_node *e, *f;
 	int quit = 0;
+	unsigned long gen = _stp_pmap_gen(pmap);
 
 	agg = _stp_pmap_get_agg(pmap);
+	if (_stp_pmap_agg_current(pmap, gen))
+		return agg;
+	pmap->agg_valid = 0;
 
         /* FIXME. we either clear the aggregation map or clear each local map */
 	/* every time we aggregate. which would be best? */
@@ -377,6 +512,8 @@ static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
 		}
 	}
 
+	pmap->agg_gen = gen;
+	pmap->agg_valid = 1;
 out:
 	return agg;
 }
@@ -391,6 +528,8 @@ static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
 		}
 		m = mlist_map_node(mlist_next(&map->head));
 		mhlist_del_init(&m->hnode);
+		if (map->node_free)
+			(*map->node_free)(map, m);
 	} else {
 		m = mlist_map_node(mlist_next(&map->pool));
 		map->num++;
@@ -404,6 +543,9 @@ static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
 
 static void _new_map_del_node (MAP map, struct map_node *n)
 {
+	if (map->node_free)
+		(*map->node_free)(map, n);
+
 	/* remove node from old hash list */
 	mhlist_del_init(&n->hnode);
 
@@ -414,6 +556,28 @@ static void _new_map_del_node (MAP map, struct map_node *n)
 	mlist_add(&n->lnode, &map->pool);
 
 	map->num--;
+	map->gen++;
+}
+
+/** Make room in the string arena of a wrapping map by dropping its
+ * oldest entry, short of the one being set.
+ * @param keep node that must stay
+ * @returns 1 if an entry was dropped, 0 if there is nothing to drop.
+ */
+static int _new_map_evict (MAP map, struct map_node *keep)
+{
+	struct map_node *m;
+
+	if (!map->wrap || map->str_arena == NULL || mlist_empty(&map->head))
+		return 0;
+	m = mlist_map_node(mlist_next(&map->head));
+	if (m == keep) {
+		if (mlist_next(&m->lnode) == &map->head)
+			return 0;
+		m = mlist_map_node(mlist_next(&m->lnode));
+	}
+	_new_map_del_node(map, m);
+	return 1;
 }
 
 static int _new_map_set_int64 (MAP map, int64_t *dst, int64_t val, int add)
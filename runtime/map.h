@@ -50,6 +50,22 @@
 #define MAP_STRING_LENGTH MAXSTRINGLEN
 #endif
 
+/** Average bytes of arena reserved per string of each node, for maps
+    instantiated with MAP_STRING_VARLEN.  Such maps store strings out of
+    line, in power-of-two chunks of a per-map arena (header included),
+    instead of reserving MAP_STRING_LENGTH bytes for each.  Freed chunks
+    are reused for their size only, so the arena may run out before the
+    map runs out of nodes. */
+#ifndef MAP_STRING_ARENA_AVG
+#define MAP_STRING_ARENA_AVG 64
+#endif
+
+/** Largest limit of a sorted foreach served by heap selection, for maps
+    created with KEY_SORTN.  Larger limits sort the whole map. */
+#ifndef MAP_SORTN_MAX
+#define MAP_SORTN_MAX 1024
+#endif
+
 /** @cond DONT_INCLUDE */
 #define INT64 0
 #define STRING 1
@@ -59,6 +75,32 @@
 
 #include "stat.h"
 
+/* Out-of-line map string, see map-str.c */
+struct _stp_map_str {
+	unsigned order;		/* chunk of MAP_STR_MIN << order bytes */
+	unsigned len;		/* strlen(data) */
+	char data[1];
+};
+
+#define MAP_STR_MIN 16
+#define MAP_STR_ORDERS 16
+
+struct _stp_map_arena {
+	size_t size;		/* bytes of mem[] */
+	size_t used;		/* bytes of mem[] handed out so far */
+	struct _stp_map_str_free *free[MAP_STR_ORDERS];
+	char mem[];
+};
+
+/* Entry of the heap used by _stp_map_sortn(): a node, with its sort
+ * key fetched just once.  */
+struct _stp_map_sort_ent {
+	int64_t v;		/* numeric sort key */
+	char *s;		/* string sort key, if not numeric */
+	struct map_node *node;
+	unsigned seq;		/* position in the list, to keep ties stable */
+};
+
 /* Keys are either int64 or strings, and values can also be stats */
 typedef union {
 	int64_t val;
@@ -88,6 +130,9 @@ struct map_root {
 	/* current number of used elements */
 	unsigned num;
 
+	/* bumped on every change, so pmaps know when to re-aggregate */
+	unsigned long gen;
+
 	/* when more than maxnum elements, wrap or discard? */
 	int wrap;
 
@@ -101,6 +146,16 @@ struct map_root {
 	void *node_mem;
 #endif
 
+	/* string arena for MAP_STRING_VARLEN maps, see map-str.c */
+	struct _stp_map_arena *str_arena;
+
+	/* releases what a node holds outside of it, before its reuse */
+	void (*node_free)(struct map_root *map, struct map_node *n);
+
+	/* scratch heap for _stp_map_sortn(), for maps made with KEY_SORTN */
+	struct _stp_map_sort_ent *sort_heap;
+	unsigned sort_heap_size;
+
 	/* linked list of current entries */
 	struct mlist_head head;
 
@@ -154,6 +209,11 @@ static int int64_eq_p(int64_t key1, int64_t key2);
 static void str_copy(char *dest, char *src);
 static void str_add(void *dest, char *val);
 static int str_eq_p(char *key1, char *key2);
+static int vstr_eq_p(char *key1, char *key2);
+static char *_stp_map_str_alloc(struct _stp_map_arena *a, const char *s1, const char *s2);
+static void _stp_map_str_free(struct _stp_map_arena *a, char *str);
+static void _stp_map_str_reset(struct _stp_map_arena *a);
+static int _stp_map_str_set(MAP map, char **dst, char *src);
 static MAP _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu);
 static PMAP _stp_pmap_new(unsigned max_entries, int wrap, int node_size);
 static MAP _stp_map_new_hstat(unsigned max_entries, int wrap, int node_size);
@@ -169,7 +229,9 @@ static void _stp_map_clear(MAP map);
 static struct map_node *_new_map_create (MAP map, struct mhlist_head *head);
 static int _new_map_set_int64 (MAP map, int64_t *dst, int64_t val, int add);
 static int _new_map_set_str (MAP map, char* dst, char *val, int add);
+static int _new_map_set_vstr (MAP map, char **dst, char *val, int add);
 static void _new_map_del_node (MAP map, struct map_node *n);
+static int _new_map_evict (MAP map, struct map_node *keep);
 static PMAP _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap,
 					int node_size, int start, int stop,
 					int interval);
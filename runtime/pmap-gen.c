@@ -155,7 +155,7 @@ static PMAP
 KEYSYM(_stp_pmap_new) (int first_arg, ...)
 {
 	int start=0, stop=0, interval=0, bit_shift=0;
-	int max_entries=0, wrap=0, stat_ops=0, htype=0;
+	int max_entries=0, wrap=0, stat_ops=0, htype=0, sortn=0;
 	int arg = first_arg;
 	PMAP pmap;
 	va_list ap;
@@ -169,6 +169,9 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 			break;
+		case KEY_SORTN:
+			sortn = 1;
+			break;
 		case KEY_HIST_TYPE:
 			htype = va_arg(ap, int);
 			if (htype == HIST_LINEAR) {
@@ -226,6 +229,12 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		pmap = NULL;
 	}
 
+	/* foreach sorts the aggregate */
+	if (pmap && sortn
+	    && _stp_map_new_sort_heap (_stp_pmap_get_agg(pmap))) {
+		_stp_pmap_del (pmap);
+		pmap = NULL;
+	}
 
 	return pmap;
 }
@@ -300,6 +309,13 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 		}
 	}
 
+	/* if no cpu changed since the last full aggregation, that's it */
+	if (_stp_pmap_agg_current(pmap, _stp_pmap_gen(pmap)))
+		return anode ? MAP_GET_VAL(KEYSYM(get_map_node)(anode)) : NULLRET;
+
+	/* else this key's node is redone below, leaving the others stale */
+	pmap->agg_valid = 0;
+
 	/* now total each cpu */
 	for_each_possible_cpu(cpu) {
 		map = _stp_pmap_get_map (pmap, cpu);
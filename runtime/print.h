@@ -17,6 +17,7 @@ static void _stp_unreserve_bytes (int numbytes);
 static void _stp_printf(const char *fmt, ...);
 static void _stp_print(const char *str);
 static inline void _stp_print_flush(void);
+static inline void _stp_print_flush_batched(void);
 
 #include "vsprintf.h"
 
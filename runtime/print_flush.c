@@ -18,10 +18,44 @@
 
 static STP_DEFINE_SPINLOCK(_stp_print_lock);
 
+#if !defined(STP_BULKMODE) && STP_TRANSPORT_VERSION != 1
+/* Write out len bytes of output; _stp_print_lock must be held. */
+static void _stp_print_write_locked(const char *bufp, size_t len)
+{
+	void *entry = NULL;
+
+	while (len > 0) {
+		size_t bytes_reserved;
+
+		bytes_reserved = _stp_data_write_reserve(len, &entry);
+		if (likely(entry && bytes_reserved > 0)) {
+			memcpy(_stp_data_entry_data(entry), bufp,
+			       bytes_reserved);
+			_stp_data_write_commit(entry);
+			bufp += bytes_reserved;
+			len -= bytes_reserved;
+		}
+		else {
+		    atomic_inc(&_stp_transport_failures);
+		    break;
+		}
+	}
+}
+#endif
+
 void stp_print_flush(_stp_pbuf *pb)
 {
-	size_t len = pb->len;
+	size_t len;
+#ifdef STP_BULKMODE
 	void *entry = NULL;
+#endif
+
+#ifdef STP_DEFERRED_PRINTF
+	if (_stp_deferred_printf)
+		_stp_deferred_close_text(pb);
+	pb->text_start = 0;
+#endif
+	len = pb->len;
 
 	/* check to see if there is anything in the buffer */
 	if (likely(len == 0))
@@ -109,7 +143,6 @@ void stp_print_flush(_stp_pbuf *pb)
 	{
 		unsigned long flags;
 		struct context* __restrict__ c = NULL;
-		char *bufp = pb->buf;
 
 		/* Prevent probe reentrancy on _stp_print_lock.
 		 *
@@ -131,22 +164,7 @@ void stp_print_flush(_stp_pbuf *pb)
 
 		dbug_trans(1, "calling _stp_data_write...\n");
 		stp_spin_lock_irqsave(&_stp_print_lock, flags);
-		while (len > 0) {
-			size_t bytes_reserved;
-
-			bytes_reserved = _stp_data_write_reserve(len, &entry);
-			if (likely(entry && bytes_reserved > 0)) {
-				memcpy(_stp_data_entry_data(entry), bufp,
-				       bytes_reserved);
-				_stp_data_write_commit(entry);
-				bufp += bytes_reserved;
-				len -= bytes_reserved;
-			}
-			else {
-			    atomic_inc(&_stp_transport_failures);
-			    break;
-			}
-		}
+		_stp_print_write_locked(pb->buf, len);
 		stp_spin_unlock_irqrestore(&_stp_print_lock, flags);
 		_stp_runtime_entryfn_put_context(c);
 	}
@@ -71,6 +71,16 @@ typedef char string_t[MAXSTRINGLEN];
 #define STP_OVERLOAD
 #endif
 
+/* Rather than shut down at once on overload, first sample the costliest
+   probes less and less often, down to one hit in 2^STP_OVERLOAD_MAX_SHIFT,
+   as done in overload.h.  -DSTP_NO_OVERLOAD_GOVERNOR shuts down at once.  */
+#if defined(STP_OVERLOAD) && !defined(STP_NO_OVERLOAD_GOVERNOR)
+#define STP_OVERLOAD_GOVERNOR
+#endif
+#ifndef STP_OVERLOAD_MAX_SHIFT
+#define STP_OVERLOAD_MAX_SHIFT 10
+#endif
+
 /* Used for CONTEXT probe_type. */
 enum stp_probe_type {
 /* begin, end or never probe, triggered by stap module itself. */
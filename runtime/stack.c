@@ -610,7 +610,7 @@ static void _stp_stack_kernel_sprint(char *str, int size, struct context* c,
 	 * then call _stp_stack_print,
 	 * then copy the result into the output string
 	 * and clear the print buffer. */
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 	_stp_print_flush();
 
 	_stp_stack_kernel_print(c, sym_flags);
@@ -627,7 +627,7 @@ static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 	 * then call _stp_stack_print,
 	 * then copy the result into the output string
 	 * and clear the print buffer. */
-	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	_stp_pbuf *pb = _stp_print_buf();
 	_stp_print_flush();
 
 	_stp_stack_user_print(c, sym_flags);
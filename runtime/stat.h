@@ -33,6 +33,7 @@
 #define KEY_MAPENTRIES    1 << 7
 #define KEY_STAT_WRAP     1 << 8
 #define KEY_HIST_TYPE     1 << 9
+#define KEY_SORTN         1 << 10
 
 /** histogram type */
 enum histtype { HIST_NONE, HIST_LOG, HIST_LINEAR };
@@ -0,0 +1,248 @@
+/* -*- linux-c -*-
+ * Resizable hash tables looked up under RCU
+ *
+ * Copyright (C) 2017 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ * */
+
+#ifndef _STP_RCU_HASH_H_
+#define _STP_RCU_HASH_H_
+
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+
+#include "stp_helper_lock.h"
+
+/*
+ * A hash table whose lookups just walk a bucket under rcu_read_lock(),
+ * and whose changes are serialized by a spinlock of the user's.
+ *
+ * The table starts with 1 << min_bits buckets.  Adding or removing an
+ * entry says when it has gotten too crowded or too sparse; the user
+ * then has stp_rcu_hash_resize() called from a work item, which moves
+ * the entries to a table with about one to two of them per bucket, up
+ * to 1 << max_bits buckets.  Since lookups may still be walking the old
+ * table, each entry has a hlist_node for either table; a new table
+ * links the node its predecessor didn't use.
+ */
+struct stp_rcu_hash_node {
+	struct hlist_node hlist[2];	/* table linkage, by generation */
+};
+
+struct stp_rcu_hash_table {
+	unsigned int bits;
+	unsigned int gen;		/* which node->hlist[] we link */
+	struct hlist_head buckets[];
+};
+
+struct stp_rcu_hash {
+	struct stp_rcu_hash_table __rcu *table;
+	unsigned long count;		/* entries in table */
+	stp_spinlock_t *lock;		/* serializes changes */
+	unsigned int min_bits;
+	unsigned int max_bits;
+	/* The bucket of an entry, in a table of 1 << bits buckets. */
+	u32 (*hash)(struct stp_rcu_hash_node *node, unsigned int bits);
+};
+
+static inline struct stp_rcu_hash_table *
+stp_rcu_hash_table_alloc(unsigned int bits, unsigned int gen)
+{
+	struct stp_rcu_hash_table *table;
+	unsigned int i;
+
+	table = _stp_vzalloc(sizeof(struct stp_rcu_hash_table)
+			     + (sizeof(struct hlist_head) << bits));
+	if (unlikely(!table))
+		return NULL;
+	table->bits = bits;
+	table->gen = gen;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&table->buckets[i]);
+	return table;
+}
+
+/* Allocate the initial table.  Nothing else may use @h yet. */
+static inline int stp_rcu_hash_init(struct stp_rcu_hash *h)
+{
+	struct stp_rcu_hash_table *table;
+
+	table = stp_rcu_hash_table_alloc(h->min_bits, 0);
+	if (unlikely(!table))
+		return -ENOMEM;
+	h->count = 0;
+	rcu_assign_pointer(h->table, table);
+	return 0;
+}
+
+/* The table, for those holding h->lock. */
+static inline struct stp_rcu_hash_table *
+stp_rcu_hash_table_locked(struct stp_rcu_hash *h)
+{
+	return rcu_dereference_protected(h->table, lockdep_is_held(h->lock));
+}
+
+/* The table, under rcu_read_lock() or h->lock.  NULL once destroyed. */
+static inline struct stp_rcu_hash_table *
+stp_rcu_hash_table(struct stp_rcu_hash *h)
+{
+	return rcu_dereference_check(h->table, lockdep_is_held(h->lock));
+}
+
+static inline struct stp_rcu_hash_node *
+stp_rcu_hash_node_of(struct hlist_node *node, unsigned int gen)
+{
+	if (node == NULL)
+		return NULL;
+	return container_of(node - gen, struct stp_rcu_hash_node, hlist[0]);
+}
+
+static inline struct stp_rcu_hash_node *
+stp_rcu_hash_first(struct stp_rcu_hash_table *table, u32 bucket)
+{
+	return stp_rcu_hash_node_of(rcu_dereference_raw(hlist_first_rcu(&table->buckets[bucket])),
+				    table->gen);
+}
+
+static inline struct stp_rcu_hash_node *
+stp_rcu_hash_next(struct stp_rcu_hash_table *table,
+		  struct stp_rcu_hash_node *node)
+{
+	return stp_rcu_hash_node_of(rcu_dereference_raw(hlist_next_rcu(&node->hlist[table->gen])),
+				    table->gen);
+}
+
+/* Walk the entries of one bucket of @table, as from stp_rcu_hash_table(). */
+#define stp_rcu_hash_for_each_possible(table, node, bucket)		\
+	for ((node) = stp_rcu_hash_first((table), (bucket)); (node);	\
+	     (node) = stp_rcu_hash_next((table), (node)))
+
+/* Walk all the entries of @table. */
+#define stp_rcu_hash_for_each(table, i, node)				\
+	for ((i) = 0; (i) < (1U << (table)->bits); (i)++)		\
+		stp_rcu_hash_for_each_possible((table), (node), (i))
+
+/* Whether the table ought to be resized.  h->lock must be held. */
+static inline bool stp_rcu_hash_check_size(struct stp_rcu_hash *h)
+{
+	struct stp_rcu_hash_table *table = stp_rcu_hash_table_locked(h);
+	unsigned long size = 1UL << table->bits;
+
+	return ((h->count > 2 * size && table->bits < h->max_bits)
+		|| (h->count < size / 8 && table->bits > h->min_bits));
+}
+
+/*
+ * Link @node into the table.  h->lock must be held, and the table not
+ * destroyed.  Returns true if the table ought to be resized.
+ */
+static inline bool stp_rcu_hash_add(struct stp_rcu_hash *h,
+				    struct stp_rcu_hash_node *node)
+{
+	struct stp_rcu_hash_table *table = stp_rcu_hash_table_locked(h);
+
+	hlist_add_head_rcu(&node->hlist[table->gen],
+			   &table->buckets[h->hash(node, table->bits)]);
+	h->count++;
+	return stp_rcu_hash_check_size(h);
+}
+
+/*
+ * Unlink @node from the table; lookups may still see it until a grace
+ * period has passed.  h->lock must be held, and the table not
+ * destroyed.  Returns true if the table ought to be resized.
+ */
+static inline bool stp_rcu_hash_del(struct stp_rcu_hash *h,
+				    struct stp_rcu_hash_node *node)
+{
+	hlist_del_rcu(&node->hlist[stp_rcu_hash_table_locked(h)->gen]);
+	h->count--;
+	return stp_rcu_hash_check_size(h);
+}
+
+/*
+ * Move all entries to a table sized for about one to two of them per
+ * bucket.  Lookups may go on in the old table until it has been
+ * replaced and a grace period has passed; changes are blocked while the
+ * entries are being linked into the new one.  May sleep, so is meant
+ * for a work item, and only one may run at a time.
+ */
+static inline void stp_rcu_hash_resize(struct stp_rcu_hash *h)
+{
+	struct stp_rcu_hash_table *table, *new_table;
+	struct stp_rcu_hash_node *node;
+	unsigned int bits, i;
+	unsigned long count, flags;
+
+	/* Size the new table outside the lock, since it may sleep. */
+	stp_spin_lock_irqsave(h->lock, flags);
+	table = stp_rcu_hash_table_locked(h);
+	count = h->count;
+	stp_spin_unlock_irqrestore(h->lock, flags);
+	if (!table)
+		return;
+
+	bits = h->min_bits;
+	while (bits < h->max_bits && (2UL << bits) < count)
+		bits++;
+	if (bits == table->bits)
+		return;
+
+	/* Only one resize runs at a time, so table->gen can't change
+	 * under us. */
+	new_table = stp_rcu_hash_table_alloc(bits, !table->gen);
+	if (unlikely(!new_table))
+		return;
+
+	stp_spin_lock_irqsave(h->lock, flags);
+	table = stp_rcu_hash_table_locked(h);
+	if (!table) {
+		stp_spin_unlock_irqrestore(h->lock, flags);
+		_stp_vfree(new_table);
+		return;
+	}
+	stp_rcu_hash_for_each(table, i, node)
+		hlist_add_head_rcu(&node->hlist[new_table->gen],
+				   &new_table->buckets[h->hash(node, bits)]);
+	rcu_assign_pointer(h->table, new_table);
+	stp_spin_unlock_irqrestore(h->lock, flags);
+
+	synchronize_rcu();
+	_stp_vfree(table);
+}
+
+/*
+ * Unlink every entry and pass it to @release (if any), under h->lock,
+ * then free the table.  Lookups must be over; a resize in progress
+ * notices the table is gone.
+ */
+static inline void stp_rcu_hash_destroy(struct stp_rcu_hash *h,
+					void (*release)(struct stp_rcu_hash_node *))
+{
+	struct stp_rcu_hash_table *table;
+	struct hlist_node *node, *n;
+	unsigned long flags;
+	unsigned int i;
+
+	stp_spin_lock_irqsave(h->lock, flags);
+	table = stp_rcu_hash_table_locked(h);
+	for (i = 0; table && i < (1U << table->bits); i++) {
+		hlist_for_each_safe(node, n, &table->buckets[i]) {
+			hlist_del(node);
+			if (release)
+				release(stp_rcu_hash_node_of(node, table->gen));
+		}
+	}
+	RCU_INIT_POINTER(h->table, NULL);
+	h->count = 0;
+	stp_spin_unlock_irqrestore(h->lock, flags);
+	if (table)
+		_stp_vfree(table);
+}
+
+#endif /* _STP_RCU_HASH_H_ */
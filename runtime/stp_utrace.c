@@ -19,7 +19,9 @@
 
 #include "stp_utrace.h"
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
 #include <linux/freezer.h>
 #include <linux/slab.h>
 #include <trace/events/sched.h>
@@ -28,6 +30,7 @@
 #include "linux/stp_tracepoint.h"
 
 #include "stp_helper_lock.h"
+#include "stp_rcu_hash.h"
 
 #if defined(__set_task_state)
 #define __stp_set_task_state(tsk, state_value)		\
@@ -87,20 +90,42 @@ struct utrace {
 
 	unsigned long utrace_flags;
 
-	struct hlist_node hlist;       /* task_utrace_table linkage */
+	struct stp_rcu_hash_node hnode;	/* task_utrace_table linkage */
 	struct task_struct *task;
+	struct rcu_head rcu;
 
 	struct task_work resume_work;
 	struct task_work report_work;
 };
 
+/*
+ * The task -> struct utrace table is looked up from the syscall, exec,
+ * clone and death tracepoints of every task on the system, so lookups
+ * just walk a bucket under rcu_read_lock().  Changes to it are much
+ * rarer (attaching to a task for the first time, and its death), and
+ * are serialized by task_utrace_lock.
+ *
+ * The table grows and shrinks (see stp_rcu_hash.h) between
+ * 1 << TASK_UTRACE_HASH_BITS and 1 << TASK_UTRACE_HASH_MAX_BITS buckets.
+ */
 #define TASK_UTRACE_HASH_BITS 5
-#define TASK_UTRACE_TABLE_SIZE (1 << TASK_UTRACE_HASH_BITS)
+#ifndef TASK_UTRACE_HASH_MAX_BITS
+#define TASK_UTRACE_HASH_MAX_BITS 16
+#endif
 
-static struct hlist_head task_utrace_table[TASK_UTRACE_TABLE_SIZE];
-//DEFINE_MUTEX(task_utrace_mutex);      /* Protects task_utrace_table */
 static STP_DEFINE_SPINLOCK(task_utrace_lock); /* Protects task_utrace_table */
 
+static u32 utrace_table_hash(struct stp_rcu_hash_node *node, unsigned int bits);
+static struct stp_rcu_hash task_utrace_table = {
+	.lock = &task_utrace_lock,
+	.min_bits = TASK_UTRACE_HASH_BITS,
+	.max_bits = TASK_UTRACE_HASH_MAX_BITS,
+	.hash = utrace_table_hash,
+};
+
+static void task_utrace_resize(struct work_struct *work);
+static DECLARE_WORK(task_utrace_resize_work, task_utrace_resize);
+
 static struct kmem_cache *utrace_cachep;
 static struct kmem_cache *utrace_engine_cachep;
 static const struct utrace_engine_ops utrace_detached_ops; /* forward decl */
@@ -204,9 +229,18 @@ stp_signal_wake_up(struct task_struct *t, bool resume)
 }
 
 
+static inline struct utrace *utrace_table_entry(struct stp_rcu_hash_node *node)
+{
+	return container_of(node, struct utrace, hnode);
+}
+
+static u32 utrace_table_hash(struct stp_rcu_hash_node *node, unsigned int bits)
+{
+	return hash_ptr(utrace_table_entry(node)->task, bits);
+}
+
 static int utrace_init(void)
 {
-	int i;
 	int rc = -1;
         static char kmem_cache1_name[50];
         static char kmem_cache2_name[50];
@@ -214,10 +248,9 @@ static int utrace_init(void)
 	if (unlikely(stp_task_work_init() != 0))
 		goto error;
 
-	/* initialize the list heads */
-	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
-		INIT_HLIST_HEAD(&task_utrace_table[i]);
-	}
+	/* Allocate the initial (small) table. */
+	if (unlikely(stp_rcu_hash_init(&task_utrace_table) != 0))
+		goto error;
 
 #if !defined(STAPCONF_TRY_TO_WAKE_UP_EXPORTED) \
     && !defined(STAPCONF_WAKE_UP_STATE_EXPORTED)
@@ -323,18 +356,19 @@ error:
 		kmem_cache_destroy(utrace_engine_cachep);
 		utrace_engine_cachep = NULL;
 	}
+	stp_rcu_hash_destroy(&task_utrace_table, NULL);
 	return rc;
 }
 
 static void utrace_cleanup(struct utrace *utrace);
 
-static int utrace_exit(void)
+static void utrace_table_cleanup(struct stp_rcu_hash_node *node)
 {
-	int i;
-	struct utrace *utrace;
-	struct hlist_head *head;
-	struct hlist_node *node, *node2;
+	utrace_cleanup(utrace_table_entry(node));
+}
 
+static int utrace_exit(void)
+{
 #ifdef STP_TF_DEBUG
 	printk(KERN_ERR "%s:%d - entry\n", __FUNCTION__, __LINE__);
 #endif
@@ -343,6 +377,7 @@ static int utrace_exit(void)
 	 * utrace_shutdown(). */
 	utrace_shutdown();
 	stp_task_work_exit();
+	cancel_work_sync(&task_utrace_resize_work);
 
 	/* After utrace_shutdown() and stp_task_work_exit() (and the
 	 * code in stap_stop_task_finder()), we're *sure* there are no
@@ -353,16 +388,11 @@ static int utrace_exit(void)
 #ifdef STP_TF_DEBUG
 	printk(KERN_ERR "%s:%d - freeing task-specific\n", __FUNCTION__, __LINE__);
 #endif
-	stp_spin_lock(&task_utrace_lock);
-	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
-		head = &task_utrace_table[i];
-		stap_hlist_for_each_entry_safe(utrace, node, node2, head,
-					       hlist) {
-			hlist_del(&utrace->hlist);
-			utrace_cleanup(utrace);
-		}
-	}
-	stp_spin_unlock(&task_utrace_lock);
+	stp_rcu_hash_destroy(&task_utrace_table, utrace_table_cleanup);
+
+	/* Wait for the utrace_free_rcu() callbacks before getting rid
+	 * of their cache. */
+	rcu_barrier();
 
 	if (utrace_cachep) {
 		kmem_cache_destroy(utrace_cachep);
@@ -454,16 +484,17 @@ static void utrace_report_work(struct task_work *work);
 
 static void utrace_cancel_all_task_work(void)
 {
-	int i;
+	unsigned int i;
 	struct utrace *utrace;
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct stp_rcu_hash_table *table;
+	struct stp_rcu_hash_node *node;
 
 	/* Cancel any pending task_work item(s). */
 	stp_spin_lock(&task_utrace_lock);
-	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
-		head = &task_utrace_table[i];
-		stap_hlist_for_each_entry(utrace, node, head, hlist) {
+	table = stp_rcu_hash_table_locked(&task_utrace_table);
+	for (i = 0; table && i < (1U << table->bits); i++) {
+		stp_rcu_hash_for_each_possible(table, node, i) {
+			utrace = utrace_table_entry(node);
 			if (atomic_add_unless(&utrace->resume_work_added,
 					      -1, 0)) {
 #ifdef STP_TF_DEBUG
@@ -533,23 +564,37 @@ static void utrace_shutdown(void)
 }
 
 /*
- * This routine must be called under the task_utrace_lock.
+ * This routine must be called under rcu_read_lock() or the
+ * task_utrace_lock.
  */
 static struct utrace *__task_utrace_struct(struct task_struct *task)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct stp_rcu_hash_table *table;
+	struct stp_rcu_hash_node *node;
 	struct utrace *utrace;
 
-	lockdep_assert_held(&task_utrace_lock);
-	head = &task_utrace_table[hash_ptr(task, TASK_UTRACE_HASH_BITS)];
-	stap_hlist_for_each_entry(utrace, node, head, hlist) {
+	table = stp_rcu_hash_table(&task_utrace_table);
+	if (unlikely(!table))
+		return NULL;
+	stp_rcu_hash_for_each_possible(table, node,
+				       hash_ptr(task, table->bits)) {
+		utrace = utrace_table_entry(node);
 		if (utrace->task == task)
 			return utrace;
 	}
 	return NULL;
 }
 
+/*
+ * Resize the table in the background, once the tracepoints that use it
+ * are registered.
+ */
+static void task_utrace_resize(struct work_struct *work)
+{
+	if (atomic_read(&utrace_state) == __UTRACE_REGISTERED)
+		stp_rcu_hash_resize(&task_utrace_table);
+}
+
 /*
  * Set up @task.utrace for the first time.  We can have races
  * between two utrace_attach_task() calls here.  The task_lock()
@@ -578,9 +623,11 @@ static bool utrace_task_alloc(struct task_struct *task)
 
 	stp_spin_lock(&task_utrace_lock);
 	u = __task_utrace_struct(task);
-	if (u == NULL) {
-		hlist_add_head(&utrace->hlist,
-			       &task_utrace_table[hash_ptr(task, TASK_UTRACE_HASH_BITS)]);
+	if (u == NULL
+	    && stp_rcu_hash_table_locked(&task_utrace_table) != NULL) {
+		if (stp_rcu_hash_add(&task_utrace_table, &utrace->hnode)
+		    && atomic_read(&utrace_state) == __UTRACE_REGISTERED)
+			schedule_work(&task_utrace_resize_work);
 	}
 	else {
 #ifdef STP_TF_DEBUG
@@ -593,6 +640,16 @@ static bool utrace_task_alloc(struct task_struct *task)
 	return true;
 }
 
+static void utrace_free_rcu(struct rcu_head *rcu)
+{
+	struct utrace *utrace = container_of(rcu, struct utrace, rcu);
+
+#ifdef STP_TF_DEBUG
+	memset(utrace, 0, sizeof(struct utrace));
+#endif
+	kmem_cache_free(utrace_cachep, utrace);
+}
+
 /*
  * Correctly free a @utrace structure.
  *
@@ -608,7 +665,11 @@ static void utrace_free(struct utrace *utrace)
 	/* Remove this utrace from the mapping list of tasks to
 	 * struct utrace. */
 	stp_spin_lock(&task_utrace_lock);
-	hlist_del(&utrace->hlist);
+	if (stp_rcu_hash_table_locked(&task_utrace_table) != NULL) {
+		if (stp_rcu_hash_del(&task_utrace_table, &utrace->hnode)
+		    && atomic_read(&utrace_state) == __UTRACE_REGISTERED)
+			schedule_work(&task_utrace_resize_work);
+	}
 	stp_spin_unlock(&task_utrace_lock);
 
 	/* Free the utrace struct. */
@@ -647,19 +708,17 @@ static void utrace_free(struct utrace *utrace)
 				: "UNKNOWN"), utrace->task->state, utrace->task->exit_state);
 	}
 
-#ifdef STP_TF_DEBUG
-	memset(utrace, 0, sizeof(struct utrace));
-#endif
-	kmem_cache_free(utrace_cachep, utrace);
+	/* Lookups may still be looking at it. */
+	call_rcu(&utrace->rcu, utrace_free_rcu);
 }
 
 static struct utrace *task_utrace_struct(struct task_struct *task)
 {
 	struct utrace *utrace;
 
-	stp_spin_lock(&task_utrace_lock);
+	rcu_read_lock();
 	utrace = __task_utrace_struct(task);
-	stp_spin_unlock(&task_utrace_lock);
+	rcu_read_unlock();
 	return utrace;
 }
 
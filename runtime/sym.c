@@ -156,12 +156,12 @@ static struct _stp_module *_stp_umod_lookup(unsigned long addr,
   return NULL;
 }
 
-static const char *_stp_kallsyms_lookup(unsigned long addr,
-                                        unsigned long *symbolsize,
-                                        unsigned long *offset, 
-                                        const char **modname, 
-                                        /* char ** secname? */
-					struct task_struct *task)
+static const char *__stp_kallsyms_lookup(unsigned long addr,
+                                         unsigned long *symbolsize,
+                                         unsigned long *offset, 
+                                         const char **modname, 
+                                         /* char ** secname? */
+					 struct task_struct *task)
 {
 	struct _stp_module *m = NULL;
 	struct _stp_section *sec = NULL;
@@ -248,6 +248,129 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
 	return NULL;
 }
 
+
+/* Scripts tend to symbolize the same few addresses over and over, so
+   each cpu keeps a small direct-mapped cache of lookup results.  Each
+   entry is tagged with the generation of the kernel module addresses,
+   and for lookups in a task also of the vma map, and misses once one
+   of those has changed since.  Lookups without a task never consult
+   the vma map, so its churn needn't evict them.  */
+#ifndef STP_SYM_CACHE_BITS
+#define STP_SYM_CACHE_BITS 8
+#endif
+#define STP_SYM_CACHE_SIZE (1 << STP_SYM_CACHE_BITS)
+
+struct _stp_sym_cache_entry {
+	unsigned long addr;
+	pid_t tgid;		/* 0 for lookups without a task */
+	int kgen, vgen;
+	const char *name;
+	const char *modname;
+	unsigned long symbolsize, offset;
+};
+
+struct _stp_sym_cache {
+	struct _stp_sym_cache_entry entries[STP_SYM_CACHE_SIZE];
+#ifdef STP_TIMING
+	unsigned long hits, misses;
+#endif
+};
+
+static struct _stp_sym_cache __percpu *_stp_sym_cache;
+
+/* Bumped by _stp_kmodule_update_address.  */
+static atomic_t _stp_kmodule_gen = ATOMIC_INIT(0);
+
+
+static int _stp_sym_cache_init(void)
+{
+	_stp_sym_cache = _stp_alloc_percpu(sizeof(struct _stp_sym_cache));
+	return _stp_sym_cache ? 0 : -ENOMEM;
+}
+
+
+static void _stp_sym_cache_free(void)
+{
+	if (_stp_sym_cache)
+		_stp_free_percpu(_stp_sym_cache);
+	_stp_sym_cache = NULL;
+}
+
+
+#ifdef STP_TIMING
+static void _stp_sym_cache_report(void)
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	if (_stp_sym_cache == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct _stp_sym_cache *c = per_cpu_ptr(_stp_sym_cache, cpu);
+		hits += c->hits;
+		misses += c->misses;
+	}
+	if (hits + misses)
+		_stp_printf("----- symbol cache: %lu hits, %lu misses\n",
+			    hits, misses);
+}
+#endif
+
+
+/* Like __stp_kallsyms_lookup, but through this cpu's cache.  Outputs
+   that lookup leaves alone come back as 0 or NULL.  */
+static const char *_stp_kallsyms_lookup(unsigned long addr,
+                                        unsigned long *symbolsize,
+                                        unsigned long *offset, 
+                                        const char **modname, 
+					struct task_struct *task)
+{
+	struct _stp_sym_cache *c;
+	struct _stp_sym_cache_entry *e;
+	const char *name;
+	pid_t tgid = task ? task->tgid : 0;
+	int kgen = atomic_read(&_stp_kmodule_gen);
+	int vgen = atomic_read(&__stp_tf_vma_gen);
+
+	if (addr == 0)
+		return NULL;
+	if (unlikely(_stp_sym_cache == NULL))
+		return __stp_kallsyms_lookup(addr, symbolsize, offset,
+					     modname, task);
+
+	c = per_cpu_ptr(_stp_sym_cache, get_cpu());
+	e = &c->entries[(hash_long(addr, STP_SYM_CACHE_BITS) ^ tgid)
+			& (STP_SYM_CACHE_SIZE - 1)];
+	if (e->addr == addr && e->tgid == tgid && e->kgen == kgen
+	    && (tgid == 0 || e->vgen == vgen)) {
+#ifdef STP_TIMING
+		c->hits++;
+#endif
+	} else {
+#ifdef STP_TIMING
+		c->misses++;
+#endif
+		e->symbolsize = e->offset = 0;
+		e->modname = NULL;
+		e->name = __stp_kallsyms_lookup(addr, &e->symbolsize,
+						&e->offset, &e->modname, task);
+		e->addr = addr;
+		e->tgid = tgid;
+		e->kgen = kgen;
+		e->vgen = vgen;
+	}
+
+	if (symbolsize)
+		*symbolsize = e->symbolsize;
+	if (offset)
+		*offset = e->offset;
+	if (modname)
+		*modname = e->modname;
+	name = e->name;
+	put_cpu();
+	return name;
+}
+
 #ifdef STP_NEED_LINE_DATA
 static void _stp_filename_lookup(struct _stp_module *mod, char ** filename,
                                  uint8_t *dirsecp, uint8_t *enddirsecp,
@@ -1064,6 +1187,7 @@ static void _stp_kmodule_update_address(const char* module,
                        _stp_modules[mi]->sections[si].name,
                        address);
               _stp_modules[mi]->sections[si].static_addr = address;
+              atomic_inc(&_stp_kmodule_gen);
 
               if (reloc) break;
               else continue; /* wildcarded - will have more hits */
@@ -3,24 +3,37 @@
 
 #include <linux/file.h>
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/jhash.h>
+#include <linux/workqueue.h>
 
 #include <linux/fs.h>
 #include <linux/dcache.h>
 
 #include "stp_helper_lock.h"
-
-// __stp_tf_vma_lock protects the hash table.
-// Documentation/spinlocks.txt suggest we can be a bit more clever
-// if we guarantee that in interrupt context we only read, not write
-// the datastructures. We should never change the hash table or the
-// contents in interrupt context (which should only ever call 
-// stap_find_vma_map_info for getting stored vma info). So we might
-// want to look into that if this seems a bottleneck.
-static STP_DEFINE_RWLOCK(__stp_tf_vma_lock);
+#include "stp_rcu_hash.h"
+
+// The vma map is consulted for every user-space symbol or backtrace,
+// often from hot probes, and changed only as tasks mmap/munmap
+// executables.  So it is read under rcu_read_lock() alone.
+//
+// Each tracked process has a __stp_tf_vma_proc, found through a hash
+// table on its pid, holding an array of its vma entries sorted by
+// vm_start, which lookups binary-search.  Changes copy the array
+// outside the lock, then take __stp_tf_vma_lock only to install the
+// copy, starting over if the map changed meanwhile (which bumps
+// __stp_tf_vma_gen).  The old array, and any removed entries, are
+// freed after a grace period.
+//
+// Like the utrace task table, the hash table grows and shrinks (see
+// stp_rcu_hash.h), between 1 << __STP_TF_HASH_BITS and
+// 1 << __STP_TF_HASH_MAX_BITS buckets.
+static STP_DEFINE_SPINLOCK(__stp_tf_vma_lock);
 
 #define __STP_TF_HASH_BITS 4
-#define __STP_TF_TABLE_SIZE (1 << __STP_TF_HASH_BITS)
+#ifndef __STP_TF_HASH_MAX_BITS
+#define __STP_TF_HASH_MAX_BITS 14
+#endif
 
 #ifndef TASK_FINDER_VMA_ENTRY_PATHLEN
 #define TASK_FINDER_VMA_ENTRY_PATHLEN 64
@@ -30,9 +43,8 @@ static STP_DEFINE_RWLOCK(__stp_tf_vma_lock);
 
 
 struct __stp_tf_vma_entry {
-	struct hlist_node hlist;
+	struct rcu_head rcu;
 
-	pid_t pid;
 	unsigned long vm_start;
 	unsigned long vm_end;
         char path[TASK_FINDER_VMA_ENTRY_PATHLEN]; /* mmpath name, if known */
@@ -41,7 +53,35 @@ struct __stp_tf_vma_entry {
 	void *user;
 };
 
-static struct hlist_head *__stp_tf_vma_map;
+struct __stp_tf_vma_array {
+	struct rcu_head rcu;
+	unsigned int nr;
+	struct __stp_tf_vma_entry *entries[];	/* sorted by vm_start */
+};
+
+struct __stp_tf_vma_proc {
+	struct stp_rcu_hash_node hnode;	/* __stp_tf_vma_map linkage */
+	struct rcu_head rcu;
+
+	pid_t pid;
+	struct __stp_tf_vma_array __rcu *maps;	/* never empty */
+};
+
+static u32 __stp_tf_vma_proc_hash(struct stp_rcu_hash_node *node,
+				  unsigned int bits);
+static struct stp_rcu_hash __stp_tf_vma_map = {
+	.lock = &__stp_tf_vma_lock,
+	.min_bits = __STP_TF_HASH_BITS,
+	.max_bits = __STP_TF_HASH_MAX_BITS,
+	.hash = __stp_tf_vma_proc_hash,
+};
+
+// Bumped on every change to the map, so that what was looked up in it
+// can be cached until then (see _stp_sym_cache in sym.c).
+static atomic_t __stp_tf_vma_gen = ATOMIC_INIT(0);
+
+static void __stp_tf_vma_resize(struct work_struct *work);
+static DECLARE_WORK(__stp_tf_vma_resize_work, __stp_tf_vma_resize);
 
 // __stp_tf_vma_new_entry(): Returns an newly allocated or NULL.
 // Must only be called from user context.
@@ -69,98 +109,193 @@ __stp_tf_vma_release_entry(struct __stp_tf_vma_entry *entry)
 	_stp_kfree (entry);
 }
 
-// stap_initialize_vma_map():  Initialize the free list.  Grabs the
-// spinlock.  Should be called before any of the other stap_*_vma_map
-// functions.  Since this is run before any other function is called,
-// this doesn't need any locking.  Should be called from a user context
-// since it can allocate memory.
-static int
-stap_initialize_vma_map(void)
+static void
+__stp_tf_vma_release_entry_rcu(struct rcu_head *rcu)
 {
-	size_t size = sizeof(struct hlist_head) * __STP_TF_TABLE_SIZE;
-	struct hlist_head *map = (struct hlist_head *) _stp_kzalloc_gfp(size,
-							STP_ALLOC_SLEEP_FLAGS);
-	if (map == NULL)
-		return -ENOMEM;
+	__stp_tf_vma_release_entry(container_of(rcu, struct __stp_tf_vma_entry,
+						rcu));
+}
 
-	__stp_tf_vma_map = map;
-	return 0;
+// __stp_tf_vma_new_array(): Returns a new array with room for nr
+// entries, or NULL.  Called under rcu_read_lock(), so it cannot
+// sleep.
+static struct __stp_tf_vma_array *
+__stp_tf_vma_new_array(unsigned int nr)
+{
+	struct __stp_tf_vma_array *maps;
+
+	maps = _stp_kmalloc_gfp(sizeof(struct __stp_tf_vma_array)
+				+ nr * sizeof(struct __stp_tf_vma_entry *),
+				STP_ALLOC_FLAGS);
+	if (maps != NULL)
+		maps->nr = nr;
+	return maps;
 }
 
-// stap_destroy_vma_map(): Unconditionally destroys vma entries.
-// Nothing should be using it anymore. Doesn't lock anything and just
-// frees all items.
 static void
-stap_destroy_vma_map(void)
+__stp_tf_vma_release_array_rcu(struct rcu_head *rcu)
 {
-	if (__stp_tf_vma_map != NULL) {
-		int i;
-		for (i = 0; i < __STP_TF_TABLE_SIZE; i++) {
-			struct hlist_head *head = &__stp_tf_vma_map[i];
-			struct hlist_node *node;
-			struct hlist_node *n;
-			struct __stp_tf_vma_entry *entry = NULL;
-
-			if (hlist_empty(head))
-				continue;
-
-		        stap_hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-				hlist_del(&entry->hlist);
-				__stp_tf_vma_release_entry(entry);
-			}
-		}
-		_stp_kfree(__stp_tf_vma_map);
-	}
+	_stp_kfree(container_of(rcu, struct __stp_tf_vma_array, rcu));
+}
+
+// __stp_tf_vma_release_proc(): Frees a process and all its entries.
+static void
+__stp_tf_vma_release_proc(struct __stp_tf_vma_proc *proc)
+{
+	struct __stp_tf_vma_array *maps = rcu_dereference_raw(proc->maps);
+	unsigned int i;
+
+	for (i = 0; i < maps->nr; i++)
+		__stp_tf_vma_release_entry(maps->entries[i]);
+	_stp_kfree(maps);
+	_stp_kfree(proc);
+}
+
+static void
+__stp_tf_vma_release_proc_rcu(struct rcu_head *rcu)
+{
+	__stp_tf_vma_release_proc(container_of(rcu, struct __stp_tf_vma_proc,
+					       rcu));
 }
 
+static inline struct __stp_tf_vma_proc *
+__stp_tf_vma_proc_entry(struct stp_rcu_hash_node *node)
+{
+	return container_of(node, struct __stp_tf_vma_proc, hnode);
+}
+
+static void
+__stp_tf_vma_release_proc_node(struct stp_rcu_hash_node *node)
+{
+	__stp_tf_vma_release_proc(__stp_tf_vma_proc_entry(node));
+}
+
+// A process' entries, for those holding __stp_tf_vma_lock.
+static inline struct __stp_tf_vma_array *
+__stp_tf_vma_maps_locked(struct __stp_tf_vma_proc *proc)
+{
+	return rcu_dereference_protected(proc->maps,
+					 lockdep_is_held(&__stp_tf_vma_lock));
+}
 
 // __stp_tf_vma_map_hash(): Compute the vma map hash.
 static inline u32
-__stp_tf_vma_map_hash(struct task_struct *tsk)
+__stp_tf_vma_map_hash(pid_t pid, unsigned int bits)
 {
-    return (jhash_1word(tsk->pid, 0) & (__STP_TF_TABLE_SIZE - 1));
+    return (jhash_1word(pid, 0) & ((1U << bits) - 1));
 }
 
-// Get vma_entry if the vma is present in the vma map hash table.
-// Returns NULL if not present.  The __stp_tf_vma_lock must be read locked
-// before calling this function.
-static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_internal(struct task_struct *tsk,
-				    unsigned long vm_start)
+static u32
+__stp_tf_vma_proc_hash(struct stp_rcu_hash_node *node, unsigned int bits)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	return __stp_tf_vma_map_hash(__stp_tf_vma_proc_entry(node)->pid, bits);
+}
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_start == entry->vm_start) {
-			return entry;
-		}
+// Get the vma entries of a process, if there are any.  Must be called
+// under rcu_read_lock() or with the __stp_tf_vma_lock held.
+static struct __stp_tf_vma_proc *
+__stp_tf_get_vma_proc(pid_t pid)
+{
+	struct stp_rcu_hash_table *table;
+	struct stp_rcu_hash_node *node;
+	struct __stp_tf_vma_proc *proc;
+
+	table = stp_rcu_hash_table(&__stp_tf_vma_map);
+	if (table == NULL)
+		return NULL;
+	stp_rcu_hash_for_each_possible(table, node,
+				       __stp_tf_vma_map_hash(pid, table->bits)) {
+		proc = __stp_tf_vma_proc_entry(node);
+		if (proc->pid == pid)
+			return proc;
 	}
 	return NULL;
 }
 
-// Get vma_entry if the vma with the given vm_end is present in the vma map
-// hash table for the tsk.  Returns NULL if not present.
-// The __stp_tf_vma_lock must be read locked before calling this function.
-static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_end_internal(struct task_struct *tsk,
-					unsigned long vm_end)
+// Returns the index of the last entry starting at or below addr, or
+// -1 if there is none.
+static int
+__stp_tf_vma_array_find(struct __stp_tf_vma_array *maps, unsigned long addr)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
-
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_end == entry->vm_end) {
-			return entry;
-		}
+	int lo = 0, hi = maps->nr;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (maps->entries[mid]->vm_start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return NULL;
+	return lo - 1;
+}
+
+static void
+__stp_tf_vma_resize(struct work_struct *work)
+{
+	stp_rcu_hash_resize(&__stp_tf_vma_map);
+}
+
+// Unlink a process from the table, and free it after a grace period.
+// The __stp_tf_vma_lock must be held.
+static void
+__stp_tf_vma_remove_proc(struct __stp_tf_vma_proc *proc)
+{
+	if (stp_rcu_hash_del(&__stp_tf_vma_map, &proc->hnode))
+		schedule_work(&__stp_tf_vma_resize_work);
+	atomic_inc(&__stp_tf_vma_gen);
+	call_rcu(&proc->rcu, __stp_tf_vma_release_proc_rcu);
+}
+
+// Install a new array of entries for a process, freeing the old one
+// after a grace period.  The __stp_tf_vma_lock must be held.
+static void
+__stp_tf_vma_replace_maps(struct __stp_tf_vma_proc *proc,
+			  struct __stp_tf_vma_array *maps)
+{
+	struct __stp_tf_vma_array *old_maps = __stp_tf_vma_maps_locked(proc);
+
+	rcu_assign_pointer(proc->maps, maps);
+	atomic_inc(&__stp_tf_vma_gen);
+	call_rcu(&old_maps->rcu, __stp_tf_vma_release_array_rcu);
+}
+
+// The __stp_tf_vma_gen to copy a process' entries against.  If it is
+// still the same once the __stp_tf_vma_lock is taken, nothing has
+// changed in the meantime, and the copy can be installed.
+static inline int
+__stp_tf_vma_snapshot_gen(void)
+{
+	int gen = atomic_read(&__stp_tf_vma_gen);
+
+	smp_rmb();
+	return gen;
+}
+
+// stap_initialize_vma_map():  Allocate the initial hash table.
+// Should be called before any of the other stap_*_vma_map
+// functions.  Since this is run before any other function is called,
+// this doesn't need any locking.  Should be called from a user context
+// since it can allocate memory.
+static int
+stap_initialize_vma_map(void)
+{
+	return stp_rcu_hash_init(&__stp_tf_vma_map);
+}
+
+// stap_destroy_vma_map(): Unconditionally destroys vma entries.
+// Nothing should be using it anymore. Just frees all items, and waits
+// for those already released to actually be freed.
+static void
+stap_destroy_vma_map(void)
+{
+	stp_rcu_hash_destroy(&__stp_tf_vma_map,
+			     __stp_tf_vma_release_proc_node);
+
+	// A resize in progress notices the table is gone.
+	cancel_work_sync(&__stp_tf_vma_resize_work);
+
+	// Wait for the call_rcu() callbacks to have run.
+	rcu_barrier();
 }
 
 
@@ -173,50 +308,107 @@ stap_add_vma_map_info(struct task_struct *tsk,
 		      unsigned long vm_start, unsigned long vm_end,
 		      const char *path, void *user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct __stp_tf_vma_proc *proc, *new_proc = NULL;
+	struct __stp_tf_vma_array *maps = NULL, *new_maps;
 	struct __stp_tf_vma_entry *entry;
-	struct __stp_tf_vma_entry *new_entry;
 	unsigned long flags;
+	unsigned int nr;
+	int i, gen;
 
-	// Take a write lock, since we are most likely going to write
-	// after reading. But reserve a new entry first outside the lock.
-	new_entry = __stp_tf_vma_new_entry();
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
+	// Reserve and fill in a new entry first outside the lock.
+	entry = __stp_tf_vma_new_entry();
 	if (entry != NULL) {
-		stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-		if (new_entry)
-			__stp_tf_vma_release_entry(new_entry);
-		return -EBUSY;	/* Already there */
+		entry->vm_start = vm_start;
+		entry->vm_end = vm_end;
+		if (strlen(path) >= TASK_FINDER_VMA_ENTRY_PATHLEN-3)
+		  {
+		    strncpy (entry->path, "...", TASK_FINDER_VMA_ENTRY_PATHLEN);
+		    strlcpy (entry->path+3, &path[strlen(path)-TASK_FINDER_VMA_ENTRY_PATHLEN+4],
+			     TASK_FINDER_VMA_ENTRY_PATHLEN-3);
+		  }
+		else
+		  {
+		    strlcpy (entry->path, path, TASK_FINDER_VMA_ENTRY_PATHLEN);
+		  }
+		entry->user = user;
 	}
 
-	if (!new_entry) {
-		stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-		return -ENOMEM;
+retry:
+	// Copy the entries, inserting the new one after entries[i].
+	gen = __stp_tf_vma_snapshot_gen();
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	nr = 0;
+	i = -1;
+	if (proc != NULL) {
+		maps = rcu_dereference(proc->maps);
+		nr = maps->nr;
+		i = __stp_tf_vma_array_find(maps, vm_start);
+		if (i >= 0 && maps->entries[i]->vm_start == vm_start) {
+			rcu_read_unlock();
+			if (entry)
+				__stp_tf_vma_release_entry(entry);
+			if (new_proc)
+				_stp_kfree(new_proc);
+			return -EBUSY;	/* Already there */
+		}
+	}
+	new_maps = entry ? __stp_tf_vma_new_array(nr + 1) : NULL;
+	if (new_maps != NULL) {
+		if (proc != NULL) {
+			memcpy(&new_maps->entries[0], &maps->entries[0],
+			       (i + 1) * sizeof(maps->entries[0]));
+			memcpy(&new_maps->entries[i + 2], &maps->entries[i + 1],
+			       (nr - i - 1) * sizeof(maps->entries[0]));
+		}
+		new_maps->entries[i + 1] = entry;
+	}
+	rcu_read_unlock();
+	if (new_maps == NULL)
+		goto enomem;
+
+	if (proc == NULL && new_proc == NULL) {
+		new_proc = _stp_kzalloc_gfp(sizeof(struct __stp_tf_vma_proc),
+					    STP_ALLOC_FLAGS);
+		if (new_proc == NULL) {
+			_stp_kfree(new_maps);
+			goto enomem;
+		}
+		new_proc->pid = tsk->pid;
 	}
 
-	// Fill in the info
-	entry = new_entry;
-	entry->pid = tsk->pid;
-	entry->vm_start = vm_start;
-	entry->vm_end = vm_end;
-        if (strlen(path) >= TASK_FINDER_VMA_ENTRY_PATHLEN-3)
-          {
-            strncpy (entry->path, "...", TASK_FINDER_VMA_ENTRY_PATHLEN);
-            strlcpy (entry->path+3, &path[strlen(path)-TASK_FINDER_VMA_ENTRY_PATHLEN+4],
-                     TASK_FINDER_VMA_ENTRY_PATHLEN-3);
-          }
-        else
-          {
-            strlcpy (entry->path, path, TASK_FINDER_VMA_ENTRY_PATHLEN);
-          }
-	entry->user = user;
-
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_add_head(&entry->hlist, head);
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	if (stp_rcu_hash_table_locked(&__stp_tf_vma_map) == NULL) {
+		stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		_stp_kfree(new_maps);
+		goto enomem;
+	}
+	if (atomic_read(&__stp_tf_vma_gen) != gen) {
+		stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		_stp_kfree(new_maps);
+		goto retry;
+	}
+	if (proc != NULL) {
+		__stp_tf_vma_replace_maps(proc, new_maps);
+	}
+	else {
+		RCU_INIT_POINTER(new_proc->maps, new_maps);
+		if (stp_rcu_hash_add(&__stp_tf_vma_map, &new_proc->hnode))
+			schedule_work(&__stp_tf_vma_resize_work);
+		atomic_inc(&__stp_tf_vma_gen);
+		new_proc = NULL;
+	}
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	if (new_proc)
+		_stp_kfree(new_proc);
 	return 0;
+
+enomem:
+	if (entry)
+		__stp_tf_vma_release_entry(entry);
+	if (new_proc)
+		_stp_kfree(new_proc);
+	return -ENOMEM;
 }
 
 // Extend the vma info vm_end in the vma map hash table if there is already
@@ -227,22 +419,28 @@ static int
 stap_extend_vma_map_info(struct task_struct *tsk,
 			 unsigned long vm_start, unsigned long vm_end)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
-
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *maps;
 	unsigned long flags;
+	unsigned int i;
 	int res = -ESRCH; // Entry not there or doesn't match.
 
-	// Take a write lock, since we are most likely going to write
-	// to the entry after reading, if its vm_end matches our vm_start.
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_end_internal(tsk, vm_start);
-	if (entry != NULL) {
-		entry->vm_end = vm_end;
-		res = 0;
+	// Extending an entry doesn't change its place in the array, so
+	// it can be done in place.
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL) {
+		maps = __stp_tf_vma_maps_locked(proc);
+		for (i = 0; i < maps->nr; i++) {
+			if (maps->entries[i]->vm_end == vm_start) {
+				maps->entries[i]->vm_end = vm_end;
+				atomic_inc(&__stp_tf_vma_gen);
+				res = 0;
+				break;
+			}
+		}
 	}
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return res;
 }
 
@@ -252,53 +450,87 @@ stap_extend_vma_map_info(struct task_struct *tsk,
 static int
 stap_remove_vma_map_info(struct task_struct *tsk, unsigned long vm_start)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *maps, *new_maps;
 	struct __stp_tf_vma_entry *entry;
-	int rc = -ESRCH;
-
-	// Take a write lock since we are most likely going to delete
-	// after reading.
 	unsigned long flags;
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
-	if (entry != NULL) {
-		hlist_del(&entry->hlist);
-		__stp_tf_vma_release_entry(entry);
-                rc = 0;
+	int i, gen;
+
+retry:
+	// Copy the remaining entries, unless that was the last one.
+	gen = __stp_tf_vma_snapshot_gen();
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc == NULL) {
+		rcu_read_unlock();
+		return -ESRCH;
 	}
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-	return rc;
+	maps = rcu_dereference(proc->maps);
+	i = __stp_tf_vma_array_find(maps, vm_start);
+	if (i < 0 || maps->entries[i]->vm_start != vm_start) {
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	entry = maps->entries[i];
+	new_maps = NULL;
+	if (maps->nr > 1) {
+		new_maps = __stp_tf_vma_new_array(maps->nr - 1);
+		if (new_maps == NULL) {
+			rcu_read_unlock();
+			return -ENOMEM;
+		}
+		memcpy(&new_maps->entries[0], &maps->entries[0],
+		       i * sizeof(maps->entries[0]));
+		memcpy(&new_maps->entries[i], &maps->entries[i + 1],
+		       (maps->nr - i - 1) * sizeof(maps->entries[0]));
+	}
+	rcu_read_unlock();
+
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	if (stp_rcu_hash_table_locked(&__stp_tf_vma_map) == NULL) {
+		stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		if (new_maps)
+			_stp_kfree(new_maps);
+		return -ESRCH;
+	}
+	if (atomic_read(&__stp_tf_vma_gen) != gen) {
+		stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		if (new_maps)
+			_stp_kfree(new_maps);
+		goto retry;
+	}
+	if (new_maps == NULL) {
+		// That was the last one, the process goes too.
+		__stp_tf_vma_remove_proc(proc);
+	}
+	else {
+		__stp_tf_vma_replace_maps(proc, new_maps);
+		call_rcu(&entry->rcu, __stp_tf_vma_release_entry_rcu);
+	}
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	return 0;
 }
 
 // Finds vma info if the vma is present in the vma map hash table for
 // a given task and address (between vm_start and vm_end).
-// Returns -ESRCH if not present.  The __stp_tf_vma_lock must *not* be
-// locked before calling this function.
+// Returns -ESRCH if not present.
 static int
 stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 		       unsigned long *vm_start, unsigned long *vm_end,
 		       const char **path, void **user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *maps;
 	struct __stp_tf_vma_entry *found_entry = NULL;
-	int rc = -ESRCH;
-	unsigned long flags;
-
-	if (__stp_tf_vma_map == NULL)
-		return rc;
-
-	stp_read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && addr >= entry->vm_start
-		    && addr < entry->vm_end) {
-			found_entry = entry;
-			break;
-		}
+	int i, rc = -ESRCH;
+
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL) {
+		maps = rcu_dereference(proc->maps);
+		i = __stp_tf_vma_array_find(maps, addr);
+		if (i >= 0 && addr < maps->entries[i]->vm_end)
+			found_entry = maps->entries[i];
 	}
 	if (found_entry != NULL) {
 		if (vm_start != NULL)
@@ -311,36 +543,33 @@ stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 			*user = found_entry->user;
 		rc = 0;
 	}
-	stp_read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock();
 	return rc;
 }
 
 // Finds vma info if the vma is present in the vma map hash table for
 // a given task with the given user handle.
-// Returns -ESRCH if not present.  The __stp_tf_vma_lock must *not* be
-// locked before calling this function.
+// Returns -ESRCH if not present.
 static int
 stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			    unsigned long *vm_start, unsigned long *vm_end,
 			    const char **path)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *maps;
 	struct __stp_tf_vma_entry *found_entry = NULL;
+	unsigned int i;
 	int rc = -ESRCH;
-	unsigned long flags;
 
-	if (__stp_tf_vma_map == NULL)
-		return rc;
-
-	stp_read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && user == entry->user) {
-			found_entry = entry;
-			break;
+	rcu_read_lock();
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL) {
+		maps = rcu_dereference(proc->maps);
+		for (i = 0; i < maps->nr; i++) {
+			if (user == maps->entries[i]->user) {
+				found_entry = maps->entries[i];
+				break;
+			}
 		}
 	}
 	if (found_entry != NULL) {
@@ -352,28 +581,21 @@ stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			*path = found_entry->path;
 		rc = 0;
 	}
-	stp_read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock();
 	return rc;
 }
 
 static int
 stap_drop_vma_maps(struct task_struct *tsk)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct hlist_node *n;
-	struct __stp_tf_vma_entry *entry;
-
+	struct __stp_tf_vma_proc *proc;
 	unsigned long flags;
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-        stap_hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-            if (tsk->pid == entry->pid) {
-		    hlist_del(&entry->hlist);
-		    __stp_tf_vma_release_entry(entry);
-            }
-        }
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk->pid);
+	if (proc != NULL)
+		__stp_tf_vma_remove_proc(proc);
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return 0;
 }
 
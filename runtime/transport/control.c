@@ -96,6 +96,19 @@ static ssize_t _stp_ctl_write_cmd(struct file *file, const char __user *buf, siz
                 goto out;
 #endif
 
+	case STP_DEFER_PRINTF:
+#ifdef STP_DEFERRED_PRINTF
+		_stp_deferred_printf = 1;
+		/* A stapio attaching to a started module needs the
+		   formats again, and a point to start reading from.  */
+		if (_stp_deferred_printf_sync() != 0)
+			_stp_warn("couldn't send the deferred printf formats\n");
+                break;
+#else
+		rc = -EINVAL;
+                goto out;
+#endif
+
 	case STP_RELOCATION:
 		if (euid != 0) {
                         rc = -EPERM;
@@ -58,6 +58,20 @@ static atomic_t _stp_transport_state = ATOMIC_INIT(_STP_TS_UNINITIALIZED);
 #define STP_TRANSPORT_VERSION 2
 #endif
 
+// Deferred printf needs stapio to read all output as a single stream
+// of whole frames, and the compiled printfs to write them.
+#if defined(STP_DEFERRED_PRINTF) \
+    && (STP_TRANSPORT_VERSION != 2 || defined(STP_BULKMODE) \
+	|| defined(STP_LEGACY_PRINT))
+#undef STP_DEFERRED_PRINTF
+#endif
+
+#ifdef STP_DEFERRED_PRINTF
+/* Set once stapio has offered to format our printfs. */
+static int _stp_deferred_printf = 0;
+static int _stp_deferred_printf_sync(void);
+#endif
+
 #include "control.h"
 #if STP_TRANSPORT_VERSION == 1
 #include "relayfs.c"
@@ -381,6 +395,7 @@ static void _stp_transport_close(void)
 	_stp_unregister_ctl_channel();
 	_stp_transport_fs_close();
 	_stp_print_cleanup();	/* free print buffers */
+	_stp_sym_cache_free();
 	_stp_mem_debug_done();
 
 	dbug_trans(1, "---- CLOSED ----\n");
@@ -469,9 +484,13 @@ static int _stp_transport_init(void)
 	if (_stp_print_init() < 0)
 		goto err2;
 
+	/* create symbol lookup caches */
+	if (_stp_sym_cache_init() < 0)
+		goto err3;
+
 	/* set _stp_module_self dynamic info */
 	if (_stp_module_update_self() < 0)
-		goto err3;
+		goto err4;
 
 	/* start transport */
 	_stp_transport_data_fs_start();
@@ -487,6 +506,8 @@ static int _stp_transport_init(void)
 	dbug_trans(1, "returning 0...\n");
 	return 0;
 
+err4:
+	_stp_sym_cache_free();
 err3:
 	_stp_print_cleanup();
 err2:
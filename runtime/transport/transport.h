@@ -9,7 +9,9 @@
 
 /* The size of print buffers. This limits the maximum */
 /* amount of data a print can send. */
+#ifndef STP_BUFFER_SIZE
 #define STP_BUFFER_SIZE 8192
+#endif
 
 /* STP_CTL_BUFFER_SIZE is the maximum size of a message */
 /* exchanged on the control channel. */
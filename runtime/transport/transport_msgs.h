@@ -24,6 +24,99 @@ struct _stp_trace {
 	uint32_t pdu_len;	/* length of data after this trace */
 };
 
+/* With STP_DEFERRED_PRINTF, the data stream is a series of frames.
+   STP_FRAME_FORMAT frames describe printf format number 'id' as a
+   struct _stp_deferred_format; STP_FRAME_PRINTF frames are the
+   arguments of one call of that printf, which stapio formats; and
+   STP_FRAME_TEXT frames are everything else, as is.  Each time a
+   stapio offers to format printfs of a started module, and when the
+   module starts, it sends an STP_FRAME_SYNC frame holding a struct
+   _stp_deferred_sync, followed by all its formats.  A stapio that
+   attaches later may find the stream starting in the middle of a
+   frame, so it skips everything up to the sync.  */
+struct _stp_frame {
+	uint32_t len;		/* length of data after this frame header */
+	uint16_t type;		/* STP_FRAME_* */
+	uint16_t id;		/* format number, if not text */
+};
+
+#define STP_FRAME_TEXT		0
+#define STP_FRAME_FORMAT	1
+#define STP_FRAME_PRINTF	2
+#define STP_FRAME_SYNC		3
+
+#define STP_DEFERRED_SYNC_MAGIC	"STPDEFERREDSYNC"
+
+struct _stp_deferred_sync {
+	char magic[16];		/* STP_DEFERRED_SYNC_MAGIC */
+};
+
+/* A printf format, made of 'nspecs' of the following.  The arguments
+   of a STP_FRAME_PRINTF follow the same order: for each spec other
+   than a literal, an int64_t each for a dynamic width and precision,
+   then an int64_t value, or for strings a uint32_t length and as many
+   bytes (with no '\0').  */
+struct _stp_deferred_format {
+	uint32_t bufsize;	/* the module's STP_BUFFER_SIZE */
+	uint32_t nspecs;
+};
+
+#define STP_DEFERRED_DYNAMIC_WIDTH	1
+#define STP_DEFERRED_DYNAMIC_PRECISION	2
+
+struct _stp_deferred_spec {
+	uint8_t type;		/* 0 for a literal, or 'd', 'c', 's', 'b' */
+	uint8_t base;		/* numbers only */
+	uint8_t flags;		/* STP_ZEROPAD etc., see vsprintf.h */
+	uint8_t dynamic;	/* STP_DEFERRED_DYNAMIC_* */
+	int32_t width;		/* -1 if none */
+	int32_t precision;	/* -1 if none */
+	uint32_t literal_len;	/* bytes of text following a literal */
+};
+
+/* In --monitor mode, stapio maps /proc/systemtap/MODULE/monitor_stats
+   read-only, and finds a struct _stp_monitor_stats at its start.  The
+   module refreshes it every STP_MONITOR_STATS_INTERVAL while the file
+   is open, making 'seq' odd while it does, so a reader should copy
+   what it needs and try again if 'seq' was odd or has changed.  The
+   names are offsets of '\0'-terminated strings from the start.  */
+#define STP_MONITOR_STATS_MAGIC		0x4d505453 /* "STPM" */
+#define STP_MONITOR_STATS_VERSION	1
+
+struct _stp_monitor_stats {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t size;		/* of the whole mapping */
+	uint32_t probe_count;
+	uint32_t probe_offset;	/* of the struct _stp_monitor_probe array */
+	uint32_t global_count;
+	uint32_t global_offset;	/* of the struct _stp_monitor_global array */
+	uint64_t uptime_ms;
+	uint32_t error_count;
+	uint32_t skipped_count;
+	uint32_t skipped_lowstack;
+	uint32_t skipped_reentrant;
+};
+
+struct _stp_monitor_probe {
+	uint64_t hits;
+	int64_t min;		/* cycles */
+	int64_t avg;
+	int64_t max;
+	uint32_t index;		/* in stap_probes[], as for monitor_control */
+	uint32_t name;
+	uint32_t enabled;
+	uint32_t sampling;	/* hits for each that runs, see overload.h */
+};
+
+struct _stp_monitor_global {
+	uint32_t name;
+	uint32_t contention;	/* times its lock was contended */
+	uint32_t skipped;	/* probes skipped waiting for its lock */
+	uint32_t pad;
+};
+
 /* stp control channel command values */
 enum
 {
@@ -87,7 +180,13 @@ enum
 	STP_MAX_CMD,
   /** Sent by stapio after having recevied STP_TRANSPORT. Notifies
       the module of the target namespaces pid.*/
-  STP_NAMESPACES_PID
+  STP_NAMESPACES_PID,
+	/** Sent by stapio after having received STP_TRANSPORT, to offer
+	    to format printf output itself.  The module accepts by
+	    returning success only if it was compiled with
+	    STP_DEFERRED_PRINTF, after which its output is framed (see
+	    struct _stp_frame).  */
+	STP_DEFER_PRINTF
 };
 
 #ifdef DEBUG_TRANS
@@ -110,6 +209,7 @@ static const char *_stp_command_name[] = {
 	"STP_PRIVILEGE_CREDENTIALS",
 	"STP_REMOTE_ID",
   "STP_NAMESPACES_PID",
+	"STP_DEFER_PRINTF",
 };
 #endif /* DEBUG_TRANS */
 
@@ -283,7 +283,7 @@ static int _stp_vma_init(void)
 /* Get rid of the vma tracker (memory). */
 static void _stp_vma_done(void)
 {
-#if defined(CONFIG_UTRACE)
+#ifdef HAVE_TASK_FINDER
 	stap_destroy_vma_map();
 #endif
 }
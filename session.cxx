@@ -103,6 +103,10 @@ systemtap_session::systemtap_session ():
   target_namespaces_pid(0),
   last_token (0)
 {
+  // Clones share the tree, so only the primary session owns the arena.
+  if (!arena_allocated::current_arena())
+    arena_allocated::current_arena() = &ast_arena;
+
   struct utsname buf;
   (void) uname (& buf);
   kernel_release = string (buf.release);
@@ -175,6 +179,7 @@ systemtap_session::systemtap_session ():
   sysroot = "";
   update_release_sysroot = false;
   suppress_time_limits = false;
+  dwarf_cache_limit = 0;
   target_namespaces_pid = 0;
   color_mode = color_auto;
   color_errors = isatty(STDERR_FILENO) // conditions for coloring when
@@ -362,6 +367,7 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   update_release_sysroot = other.update_release_sysroot;
   sysenv = other.sysenv;
   suppress_time_limits = other.suppress_time_limits;
+  dwarf_cache_limit = other.dwarf_cache_limit;
   color_errors = other.color_errors;
   color_mode = other.color_mode;
   interactive_mode = other.interactive_mode;
@@ -412,6 +418,10 @@ systemtap_session::~systemtap_session ()
   remove_tmp_dir();
   delete_map(subsessions);
   delete pattern_root;
+
+  // The tree itself goes when ast_arena is destroyed, last of all.
+  if (arena_allocated::current_arena() == &ast_arena)
+    arena_allocated::current_arena() = NULL;
 }
 
 const string
@@ -645,6 +655,8 @@ systemtap_session::usage (int exitcode)
 #endif /* HAVE_DYNINST */
     "   --prologue-searching[=WHEN]\n"
     "              prologue-searching for function probes\n"
+    "   --dwarf-cache-limit=MB\n"
+    "              evict per-CU debuginfo caches beyond MB megabytes\n"
     "   --privilege=PRIVILEGE_LEVEL\n"
     "              check the script for constructs not allowed at the given privilege level\n"
     "   --unprivileged\n"
@@ -1590,6 +1602,16 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
           }
           break;
 
+        case LONG_OPT_DWARF_CACHE_LIMIT:
+          assert(optarg);
+          dwarf_cache_limit = strtoul(optarg, &num_endptr, 10);
+          if (*optarg == '\0' || *num_endptr != '\0')
+            {
+              cerr << _F("Invalid argument '%s' for --dwarf-cache-limit.", optarg) << endl;
+              return 1;
+            }
+          break;
+
         case LONG_OPT_SAVE_UPROBES:
           save_uprobes = true;
           break;
@@ -32,6 +32,7 @@ extern "C" {
 #include "privilege.h"
 #include "util.h"
 #include "stringtable.h"
+#include "arena.h"
 
 /* statistical operations used with a global */
 #define STAT_OP_NONE      1 << 0
@@ -134,6 +135,11 @@ private:
                      const std::string& kern);
 
 public:
+  // Backs the parse tree of the primary session and all its clones.
+  // Declared first, so it's destroyed last, after anything that might
+  // still refer to the tree.
+  bump_arena ast_arena;
+
   systemtap_session ();
   ~systemtap_session ();
 
@@ -257,6 +263,9 @@ public:
   enum { color_never, color_auto, color_always } color_mode;
   enum { prologue_searching_never, prologue_searching_auto, prologue_searching_always } prologue_searching_mode;
 
+  // Budget in MiB for dwflpp's per-CU caches, or 0 for no limit.
+  unsigned long dwarf_cache_limit;
+
   enum { kernel_runtime, dyninst_runtime, bpf_runtime } runtime_mode;
   bool runtime_usermode_p() const { return runtime_mode == dyninst_runtime; }
 
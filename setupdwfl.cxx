@@ -20,6 +20,7 @@
 #include <sstream>
 #include <set>
 #include <string>
+#include <system_error>
 
 extern "C" {
 #include <fnmatch.h>
@@ -530,6 +531,152 @@ setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
   return dwfl;
 }
 
+static int
+collect_prefetch_module (Dwfl_Module *mod,
+                         void **userdata __attribute__ ((unused)),
+                         const char *name __attribute__ ((unused)),
+                         Dwarf_Addr base __attribute__ ((unused)),
+                         void *arg)
+{
+  vector<Dwfl_Module*> *modules = (vector<Dwfl_Module*> *) arg;
+  modules->push_back(mod);
+  return DWARF_CB_OK;
+}
+
+debuginfo_prefetcher *
+debuginfo_prefetcher::start(systemtap_session &s, Dwfl *dwfl,
+                            const vector<string> &patterns)
+{
+  // A download through abrt may prompt the user, and a debuginfod
+  // client is set up lazily for the whole Dwfl, so neither may be
+  // started from our threads.
+  const char *urls = getenv("DEBUGINFOD_URLS");
+  if (s.download_dbinfo || (urls && *urls))
+    return NULL;
+
+  unsigned ncpus = thread::hardware_concurrency();
+  if (ncpus < 2)
+    return NULL;
+
+  vector<Dwfl_Module*> all, modules;
+  dwfl_getmodules (dwfl, &collect_prefetch_module, &all, 0);
+  for (unsigned i = 0; i < all.size(); ++i)
+    {
+      const char *name = dwfl_module_info (all[i], NULL, NULL, NULL,
+                                           NULL, NULL, NULL, NULL);
+      // The kernel is always reported, but module("*") won't want it.
+      for (unsigned j = 0; name && j < patterns.size(); ++j)
+        if (strcmp (name, "kernel") == 0
+            ? patterns[j] == "kernel"
+            : fnmatch (patterns[j].c_str(), name, 0) == 0)
+          {
+            modules.push_back(all[i]);
+            break;
+          }
+    }
+  if (modules.size() < 2)
+    return NULL;
+
+  // Relocating one module may resolve symbols in any of the others, so
+  // first load everything that looks at, their build-ids, symbol tables
+  // and section layout.  Then the threads only ever read them.
+  for (unsigned i = 0; i < all.size(); ++i)
+    {
+      const unsigned char *bits;
+      GElf_Addr vaddr;
+      (void) dwfl_module_build_id (all[i], &bits, &vaddr);
+      (void) dwfl_module_getsymtab (all[i]);
+      (void) dwfl_module_relocations (all[i]);
+    }
+
+  debuginfo_prefetcher *p = new debuginfo_prefetcher (s, modules);
+  unsigned nthreads = min (ncpus, (unsigned) modules.size());
+  try
+    {
+      for (unsigned i = 0; i < nthreads; ++i)
+        p->threads.push_back(thread(&debuginfo_prefetcher::worker, p));
+    }
+  catch (const system_error &)
+    {
+      // Make do with the threads we have.
+    }
+  if (p->threads.empty())
+    {
+      delete p;
+      return NULL;
+    }
+
+  if (s.verbose > 2)
+    clog << _F("Pass 2: prefetching debuginfo for %zu modules on %zu threads",
+               modules.size(), p->threads.size()) << endl;
+  return p;
+}
+
+debuginfo_prefetcher::debuginfo_prefetcher(systemtap_session &s,
+                                           const vector<Dwfl_Module*> &modules):
+  sess(s), modules(modules), states(modules.size(), pending), next(0),
+  stopping(false), prefetched(0), waited(0)
+{
+  for (unsigned i = 0; i < modules.size(); ++i)
+    indexes[modules[i]] = i;
+}
+
+debuginfo_prefetcher::~debuginfo_prefetcher()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  for (unsigned i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  if (sess.verbose > 2)
+    clog << _F("Pass 2: prefetched debuginfo for %u of %zu modules, "
+               "waited for %u", prefetched, modules.size(), waited) << endl;
+}
+
+void
+debuginfo_prefetcher::worker()
+{
+  unique_lock<mutex> guard(lock);
+  while (!stopping && !pending_interrupts && next < modules.size())
+    {
+      unsigned i = next++;
+      if (states[i] != pending)
+        continue;
+      states[i] = loading;
+      guard.unlock();
+
+      // This opens the debuginfo, decompresses any .zdebug or
+      // SHF_COMPRESSED sections, and applies the ET_REL relocations.
+      Dwarf_Addr bias;
+      (void) dwfl_module_getdwarf (modules[i], &bias);
+
+      guard.lock();
+      states[i] = done;
+      ++prefetched;
+      loaded.notify_all();
+    }
+}
+
+void
+debuginfo_prefetcher::wait(Dwfl_Module *mod)
+{
+  auto it = indexes.find(mod);
+  if (it == indexes.end())
+    return;
+
+  unique_lock<mutex> guard(lock);
+  state &st = states[it->second];
+  if (st == pending)
+    st = done; // the caller will load it itself
+  else if (st == loading)
+    {
+      ++waited;
+      loaded.wait(guard, [&st] { return st == done; });
+    }
+}
+
 bool
 is_user_module(const std::string &m)
 {
@@ -16,8 +16,12 @@
 #include "config.h"
 #include "session.h"
 
+#include <condition_variable>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 extern "C" {
@@ -38,6 +42,43 @@ Dwfl *setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
 		        const std::vector<std::string>::const_iterator &end,
 		        bool all_needed, systemtap_session &s);
 
+// Loads the debuginfo of a Dwfl's modules matching one of PATTERNS on a
+// pool of threads, in the order that dwfl_getmodules visits them, so
+// that opening, decompressing and relocating the next modules overlaps
+// with the queries of the current one.
+class debuginfo_prefetcher
+{
+public:
+  // Returns NULL if there's nothing worth prefetching.
+  static debuginfo_prefetcher *start(systemtap_session &s, Dwfl *dwfl,
+                                     const std::vector<std::string> &patterns);
+  ~debuginfo_prefetcher();
+
+  // Any call on MOD may race with its prefetch, so this must come first.
+  // If no thread has started on MOD yet, it's left for the caller.
+  void wait(Dwfl_Module *mod);
+
+private:
+  debuginfo_prefetcher(systemtap_session &s,
+                       const std::vector<Dwfl_Module*> &modules);
+  void worker();
+
+  enum state { pending, loading, done };
+
+  systemtap_session &sess;
+  std::vector<Dwfl_Module*> modules;
+  std::unordered_map<Dwfl_Module*, unsigned> indexes;
+  std::vector<state> states;
+  unsigned next;
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable loaded;
+  std::vector<std::thread> threads;
+
+  unsigned prefetched;
+  unsigned waited;
+};
+
 // user-space files must be full paths and not end in .ko
 bool is_user_module(const std::string &m);
 
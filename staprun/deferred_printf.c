@@ -0,0 +1,614 @@
+/* -*- linux-c -*-
+ *
+ * deferred_printf.c - format printfs deferred by the module
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2017 Red Hat Inc.
+ */
+
+#include "staprun.h"
+
+/* A module compiled with STP_DEFERRED_PRINTF logs the arguments of
+ * its printfs, and frames all of its output, once we offer to format
+ * them here.  The formatting follows runtime/vsprintf.c, which is what
+ * the module would have done itself.  Deferred printf is only used
+ * with a single output stream, so there's just one reader here.
+ *
+ * The module sends a sync frame and all its formats when it starts,
+ * and again whenever a stapio attaches to it.  Having attached to a
+ * module that has been running, we may come in halfway through a
+ * frame, so everything up to the first sync frame is skipped.  */
+
+int deferred_printf = 0;
+
+/* Sanity limit on the length of a frame, to catch a garbled stream. */
+#define MAX_FRAME_LEN (16 * 1024 * 1024)
+
+/* These match enum print_flag in runtime/vsprintf.h. */
+#define STP_ZEROPAD	1
+#define STP_SIGN	2
+#define STP_PLUS	4
+#define STP_SPACE	8
+#define STP_LEFT	16
+#define STP_SPECIAL	32
+#define STP_LARGE	64
+
+struct deferred_format {
+	uint32_t bufsize;
+	uint32_t nspecs;
+	struct _stp_deferred_spec *specs;
+	char **literals;
+};
+
+static struct deferred_format *formats[UINT16_MAX + 1];
+
+/* Incoming bytes not yet making a whole frame. */
+static char *pending = NULL;
+static size_t pending_len = 0, pending_size = 0;
+
+/* Whether we have seen a sync frame, and so are at a frame boundary. */
+static int synced = 0;
+
+/* Outgoing text, and a scratch buffer for formatting one record. */
+static char *text = NULL;
+static size_t text_len = 0, text_size = 0;
+static char *scratch = NULL;
+static size_t scratch_size = 0;
+
+static int reserve(char **buf, size_t *size, size_t needed)
+{
+	char *p;
+	size_t new_size = *size ? *size : 4096;
+
+	if (needed <= *size)
+		return 0;
+	while (new_size < needed)
+		new_size *= 2;
+	p = realloc(*buf, new_size);
+	if (p == NULL) {
+		_err("Memory allocation failed\n");
+		return -1;
+	}
+	*buf = p;
+	*size = new_size;
+	return 0;
+}
+
+static int append_text(const char *data, size_t len)
+{
+	if (reserve(&text, &text_size, text_len + len) < 0)
+		return -1;
+	memcpy(text + text_len, data, len);
+	text_len += len;
+	return 0;
+}
+
+static void free_format(struct deferred_format *f)
+{
+	uint32_t i;
+
+	if (f == NULL)
+		return;
+	if (f->literals)
+		for (i = 0; i < f->nspecs; i++)
+			free(f->literals[i]);
+	free(f->literals);
+	free(f->specs);
+	free(f);
+}
+
+static int add_format(uint16_t id, const char *data, uint32_t len)
+{
+	struct _stp_deferred_format df;
+	struct deferred_format *f;
+	const char *end = data + len;
+	uint32_t i;
+
+	if (len < sizeof(df))
+		goto bad;
+	memcpy(&df, data, sizeof(df));
+	data += sizeof(df);
+	if (df.nspecs > len / sizeof(struct _stp_deferred_spec))
+		goto bad;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		goto nomem;
+	f->bufsize = df.bufsize;
+	f->nspecs = df.nspecs;
+	f->specs = calloc(df.nspecs, sizeof(*f->specs));
+	f->literals = calloc(df.nspecs, sizeof(*f->literals));
+	if (f->specs == NULL || f->literals == NULL)
+		goto nomem_free;
+
+	for (i = 0; i < df.nspecs; i++) {
+		struct _stp_deferred_spec *s = &f->specs[i];
+
+		if ((size_t)(end - data) < sizeof(*s))
+			goto bad_free;
+		memcpy(s, data, sizeof(*s));
+		data += sizeof(*s);
+		if (s->literal_len > (size_t)(end - data))
+			goto bad_free;
+		f->literals[i] = malloc(s->literal_len + 1);
+		if (f->literals[i] == NULL)
+			goto nomem_free;
+		memcpy(f->literals[i], data, s->literal_len);
+		f->literals[i][s->literal_len] = '\0';
+		data += s->literal_len;
+	}
+
+	dbug(2, "deferred printf format %u: %u specs\n", id, f->nspecs);
+	free_format(formats[id]);
+	formats[id] = f;
+	return 0;
+
+bad_free:
+	free_format(f);
+bad:
+	_err("Invalid deferred printf format %u.\n", id);
+	return -1;
+
+nomem_free:
+	free_format(f);
+nomem:
+	_err("Memory allocation failed\n");
+	return -1;
+}
+
+static char *number(char *buf, char *end, uint64_t num, int base, int size,
+		    int precision, int type)
+{
+	char c, sign, tmp[66];
+	const char *digits;
+	static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	int i;
+
+	digits = (type & STP_LARGE) ? large_digits : small_digits;
+	if (type & STP_LEFT)
+		type &= ~STP_ZEROPAD;
+	if (base < 2 || base > 36)
+		return buf;
+	c = (type & STP_ZEROPAD) ? '0' : ' ';
+	sign = 0;
+	if (type & STP_SIGN) {
+		if ((int64_t) num < 0) {
+			sign = '-';
+			num = - (int64_t) num;
+			size--;
+		} else if (type & STP_PLUS) {
+			sign = '+';
+			size--;
+		} else if (type & STP_SPACE) {
+			sign = ' ';
+			size--;
+		}
+	}
+	if (type & STP_SPECIAL) {
+		if (base == 16)
+			size -= 2;
+		else if (base == 8)
+			size--;
+	}
+	i = 0;
+	if (num == 0)
+		tmp[i++] = '0';
+	else while (num != 0) {
+		tmp[i++] = digits[num % base];
+		num /= base;
+	}
+	if (i > precision)
+		precision = i;
+	size -= precision;
+	if (!(type & (STP_ZEROPAD + STP_LEFT))) {
+		while (size-- > 0) {
+			if (buf <= end)
+				*buf = ' ';
+			++buf;
+		}
+	}
+	if (sign) {
+		if (buf <= end)
+			*buf = sign;
+		++buf;
+	}
+	if (type & STP_SPECIAL) {
+		if (base == 8) {
+			if (buf <= end)
+				*buf = '0';
+			++buf;
+		} else if (base == 16) {
+			if (buf <= end)
+				*buf = '0';
+			++buf;
+			if (buf <= end)
+				*buf = digits[33];
+			++buf;
+		}
+	}
+	if (!(type & STP_LEFT)) {
+		while (size-- > 0) {
+			if (buf <= end)
+				*buf = c;
+			++buf;
+		}
+	}
+	while (i < precision--) {
+		if (buf <= end)
+			*buf = '0';
+		++buf;
+	}
+	while (i-- > 0) {
+		if (buf <= end)
+			*buf = tmp[i];
+		++buf;
+	}
+	while (size-- > 0) {
+		if (buf <= end)
+			*buf = ' ';
+		++buf;
+	}
+	return buf;
+}
+
+static char *format_char(char *str, char *end, char c, int width, int flags)
+{
+	char escape = 0;
+	int size = 1;
+
+	/* look for quoteworthy characters */
+	if ((flags & STP_SPECIAL) &&
+	    (!(isprint(c) && isascii(c)) || c == '\'' || c == '\\')) {
+		switch (c) {
+		case '\a': escape = 'a'; break;
+		case '\b': escape = 'b'; break;
+		case '\f': escape = 'f'; break;
+		case '\n': escape = 'n'; break;
+		case '\r': escape = 'r'; break;
+		case '\t': escape = 't'; break;
+		case '\v': escape = 'v'; break;
+		case '\'': escape = '\''; break;
+		case '\\': escape = '\\'; break;
+		}
+		size = escape ? 2 : 4;
+	}
+
+	if (!(flags & STP_LEFT)) {
+		while (width-- > size) {
+			if (str <= end)
+				*str = ' ';
+			++str;
+		}
+	}
+
+	if (size == 1) {
+		if (str <= end)
+			*str = c;
+		++str;
+	} else {
+		if (str <= end)
+			*str = '\\';
+		++str;
+		if (escape) {
+			if (str <= end)
+				*str = escape;
+			++str;
+		} else {
+			/* Fall back to octal for everything else */
+			if (str <= end)
+				*str = '0' + ((c >> 6) & 03);
+			++str;
+			if (str <= end)
+				*str = '0' + ((c >> 3) & 07);
+			++str;
+			if (str <= end)
+				*str = '0' + (c & 07);
+			++str;
+		}
+	}
+
+	while (width-- > size) {
+		if (str <= end)
+			*str = ' ';
+		++str;
+	}
+	return str;
+}
+
+static char *format_string(char *str, char *end, const char *ptr, int len,
+			   int width, int flags)
+{
+	int i;
+
+	if (!(flags & STP_LEFT))
+		while (len < width-- && str <= end)
+			*str++ = ' ';
+	for (i = 0; i < len && str <= end; ++i)
+		*str++ = *ptr++;
+	while (len < width-- && str <= end)
+		*str++ = ' ';
+	if (flags & STP_ZEROPAD && str <= end)
+		*str++ = '\0';
+	return str;
+}
+
+static int check_binary_precision(int precision)
+{
+	/* precision can be unspecified (-1) or one of 1, 2, 4 or 8.  */
+	switch (precision) {
+	case -1:
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		return precision;
+	default:
+		return -1;
+	}
+}
+
+static char *format_binary(char *str, char *end, int64_t num,
+			   int width, int precision, int flags)
+{
+	precision = check_binary_precision(precision);
+
+	/* Unspecified field width defaults to the specified
+	   precision and vice versa. If neither is specified,
+	   then both default to 8.  */
+	if (width == -1) {
+		if (precision == -1) {
+			width = 8;
+			precision = 8;
+		} else
+			width = precision;
+	} else if (precision == -1) {
+		precision = check_binary_precision(width);
+		if (precision == -1)
+			precision = 8;
+	}
+
+	if (!(flags & STP_LEFT))
+		while (precision < width-- && str <= end)
+			*str++ = '\0';
+
+	if ((str + precision - 1) <= end) {
+		int8_t n8 = num;
+		int16_t n16 = num;
+		int32_t n32 = num;
+
+		switch (precision) {
+		case 1:
+			memcpy(str, &n8, 1);
+			break;
+		case 2:
+			memcpy(str, &n16, 2);
+			break;
+		case 4:
+			memcpy(str, &n32, 4);
+			break;
+		default:
+			memcpy(str, &num, 8);
+			break;
+		}
+		str += precision;
+	}
+
+	while (precision >= 0 && width >= 0 && precision < width-- && str <= end)
+		*str++ = '\0';
+	return str;
+}
+
+static int clamp(int64_t value, int64_t max)
+{
+	return value < 0 ? 0 : value > max ? max : value;
+}
+
+static int take(const char **data, const char *end, void *value, size_t len)
+{
+	if ((size_t)(end - *data) < len)
+		return -1;
+	memcpy(value, *data, len);
+	*data += len;
+	return 0;
+}
+
+/* Format one record, much as the module's compiled printf would have,
+ * into the text.  */
+static int format_record(uint16_t id, const char *data, uint32_t len)
+{
+	struct deferred_format *f = formats[id];
+	const char *data_end = data + len;
+	char *str, *end;
+	uint32_t i;
+
+	if (f == NULL) {
+		_err("Deferred printf format %u is missing.\n", id);
+		return -1;
+	}
+	if (reserve(&scratch, &scratch_size, f->bufsize) < 0)
+		return -1;
+	str = scratch;
+	end = scratch + f->bufsize - 1;
+
+	for (i = 0; i < f->nspecs && str <= end; i++) {
+		const struct _stp_deferred_spec *s = &f->specs[i];
+		int width = s->width, precision = s->precision;
+		int64_t value = 0;
+		uint32_t slen = 0;
+		const char *sval = NULL;
+
+		if (s->type == 0) {
+			const char *src = f->literals[i];
+			while (*src && str <= end)
+				*str++ = *src++;
+			continue;
+		}
+
+		if (s->dynamic & STP_DEFERRED_DYNAMIC_WIDTH) {
+			if (take(&data, data_end, &value, sizeof(value)) < 0)
+				goto bad;
+			width = value;
+		}
+		if (s->dynamic & STP_DEFERRED_DYNAMIC_PRECISION) {
+			if (take(&data, data_end, &value, sizeof(value)) < 0)
+				goto bad;
+			precision = value;
+		}
+		if (s->type == 's') {
+			if (take(&data, data_end, &slen, sizeof(slen)) < 0
+			    || slen > (size_t)(data_end - data))
+				goto bad;
+			sval = data;
+			data += slen;
+		} else if (take(&data, data_end, &value, sizeof(value)) < 0)
+			goto bad;
+
+		if (width != -1 || (s->dynamic & STP_DEFERRED_DYNAMIC_WIDTH))
+			width = clamp(width, end - str + 1);
+		if (precision != -1 || (s->dynamic & STP_DEFERRED_DYNAMIC_PRECISION))
+			precision = clamp(precision, end - str + 1);
+
+		switch (s->type) {
+		case 'd':
+			str = number(str, end, value, s->base, width,
+				     precision, s->flags);
+			break;
+		case 'c':
+			str = format_char(str, end, value, width, s->flags);
+			break;
+		case 's':
+			str = format_string(str, end, sval, slen, width,
+					    s->flags);
+			break;
+		case 'b':
+			str = format_binary(str, end, value, width, precision,
+					    s->flags);
+			break;
+		default:
+			goto bad;
+		}
+	}
+
+	if (str > end + 1)
+		str = end + 1;
+	return append_text(scratch, str - scratch);
+
+bad:
+	_err("Invalid deferred printf record for format %u.\n", id);
+	return -1;
+}
+
+/* Find the first sync frame in the pending bytes, dropping those
+ * before it.  Returns 1 if found.  Otherwise returns 0, keeping only
+ * what may be the start of one.  */
+static int find_sync(void)
+{
+	struct _stp_deferred_sync sync = { STP_DEFERRED_SYNC_MAGIC };
+	struct _stp_frame f = { sizeof(sync), STP_FRAME_SYNC, 0 };
+	char marker[sizeof(f) + sizeof(sync)];
+	size_t pos;
+	int found = 0;
+
+	memcpy(marker, &f, sizeof(f));
+	memcpy(marker + sizeof(f), &sync, sizeof(sync));
+	for (pos = 0; pos + sizeof(marker) <= pending_len; pos++)
+		if (memcmp(pending + pos, marker, sizeof(marker)) == 0) {
+			found = 1;
+			break;
+		}
+
+	if (pos > 0)
+		dbug(1, "skipping %zu bytes of output before the sync\n", pos);
+	pending_len -= pos;
+	memmove(pending, pending + pos, pending_len);
+	return found;
+}
+
+/**
+ *	deferred_printf_render - format the frames read from the module
+ *	@data: the bytes read
+ *	@len: how many
+ *	@out: set to the resulting text
+ *
+ *	Frames may be split across reads, so the tail of a read is kept
+ *	for the next one.  Until the first sync frame, the bytes are
+ *	skipped.  Returns the length of the text, or -1 if the stream is
+ *	garbled.
+ */
+ssize_t deferred_printf_render(const char *data, size_t len, char **out)
+{
+	struct _stp_frame f;
+	size_t pos = 0;
+
+	if (reserve(&pending, &pending_size, pending_len + len) < 0)
+		return -1;
+	memcpy(pending + pending_len, data, len);
+	pending_len += len;
+	text_len = 0;
+
+	if (!synced && !(synced = find_sync())) {
+		*out = text;
+		return 0;
+	}
+
+	while (pending_len - pos >= sizeof(f)) {
+		const char *payload;
+
+		memcpy(&f, pending + pos, sizeof(f));
+		if (f.len > MAX_FRAME_LEN) {
+			_err("Invalid output frame of %u bytes.\n", f.len);
+			return -1;
+		}
+		if (pending_len - pos - sizeof(f) < f.len)
+			break;
+		payload = pending + pos + sizeof(f);
+		pos += sizeof(f) + f.len;
+
+		switch (f.type) {
+		case STP_FRAME_TEXT:
+			if (append_text(payload, f.len) < 0)
+				return -1;
+			break;
+		case STP_FRAME_FORMAT:
+			if (add_format(f.id, payload, f.len) < 0)
+				return -1;
+			break;
+		case STP_FRAME_PRINTF:
+			if (format_record(f.id, payload, f.len) < 0)
+				return -1;
+			break;
+		case STP_FRAME_SYNC:
+			dbug(2, "deferred printf sync\n");
+			break;
+		default:
+			_err("Invalid output frame type %u.\n", f.type);
+			return -1;
+		}
+	}
+
+	pending_len -= pos;
+	memmove(pending, pending + pos, pending_len);
+	*out = text;
+	return text_len;
+}
+
+void deferred_printf_cleanup(void)
+{
+	unsigned i;
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		free_format(formats[i]);
+		formats[i] = NULL;
+	}
+	free(pending);
+	free(text);
+	free(scratch);
+	pending = text = scratch = NULL;
+	pending_len = pending_size = text_len = text_size = scratch_size = 0;
+	synced = 0;
+}
@@ -828,6 +828,12 @@ int stp_main_loop(void)
                       /* trim "ERROR: " */
                       err("%.*s", (int) nb-7, recvbuf.payload.data+7);
               error_detected = 1;
+      /* Likewise "INFO:", which the module uses for reports on its own
+       * workings that are only of interest in verbose mode. */
+      } else if (strncmp(recvbuf.payload.data, "INFO: ", 6) == 0) {
+              if (verbose)
+                      /* trim "INFO: " */
+                      eprintf("%.*s", (int) nb-6, recvbuf.payload.data+6);
       } else { /* neither warning nor error */
               if (monitor)
                       monitor_remember_output_line (recvbuf.payload.data, nb);
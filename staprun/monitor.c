@@ -163,6 +163,135 @@ static int comp_name(const void *p1, const void *p2)
   return strcmp(json_object_get_string(name1), json_object_get_string(name2));
 }
 
+/* The probe's state, with how few of its hits run if the overload
+   governor is sampling them.  */
+static const char *probe_state(json_object *probe)
+{
+  static char buf[64];
+  json_object *state, *sampling;
+  json_object_object_get_ex(probe, "state", &state);
+  if (!json_object_object_get_ex(probe, "sampling", &sampling)
+      || json_object_get_int(sampling) <= 1)
+    return json_object_get_string(state);
+  snprintf(buf, sizeof(buf), "%s 1/%d", json_object_get_string(state),
+           json_object_get_int(sampling));
+  return buf;
+}
+
+/* The module's binary stats, mapped read-only.  The file stays open,
+   as the module only refreshes them while it is.  */
+static int stats_fd = -1;
+static void *stats_map = NULL;
+static size_t stats_size = 0;
+static void *stats_copy = NULL;
+
+static void stats_unmap(void)
+{
+  if (stats_map)
+    munmap(stats_map, stats_size);
+  if (stats_fd >= 0)
+    close(stats_fd);
+  free(stats_copy);
+  stats_map = stats_copy = NULL;
+  stats_fd = -1;
+  stats_size = 0;
+}
+
+/* Map monitor_stats, if the module has one this stapio understands.  */
+static int stats_mmap(void)
+{
+  char path[PATH_MAX];
+  const struct _stp_monitor_stats *ms;
+  size_t page = getpagesize();
+
+  if (sprintf_chk(path, "/proc/systemtap/%s/monitor_stats", modname))
+    return -1;
+  stats_fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (stats_fd < 0)
+    return -1;
+
+  /* Map the header first to learn the size of the rest.  */
+  stats_map = mmap(NULL, page, PROT_READ, MAP_SHARED, stats_fd, 0);
+  if (stats_map == MAP_FAILED)
+    goto err;
+  ms = stats_map;
+  if (ms->magic != STP_MONITOR_STATS_MAGIC
+      || ms->version != STP_MONITOR_STATS_VERSION
+      || ms->size < sizeof(*ms))
+    {
+      munmap(stats_map, page);
+      stats_map = NULL;
+      goto err;
+    }
+  stats_size = ms->size;
+  munmap(stats_map, page);
+
+  stats_map = mmap(NULL, stats_size, PROT_READ, MAP_SHARED, stats_fd, 0);
+  if (stats_map == MAP_FAILED)
+    goto err;
+  stats_copy = malloc(stats_size);
+  if (stats_copy == NULL)
+    goto err;
+  return 0;
+
+err:
+  if (stats_map == MAP_FAILED)
+    stats_map = NULL;
+  stats_unmap();
+  return -1;
+}
+
+/* Take a consistent copy of the stats, retrying while the module is
+   refreshing them.  */
+static const struct _stp_monitor_stats *stats_snapshot(void)
+{
+  const volatile struct _stp_monitor_stats *ms = stats_map;
+  int tries;
+
+  for (tries = 0; tries < 100; tries++)
+    {
+      uint32_t seq = ms->seq;
+      if (seq & 1)
+        {
+          usleep(100);
+          continue;
+        }
+      __sync_synchronize();
+      memcpy(stats_copy, stats_map, stats_size);
+      __sync_synchronize();
+      if (ms->seq == seq)
+        return stats_copy;
+    }
+  return NULL;
+}
+
+/* The probe_list that monitor_status would have, from the stats.  */
+static json_object *stats_probe_list(const struct _stp_monitor_stats *ms)
+{
+  const struct _stp_monitor_probe *mp =
+    (const void *)((const char *)ms + ms->probe_offset);
+  json_object *list = json_object_new_array();
+  uint32_t i;
+
+  for (i = 0; i < ms->probe_count; i++)
+    {
+      json_object *probe = json_object_new_object();
+      json_object_object_add(probe, "index", json_object_new_int(mp[i].index));
+      json_object_object_add(probe, "state",
+                             json_object_new_string(mp[i].enabled ? "on" : "off"));
+      json_object_object_add(probe, "hits", json_object_new_int64(mp[i].hits));
+      json_object_object_add(probe, "min", json_object_new_int64(mp[i].min));
+      json_object_object_add(probe, "avg", json_object_new_int64(mp[i].avg));
+      json_object_object_add(probe, "max", json_object_new_int64(mp[i].max));
+      json_object_object_add(probe, "sampling",
+                             json_object_new_int(mp[i].sampling));
+      json_object_object_add(probe, "name",
+                             json_object_new_string((const char *)ms + mp[i].name));
+      json_object_array_add(list, probe);
+    }
+  return list;
+}
+
 static void write_command(const char *msg)
 {
   char path[PATH_MAX];
@@ -291,6 +420,7 @@ void monitor_setup(void)
 
 void monitor_cleanup(void)
 {
+  stats_unmap();
   pthread_mutex_destroy(&mutex);
   monitor_end = 1;
   endwin();
@@ -338,8 +468,24 @@ void monitor_render(void)
   char json[MAX_DATA];
   size_t bytes = 0;
 
+  static int stats_tried = 0;
+  const struct _stp_monitor_stats *ms = NULL;
+
+  /* Prefer the binary stats for the probes, which cost the module
+     nothing to read however many there are; monitor_globals then has
+     just the rest of monitor_status.  If the module kept refreshing
+     them, take the whole of monitor_status this time instead.  */
+  if (!stats_tried)
+    {
+      stats_tried = 1;
+      stats_mmap();
+    }
+  if (stats_map)
+    ms = stats_snapshot();
+
   /* Render monitor mode statistics */
-  if (sprintf_chk(path, "/proc/systemtap/%s/monitor_status", modname))
+  if (sprintf_chk(path, "/proc/systemtap/%s/%s", modname,
+                  ms ? "monitor_globals" : "monitor_status"))
     return;
   monitor_fp = fopen(path, "r");
   if (monitor_fp)
@@ -354,6 +500,8 @@ void monitor_render(void)
         json_object_put(jso);
       jso = json_tokener_parse(json);
     }
+  if (jso && ms)
+    json_object_object_add(jso, "probe_list", stats_probe_list(ms));
 
   wclear(status);
 
@@ -386,9 +534,14 @@ void monitor_render(void)
               json_object_get_string(jso_uid),
               json_object_get_string(jso_mem));
 
-      wprintw(status, "module_name: %s probes: %d \n",
-              json_object_get_string(jso_name),
-              num_probes);
+      if (ms)
+        wprintw(status, "module_name: %s probes: %d errors: %u skipped: %u \n",
+                json_object_get_string(jso_name),
+                num_probes, ms->error_count, ms->skipped_count);
+      else
+        wprintw(status, "module_name: %s probes: %d \n",
+                json_object_get_string(jso_name),
+                num_probes);
 
       col = 0;
       col += snprintf(monitor_out, max_cols, "globals: ");
@@ -429,8 +582,7 @@ void monitor_render(void)
 
           json_object_object_get_ex(probe, "index", &field);
           width[p_index] = MAX(width[p_index], strlen(json_object_get_string(field)));
-          json_object_object_get_ex(probe, "state", &field);
-          width[p_state] = MAX(width[p_state], strlen(json_object_get_string(field)));
+          width[p_state] = MAX(width[p_state], strlen(probe_state(probe)));
           json_object_object_get_ex(probe, "hits", &field);
           width[p_hits] = MAX(width[p_hits], strlen(json_object_get_string(field)));
           json_object_object_get_ex(probe, "min", &field);
@@ -467,8 +619,7 @@ void monitor_render(void)
           probe = json_object_array_get_idx(jso_probe_list, i);
           json_object_object_get_ex(probe, "index", &field);
           wprintw(status, "%*s\t", width[p_index], json_object_get_string(field));
-          json_object_object_get_ex(probe, "state", &field);
-          wprintw(status, "%*s\t", width[p_state], json_object_get_string(field));
+          wprintw(status, "%*s\t", width[p_state], probe_state(probe));
           json_object_object_get_ex(probe, "hits", &field);
           wprintw(status, "%*s\t", width[p_hits], json_object_get_string(field));
           json_object_object_get_ex(probe, "min", &field);
@@ -194,9 +194,18 @@ static void *reader_thread(void *data)
                         int wbytes = rc;
                         char *wbuf = buf;
 
+			/* Format what the module left for us to. */
+			if (deferred_printf) {
+				wbytes = deferred_printf_render(buf, rc, &wbuf);
+				if (wbytes < 0)
+					goto error_out;
+				if (wbytes == 0)
+					continue;
+			}
+
 			/* Switching file */
 			pthread_mutex_lock(&mutex[cpu]);
-			if ((fsize_max && ((wsize + rc) > fsize_max)) ||
+			if ((fsize_max && ((wsize + wbytes) > fsize_max)) ||
 			    switch_file[cpu]) {
 				if (switch_outfile(cpu, &fnum) < 0) {
 					switch_file[cpu] = 0;
@@ -313,6 +322,14 @@ int init_relayfs(void)
 	if (send_request(STP_BULK, rqbuf, sizeof(rqbuf)) == 0)
 		bulkmode = 1;
 
+	/* Offer to format the printfs of a module compiled with
+	   STP_DEFERRED_PRINTF.  Older modules just refuse.  This has to
+	   be settled before STP_START, even with load_only, since the
+	   module frames its output from then on.  */
+	if (!bulkmode && send_request(STP_DEFER_PRINTF, NULL, 0) == 0)
+		deferred_printf = 1;
+	dbug(2, "deferred_printf = %d\n", deferred_printf);
+
 	/* Try to open a slew of per-cpu trace%d files.  Per PR19241, we
 	   need to go through all potentially present CPUs up to NR_CPUS, that
 	   we hope is a reasonable limit.  For !bulknode, "trace0" will be
@@ -466,5 +483,6 @@ void close_relayfs(void)
 	for (i = 0; i < ncpus; i++) {
 		pthread_mutex_destroy(&mutex[avail_cpus[i]]);
 	}
+	deferred_printf_cleanup();
 	dbug(2, "done\n");
 }
@@ -229,6 +229,10 @@ int openat_cloexec(int dirfd, const char *pathname, int flags, mode_t mode);
 int pipe_cloexec(int pipefd[2]);
 void closefrom(int lowfd);
 
+/* deferred_printf.c functions */
+ssize_t deferred_printf_render(const char *data, size_t len, char **out);
+void deferred_printf_cleanup(void);
+
 /* monitor.c function */
 void monitor_winch(int signum);
 void monitor_setup(void);
@@ -291,6 +295,7 @@ extern int optind;
 
 /* relay*.c uses these */
 extern int out_fd[NR_CPUS];
+extern int deferred_printf;
 
 /* relay_old uses these. Set in ctl.c */
 extern unsigned subbuf_size;
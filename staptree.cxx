@@ -1289,6 +1289,12 @@ void foreach_loop::print (ostream& o) const
       limit->print (o);
     }
   o << ") ";
+  if (snapshot_of)
+    {
+      o << "/* swapped out of ";
+      snapshot_of->print (o);
+      o << " */ ";
+    }
   block->print (o);
 }
 
@@ -2510,7 +2516,7 @@ varuse_collecting_visitor::visit_functioncall (functioncall* e)
 
   // but function body shouldn't all be marked used
   current_lvalue_read = false;
-  functioncall_traversing_visitor::enter_functioncall(e);
+  enter_functioncall(e);
 
   current_lvalue_read = last_lvalue_read;
 }
@@ -26,6 +26,7 @@ extern "C" {
 
 #include "util.h"
 #include "stringtable.h"
+#include "arena.h"
 
 
 struct token; // parse.h
@@ -131,7 +132,7 @@ struct token;
 struct visitor;
 struct update_visitor;
 
-struct visitable
+struct visitable: public arena_allocated
 {
   virtual ~visitable ();
 };
@@ -610,8 +611,8 @@ struct hist_op: public indexable
 // ------------------------------------------------------------------------
 
 
-struct symboldecl // unique object per (possibly implicit)
-		  // symbol declaration
+struct symboldecl: public arena_allocated
+  // unique object per (possibly implicit) symbol declaration
 {
   const token* tok;
   const token* systemtap_v_conditional; //checking systemtap compatibility
@@ -748,6 +749,7 @@ struct foreach_loop: public statement
   enum stat_component_type sort_aggr; // for aggregate arrays, which aggregate to sort on
   symbol* value; // optional iteration value
   expression* limit; // optional iteration limit
+  symbol* snapshot_of; // optional live array that base is swapped out of
 
   statement* block;
   void print (std::ostream& o) const;
@@ -820,7 +822,7 @@ struct probe;
 struct derived_probe;
 struct probe_alias;
 struct embeddedcode;
-struct stapfile
+struct stapfile: public arena_allocated
 {
   std::string name;
   std::vector<probe*> probes;
@@ -837,9 +839,9 @@ struct stapfile
 };
 
 
-struct probe_point
+struct probe_point: public arena_allocated
 {
-  struct component // XXX: sort of a restricted functioncall
+  struct component: public arena_allocated // XXX: sort of a restricted functioncall
   {
     interned_string functor;
     literal* arg; // optional
@@ -865,7 +867,7 @@ struct probe_point
 std::ostream& operator << (std::ostream& o, const probe_point& k);
 
 
-struct probe
+struct probe: public arena_allocated
 {
   static unsigned last_probeidx;
 
@@ -1120,7 +1122,7 @@ struct functioncall_traversing_visitor: public traversing_visitor
   functiondecl* current_function;
   functioncall_traversing_visitor(): current_function(0) {}
   void visit_functioncall (functioncall* e);
-  void enter_functioncall (functioncall* e);
+  virtual void enter_functioncall (functioncall* e);
   virtual void note_recursive_functioncall (functioncall* e);
 };
 
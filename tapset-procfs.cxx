@@ -15,6 +15,7 @@
 
 #include <cstring>
 #include <string>
+#include <sstream>
 
 
 using namespace std;
@@ -200,6 +201,44 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline() << "#include \"procfs.c\"";
   s.op->newline() << "#include \"procfs-probes.c\"";
 
+  // The probes and globals that --monitor mode's binary stats cover.
+  if (s.monitor)
+    {
+      s.op->newline() << "#include \"monitor_stats.c\"";
+      s.op->newline() << "static const struct _stp_monitor_probe_info "
+                      << "_stp_monitor_probes[] = {";
+      s.op->indent(1);
+      for (unsigned i = 0; i < s.probes.size(); i++)
+        {
+          derived_probe* p = s.probes[i];
+          if (p->synthetic)
+            continue;
+          // Named as in monitor_status, by the first word of its location.
+          istringstream probe_point(p->sole_location()->str());
+          string name;
+          probe_point >> name;
+          s.op->newline() << "{ " << p->session_index << ", "
+                          << lex_cast_qstring (name) << " },";
+        }
+      s.op->newline() << "{ 0, NULL }";
+      s.op->newline(-1) << "};";
+
+      s.op->newline() << "static const struct _stp_monitor_global_info "
+                      << "_stp_monitor_globals[] = {";
+      s.op->indent(1);
+      for (unsigned i = 0; i < s.globals.size(); i++)
+        {
+          vardecl* v = s.globals[i];
+          if (v->synthetic)
+            continue;
+          string vn = s.up->c_globalname (v->name);
+          s.op->newline() << "{ " << lex_cast_qstring (v->unmangled_name)
+                          << ", global_lock_stats(" << vn << ") },";
+        }
+      s.op->newline() << "{ NULL, NULL }";
+      s.op->newline(-1) << "};";
+    }
+
   // Emit the procfs probe buffer structure
   s.op->newline() << "static struct stap_procfs_probe_buffer {";
   s.op->indent(1);
@@ -447,6 +486,20 @@ procfs_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline() << "break;";
   s.op->newline(-1) << "}";
   s.op->newline(-1) << "}"; // for loop
+
+  if (s.monitor)
+    {
+      s.op->newline() << "if (rc == 0) {";
+      s.op->newline(1) << "probe_point = \"monitor stats\";";
+      s.op->newline() << "rc = _stp_monitor_stats_init(_stp_monitor_probes, "
+                      << "_stp_monitor_globals);";
+      s.op->newline() << "if (rc) {";
+      s.op->newline(1) << "_stp_close_procfs();";
+      s.op->newline() << "for (i = 0; i < " << probes_by_path.size() << "; i++)";
+      s.op->newline(1) << "_spp_shutdown(&stap_procfs_probes[i]);";
+      s.op->newline(-2) << "}";
+      s.op->newline(-1) << "}";
+    }
 }
 
 
@@ -457,6 +510,8 @@ procfs_derived_probe_group::emit_module_exit (systemtap_session& s)
     return;
 
   s.op->newline() << "_stp_close_procfs();";
+  if (s.monitor)
+    s.op->newline() << "_stp_monitor_stats_exit();";
   s.op->newline() << "for (i = 0; i < " << probes_by_path.size() << "; i++) {";
   s.op->newline(1) << "struct stap_procfs_probe *spp = &stap_procfs_probes[i];";
   s.op->newline() << "_spp_shutdown(spp);";
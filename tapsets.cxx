@@ -21,6 +21,7 @@
 #include "dwarf_wrappers.h"
 #include "hash.h"
 #include "dwflpp.h"
+#include "btf.h"
 #include "setupdwfl.h"
 #include "loc2stap.h"
 #include <gelf.h>
@@ -56,6 +57,7 @@ extern "C" {
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <math.h>
 #include <regex.h>
 #include <unistd.h>
@@ -163,6 +165,16 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline(1) << "goto probe_epilogue;";
   s.op->indent(-1);
 
+  if (overload_processing && !s.runtime_usermode_p())
+    {
+      // An overloaded probe may only get to run for some of its hits.
+      s.op->newline() << "#ifdef STP_OVERLOAD_GOVERNOR";
+      s.op->newline() << "if (unlikely (_stp_overload_skip (" << probe
+                      << ", cycles_atstart)))";
+      s.op->newline(1) << "goto probe_epilogue;";
+      s.op->newline(-1) << "#endif";
+    }
+
   if (pre_context_callback)
     {
       s.op->newline() << "#if INTERRUPTIBLE";
@@ -191,6 +203,7 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#endif";
   if (s.runtime_usermode_p())
     s.op->newline() << "c->probe_index = " << probe << "->index;";
+  s.op->newline() << "c->probe = " << probe << ";";
   s.op->newline() << "c->probe_point = " << probe << "->pp;";
   s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
   s.op->newline() << "c->probe_name = " << probe << "->pn;";
@@ -285,15 +298,23 @@ common_probe_entryfn_epilogue (systemtap_session& s,
       s.op->newline(1) << "? (cycles_atend - c->cycles_base)";
       s.op->newline() << ": (STP_OVERLOAD_INTERVAL + 1);";
       s.op->newline(-1) << "c->cycles_sum += cycles_elapsed;";
+      s.op->newline() << "#ifdef STP_OVERLOAD_GOVERNOR";
+      s.op->newline() << "c->overload_cycles[c->probe->index] += cycles_elapsed;";
+      s.op->newline() << "#endif";
 
       // If we've spent more than STP_OVERLOAD_THRESHOLD cycles in a
       // probe during the last STP_OVERLOAD_INTERVAL cycles, the probe
-      // has overloaded the system and we need to quit.
+      // has overloaded the system and we need to quit, unless the
+      // governor can still sample the costliest probes less often.
       // NB: this is not suppressible via --suppress-runtime-errors,
       // because this is a system safety metric that we cannot trust
       // unprivileged users to override.
       s.op->newline() << "if (interval > STP_OVERLOAD_INTERVAL) {";
-      s.op->newline(1) << "if (c->cycles_sum > STP_OVERLOAD_THRESHOLD) {";
+      s.op->newline(1) << "#ifdef STP_OVERLOAD_GOVERNOR";
+      s.op->newline() << "if (_stp_overload_govern (c)) {";
+      s.op->newline() << "#else";
+      s.op->newline() << "if (c->cycles_sum > STP_OVERLOAD_THRESHOLD) {";
+      s.op->newline() << "#endif";
       s.op->newline(1) << "_stp_error (\"probe overhead exceeded threshold\");";
       s.op->newline() << "atomic_set (session_state(), STAP_SESSION_ERROR);";
       s.op->newline() << "atomic_inc (error_count());";
@@ -309,7 +330,8 @@ common_probe_entryfn_epilogue (systemtap_session& s,
   s.op->newline(-1) << "}";
   s.op->newline() << "#endif";
 
-  s.op->newline() << "c->probe_point = 0;"; // vacated
+  s.op->newline() << "c->probe = 0;"; // vacated
+  s.op->newline() << "c->probe_point = 0;";
   s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
   s.op->newline() << "c->probe_name = 0;";
   s.op->newline() << "#endif";
@@ -522,6 +544,28 @@ struct exp_type_dwarf : public exp_type_details
   functioncall *expand(autocast_op* e, bool lvalue);
 };
 
+struct dwarf_builder;
+struct exp_type_btf : public exp_type_details
+{
+  // NB: As with exp_type_dwarf, the dwarf_builder owns this btf_info,
+  // so don't use it after build_no_more.
+  dwarf_builder* db;
+  systemtap_session& sess;
+  btf_info* btf;
+  string module;
+  uint32_t type;
+  bool is_pointer;
+  exp_type_btf(dwarf_builder* db, systemtap_session& sess, btf_info* btf,
+               const string& module, uint32_t type, bool addressof);
+  uintptr_t id () const
+    {
+      const btf_type *t = btf->type(type);
+      return t ? reinterpret_cast<uintptr_t>(t) : reinterpret_cast<uintptr_t>(btf);
+    }
+  bool expandable() const { return true; }
+  functioncall *expand(autocast_op* e, bool lvalue);
+};
+
 
 enum
 function_spec_type
@@ -646,9 +690,17 @@ struct generic_kprobe_derived_probe_group: public derived_probe_group
 
 private:
   unordered_multimap<interned_string,generic_kprobe_derived_probe*> probes_by_module;
+  bool have_symbol_index;
+
+  // The stapkp_init/refresh() arguments for the symbol name index.
+  string symbol_index_args() const
+  {
+    return have_symbol_index
+      ? "stap_kprobe_symbols, ARRAY_SIZE(stap_kprobe_symbols)" : "NULL, 0";
+  }
 
 public:
-  generic_kprobe_derived_probe_group() {}
+  generic_kprobe_derived_probe_group(): have_symbol_index(false) {}
   void enroll (generic_kprobe_derived_probe* probe);
   void emit_module_decls (systemtap_session& s);
   void emit_module_init (systemtap_session& s);
@@ -976,6 +1028,7 @@ struct dwarf_builder: public derived_probe_builder
 {
   map <string,dwflpp*> kern_dw; /* NB: key string could be a wildcard */
   map <string,dwflpp*> user_dw;
+  map <string,btf_info*> kern_btf; /* NB: NULL if there's none */
   interned_string user_path;
   interned_string user_lib;
 
@@ -999,11 +1052,34 @@ struct dwarf_builder: public derived_probe_builder
     return user_dw[module];
   }
 
+  // The running kernel's BTF, or that of one of its modules.
+  btf_info *get_kern_btf(systemtap_session& sess, const string& module)
+  {
+    auto it = kern_btf.find(module);
+    if (it != kern_btf.end())
+      return it->second;
+
+    btf_info *btf = NULL;
+    if (module == TOK_KERNEL)
+      {
+        if (btf_info::usable(sess))
+          btf = btf_info::load(sess, "/sys/kernel/btf/vmlinux");
+      }
+    else if (module.find_first_of("/*?[") == string::npos)
+      {
+        btf_info *base = get_kern_btf(sess, TOK_KERNEL);
+        if (base)
+          btf = btf_info::load(sess, "/sys/kernel/btf/" + module, base);
+      }
+    return kern_btf[module] = btf;
+  }
+
   /* NB: not virtual, so can be called from dtor too: */
   void dwarf_build_no_more (bool)
   {
     delete_map(kern_dw);
     delete_map(user_dw);
+    delete_map(kern_btf);
   }
 
   void build_no_more (systemtap_session &s)
@@ -3685,11 +3761,10 @@ static const string EMBEDDED_FETCH_DEREF_DONE = string("\n")
   + "#undef store_deref\n";
 
 static functioncall*
-synthetic_embedded_deref_call(dwflpp& dw, location_context &ctx,
+synthetic_embedded_deref_call(systemtap_session& sess, location_context &ctx,
                               const std::string &function_name,
-			      Dwarf_Die *function_type,
-			      bool userspace_p, bool lvalue_p,
-                              expression *pointer = NULL)
+                              const exp_type_ptr& type_details,
+                              bool lvalue_p, expression *pointer = NULL)
 {
   target_symbol *e = ctx.e;
   const target_symbol *e_orig = ctx.e_orig;
@@ -3706,8 +3781,7 @@ synthetic_embedded_deref_call(dwflpp& dw, location_context &ctx,
   fdecl->unmangled_name = fdecl->name = "__private_" + fhash + function_name;
   // The fdecl type is generic, but we'll be detailed on the fcall below.
   fdecl->type = pe_long;
-  fdecl->type_details = make_shared<exp_type_dwarf>(&dw, function_type,
-                                                    userspace_p, e->addressof);
+  fdecl->type_details = type_details;
   // Synthesize a functioncall.
   functioncall* fcall = new functioncall;
   fcall->tok = tok;
@@ -3840,11 +3914,25 @@ synthetic_embedded_deref_call(dwflpp& dw, location_context &ctx,
   blk->statements.push_back(ret);
 
   // Add the synthesized decl to the session now.
-  fdecl->join (dw.sess);
+  fdecl->join (sess);
 
   return fcall;
 }
 
+static functioncall*
+synthetic_embedded_deref_call(dwflpp& dw, location_context &ctx,
+                              const std::string &function_name,
+			      Dwarf_Die *function_type,
+			      bool userspace_p, bool lvalue_p,
+                              expression *pointer = NULL)
+{
+  exp_type_ptr type_details
+    = make_shared<exp_type_dwarf>(&dw, function_type,
+                                  userspace_p, ctx.e->addressof);
+  return synthetic_embedded_deref_call(dw.sess, ctx, function_name,
+                                       type_details, lvalue_p, pointer);
+}
+
 expression*
 dwarf_pretty_print::deref (target_symbol* e)
 {
@@ -4668,6 +4756,7 @@ struct dwarf_cast_expanding_visitor: public var_expanding_visitor
     var_expanding_visitor(s), db(db) {}
   void visit_cast_op (cast_op* e);
   void filter_special_modules(string& module);
+  functioncall *btf_cast (const string& module, cast_op* e, bool lvalue);
 };
 
 
@@ -4839,10 +4928,15 @@ void dwarf_cast_expanding_visitor::visit_cast_op (cast_op* e)
 
       // NB: This uses '/' to distinguish between kernel modules and userspace,
       // which means that userspace modules won't get any PATH searching.
+      userspace_p=is_user_module (module);
+
+      // Kernel types may not need the debuginfo at all.
+      if (! userspace_p && (result = btf_cast (module, e, lvalue)))
+        break;
+
       dwflpp* dw;
       try
 	{
-          userspace_p=is_user_module (module);
 	  if (! userspace_p)
 	    {
 	      // kernel or kernel module target
@@ -4953,6 +5047,432 @@ exp_type_dwarf::expand(autocast_op* e, bool lvalue)
 }
 
 
+// Kernel types can also be described by the running kernel's BTF, which
+// is far cheaper to load than its debuginfo, and often present when the
+// debuginfo isn't.  That's enough to translate a @cast or an autocast
+// into plain memory reads, much as dwflpp::literal_stmt_for_pointer does
+// with DWARF, though pretty-printing still needs the debuginfo.
+
+static location *
+btf_translate_base_ref (location_context &ctx, uint64_t byte_size,
+                        bool signed_p)
+{
+  location *loc = ctx.locations.back ();
+  assert (loc->type == loc_address);
+
+  target_deref *d = new target_deref;
+  d->tok = ctx.e->tok;
+  d->addr = loc->program;
+  d->size = byte_size;
+  d->signed_p = signed_p;
+  d->userspace_p = ctx.userspace_p;
+
+  loc = ctx.new_location(loc_value);
+  loc->program = d;
+  loc->byte_size = byte_size;
+  return loc;
+}
+
+static location *
+btf_translate_pointer (const btf_info &btf, location_context &ctx)
+{
+  location *loc = btf_translate_base_ref (ctx, btf.pointer_size(), false);
+  loc->type = loc_address;
+  return loc;
+}
+
+static location *
+btf_translate_array (location_context &ctx, uint64_t stride,
+                     const target_symbol::component& c)
+{
+  if (stride == 0)
+    throw SEMANTIC_ERROR (_F("invalid access '%s' of an unsized type",
+                             lex_cast(c).c_str()), c.tok);
+
+  location *loc = ctx.locations.back ();
+  location *nloc = ctx.new_location(*loc);
+  if (c.type == target_symbol::comp_literal_array_index)
+    nloc->program = ctx.new_plus_const(loc->program, c.num_index * stride);
+  else
+    {
+      binary_expression *m = new binary_expression;
+      m->op = "*";
+      m->left = c.expr_index;
+      m->right = new literal_number(stride);
+      m->right->tok = c.tok;
+      m->tok = c.tok;
+      binary_expression *a = new binary_expression;
+      a->op = "+";
+      a->left = loc->program;
+      a->right = m;
+      a->tok = c.tok;
+      nloc->program = a;
+    }
+  return nloc;
+}
+
+// Translate the ->bar->baz[NN] parts from a pointer to TYPE, and the
+// final fetch or store, leaving the result as the last location in CTX.
+// Returns the type of the final value.
+static uint32_t
+btf_literal_stmt_for_pointer (const btf_info &btf, location_context &ctx,
+                              uint32_t type, bool lvalue)
+{
+  const target_symbol *e = ctx.e;
+  location *loc = ctx.translate_argument (ctx.pointer);
+
+  // The member last accessed, if it's a bit field.
+  btf_member bitfield = btf_member();
+
+  for (unsigned i = 0; i < e->components.size(); )
+    {
+      const target_symbol::component& c = e->components[i];
+      bool index_p = (c.type == target_symbol::comp_literal_array_index
+                      || c.type == target_symbol::comp_expression_array_index);
+      uint32_t id = btf.strip (type);
+      const btf_type *t = btf.type (id);
+      if (!t)
+        throw SEMANTIC_ERROR (_F("invalid access '%s' vs. %s",
+                                 lex_cast(c).c_str(),
+                                 btf.type_name(type).c_str()), c.tok);
+
+      // As a special case when the type is not an array or pointer,
+      // allow indexing the pointer itself.  PR11556.
+      if (i == 0 && index_p && t->kind != btf_type::kind_ptr
+          && t->kind != btf_type::kind_array)
+        {
+          loc = btf_translate_array (ctx, btf.size_of (id), c);
+          ++i;
+          continue;
+        }
+
+      switch (t->kind)
+        {
+        case btf_type::kind_ptr:
+          // A pointer with no type is a void* -- can't dereference it.
+          if (!t->type)
+            throw SEMANTIC_ERROR (_F("invalid access '%s' vs '%s'",
+                                     lex_cast(c).c_str(),
+                                     btf.type_name(type).c_str()), c.tok);
+          loc = btf_translate_pointer (btf, ctx);
+          type = t->type;
+          if (index_p)
+            {
+              loc = btf_translate_array (ctx, btf.size_of (type), c);
+              ++i;
+            }
+          break;
+
+        case btf_type::kind_array:
+          if (!index_p)
+            throw SEMANTIC_ERROR (_F("invalid access '%s' for array type",
+                                     lex_cast(c).c_str()), c.tok);
+          type = t->type;
+          loc = btf_translate_array (ctx, btf.size_of (type), c);
+          ++i;
+          break;
+
+        case btf_type::kind_struct:
+        case btf_type::kind_union:
+          {
+            if (index_p)
+              throw SEMANTIC_ERROR (_F("invalid access '%s' for %s",
+                                       lex_cast(c).c_str(),
+                                       btf.type_name(id).c_str()), c.tok);
+
+            btf_member m;
+            if (!btf.find_member (id, c.member, m))
+              {
+                set<string> members;
+                btf.get_members (id, members);
+                string sugs = levenshtein_suggest(c.member, members);
+                if (!sugs.empty())
+                  sugs = " (alternatives: " + sugs + ")";
+                throw SEMANTIC_ERROR(_F("unable to find member '%s' for %s%s",
+                                        c.member.c_str(),
+                                        btf.type_name(id).c_str(),
+                                        sugs.c_str()), c.tok);
+              }
+
+            type = m.type;
+            if (m.bitfield_size == 0 && m.bit_offset % 8 == 0)
+              {
+                location *nloc = ctx.new_location(*loc);
+                nloc->program = ctx.new_plus_const(loc->program,
+                                                   m.bit_offset / 8);
+                loc = nloc;
+                bitfield = btf_member();
+              }
+            else
+              bitfield = m; // left for the final fetch or store
+            ++i;
+          }
+          break;
+
+        default:
+          throw SEMANTIC_ERROR (_F("invalid access '%s' vs. %s",
+                                   lex_cast(c).c_str(),
+                                   btf.type_name(id).c_str()), c.tok);
+        }
+    }
+
+  // If we're looking for an address, then we can just provide what
+  // we computed to this point, without using a fetch/store.
+  if (e->addressof)
+    {
+      if (lvalue)
+        throw SEMANTIC_ERROR (_("cannot write to member address"), e->tok);
+      if (bitfield.bitfield_size || bitfield.bit_offset % 8)
+        throw SEMANTIC_ERROR (_("cannot take the address of a bit field"),
+                              e->tok);
+      return type;
+    }
+
+  uint32_t id = btf.strip (type);
+  const btf_type *t = btf.type (id);
+  unsigned kind = t ? t->kind : btf_type::kind_unknown;
+  switch (kind)
+    {
+    case btf_type::kind_struct:
+    case btf_type::kind_union:
+      {
+        string a_member;
+        set<string> members;
+        btf.get_members (id, members);
+        if (!members.empty())
+          a_member = " such as '->" + (*members.begin()) + "'";
+        throw SEMANTIC_ERROR (_F("'%s' is being accessed instead of a member%s",
+                                 btf.type_name(id).c_str(),
+                                 a_member.c_str()),
+                              (e->components.size() > 0 ?
+                               (e->components[e->components.size()-1].tok) :
+                               (e->tok)));
+      }
+
+    case btf_type::kind_int:
+    case btf_type::kind_enum:
+    case btf_type::kind_enum64:
+      {
+        uint64_t byte_size = t->size;
+        // kind_flag marks a signed enum
+        bool signed_p = (kind == btf_type::kind_int
+                         ? t->int_signed : t->kind_flag);
+        uint64_t bit_offset = bitfield.bit_offset;
+        uint64_t bit_size = bitfield.bitfield_size;
+        if (kind == btf_type::kind_int
+            && (t->int_offset || t->int_bits < byte_size * 8))
+          {
+            bit_offset += t->int_offset;
+            bit_size = t->int_bits;
+          }
+
+        if (byte_size == 0 || byte_size > 8)
+          throw SEMANTIC_ERROR (_F("unsupported type %s",
+                                   btf.type_name(id).c_str()), e->tok);
+
+        if (bit_size)
+          {
+            // Fetch the whole aligned unit holding the bit field.
+            uint64_t unit = bit_offset / (byte_size * 8) * byte_size;
+            bit_offset -= unit * 8;
+            if (bit_offset + bit_size > byte_size * 8)
+              throw SEMANTIC_ERROR (_("unsupported bit field layout"), e->tok);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            bit_offset = byte_size * 8 - bit_offset - bit_size;
+#endif
+            location *nloc = ctx.new_location(*loc);
+            nloc->program = ctx.new_plus_const(loc->program, unit);
+            loc = nloc;
+          }
+        else if (bit_offset % 8)
+          throw SEMANTIC_ERROR (_("cannot get bit field parameters"), e->tok);
+
+        loc = btf_translate_base_ref (ctx, byte_size, signed_p);
+
+        if (bit_size)
+          {
+            target_bitfield *bf = new target_bitfield;
+            bf->tok = e->tok;
+            bf->base = loc->program;
+            bf->offset = bit_offset;
+            bf->size = bit_size;
+            bf->signed_p = signed_p;
+
+            loc = ctx.new_location(loc_value);
+            loc->program = bf;
+            loc->byte_size = byte_size;
+          }
+      }
+      break;
+
+    case btf_type::kind_ptr:
+      btf_translate_pointer (btf, ctx);
+      break;
+
+    case btf_type::kind_array:
+      if (lvalue)
+        throw SEMANTIC_ERROR (_("cannot write to array address"), e->tok);
+      break;
+
+    default:
+      throw SEMANTIC_ERROR (_F("unsupported type %s",
+                               btf.type_name(id).c_str()), e->tok);
+    }
+
+  return type;
+}
+
+
+exp_type_btf::exp_type_btf(dwarf_builder* db, systemtap_session& sess,
+                           btf_info* btf, const string& module,
+                           uint32_t type, bool addressof):
+  db(db), sess(sess), btf(btf), module(module), type(type), is_pointer(false)
+{
+  // As with exp_type_dwarf, keep the pointed-to type if we can
+  // dereference it; otherwise it will be treated as an end point.
+  if (addressof)
+    is_pointer = true;
+  else
+    {
+      const btf_type *t = btf->type(btf->strip(type));
+      if (t && (t->kind == btf_type::kind_ptr
+                || t->kind == btf_type::kind_array))
+        {
+          is_pointer = true;
+          this->type = t->type;
+        }
+    }
+}
+
+
+functioncall *
+exp_type_btf::expand(autocast_op* e, bool lvalue)
+{
+  static unsigned tick = 0;
+
+  try
+    {
+      // make sure we're not dereferencing base types or void
+      bool deref_p = is_pointer && btf->type(btf->strip(type));
+      if (!deref_p)
+        e->assert_no_components("autocast", true);
+
+      if (lvalue && !sess.guru_mode)
+	throw SEMANTIC_ERROR(_("write not permitted; need stap -g"), e->tok);
+
+      if (e->components.empty())
+        {
+          if (e->addressof)
+            throw SEMANTIC_ERROR(_("cannot take address of tracepoint variable"), e->tok);
+
+          // no components and no addressof?  how did this autocast come to be?
+          throw SEMANTIC_ERROR(_("internal error: no-op autocast encountered"), e->tok);
+        }
+
+      if (e->check_pretty_print (lvalue))
+        {
+          // Pretty-printing needs the debuginfo after all, so treat
+          // this as the equivalent @cast.
+          cast_op *cast = new cast_op;
+          cast->tok = e->tok;
+          cast->operand = e->operand;
+          cast->components = e->components;
+          cast->addressof = e->addressof;
+          cast->type_name = btf->type_name(btf->strip(type));
+          cast->module = module;
+
+          functioncall *result = NULL;
+          dwflpp *dw = db->get_kern_dw(sess, module);
+          dwarf_cast_query q (*dw, module, *cast, lvalue, false, result);
+          dw->iterate_over_modules<base_query>(&query_module, &q);
+          if (!result)
+            {
+              if (cast->saved_conversion_error)
+                throw *cast->saved_conversion_error;
+              throw SEMANTIC_ERROR(_F("type %s not found in debuginfo",
+                                      cast->type_name.to_string().c_str()),
+                                   e->tok);
+            }
+          return result;
+        }
+
+      location_context ctx(e, e->operand);
+      uint32_t endtype = btf_literal_stmt_for_pointer (*btf, ctx, type, lvalue);
+
+      string fname = (string(lvalue ? "_btf_autocast_set"
+			     : "_btf_autocast_get")
+		      + "_" + lex_cast(tick++));
+
+      exp_type_ptr details = make_shared<exp_type_btf>(db, sess, btf, module,
+                                                       endtype, e->addressof);
+      return synthetic_embedded_deref_call(sess, ctx, fname, details,
+                                           lvalue, e->operand);
+    }
+  catch (const semantic_error &er)
+    {
+      e->chain (er);
+      return NULL;
+    }
+}
+
+
+functioncall *
+dwarf_cast_expanding_visitor::btf_cast (const string& module, cast_op* e,
+                                        bool lvalue)
+{
+  static unsigned tick = 0;
+
+  if (e->check_pretty_print (lvalue))
+    return NULL;
+
+  btf_info *btf = db.get_kern_btf(sess, module);
+  if (!btf)
+    return NULL;
+
+  // The same lookups as dwarf_cast_query, bare names first.
+  string tns = e->type_name;
+  uint32_t type = btf->find(tns);
+  if (!type &&
+      !startswith(tns, "struct ") &&
+      !startswith(tns, "union ") &&
+      !startswith(tns, "enum "))
+    {
+      type = btf->find("struct " + tns);
+      if (!type)
+        type = btf->find("union " + tns);
+      if (!type)
+        type = btf->find("enum " + tns);
+    }
+  if (!type)
+    return NULL;
+
+  try
+    {
+      location_context ctx(e, e->operand);
+      uint32_t endtype = btf_literal_stmt_for_pointer (*btf, ctx, type, lvalue);
+
+      if (sess.verbose > 2)
+        clog << _F("Pass 2: resolved @cast to %s in %s with BTF",
+                   tns.c_str(), module.c_str()) << endl;
+
+      string fname = (string(lvalue ? "_btf_cast_set" : "_btf_cast_get")
+		      + "_" + e->sym_name()
+		      + "_" + lex_cast(tick++));
+      exp_type_ptr details = make_shared<exp_type_btf>(&db, sess, btf, module,
+                                                       endtype, e->addressof);
+      return synthetic_embedded_deref_call(sess, ctx, fname, details,
+                                           lvalue, e->operand);
+    }
+  catch (const semantic_error& er)
+    {
+      // The debuginfo may yet do better, but keep this error in case
+      // it's the only explanation we get.
+      e->chain (er);
+      return NULL;
+    }
+}
+
+
 struct dwarf_atvar_expanding_visitor: public var_expanding_visitor
 {
   dwarf_builder& db;
@@ -6031,6 +6551,50 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
 
   s.op->newline(-1) << "};";
 
+  // Emit the index of symbol_name+offset probes, sorted by symbol name,
+  // so that the runtime can find the probes for each symbol it comes
+  // across while walking kallsyms with a binary search.  Module probes
+  // are named "module:symbol", kallsyms just has the "symbol".
+  vector<pair<string, size_t> > symbols;
+  vector<generic_kprobe_derived_probe*> symbol_probes;
+  for (auto it = probes_by_module.begin(); it != probes_by_module.end(); it++)
+    {
+      generic_kprobe_derived_probe* p = it->second;
+      symbol_probes.push_back(p);
+      if (p->symbol_name.empty())
+        continue;
+      string name = p->symbol_name;
+      if (!p->module.empty())
+        {
+          size_t colon = name.find(':');
+          if (colon == string::npos)
+            continue; // would never match anyway
+          name.erase(0, colon + 1);
+        }
+      symbols.push_back(make_pair(name, symbol_probes.size() - 1));
+    }
+  sort(symbols.begin(), symbols.end());
+
+  have_symbol_index = !symbols.empty();
+  if (have_symbol_index)
+    {
+      s.op->newline() << "static const struct stap_kprobe_symbol stap_kprobe_symbols[] = {";
+      s.op->indent(1);
+      for (size_t i = 0; i < symbols.size(); i++)
+        {
+          // As above, only module probes that have a section need the
+          // kernel version check; leaving out entries keeps the rest sorted.
+          generic_kprobe_derived_probe* p = symbol_probes[symbols[i].second];
+          if (! p->section.empty())
+            s.op->newline() << "#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)";
+          s.op->newline() << "{ .name=" << lex_cast_qstring(symbols[i].first)
+                          << ", .idx=" << symbols[i].second << " },";
+          if (! p->section.empty())
+            s.op->newline() << "#endif";
+        }
+      s.op->newline(-1) << "};";
+    }
+
   // Emit the kprobes callback function
   s.op->newline();
   s.op->newline() << "static int enter_kprobe_probe (struct kprobe *inst,";
@@ -6123,7 +6687,8 @@ generic_kprobe_derived_probe_group::emit_module_init (systemtap_session& s)
 
   s.op->newline() << "rc = stapkp_init( "
                                      << "stap_kprobe_probes, "
-                                     << "ARRAY_SIZE(stap_kprobe_probes));";
+                                     << "ARRAY_SIZE(stap_kprobe_probes), "
+                                     << symbol_index_args() << ");";
 }
 
 std::string
@@ -6167,7 +6732,8 @@ generic_kprobe_derived_probe_group::emit_module_refresh (systemtap_session& s)
   s.op->newline() << "stapkp_refresh( "
                                    << "modname, "
                                    << "stap_kprobe_probes, "
-                                   << "ARRAY_SIZE(stap_kprobe_probes));";
+                                   << "ARRAY_SIZE(stap_kprobe_probes), "
+                                   << symbol_index_args() << ");";
 }
 
 void
@@ -7296,15 +7862,19 @@ private:
   void iterate_over_probe_entries();
   void handle_probe_entry();
 
-  static void setup_note_probe_entry_callback (sdt_query *me,
-                                               const string& scn_name,
-                                               const string& note_name,
-                                               int type,
-                                               const char *data,
-                                               size_t len);
-  void setup_note_probe_entry (const string& scn_name,
-                               const string& note_name, int type,
-                               const char *data, size_t len);
+  void index_notes();
+  bool load_note_index(const string& path);
+  void save_note_index(const string& path);
+  static void index_note_callback (sdt_query *me,
+                                   const string& scn_name,
+                                   const string& note_name,
+                                   int type,
+                                   const char *data,
+                                   size_t len);
+  void index_note (const string& scn_name,
+                   const string& note_name, int type,
+                   const char *data, size_t len);
+  void handle_note_entry (const sdt_note& note, GElf_Addr bias);
 
   void convert_probe(probe *base);
   void record_semaphore(vector<derived_probe *> & results, unsigned start);
@@ -7478,7 +8048,30 @@ sdt_query::handle_query_module()
       else
 	base = semaphore_load_offset = 0;
 
-      dw.iterate_over_notes (this, &sdt_query::setup_note_probe_entry_callback);
+      index_notes();
+
+      Dwarf_Addr bias;
+      dwfl_module_getelf (dw.mod_info->mod, &bias);
+
+      // Exact names can go straight to their notes; anything else has
+      // to be matched against each of them, in their original order.
+      const vector<sdt_note>& notes = dw.mod_info->sdt_notes;
+      if (pp_provider != ""
+          && pp_provider.to_string().find_first_of("*?[\\") == string::npos
+          && pp_mark.to_string().find_first_of("*?[\\") == string::npos)
+        {
+          auto it = dw.mod_info->sdt_note_index.find
+            (make_pair(pp_provider.to_string(), pp_mark.to_string()));
+          if (it != dw.mod_info->sdt_note_index.end())
+            for (unsigned i = 0; i < it->second.size(); ++i)
+              handle_note_entry (notes[it->second[i]], bias);
+        }
+      else
+        for (unsigned i = 0; i < notes.size(); ++i)
+          if (dw.function_name_matches_pattern (notes[i].name, pp_mark)
+              && ((pp_provider == "")
+                  || dw.function_name_matches_pattern (notes[i].provider, pp_provider)))
+            handle_note_entry (notes[i], bias);
     }
   else if (probe_loc == probe_section)
     iterate_over_probe_entries ();
@@ -7515,20 +8108,144 @@ sdt_query::init_probe_scn()
     return false;
 }
 
+// Index the module's .note.stapsdt, once per session, so that each
+// process.mark probe point needn't rescan and reparse every note.  The
+// index is also kept in the cache per build-id, since big binaries may
+// have many thousands of them.
+
 void
-sdt_query::setup_note_probe_entry_callback (sdt_query *me,
-                                            const string& scn_name,
-                                            const string& note_name, int type,
-                                            const char *data, size_t len)
+sdt_query::index_notes()
 {
-  me->setup_note_probe_entry (scn_name, note_name, type, data, len);
+  module_info *mi = dw.mod_info;
+  if (mi->sdt_notes_status != info_unknown)
+    return;
+  mi->sdt_notes_status = info_absent;
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id (mi->mod, &bits, &vaddr);
+  string path;
+  if (bits_length > 0 && sess.use_cache)
+    path = find_sdt_notes_hash (sess, hex_dump (bits, bits_length));
+
+  bool cached = (!path.empty() && !sess.poison_cache
+                 && file_exists (path) && load_note_index (path));
+  if (!cached)
+    {
+      dw.iterate_over_notes (this, &sdt_query::index_note_callback);
+      if (!path.empty())
+        save_note_index (path);
+    }
+
+  for (unsigned i = 0; i < mi->sdt_notes.size(); ++i)
+    {
+      const sdt_note& note = mi->sdt_notes[i];
+      pair<string,string> key = make_pair (note.provider, note.name);
+      mi->sdt_note_index[key].push_back (i);
+      mi->marks.insert (key);
+    }
+  mi->sdt_notes_status = info_present;
+
+  if (sess.verbose > 2)
+    clog << _F("%s %zu .note.stapsdt probes in %s",
+               cached ? "loaded" : "indexed", mi->sdt_notes.size(),
+               mi->name) << endl;
+}
+
+
+// The cached index has a count, then a line per note with its
+// addresses and its tab-separated provider, name and argument string.
+
+bool
+sdt_query::load_note_index (const string& path)
+{
+  vector<sdt_note>& notes = dw.mod_info->sdt_notes;
+  ifstream in (path.c_str());
+  string line;
+  size_t count = 0;
+  if (getline (in, line))
+    count = strtoul (line.c_str(), NULL, 10);
+
+  while (notes.size() < count && getline (in, line))
+    {
+      vector<string> fields;
+      tokenize (line, fields, "\t");
+      if (fields.size() < 5)
+        break;
+
+      sdt_note note;
+      note.pc = strtoull (fields[0].c_str(), NULL, 16);
+      note.base_ref = strtoull (fields[1].c_str(), NULL, 16);
+      note.semaphore = strtoull (fields[2].c_str(), NULL, 16);
+      note.provider = fields[3];
+      note.name = fields[4];
+      note.args = fields.size() > 5 ? fields[5] : "";
+      notes.push_back (note);
+    }
+
+  if (count == 0 || notes.size() != count)
+    {
+      if (sess.verbose > 2)
+        clog << _F("ignoring stale %s", path.c_str()) << endl;
+      notes.clear();
+      return false;
+    }
+  return true;
 }
 
 
 void
-sdt_query::setup_note_probe_entry (const string& scn_name,
-                                   const string& note_name, int type,
-                                   const char *data, size_t len)
+sdt_query::save_note_index (const string& path)
+{
+  const vector<sdt_note>& notes = dw.mod_info->sdt_notes;
+  if (notes.empty())
+    return;
+
+  string tmp = path + ".tmp";
+  ofstream out (tmp.c_str());
+  out << notes.size() << "\n" << hex;
+  for (unsigned i = 0; i < notes.size(); ++i)
+    {
+      const sdt_note& note = notes[i];
+      // tokenize() would lose empty fields, and the line can't be split
+      // up again if any field holds a tab or newline; don't cache those.
+      if (note.provider.empty() || note.name.empty()
+          || note.provider.find_first_of ("\t\n") != string::npos
+          || note.name.find_first_of ("\t\n") != string::npos
+          || note.args.find_first_of ("\t\n") != string::npos)
+        {
+          out.close();
+          unlink (tmp.c_str());
+          return;
+        }
+      out << note.pc << "\t" << note.base_ref << "\t" << note.semaphore
+          << "\t" << note.provider << "\t" << note.name;
+      if (!note.args.empty())
+        out << "\t" << note.args;
+      out << "\n";
+    }
+  out.close();
+  if (!out.good() || rename (tmp.c_str(), path.c_str()) != 0)
+    {
+      if (sess.verbose > 1)
+        clog << _F("couldn't save %s", path.c_str()) << endl;
+      unlink (tmp.c_str());
+    }
+}
+
+
+void
+sdt_query::index_note_callback (sdt_query *me, const string& scn_name,
+                                const string& note_name, int type,
+                                const char *data, size_t len)
+{
+  me->index_note (scn_name, note_name, type, data, len);
+}
+
+
+void
+sdt_query::index_note (const string& scn_name, const string& note_name,
+                       int type, const char *data, size_t len)
 {
   if (scn_name.compare(".note.stapsdt"))
     return;
@@ -7567,7 +8284,6 @@ sdt_query::setup_note_probe_entry (const string& scn_name,
 		      elf_getident (elf, NULL)[EI_DATA]) == NULL)
     printf ("gelf_xlatetom: %s", elf_errmsg (-1));
 
-  probe_type = uprobe3_type;
   const char * provider = data + dst.d_size;
 
   const char *name = (const char*)memchr (provider, '\0', data + len - provider);
@@ -7578,17 +8294,33 @@ sdt_query::setup_note_probe_entry (const string& scn_name,
   if (args++ == NULL || memchr (args, '\0', data + len - name) != data + len - 1)
     return;
 
-  provider_name = provider;
-  probe_name = name;
-  arg_string = args;
+  sdt_note note;
+  note.provider = provider;
+  note.name = name;
+  note.args = args;
+  if (gelf_getclass (elf) == ELFCLASS32)
+    {
+      note.pc = buf.a32[0];
+      note.base_ref = buf.a32[1];
+      note.semaphore = buf.a32[2];
+    }
+  else
+    {
+      note.pc = buf.a64[0];
+      note.base_ref = buf.a64[1];
+      note.semaphore = buf.a64[2];
+    }
+  dw.mod_info->sdt_notes.push_back (note);
+}
 
-  dw.mod_info->marks.insert(make_pair(provider, name));
 
-  // Did we find a matching probe?
-  if (! (dw.function_name_matches_pattern (probe_name, pp_mark)
-	 && ((pp_provider == "")
-	     || dw.function_name_matches_pattern (provider_name, pp_provider))))
-    return;
+void
+sdt_query::handle_note_entry (const sdt_note& note, GElf_Addr bias)
+{
+  probe_type = uprobe3_type;
+  provider_name = note.provider;
+  probe_name = note.name;
+  arg_string = note.args;
 
   // PR13934: Assembly probes are not forced to use the N@OP form.
   // If we have '@' then great, else count based on space-delimiters.
@@ -7596,22 +8328,8 @@ sdt_query::setup_note_probe_entry (const string& scn_name,
   if (!arg_count && !arg_string.empty())
     arg_count = 1 + count(arg_string.begin(), arg_string.end(), ' ');
 
-  GElf_Addr base_ref;
-  if (gelf_getclass (elf) == ELFCLASS32)
-    {
-      pc = buf.a32[0];
-      base_ref = buf.a32[1];
-      semaphore = buf.a32[2];
-    }
-  else
-    {
-      pc = buf.a64[0];
-      base_ref = buf.a64[1];
-      semaphore = buf.a64[2];
-    }
-
-  semaphore += base - base_ref;
-  pc += base - base_ref;
+  semaphore = note.semaphore + base - note.base_ref;
+  pc = note.pc + base - note.base_ref;
 
   // The semaphore also needs the ELF bias added now, so
   // record_semaphore can properly relocate it later.
@@ -10622,7 +11340,8 @@ struct tracepoint_derived_probe: public derived_probe
                             dwflpp& dw, Dwarf_Die& func_die,
                             const string& tracepoint_system,
                             const string& tracepoint_name,
-                            probe* base_probe, probe_point* location);
+                            probe* base_probe, probe_point* location,
+                            const string& tracepoint_header = "");
 
   systemtap_session& sess;
   string tracepoint_system, tracepoint_name, header;
@@ -10849,11 +11568,29 @@ tracepoint_var_expanding_visitor::visit_target_symbol (target_symbol* e)
 }
 
 
+// Return the header declaring a tracepoint function.
+static string
+tracepoint_decl_header(Dwarf_Die *func_die)
+{
+  string header = dwarf_decl_file(func_die) ?: "";
+
+  // tracepoints from FOO_event_types.h should really be included from FOO.h
+  // XXX can dwarf tell us the include hierarchy?  it would be better to
+  // ... walk up to see which one was directly included by tracequery.c
+  // XXX: see also PR9993.
+  size_t header_pos = header.find("_event_types");
+  if (header_pos != string::npos)
+    header.erase(header_pos, 12);
+  return header;
+}
+
+
 tracepoint_derived_probe::tracepoint_derived_probe (systemtap_session& s,
                                                     dwflpp& dw, Dwarf_Die& func_die,
                                                     const string& tracepoint_system,
                                                     const string& tracepoint_name,
-                                                    probe* base, probe_point* loc):
+                                                    probe* base, probe_point* loc,
+                                                    const string& tracepoint_header):
   derived_probe (base, loc, true /* .components soon rewritten */), sess (s),
   tracepoint_system (tracepoint_system), tracepoint_name (tracepoint_name)
 {
@@ -10875,17 +11612,12 @@ tracepoint_derived_probe::tracepoint_derived_probe (systemtap_session& s,
   // fill out the available arguments in this tracepoint
   build_args(dw, func_die);
 
-  // determine which header defined this tracepoint
-  string decl_file = dwarf_decl_file(&func_die);
-  header = decl_file;
-
-  // tracepoints from FOO_event_types.h should really be included from FOO.h
-  // XXX can dwarf tell us the include hierarchy?  it would be better to
-  // ... walk up to see which one was directly included by tracequery.c
-  // XXX: see also PR9993.
-  size_t header_pos = header.find("_event_types");
-  if (header_pos != string::npos)
-    header.erase(header_pos, 12);
+  // determine which header defined this tracepoint, unless our caller
+  // already knows (see tracepoint_builder::build_catalog)
+  if (!tracepoint_header.empty())
+    header = tracepoint_header;
+  else
+    header = tracepoint_decl_header(&func_die);
 
   // Now expand the local variables in the probe body
   tracepoint_var_expanding_visitor v (dw, args);
@@ -11633,16 +12365,32 @@ tracepoint_derived_probe_group::emit_module_exit (systemtap_session& s)
 }
 
 
+// A tracepoint found in the kernel's own debuginfo, rather than in a
+// tracequery module (see tracepoint_builder::build_catalog).
+struct tracepoint_catalog_entry
+{
+  string system, name, header;
+  Dwarf_Off die_offset;
+  Dwarf_Die die;
+};
+
+// The kernel's tracepoints, by the offset of the CU holding their DIE.
+typedef map<Dwarf_Off, vector<tracepoint_catalog_entry> > tracepoint_catalog;
+
+
 struct tracepoint_query : public base_query
 {
   probe * base_probe;
   probe_point * base_loc;
   vector<derived_probe *> & results;
   set<string> probed_names;
+  const tracepoint_catalog *catalog; // non-NULL when querying the kernel
 
   void handle_query_module();
   int handle_query_cu(Dwarf_Die * cudie);
   int handle_query_func(Dwarf_Die * func);
+  void add_probe(Dwarf_Die * func, const string& system,
+                 const string& name, const string& header = "");
   void query_library (const char *) {}
   void query_plt (const char *, size_t) {}
 
@@ -11651,9 +12399,10 @@ struct tracepoint_query : public base_query
 
   tracepoint_query(dwflpp & dw, const string & tracepoint,
                    probe * base_probe, probe_point * base_loc,
-                   vector<derived_probe *> & results):
-    base_query(dw, "*"), base_probe(base_probe),
-    base_loc(base_loc), results(results)
+                   vector<derived_probe *> & results,
+                   const tracepoint_catalog *catalog = NULL):
+    base_query(dw, catalog ? "kernel" : "*"), base_probe(base_probe),
+    base_loc(base_loc), results(results), catalog(catalog)
   {
     // The user may have specified the system to probe, e.g. all of the
     // following are possible:
@@ -11740,6 +12489,13 @@ tracepoint_query::retrieve_trace_system()
 void
 tracepoint_query::handle_query_module()
 {
+  // The catalog knows the system of each tracepoint.
+  if (catalog)
+    {
+      dw.iterate_over_cus(tracepoint_query_cu, this, false);
+      return;
+    }
+
   // Get the TRACE_SYSTEM for this module, if any. It will be found in the
   // STAP_TRACE_SYSTEM section if it exists.
   current_system = retrieve_trace_system();
@@ -11762,6 +12518,30 @@ tracepoint_query::handle_query_module()
 int
 tracepoint_query::handle_query_cu(Dwarf_Die * cudie)
 {
+  if (catalog)
+    {
+      tracepoint_catalog::const_iterator it
+        = catalog->find(dwarf_dieoffset(cudie));
+      if (it == catalog->end())
+        return DWARF_CB_OK;
+
+      dw.focus_on_cu (cudie);
+      for (unsigned i = 0; i < it->second.size(); ++i)
+        {
+          const tracepoint_catalog_entry& entry = it->second[i];
+          if (!system.empty()
+              && !dw.function_name_matches_pattern(entry.system, system))
+            continue;
+          if (!dw.function_name_matches_pattern(entry.name, tracepoint))
+            continue;
+
+          Dwarf_Die *func = const_cast<Dwarf_Die *>(&entry.die);
+          dw.focus_on_function (func);
+          add_probe (func, entry.system, entry.name, entry.header);
+        }
+      return DWARF_CB_OK;
+    }
+
   dw.focus_on_cu (cudie);
   dw.mod_info->get_symtab();
 
@@ -11777,12 +12557,20 @@ tracepoint_query::handle_query_func(Dwarf_Die * func)
   dw.focus_on_function (func);
 
   assert(startswith(dw.function_name, "stapprobe_"));
-  string tracepoint_instance = dw.function_name.substr(10);
+  add_probe (func, current_system, dw.function_name.substr(10));
+  return DWARF_CB_OK;
+}
 
+
+void
+tracepoint_query::add_probe(Dwarf_Die * func, const string& system,
+                            const string& tracepoint_instance,
+                            const string& header)
+{
   // check for duplicates -- sometimes tracepoint headers may be indirectly
   // included in more than one of our tracequery modules.
   if (!probed_names.insert(tracepoint_instance).second)
-    return DWARF_CB_OK;
+    return;
 
   // PR17126: blacklist
   if (!sess.guru_mode)
@@ -11795,16 +12583,16 @@ tracepoint_query::handle_query_func(Dwarf_Die * func)
         {
           sess.print_warning(_F("tracepoint %s is blacklisted on architecture %s",
                                 tracepoint_instance.c_str(), sess.architecture.c_str()));
-          return DWARF_CB_OK;
+          return;
         }
   }
 
   derived_probe *dp = new tracepoint_derived_probe (dw.sess, dw, *func,
-                                                    current_system,
+                                                    system,
                                                     tracepoint_instance,
-                                                    base_probe, base_loc);
+                                                    base_probe, base_loc,
+                                                    header);
   results.push_back (dp);
-  return DWARF_CB_OK;
 }
 
 
@@ -11827,23 +12615,51 @@ tracepoint_query::tracepoint_query_func (Dwarf_Die * func, tracepoint_query * q)
 struct tracepoint_builder: public derived_probe_builder
 {
 private:
-  dwflpp *dw;
-  bool init_dw(systemtap_session& s);
+  map<vector<string>, dwflpp*> tracequery_dws; // by the headers queried
+  dwflpp *init_dw(systemtap_session& s, const vector<string>& headers);
   void get_tracequery_modules(systemtap_session& s,
                               const vector<string>& headers,
                               vector<string>& modules);
 
+  bool headers_found;
+  vector<string> system_headers;
+  void find_headers(systemtap_session& s);
+
+  dwflpp *kernel_dw;
+  bool catalog_tried;
+  tracepoint_catalog catalog;
+  bool init_catalog(systemtap_session& s);
+  bool load_catalog(systemtap_session& s, const string& path, Dwarf *dwarf);
+  void save_catalog(systemtap_session& s, const string& path);
+  void build_catalog(systemtap_session& s, Dwfl_Module *mod, Dwarf *dwarf);
+  static int catalog_module (Dwfl_Module *mod, void **, const char *,
+                             Dwarf_Addr, tracepoint_builder *self);
+  systemtap_session *catalog_sess;
+  void uncovered_headers(const string& tracepoint, vector<string>& headers);
+
+  void release_tracequery_dws ()
+  {
+    for (map<vector<string>, dwflpp*>::iterator it = tracequery_dws.begin();
+         it != tracequery_dws.end(); ++it)
+      delete it->second;
+    tracequery_dws.clear();
+  }
+
 public:
 
-  tracepoint_builder(): dw(0) {}
-  ~tracepoint_builder() { delete dw; }
+  tracepoint_builder(): headers_found(false), kernel_dw(0),
+                        catalog_tried(false), catalog_sess(0) {}
+  ~tracepoint_builder() { release_tracequery_dws(); delete kernel_dw; }
 
   void build_no_more (systemtap_session& s)
   {
-    if (dw && s.verbose > 3)
+    if ((!tracequery_dws.empty() || kernel_dw) && s.verbose > 3)
       clog << _("tracepoint_builder releasing dwflpp") << endl;
-    delete dw;
-    dw = NULL;
+    release_tracequery_dws();
+    delete kernel_dw;
+    kernel_dw = NULL;
+    catalog.clear();
+    catalog_tried = false;
 
     delete_session_module_cache (s);
   }
@@ -11999,14 +12815,14 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
 
 
 
-bool
-tracepoint_builder::init_dw(systemtap_session& s)
-{
-  if (dw != NULL)
-    return true;
+// Find the tracepoint headers of the kernel being built for.
 
-  vector<string> tracequery_modules;
-  vector<string> system_headers;
+void
+tracepoint_builder::find_headers(systemtap_session& s)
+{
+  if (headers_found)
+    return;
+  headers_found = true;
 
   glob_t trace_glob;
 
@@ -12141,39 +12957,471 @@ tracepoint_builder::init_dw(systemtap_session& s)
         }
       globfree(&trace_glob);
     }
+}
+
+
+// Get the tracequery modules for the given headers, building them if
+// needed, ready to query.  Returns NULL if there's nothing to query.
+dwflpp *
+tracepoint_builder::init_dw(systemtap_session& s, const vector<string>& headers)
+{
+  map<vector<string>, dwflpp*>::iterator it = tracequery_dws.find(headers);
+  if (it != tracequery_dws.end())
+    return it->second;
+
+  vector<string> tracequery_modules;
 
   // Build tracequery modules
-  get_tracequery_modules(s, system_headers, tracequery_modules);
+  if (!headers.empty())
+    get_tracequery_modules(s, headers, tracequery_modules);
 
   // TODO: consider other sources of tracepoint headers too, like from
   // a command-line parameter or some environment or .systemtaprc
 
-  dw = new dwflpp(s, tracequery_modules, true);
+  dwflpp *dw = NULL;
+  if (!tracequery_modules.empty())
+    dw = new dwflpp(s, tracequery_modules, true);
+  return tracequery_dws[headers] = dw;
+}
+
+// The TRACE_SYSTEMs a tracepoint header sets, by the line from which
+// each is in effect, with "" from an #undef on.  Headers usually #undef
+// and then #define it once, but some switch systems part way through.
+typedef map<int, string> tracepoint_header_systems;
+
+static tracepoint_header_systems
+tracepoint_header_system_lines(const string& header)
+{
+  tracepoint_header_systems systems;
+  ifstream in(header.c_str());
+  string line;
+  for (int lineno = 1; getline(in, line); ++lineno)
+    {
+      // "#define X", "# define X" and "#\tdefine X" all count
+      size_t hash = line.find_first_not_of(" \t");
+      if (hash == string::npos || line[hash] != '#')
+        continue;
+      istringstream words(line.substr(hash + 1));
+      string directive, macro, system;
+      if (!(words >> directive >> macro) || macro != "TRACE_SYSTEM")
+        continue;
+      if (directive == "define" && words >> system)
+        systems[lineno] = system;
+      else if (directive == "undef")
+        systems[lineno] = "";
+    }
+  return systems;
+}
+
+// The TRACE_SYSTEM in effect at LINE, or if that isn't known, the
+// first one the header sets.
+static string
+tracepoint_header_system(const tracepoint_header_systems& systems, int line)
+{
+  if (line > 0)
+    {
+      tracepoint_header_systems::const_iterator it = systems.upper_bound(line);
+      if (it == systems.begin())
+        return "";
+      return (--it)->second;
+    }
+  for (tracepoint_header_systems::const_iterator it = systems.begin();
+       it != systems.end(); ++it)
+    if (!it->second.empty())
+      return it->second;
+  return "";
+}
+
+
+int
+tracepoint_builder::catalog_module (Dwfl_Module *mod, void **, const char *name,
+                                    Dwarf_Addr, tracepoint_builder *self)
+{
+  if (name == NULL || name != TOK_KERNEL)
+    return DWARF_CB_OK;
+
+  systemtap_session& s = *self->catalog_sess;
+  Dwarf_Addr bias;
+  Dwarf *dwarf = dwfl_module_getdwarf(mod, &bias);
+  if (!dwarf)
+    return DWARF_CB_ABORT;
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id(mod, &bits, &vaddr);
+  string path;
+  if (bits_length > 0)
+    path = find_tracepoint_catalog_hash(s, hex_dump(bits, bits_length));
+
+  if (!path.empty() && s.use_cache && !s.poison_cache
+      && file_exists(path) && self->load_catalog(s, path, dwarf))
+    {
+      if (s.verbose > 2)
+        clog << _F("Pass 2: using cached %s", path.c_str()) << endl;
+      return DWARF_CB_ABORT;
+    }
+
+  self->build_catalog(s, mod, dwarf);
+  if (!path.empty() && s.use_cache)
+    self->save_catalog(s, path);
+  return DWARF_CB_ABORT;
+}
+
+
+// Find the kernel's tracepoints directly in its debuginfo, so that the
+// common queries don't need any tracequery modules built.  Every
+// tracepoint gets a static inline trace_NAME() taking its arguments,
+// just like the stapprobe_NAME() of a tracequery module, and its DWARF
+// can be found in each CU that fires that tracepoint.  The result is
+// cached per kernel build-id.
+
+bool
+tracepoint_builder::init_catalog(systemtap_session& s)
+{
+  if (catalog_tried)
+    return kernel_dw != NULL;
+  catalog_tried = true;
+
+  // This is just a shortcut, so don't complain about (or suggest
+  // installing) missing kernel debuginfo.
+  unsigned found = 0;
+  Dwfl *dwfl = setup_dwfl_kernel ("kernel", &found, s);
+  if (dwfl)
+    dwfl_end (dwfl);
+  if (!found)
+    {
+      if (s.verbose > 2)
+        clog << _("Pass 2: no kernel debuginfo for a tracepoint catalog") << endl;
+      return false;
+    }
+
+  try
+    {
+      kernel_dw = new dwflpp(s, "kernel", true);
+    }
+  catch (const semantic_error& e)
+    {
+      if (s.verbose > 2)
+        clog << _F("Pass 2: no tracepoint catalog: %s", e.what()) << endl;
+      return false;
+    }
+
+  catalog_sess = &s;
+  kernel_dw->iterate_over_modules<tracepoint_builder>(&catalog_module, this);
+
+  if (catalog.empty())
+    {
+      delete kernel_dw;
+      kernel_dw = NULL;
+      return false;
+    }
   return true;
 }
 
+
+void
+tracepoint_builder::build_catalog(systemtap_session& s,
+                                  Dwfl_Module *mod, Dwarf *dwarf)
+{
+  struct timeval tv_before;
+  gettimeofday (&tv_before, NULL);
+
+  // The names of the kernel's tracepoints, from their struct tracepoint.
+  set<string> tracepoints;
+  int syms = dwfl_module_getsymtab (mod);
+  for (int i = 0; i < syms; i++)
+    {
+      GElf_Sym sym;
+      const char *name = dwfl_module_getsym (mod, i, &sym, NULL);
+      if (name && startswith(name, "__tracepoint_")
+          && GELF_ST_TYPE(sym.st_info) == STT_OBJECT)
+        tracepoints.insert(name + 13);
+    }
+
+  // The headers we know how to #include, by the path relative to
+  // their include/ directory, or else their kernel tree, and their
+  // TRACE_SYSTEM.
+  find_headers(s);
+  map<string, pair<string,tracepoint_header_systems> > headers;
+  vector<string> trees;
+  trees.push_back(s.kernel_build_tree + "/");
+  if (s.kernel_source_tree != "")
+    trees.push_back(s.kernel_source_tree + "/");
+  for (unsigned i = 0; i < system_headers.size(); ++i)
+    {
+      const string& header = system_headers[i];
+      string key = header;
+      size_t root_pos = header.rfind("include/");
+      if (root_pos != string::npos)
+        key = header.substr(root_pos + 8);
+      else
+        for (unsigned j = 0; j < trees.size(); ++j)
+          if (startswith(header, trees[j]))
+            {
+              key = header.substr(trees[j].size());
+              break;
+            }
+      headers[key] = make_pair(header, tracepoint_header_system_lines(header));
+    }
+
+  set<string> seen;
+  unsigned entries = 0;
+  Dwarf_Off off = 0, noff;
+  size_t cuhl;
+  while (dwarf_nextcu (dwarf, off, &noff, &cuhl, NULL, NULL, NULL) == 0)
+    {
+      assert_no_interrupts();
+      Dwarf_Die cu_mem, die;
+      Dwarf_Die *cudie = dwarf_offdie (dwarf, off + cuhl, &cu_mem);
+      off = noff;
+      if (!cudie || dwarf_tag (cudie) != DW_TAG_compile_unit
+          || dwarf_child (cudie, &die) != 0)
+        continue;
+
+      do
+        {
+          if (dwarf_tag (&die) != DW_TAG_subprogram
+              || dwarf_hasattr (&die, DW_AT_declaration))
+            continue;
+          const char *fname = dwarf_diename (&die);
+          if (!fname || !startswith(fname, "trace_"))
+            continue;
+          string name = fname + 6;
+          if (!tracepoints.count(name) || seen.count(name))
+            continue;
+
+          string decl = tracepoint_decl_header(&die);
+          size_t root_pos = decl.rfind("include/");
+          if (root_pos != string::npos)
+            decl = decl.substr(root_pos + 8);
+          else if (startswith(decl, "./"))
+            decl = decl.substr(2);
+          map<string, pair<string,tracepoint_header_systems> >::const_iterator it
+            = headers.find(decl);
+          if (it == headers.end())
+            for (it = headers.begin(); it != headers.end(); ++it)
+              if (endswith(decl, ("/" + it->first).c_str()))
+                break;
+          if (it == headers.end())
+            continue;
+
+          int decl_line = 0;
+          dwarf_decl_line (&die, &decl_line);
+
+          tracepoint_catalog_entry entry;
+          entry.system = tracepoint_header_system(it->second.second, decl_line);
+          entry.name = name;
+          entry.header = it->second.first;
+          entry.die_offset = dwarf_dieoffset (&die);
+          entry.die = die;
+          catalog[dwarf_dieoffset (cudie)].push_back(entry);
+          seen.insert(name);
+          ++entries;
+        }
+      while (dwarf_siblingof (&die, &die) == 0);
+    }
+
+  if (s.verbose > 1)
+    {
+      struct timeval tv_after;
+      gettimeofday (&tv_after, NULL);
+      clog << _F("Pass 2: found %u of %zu kernel tracepoints in debuginfo "
+                 "in %ld ms", entries, tracepoints.size(),
+                 (long)((tv_after.tv_sec - tv_before.tv_sec) * 1000
+                        + (tv_after.tv_usec - tv_before.tv_usec) / 1000))
+           << endl;
+    }
+}
+
+
+// The catalog file has a line per tracepoint, with the offsets of its
+// CU and function DIE, its name, header and system, separated by tabs
+// since a header path may well have spaces.
+
+bool
+tracepoint_builder::load_catalog(systemtap_session& s, const string& path,
+                                 Dwarf *dwarf)
+{
+  ifstream in(path.c_str());
+  string line;
+  while (getline(in, line))
+    {
+      vector<string> fields;
+      tokenize(line, fields, "\t");
+      if (fields.size() < 4 || fields.size() > 5)
+        break;
+      tracepoint_catalog_entry entry;
+      Dwarf_Off cu_offset;
+      try
+        {
+          cu_offset = lex_cast<Dwarf_Off>(fields[0]);
+          entry.die_offset = lex_cast<Dwarf_Off>(fields[1]);
+        }
+      catch (const runtime_error&)
+        {
+          break;
+        }
+      entry.name = fields[2];
+      entry.header = fields[3];
+      if (fields.size() > 4)
+        entry.system = fields[4]; // may be empty
+
+      // Make sure it still describes this debuginfo.
+      const char *fname;
+      if (!dwarf_offdie (dwarf, entry.die_offset, &entry.die)
+          || !(fname = dwarf_diename (&entry.die))
+          || string(fname) != "trace_" + entry.name)
+        break;
+      catalog[cu_offset].push_back(entry);
+    }
+
+  if (!in.eof() || catalog.empty())
+    {
+      if (s.verbose > 2)
+        clog << _F("Pass 2: ignoring stale %s", path.c_str()) << endl;
+      catalog.clear();
+      return false;
+    }
+  return true;
+}
+
+
+void
+tracepoint_builder::save_catalog(systemtap_session& s, const string& path)
+{
+  string tmp = path + ".tmp";
+  ofstream out(tmp.c_str());
+  for (tracepoint_catalog::const_iterator it = catalog.begin();
+       it != catalog.end(); ++it)
+    for (unsigned i = 0; i < it->second.size(); ++i)
+      {
+        const tracepoint_catalog_entry& entry = it->second[i];
+        out << it->first << "\t" << entry.die_offset << "\t" << entry.name
+            << "\t" << entry.header << "\t" << entry.system << "\n";
+      }
+  out.close();
+  if (!out.good() || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+      if (s.verbose > 1)
+        clog << _F("Pass 2: couldn't save %s", path.c_str()) << endl;
+      unlink(tmp.c_str());
+    }
+}
+
+
+// The headers that none of the catalog's tracepoints come from, i.e.
+// those of tracepoints in modules, and of the kernel's that it never
+// fires.  Only these need tracequery modules for a wildcard query.  If
+// it names a system, skip the headers known to define another one.
+
+void
+tracepoint_builder::uncovered_headers(const string& tracepoint,
+                                      vector<string>& headers)
+{
+  set<string> covered;
+  for (tracepoint_catalog::const_iterator it = catalog.begin();
+       it != catalog.end(); ++it)
+    for (unsigned i = 0; i < it->second.size(); ++i)
+      covered.insert(it->second[i].header);
+
+  size_t sys_pos = tracepoint.find(':');
+  string system = (sys_pos == string::npos) ? "" : tracepoint.substr(0, sys_pos);
+
+  for (unsigned i = 0; i < system_headers.size(); ++i)
+    {
+      const string& header = system_headers[i];
+      if (covered.count(header))
+        continue;
+      if (!system.empty())
+        {
+          // Keep a header that sets no system we can see, or any one
+          // matching the query.
+          tracepoint_header_systems systems
+            = tracepoint_header_system_lines(header);
+          bool match = true;
+          for (tracepoint_header_systems::const_iterator it = systems.begin();
+               it != systems.end(); ++it)
+            if (!it->second.empty())
+              {
+                match = fnmatch(system.c_str(), it->second.c_str(), 0) == 0;
+                if (match)
+                  break;
+              }
+          if (!match)
+            continue;
+        }
+      headers.push_back(header);
+    }
+}
+
 void
 tracepoint_builder::build(systemtap_session& s,
                           probe *base, probe_point *location,
                           literal_map_t const& parameters,
                           vector<derived_probe*>& finished_results)
 {
-  if (!init_dw(s))
-    return;
-
   interned_string tracepoint;
   assert(get_param (parameters, TOK_TRACE, tracepoint));
 
-  tracepoint_query q(*dw, tracepoint, base, location, finished_results);
   unsigned results_pre = finished_results.size();
-  dw->iterate_over_modules<base_query>(&query_module, &q);
+  find_headers(s);
+
+  // Try the catalog of the kernel's own tracepoints first.  That's all
+  // we need for a specific tracepoint.  A wildcard may also match some
+  // in modules, which only tracequery modules of the headers without
+  // any tracepoints in the catalog will find.
+  set<string> probed_names;
+  dwflpp *dw = NULL;
+  set<string> visited_modules;
+  if (init_catalog(s))
+    {
+      tracepoint_query cq(*kernel_dw, tracepoint, base, location,
+                          finished_results, &catalog);
+      kernel_dw->iterate_over_modules<base_query>(&query_module, &cq);
+      if (finished_results.size() > results_pre
+          && !contains_glob_chars(tracepoint))
+        return;
+      probed_names = cq.probed_names;
+
+      vector<string> headers;
+      uncovered_headers(tracepoint, headers);
+      dw = init_dw(s, headers);
+      if (dw)
+        {
+          tracepoint_query q(*dw, tracepoint, base, location,
+                             finished_results);
+          q.probed_names = probed_names;
+          dw->iterate_over_modules<base_query>(&query_module, &q);
+          probed_names = q.probed_names;
+          visited_modules = q.visited_modules;
+        }
+
+      // A specific tracepoint that's still missing may be one the kernel
+      // defines but never fires, or the catalog may be stale, so fall
+      // back to all the headers.
+      if (finished_results.size() > results_pre
+          || contains_glob_chars(tracepoint))
+        dw = NULL;
+      else
+        dw = init_dw(s, system_headers);
+    }
+  else
+    dw = init_dw(s, system_headers);
+
+  if (dw)
+    {
+      tracepoint_query q(*dw, tracepoint, base, location, finished_results);
+      q.probed_names = probed_names;
+      dw->iterate_over_modules<base_query>(&query_module, &q);
+      visited_modules = q.visited_modules;
+    }
   unsigned results_post = finished_results.size();
 
   // Did we fail to find a match? Let's suggest something!
   if (results_pre == results_post)
     {
       size_t pos;
-      string sugs = suggest_dwarf_functions(s, q.visited_modules, tracepoint);
+      string sugs = suggest_dwarf_functions(s, visited_modules, tracepoint);
       while ((pos = sugs.find("stapprobe_")) != string::npos)
         sugs.erase(pos, string("stapprobe_").size());
       if (!sugs.empty())
@@ -0,0 +1,47 @@
+/* Syscall load for utrace_syscall.exp: start a number of threads that
+ * each make a number of cheap syscalls, and report how long it took. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static long loops;
+
+static void *
+worker(void *arg)
+{
+	long i;
+
+	for (i = 0; i < loops; i++)
+		syscall(SYS_getppid);
+	return arg;
+}
+
+int
+main(int argc, char **argv)
+{
+	int nthreads = argc > 1 ? atoi(argv[1]) : 64;
+	pthread_t *threads;
+	struct timespec start, end;
+	int i;
+
+	loops = argc > 2 ? atol(argv[2]) : 20000;
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (threads == NULL)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			return 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("elapsed %ld us\n",
+	       (long)((end.tv_sec - start.tv_sec) * 1000000
+		      + (end.tv_nsec - start.tv_nsec) / 1000));
+	return 0;
+}
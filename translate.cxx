@@ -71,6 +71,39 @@ class itervar;
 static ostream nullstream(NULL);
 static translator_output null_o(nullstream);
 
+// Look up the numeric value of a -D macro, if it was given as one.
+bool
+c_macro_value (systemtap_session& s, const string& name, unsigned long& value)
+{
+  string prefix = name + "=";
+  for (unsigned i=0; i<s.c_macros.size(); i++)
+    if (startswith (s.c_macros[i], prefix))
+      try
+        {
+          value = lex_cast<unsigned long> (s.c_macros[i].substr (prefix.size()));
+          return true;
+        }
+      catch (const runtime_error&)
+        {
+          return false; // some expression, leave it to the caller's guess
+        }
+  return false;
+}
+
+// Liveness-based overlay of the script-level locals of one probe or
+// function body, see compute_local_overlay().
+struct local_overlay
+{
+  // Groups of same-typed locals with disjoint lifetimes, which share
+  // one slot of the locals struct.  Only groups of two or more.
+  vector<vector<vardecl*> > slots;
+  map<vardecl*, unsigned> slot_of;
+
+  // Overlaid locals can't be initialized at entry, since their slot
+  // may still be in use; they're initialized before their first use.
+  map<statement*, vector<vardecl*> > inits;
+};
+
 struct c_unparser: public unparser, public visitor
 {
   systemtap_session* session;
@@ -90,15 +123,44 @@ struct c_unparser: public unparser, public visitor
 
   varuse_collecting_visitor vcv_needs_global_locks;
 
+  // The live arrays of the current probe's foreach snapshots, and
+  // their index in its locks[] (see emit_snapshot_swap).
+  map<vardecl*, int> snapshot_locks;
+  unsigned num_locks;
+
   map<string, probe*> probe_contents;
 
+  // For handlers shared by probes calling different thunks (see
+  // find_shared_probes), the leader's call sites that go through
+  // c->probe->thunks, and each probe's own thunks.
+  struct thunk_slot
+  {
+    unsigned index;
+    set<functiondecl*> functions; // called here by any of the probes
+  };
+  map<const functioncall*, thunk_slot> thunk_slots;
+  map<derived_probe*, vector<functiondecl*> > probe_thunks;
+
   map<pair<bool, string>, string> compiled_printfs;
+  unsigned deferred_printf_count;
+
+  // Deferred initialization of overlaid locals in the current body.
+  map<statement*, vector<vardecl*> > overlay_inits;
+
+  // Estimated sizes of the locals in struct context, for -v.
+  unsigned long probe_locals_size;
+  unsigned long function_locals_size;
+  unsigned long overlay_saved_size;
 
   c_unparser (systemtap_session* ss, translator_output* op=NULL):
     session (ss), o (op ?: ss->op), current_probe(0), current_function (0),
     assigned_functioncall (0), assigned_functioncall_retval (0),
     tmpvar_counter (0), label_counter (0), action_counter(0), fc_counter(0),
-    already_checked_action_count(false), vcv_needs_global_locks (*ss) {}
+    already_checked_action_count(false), vcv_needs_global_locks (*ss),
+    num_locks (0),
+    deferred_printf_count (0), sortn_maps_collected (false),
+    probe_locals_size (0), function_locals_size (0),
+    overlay_saved_size (0) {}
   ~c_unparser () {}
 
   // The main c_unparser doesn't write declarations as it traverses,
@@ -107,6 +169,9 @@ struct c_unparser: public unparser, public visitor
 
   // If we've seen a dupe, return it; else remember this and return NULL.
   probe *get_probe_dupe (derived_probe *dp);
+  string probe_dupe_stamp (derived_probe *dp, vector<functioncall*>& thunk_calls);
+  void find_shared_probes ();
+  void emit_probe_thunks ();
 
   void emit_map_type_instantiations ();
   void emit_common_header ();
@@ -115,6 +180,8 @@ struct c_unparser: public unparser, public visitor
   void emit_global_init_type (vardecl *v);
   void emit_global_param (vardecl* v);
   void emit_global_init_setters ();
+  void emit_lock_stats_table ();
+  void emit_lock_stats_free ();
   void emit_functionsig (functiondecl* v);
   void emit_kernel_module_init ();
   void emit_kernel_module_exit ();
@@ -123,13 +190,22 @@ struct c_unparser: public unparser, public visitor
   void emit_module_exit ();
   void emit_function (functiondecl* v);
   void emit_lock_decls (const varuse_collecting_visitor& v);
+  void emit_lock_entry (vardecl* v, bool write_p);
   void emit_locks ();
+  void emit_snapshot_swap (vardecl* live, vardecl* spare);
   void emit_probe (derived_probe* v);
   void emit_probe_condition_update(derived_probe* v);
   void emit_unlocks ();
+  void emit_overlay_inits (statement* s);
+  void emit_local_init (vardecl* v);
 
   void emit_compiled_printfs ();
   void emit_compiled_printf_locals ();
+  void emit_deferred_printf (const vector<print_format::format_component>&
+                             components, unsigned id);
+  void emit_deferred_printf_format (const string& name,
+                                    const vector<print_format::format_component>&
+                                    components);
   void declare_compiled_printf (bool print_to_stream, const string& format);
   virtual const string& get_compiled_printf (bool print_to_stream,
 					     const string& format);
@@ -137,6 +213,10 @@ struct c_unparser: public unparser, public visitor
   // for use by stats (pmap) foreach
   set<string> aggregations_active;
 
+  // arrays iterated by sorted foreach with a limit, see map_sortn_p
+  set<vardecl*> sortn_maps;
+  bool sortn_maps_collected;
+
   // values immediately available in foreach_loop iterations
   map<string, string> foreach_loop_values;
   void visit_foreach_loop_value (foreach_loop* s, const string& value="");
@@ -155,6 +235,8 @@ struct c_unparser: public unparser, public visitor
   string c_arg_undef (const string& e);
 
   string map_keytypes(vardecl* v);
+  bool map_string_varlen(vardecl* v);
+  bool map_sortn_p(vardecl* v);
   void c_global_write_def(vardecl* v);
   void c_global_read_def(vardecl* v);
   void c_global_write_undef(vardecl* v);
@@ -191,7 +273,7 @@ struct c_unparser: public unparser, public visitor
   string histogram_index_check(var & vase, tmpvar & idx) const;
 
   void collect_map_index_types(vector<vardecl* > const & vars,
-			       set< pair<vector<exp_type>, exp_type> > & types);
+			       map<string, vardecl*> & types);
 
   void record_actions (unsigned actions, const token* tok, bool update=false);
 
@@ -258,10 +340,24 @@ struct c_tmpcounter cxx_final: public c_unparser
   c_unparser* parent;
   set<string> declared_vars;
 
+  // Running size estimate of the struct/union nest being declared:
+  // (is_union, bytes) for each open level.
+  vector<pair<bool, unsigned long> > size_frames;
+  unsigned long maxstringlen;
+
   c_tmpcounter (c_unparser* p):
-    c_unparser(p->session, &null_o), parent (p)
+    c_unparser(p->session, &null_o), parent (p),
+    maxstringlen (estimate_maxstringlen (*p->session))
   { }
 
+  static unsigned long estimate_maxstringlen (systemtap_session& s);
+  unsigned long type_size (exp_type ty) const;
+  void push_size_frame (bool is_union);
+  unsigned long pop_size_frame ();
+  void add_size (unsigned long bytes);
+
+  void emit_overlay_slot (const vector<vardecl*>& slot);
+
   // When vars are created *and used* (i.e. not overridden tmpvars) they call
   // var_declare(), which will forward to the parent c_unparser for output;
   void var_declare(string const&, var const& v) cxx_override;
@@ -571,7 +667,10 @@ void
 c_tmpcounter::var_declare (string const& name, var const& v)
 {
   if (declared_vars.insert(name).second)
-    v.declare (*parent);
+    {
+      v.declare (*parent);
+      add_size (type_size (v.type()));
+    }
 }
 
 struct stmt_expr
@@ -662,15 +761,17 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool varlen; // strings stored out of line, see c_unparser::map_string_varlen
+  bool sortn; // wants a top-k heap, see c_unparser::map_sortn_p
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool varlen, bool sortn)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), varlen(varlen), sortn(sortn)
   {}
 
   static string shortname(exp_type e);
@@ -690,7 +791,7 @@ struct mapvar
 	    result += 'i';
 	    break;
 	  case pe_string:
-	    result += 's';
+	    result += varlen ? 'v' : 's';
 	    break;
 	  case pe_stats:
 	    result += 'x';
@@ -869,7 +970,8 @@ struct mapvar
     prefix += function_keysym("new") + " ("
       + (is_parallel() ? stat_op_tokens() : "")
       + "KEY_MAPENTRIES, " + (maxsize > 0 ? lex_cast(maxsize) : "MAXMAPENTRIES") + ", "
-      + ((wrap == true) ? "KEY_STAT_WRAP, " : "");
+      + ((wrap == true) ? "KEY_STAT_WRAP, " : "")
+      + (sortn ? "KEY_SORTN, " : "");
 
     // See also var::init().
 
@@ -1056,13 +1158,41 @@ is_unmodified_string_fnarg (systemtap_session* sess, functiondecl* fd, vardecl*
   return (vut.written.find(v) == vut.written.end());
 }
 
-// If we've seen a dupe, return it; else remember this and return NULL.
-probe *
-c_unparser::get_probe_dupe (derived_probe *dp)
+// A call to a synthetic function of no arguments returning a number,
+// such as those fetching $target variables.  These are what tend to
+// differ between the bodies of probes from the same wildcard, and are
+// easily called through a pointer instead.
+static bool
+is_thunk_call (functioncall* e)
 {
-  if (session->unoptimized)
-    return NULL;
+  if (e->referents.size() != 1 || !e->args.empty() || e->type != pe_long)
+    return false;
+  functiondecl* fd = e->referents[0];
+  return (fd->synthetic && fd->formal_args.empty() && fd->type == pe_long
+          && !fd->has_next);
+}
+
+
+struct thunk_call_collector: public traversing_visitor
+{
+  vector<functioncall*>& calls;
+
+  thunk_call_collector (vector<functioncall*>& c): calls(c) {}
+
+  void visit_functioncall (functioncall* e)
+    {
+      traversing_visitor::visit_functioncall (e);
+      if (is_thunk_call (e))
+        calls.push_back (e);
+    }
+};
+
 
+// What must match for two probes to share a handler.  The calls to
+// thunks are numbered rather than named, and returned in that order.
+string
+c_unparser::probe_dupe_stamp (derived_probe *dp, vector<functioncall*>& thunk_calls)
+{
   // Notice we're using the probe body itself instead of the emitted C
   // probe body to compare probes.  We need to do this because the
   // emitted C probe body has stuff in it like:
@@ -1073,7 +1203,18 @@ c_unparser::get_probe_dupe (derived_probe *dp)
   ostringstream oss;
 
   dp->print_dupe_stamp (oss);
+
+  thunk_call_collector tcc (thunk_calls);
+  dp->body->visit (& tcc);
+  vector<interned_string> names;
+  for (unsigned i = 0; i < thunk_calls.size(); i++)
+    {
+      names.push_back (thunk_calls[i]->function);
+      thunk_calls[i]->function = "__thunk_" + lex_cast (i);
+    }
   dp->body->print(oss);
+  for (unsigned i = 0; i < thunk_calls.size(); i++)
+    thunk_calls[i]->function = names[i];
 
   // Since the generated C changes based on whether or not the probe
   // needs locks around global variables, this needs to be reflected
@@ -1085,8 +1226,20 @@ c_unparser::get_probe_dupe (derived_probe *dp)
   // be.  That's because they're only dependent on the probe body, which is
   // already "hashed" in above.
 
+  return oss.str();
+}
+
+
+// If we've seen a dupe, return it; else remember this and return NULL.
+probe *
+c_unparser::get_probe_dupe (derived_probe *dp)
+{
+  if (session->unoptimized)
+    return NULL;
+
+  vector<functioncall*> thunk_calls;
   pair<map<string, probe*>::iterator, bool> const& inserted =
-    probe_contents.insert(make_pair(oss.str(), dp));
+    probe_contents.insert(make_pair(probe_dupe_stamp (dp, thunk_calls), dp));
 
   if (inserted.second)
     return NULL; // it's new!
@@ -1095,6 +1248,111 @@ c_unparser::get_probe_dupe (derived_probe *dp)
   return inserted.first->second;
 }
 
+
+// Find the probes that get_probe_dupe will fold together even though
+// they call different thunks, typically to fetch the same $target
+// variables at different addresses.  Their shared handler will call
+// through each probe's own table of thunks.
+void
+c_unparser::find_shared_probes ()
+{
+  if (session->unoptimized)
+    return;
+
+  map<string, derived_probe*> leaders;
+  map<derived_probe*, vector<functioncall*> > leader_calls;
+  map<derived_probe*, vector<derived_probe*> > followers;
+  for (unsigned i = 0; i < session->probes.size(); i++)
+    {
+      derived_probe* dp = session->probes[i];
+      vector<functioncall*> calls;
+      string stamp = probe_dupe_stamp (dp, calls);
+
+      vector<functiondecl*> functions;
+      for (unsigned j = 0; j < calls.size(); j++)
+        functions.push_back (calls[j]->referents[0]);
+      probe_thunks[dp] = functions;
+
+      pair<map<string, derived_probe*>::iterator, bool> inserted =
+        leaders.insert (make_pair (stamp, dp));
+      if (inserted.second)
+        leader_calls[dp] = calls;
+      else
+        followers[inserted.first->second].push_back (dp);
+    }
+
+  for (map<derived_probe*, vector<functioncall*> >::iterator it = leader_calls.begin();
+       it != leader_calls.end(); ++it)
+    {
+      derived_probe* leader = it->first;
+      const vector<derived_probe*>& group = followers[leader];
+      const vector<functiondecl*>& functions = probe_thunks[leader];
+
+      bool same = true;
+      for (unsigned i = 0; i < group.size() && same; i++)
+        same = (probe_thunks[group[i]] == functions);
+
+      if (same) // all exact duplicates, or none at all
+        {
+          probe_thunks.erase (leader);
+          for (unsigned i = 0; i < group.size(); i++)
+            probe_thunks.erase (group[i]);
+          continue;
+        }
+
+      const vector<functioncall*>& calls = it->second;
+      for (unsigned j = 0; j < calls.size(); j++)
+        {
+          thunk_slot& slot = thunk_slots[calls[j]];
+          slot.index = j;
+          slot.functions.insert (functions[j]);
+          for (unsigned i = 0; i < group.size(); i++)
+            slot.functions.insert (probe_thunks[group[i]][j]);
+        }
+
+      if (session->verbose > 1)
+        clog << _F("%s shared by %zu probes, through %zu thunks each",
+                   leader->name().c_str(), group.size() + 1, calls.size())
+             << endl;
+    }
+}
+
+
+// The thunks named by find_shared_probes return their function's value
+// directly, and are listed for each probe that shares a handler.
+void
+c_unparser::emit_probe_thunks ()
+{
+  set<functiondecl*> thunks;
+  for (map<derived_probe*, vector<functiondecl*> >::iterator it = probe_thunks.begin();
+       it != probe_thunks.end(); ++it)
+    thunks.insert (it->second.begin(), it->second.end());
+
+  for (set<functiondecl*>::iterator it = thunks.begin(); it != thunks.end(); ++it)
+    {
+      string name = c_funcname ((*it)->name);
+      o->newline() << "static int64_t thunk_" << name
+                   << " (struct context * __restrict__ c) {";
+      o->newline(1) << name << " (c);";
+      o->newline() << "return c->locals[c->nesting+1]." << name << ".__retvalue;";
+      o->newline(-1) << "}";
+    }
+
+  for (unsigned i = 0; i < session->probes.size(); i++)
+    {
+      map<derived_probe*, vector<functiondecl*> >::iterator it =
+        probe_thunks.find (session->probes[i]);
+      if (it == probe_thunks.end())
+        continue;
+      o->newline() << "static int64_t (* const stap_probe_thunks_" << i
+                   << "[]) (struct context *) = {";
+      o->indent(1);
+      for (unsigned j = 0; j < it->second.size(); j++)
+        o->newline() << "&thunk_" << c_funcname (it->second[j]->name) << ",";
+      o->newline(-1) << "};";
+    }
+}
+
 void
 c_unparser::emit_common_header ()
 {
@@ -1292,10 +1550,38 @@ c_unparser::emit_compiled_printf_locals ()
   o->newline() << "#endif // STP_LEGACY_PRINT";
 }
 
+// Whether a printf's arguments can be logged as they are, for stapio
+// to format later.  That's not so for %m and %M, which read memory, or
+// for the odd %p of stap < 1.3.
+static bool
+deferrable_printf (systemtap_session& s,
+                   const vector<print_format::format_component>& components)
+{
+  if (s.runtime_usermode_p() || components.empty())
+    return false;
+
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    switch (c->type)
+      {
+      case print_format::conv_memory:
+      case print_format::conv_memory_hex:
+        return false;
+      case print_format::conv_pointer:
+        if (strverscmp(s.compatible.c_str(), "1.3") < 0)
+          return false;
+        break;
+      default:
+        break;
+      }
+  return true;
+}
+
 void
 c_unparser::emit_compiled_printfs ()
 {
   o->newline() << "#ifndef STP_LEGACY_PRINT";
+  vector<pair<string, size_t> > deferred_formats;
   map<pair<bool, string>, string>::iterator it;
   for (it = compiled_printfs.begin(); it != compiled_printfs.end(); ++it)
     {
@@ -1305,6 +1591,15 @@ c_unparser::emit_compiled_printfs ()
       vector<print_format::format_component> components =
 	print_format::string_to_components(format_string);
 
+      // Format ids are 16 bits in the frame header.
+      bool deferred = (print_to_stream && deferred_formats.size() <= 0xffff
+                       && deferrable_printf (*session, components));
+      if (deferred)
+        {
+          emit_deferred_printf_format (name, components);
+          deferred_formats.push_back (make_pair (name, components.size()));
+        }
+
       o->newline();
 
       // Might be nice to output the format string in a comment, but we'd have
@@ -1325,6 +1620,9 @@ c_unparser::emit_compiled_printfs ()
       o->newline() << "(void) ptr_value;";
       o->newline() << "(void) num_bytes;";
 
+      if (deferred)
+        emit_deferred_printf (components, deferred_formats.size() - 1);
+
       if (print_to_stream)
         {
 	  // Compute the buffer size needed for these arguments.
@@ -1543,10 +1841,181 @@ c_unparser::emit_compiled_printfs ()
 
       o->newline(-1) << "}";
     }
+
+  if (!session->runtime_usermode_p())
+    {
+      deferred_printf_count = deferred_formats.size();
+      o->newline();
+      o->newline() << "#ifdef STP_DEFERRED_PRINTF";
+      o->newline() << "static const struct _stp_deferred_printf_format "
+                   << "_stp_deferred_printf_formats[] = {";
+      o->indent(1);
+      for (unsigned i = 0; i < deferred_formats.size(); ++i)
+        o->newline() << "{ " << deferred_formats[i].first << "_deferred, "
+                     << deferred_formats[i].second << " },";
+      o->newline() << "{ NULL, 0 }";
+      o->newline(-1) << "};";
+      o->newline() << "#endif // STP_DEFERRED_PRINTF";
+    }
   o->newline() << "#endif // STP_LEGACY_PRINT";
 }
 
 
+// The format of a deferred printf, for stapio to render its records.
+void
+c_unparser::emit_deferred_printf_format (const string& name,
+                                         const vector<print_format::format_component>&
+                                         components)
+{
+  o->newline();
+  o->newline() << "#ifdef STP_DEFERRED_PRINTF";
+  o->newline() << "static const struct _stp_deferred_printf_spec "
+               << name << "_deferred[] = {";
+  o->indent(1);
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        {
+          literal_string ls(c->literal_string);
+          o->newline() << "{ { 0, 0, 0, 0, -1, -1, sizeof(";
+          visit_literal_string(&ls);
+          o->line() << ") - 1 }, ";
+          visit_literal_string(&ls);
+          o->line() << " },";
+          continue;
+        }
+
+      char type;
+      switch (c->type)
+        {
+        case print_format::conv_char:
+          type = 'c';
+          break;
+        case print_format::conv_string:
+          type = 's';
+          break;
+        case print_format::conv_binary:
+          type = 'b';
+          break;
+        default: // conv_pointer, conv_number
+          type = 'd';
+          break;
+        }
+
+      int dynamic = 0;
+      if (c->widthtype == print_format::width_dynamic)
+        dynamic |= 1; // STP_DEFERRED_DYNAMIC_WIDTH
+      if (c->prectype == print_format::prec_dynamic)
+        dynamic |= 2; // STP_DEFERRED_DYNAMIC_PRECISION
+
+      o->newline() << "{ { '" << type << "', " << c->base << ", "
+                   << c->flags << ", " << dynamic << ", "
+                   << (c->widthtype == print_format::width_static
+                       ? (int) c->width : -1) << ", "
+                   << (c->prectype == print_format::prec_static
+                       ? (int) c->precision : -1) << ", 0 }, \"\" },";
+    }
+  o->newline(-1) << "};";
+  o->newline() << "#endif // STP_DEFERRED_PRINTF";
+}
+
+
+// Log a printf's format id and arguments, if stapio is formatting them,
+// instead of formatting them here.  The arguments are written in the
+// order of the format's components, as described in transport_msgs.h.
+void
+c_unparser::emit_deferred_printf (const vector<print_format::format_component>&
+                                  components, unsigned id)
+{
+  o->newline() << "#ifdef STP_DEFERRED_PRINTF";
+  o->newline() << "if (_stp_deferred_printf) {";
+  o->indent(1);
+
+  // Strings are logged with their length, as far as %s would print.
+  size_t arg_ix = 0, fixed_bytes = 0;
+  vector<size_t> strings;
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+
+      string precision = "STP_BUFFER_SIZE";
+      if (c->widthtype == print_format::width_dynamic)
+        {
+          arg_ix++;
+          fixed_bytes += sizeof(int64_t);
+        }
+      if (c->prectype == print_format::prec_dynamic)
+        {
+          precision = "clamp_t(int, l->arg" + lex_cast(arg_ix++)
+            + ", 0, STP_BUFFER_SIZE)";
+          fixed_bytes += sizeof(int64_t);
+        }
+      else if (c->prectype == print_format::prec_static)
+        precision = "clamp_t(int, " + lex_cast(c->precision)
+          + ", 0, STP_BUFFER_SIZE)";
+
+      if (c->type == print_format::conv_string)
+        {
+          string s = "s" + lex_cast(arg_ix), n = "n" + lex_cast(arg_ix);
+          o->newline() << "const char *" << s << " = "
+                       << "((unsigned long) l->arg" << arg_ix
+                       << " < PAGE_SIZE) ? \"<NULL>\" : l->arg" << arg_ix << ";";
+          o->newline() << "uint32_t " << n << " = strnlen(" << s << ", "
+                       << precision << ");";
+          strings.push_back (arg_ix);
+          fixed_bytes += sizeof(uint32_t);
+        }
+      else
+        fixed_bytes += sizeof(int64_t);
+      arg_ix++;
+    }
+
+  o->newline() << "num_bytes = " << fixed_bytes;
+  for (unsigned i = 0; i < strings.size(); ++i)
+    o->line() << " + n" << strings[i];
+  o->line() << ";";
+  o->newline() << "str = (char*)_stp_deferred_reserve_bytes(" << id
+               << ", num_bytes);";
+  o->newline() << "if (str) {";
+  o->indent(1);
+
+  arg_ix = 0;
+  for (c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+
+      size_t args = 1 + (c->widthtype == print_format::width_dynamic)
+        + (c->prectype == print_format::prec_dynamic);
+      for (size_t i = 0; i < args; ++i, ++arg_ix)
+        if (i + 1 < args || c->type != print_format::conv_string)
+          {
+            o->newline() << "memcpy(str, &l->arg" << arg_ix
+                         << ", sizeof(int64_t));";
+            o->newline() << "str += sizeof(int64_t);";
+          }
+        else
+          {
+            o->newline() << "memcpy(str, &n" << arg_ix
+                         << ", sizeof(uint32_t));";
+            o->newline() << "str += sizeof(uint32_t);";
+            o->newline() << "memcpy(str, s" << arg_ix << ", n" << arg_ix << ");";
+            o->newline() << "str += n" << arg_ix << ";";
+          }
+    }
+
+  o->newline() << "return;";
+  o->newline(-1) << "}";
+
+  // Otherwise, too big to log, so format it here after all.
+  o->newline(-1) << "}";
+  o->newline() << "#endif // STP_DEFERRED_PRINTF";
+}
+
+
 void
 c_unparser::emit_global_param (vardecl *v)
 {
@@ -1628,6 +2097,37 @@ c_unparser::emit_global_init_setters ()
 }
 
 
+// The kernel runtime's table of each global's per-cpu lock stats,
+// which the -t report and the lock_stats procfs file go through.
+void
+c_unparser::emit_lock_stats_table ()
+{
+  o->newline() << "#ifdef STP_TIMING";
+  o->newline() << "static const struct stp_lock_global stp_lock_globals[] = {";
+  o->indent(1);
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      o->newline() << "{ " << lex_cast_qstring (v->unmangled_name) << ", "
+                   << "global_lock_stats(" << c_globalname (v->name) << ") },";
+    }
+  o->newline() << "{ NULL, NULL }";
+  o->newline(-1) << "};";
+  o->newline() << "#endif";
+}
+
+
+void
+c_unparser::emit_lock_stats_free ()
+{
+  o->newline() << "#ifdef STP_TIMING";
+  for (unsigned i=0; i<session->globals.size(); i++)
+    o->newline() << "stp_lock_stats_free(global_lock_stats("
+                 << c_globalname (session->globals[i]->name) << "));";
+  o->newline() << "#endif";
+}
+
+
 void
 c_unparser::emit_global (vardecl *v)
 {
@@ -1662,8 +2162,13 @@ c_unparser::emit_global (vardecl *v)
 
   o->newline() << "rwlock_t " << vn << "_lock;";
   o->newline() << "#ifdef STP_TIMING";
-  o->newline() << "atomic_t " << vn << "_lock_skip_count;";
-  o->newline() << "atomic_t " << vn << "_lock_contention_count;";
+  if (session->runtime_usermode_p())
+    {
+      o->newline() << "atomic_t " << vn << "_lock_skip_count;";
+      o->newline() << "atomic_t " << vn << "_lock_contention_count;";
+    }
+  else
+    o->newline() << "struct stp_lock_stats __percpu *" << vn << "_lock_stats;"; // see probe_lock.h
   o->newline() << "#endif\n";
 }
 
@@ -1788,6 +2293,8 @@ c_unparser::emit_module_init ()
   o->newline() << "int cpu;";
   o->newline() << "int i=0, j=0;"; // for derived_probe_group use
   o->newline() << "const char *probe_point = \"\";";
+  if (! session->runtime_usermode_p())
+    o->newline() << "ktime_t registration_start;";
 
   // NB: This block of initialization only makes sense in kernel
   if (! session->runtime_usermode_p())
@@ -1930,6 +2437,18 @@ c_unparser::emit_module_init ()
   o->newline(1) << "goto out;";
   o->indent(-1);
 
+  // Tell stapio how to format the deferred printfs, before any probe
+  // can start using them.
+  if (! session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef STP_DEFERRED_PRINTF";
+      o->newline() << "rc = _stp_deferred_printf_send(_stp_deferred_printf_formats, "
+                   << deferred_printf_count << ");";
+      o->newline() << "if (rc != 0)";
+      o->newline(1) << "goto out;";
+      o->newline(-1) << "#endif";
+    }
+
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
@@ -1950,8 +2469,21 @@ c_unparser::emit_module_init ()
 
       o->newline() << "global_lock_init(" << c_globalname (v->name) << ");";
       o->newline() << "#ifdef STP_TIMING";
-      o->newline() << "atomic_set(global_skipped(" << c_globalname (v->name) << "), 0);";
-      o->newline() << "atomic_set(global_contended(" << c_globalname (v->name) << "), 0);";
+      if (session->runtime_usermode_p())
+        {
+          o->newline() << "atomic_set(global_skipped(" << c_globalname (v->name) << "), 0);";
+          o->newline() << "atomic_set(global_contended(" << c_globalname (v->name) << "), 0);";
+        }
+      else
+        {
+          o->newline() << "rc = stp_lock_stats_alloc(global_lock_stats("
+                       << c_globalname (v->name) << "));";
+          o->newline() << "if (rc) {";
+          o->newline(1) << "_stp_error (\"global variable '" << v->name
+                        << "' lock stats allocation failed\");";
+          o->newline() << "goto out;";
+          o->newline(-1) << "}";
+        }
       o->newline() << "#endif";
     }
 
@@ -1983,6 +2515,8 @@ c_unparser::emit_module_init ()
     }
 
   // Run all probe registrations.  This actually runs begin probes.
+  if (!session->runtime_usermode_p())
+    o->newline() << "registration_start = ktime_get();";
 
   for (unsigned i=0; i<g.size(); i++)
     {
@@ -2005,6 +2539,18 @@ c_unparser::emit_module_init ()
       o->newline(-1) << "}";
     }
 
+  // Let staprun -v tell how long it took to get going, and how many
+  // probes actually got registered.
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "_stp_info(\"registered %lu of " << session->probes.size()
+                   << " probes in %lld us\",";
+      o->newline(1) << session->probes.size() << "UL - _stp_probes_unregistered,";
+      o->newline() << "(long long)ktime_to_ns(ktime_sub(ktime_get(), registration_start))"
+                   << " / NSEC_PER_USEC);";
+      o->indent(-1);
+    }
+
   // All registrations were successful.  Consider the system started.
   // NB: only other valid state value is ERROR, in which case we don't
   o->newline() << "atomic_cmpxchg(session_state(), STAP_SESSION_STARTING, STAP_SESSION_RUNNING);";
@@ -2081,6 +2627,8 @@ c_unparser::emit_module_init ()
       else
 	o->newline() << getvar (v).fini();
     }
+  if (!session->runtime_usermode_p())
+    emit_lock_stats_free ();
 
   // For any partially registered/unregistered kernel facilities.
   o->newline() << "atomic_set (session_state(), STAP_SESSION_STOPPED);";
@@ -2206,6 +2754,11 @@ c_unparser::emit_module_exit ()
   // cargo cult prologue ... hope to flush any pending workqueue items too
   o->newline() << "stp_synchronize_sched();";
 
+  // Send any output that running probes left batched in the print
+  // buffers, before the "end" probes add their own.
+  if (!session->runtime_usermode_p())
+    o->newline() << "_stp_print_flush_all();";
+
   // Get the lock before exiting to ensure there's no one in module_refresh
   // NB: this should't be able to happen, because both the module_refresh_timer
   // and the workqueue ought to have been shut down by now.
@@ -2322,6 +2875,7 @@ c_unparser::emit_module_exit ()
       o->newline(-3) << "}";
       o->newline() << "_stp_stat_del (g_refresh_timing);";
       o->newline(-1) << "}";
+      o->newline() << "_stp_sym_cache_report();";
       o->newline() << "#endif"; // STP_TIMING
     }
 
@@ -2330,17 +2884,22 @@ c_unparser::emit_module_exit ()
 
   //print lock contentions if non-zero
   o->newline() << "#ifdef STP_TIMING";
-  o->newline() << "{";
-  o->newline(1) << "int ctr;";
-  for (unsigned i=0; i<session->globals.size(); i++)
+  if (!session->runtime_usermode_p())
+    o->newline() << "stp_lock_stats_report(stp_lock_globals);";
+  else
     {
-      string orig_vn = session->globals[i]->name;
-      string vn = c_globalname (orig_vn);
-      o->newline() << "ctr = atomic_read (global_contended(" << vn << "));";
-      o->newline() << "if (ctr) _stp_printf(\"'%s' lock contention occurred %d times\\n\", "
-	           << lex_cast_qstring(orig_vn) << ", ctr);";
+      o->newline() << "{";
+      o->newline(1) << "int ctr;";
+      for (unsigned i=0; i<session->globals.size(); i++)
+        {
+          string orig_vn = session->globals[i]->name;
+          string vn = c_globalname (orig_vn);
+          o->newline() << "ctr = atomic_read (global_contended(" << vn << "));";
+          o->newline() << "if (ctr) _stp_printf(\"'%s' lock contention occurred %d times\\n\", "
+                       << lex_cast_qstring(orig_vn) << ", ctr);";
+        }
+      o->newline(-1) << "}";
     }
-  o->newline(-1) << "}";
   o->newline() << "_stp_print_flush();";
   o->newline () << "#endif";
 
@@ -2355,14 +2914,17 @@ c_unparser::emit_module_exit ()
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "{";
   o->newline(1) << "int ctr;";
-  for (unsigned i=0; i<session->globals.size(); i++)
-    {
-      string orig_vn = session->globals[i]->name;
-      string vn = c_globalname (orig_vn);
-      o->newline() << "ctr = atomic_read (global_skipped(" << vn << "));";
-      o->newline() << "if (ctr) _stp_warn (\"Skipped due to global '%s' lock timeout: %d\\n\", "
-                   << lex_cast_qstring(orig_vn) << ", ctr);";
-    }
+  if (!session->runtime_usermode_p())
+    o->newline() << "stp_lock_stats_warn_skipped(stp_lock_globals);";
+  else
+    for (unsigned i=0; i<session->globals.size(); i++)
+      {
+        string orig_vn = session->globals[i]->name;
+        string vn = c_globalname (orig_vn);
+        o->newline() << "ctr = atomic_read (global_skipped(" << vn << "));";
+        o->newline() << "if (ctr) _stp_warn (\"Skipped due to global '%s' lock timeout: %d\\n\", "
+                     << lex_cast_qstring(orig_vn) << ", ctr);";
+      }
   o->newline() << "ctr = atomic_read (skipped_count_lowstack());";
   o->newline() << "if (ctr) _stp_warn (\"Skipped due to low stack: %d\\n\", ctr);";
   o->newline() << "ctr = atomic_read (skipped_count_reentrant());";
@@ -2379,6 +2941,9 @@ c_unparser::emit_module_exit ()
   // NB: PR13386 needs to restore preemption-blocking counts
   o->newline() << "preempt_enable_no_resched();";
 
+  if (!session->runtime_usermode_p())
+    emit_lock_stats_free ();
+
   // In dyninst mode, now we're done with the contexts, transport, everything!
   if (session->runtime_usermode_p())
     {
@@ -2442,6 +3007,175 @@ struct max_action_info: public functioncall_traversing_visitor
   void visit_continue_statement (continue_statement *) { add_stmt_count(1); }
 };
 
+// Collects the locals referenced by a statement, and notes embedded-C
+// code, which may reference locals behind our back.
+struct local_use_collector: public traversing_visitor
+{
+  set<vardecl*> used;
+  bool embedded;
+
+  local_use_collector (): embedded (false) {}
+
+  void visit_symbol (symbol* e) { if (e->referent) used.insert (e->referent); }
+  void visit_embeddedcode (embeddedcode*) { embedded = true; }
+  void visit_embedded_expr (embedded_expr*) { embedded = true; }
+};
+
+// Flatten nested blocks into the sequence of statements they run.
+static void
+collect_overlay_units (statement* s, vector<statement*>& units)
+{
+  block* b = dynamic_cast<block*> (s);
+  if (b)
+    for (unsigned i=0; i<b->statements.size(); i++)
+      collect_overlay_units (b->statements[i], units);
+  else if (s)
+    units.push_back (s);
+}
+
+// Temporaries are already overlaid per statement (see visit_block), but
+// every script-level local of a probe or function gets its own member
+// in struct context.  Here we compute the live range of each local, in
+// terms of the sequence of top-level statements of the body, and pack
+// locals of the same type whose ranges don't intersect into shared
+// slots.  Since no control flow leads back into an earlier top-level
+// statement, a local is dead after the last statement that uses it.
+static void
+compute_local_overlay (systemtap_session& s, statement* body,
+                       const vector<vardecl*>& locals, local_overlay& ov)
+{
+  if (s.unoptimized)
+    return;
+
+  vector<statement*> units;
+  collect_overlay_units (body, units);
+  if (units.size() < 2)
+    return;
+
+  map<vardecl*, unsigned> candidates; // local -> declaration order
+  for (unsigned i=0; i<locals.size(); i++)
+    {
+      vardecl* v = locals[i];
+      if (!v->synthetic && v->index_types.empty()
+          && (v->type == pe_long || v->type == pe_string))
+        candidates[v] = i;
+    }
+
+  // (first unit, last unit, declaration order) for each used candidate
+  map<vardecl*, unsigned> first, last;
+  for (unsigned i=0; i<units.size(); i++)
+    {
+      local_use_collector luc;
+      units[i]->visit (&luc);
+      if (luc.embedded)
+        return;
+      for (set<vardecl*>::iterator it = luc.used.begin();
+           it != luc.used.end(); ++it)
+        if (candidates.count (*it))
+          {
+            if (!first.count (*it))
+              first[*it] = i;
+            last[*it] = i;
+          }
+    }
+
+  vector<pair<pair<unsigned, unsigned>, vardecl*> > order;
+  for (map<vardecl*, unsigned>::iterator it = first.begin();
+       it != first.end(); ++it)
+    order.push_back (make_pair (make_pair (it->second, candidates[it->first]),
+                                it->first));
+  sort (order.begin(), order.end());
+
+  // Greedy interval coloring, which is optimal for interval graphs.
+  vector<vector<vardecl*> > slots;
+  vector<unsigned> slot_end;
+  for (unsigned i=0; i<order.size(); i++)
+    {
+      vardecl* v = order[i].second;
+      unsigned j;
+      for (j=0; j<slots.size(); j++)
+        if (slots[j][0]->type == v->type && slot_end[j] < first[v])
+          break;
+      if (j == slots.size())
+        {
+          slots.push_back (vector<vardecl*>());
+          slot_end.push_back (0);
+        }
+      slots[j].push_back (v);
+      slot_end[j] = last[v];
+    }
+
+  for (unsigned j=0; j<slots.size(); j++)
+    {
+      if (slots[j].size() < 2)
+        continue;
+      for (unsigned k=0; k<slots[j].size(); k++)
+        {
+          vardecl* v = slots[j][k];
+          ov.slot_of[v] = ov.slots.size();
+          ov.inits[units[first[v]]].push_back (v);
+        }
+      ov.slots.push_back (slots[j]);
+    }
+}
+
+unsigned long
+c_tmpcounter::estimate_maxstringlen (systemtap_session& s)
+{
+  unsigned long len = 512; // the runtime default for 64-bit architectures
+  c_macro_value (s, "MAXSTRINGLEN", len);
+  return len;
+}
+
+unsigned long
+c_tmpcounter::type_size (exp_type ty) const
+{
+  return (ty == pe_string) ? maxstringlen : 8;
+}
+
+void
+c_tmpcounter::push_size_frame (bool is_union)
+{
+  size_frames.push_back (make_pair (is_union, 0UL));
+}
+
+unsigned long
+c_tmpcounter::pop_size_frame ()
+{
+  assert (!size_frames.empty());
+  unsigned long bytes = size_frames.back().second;
+  size_frames.pop_back();
+  add_size (bytes);
+  return bytes;
+}
+
+void
+c_tmpcounter::add_size (unsigned long bytes)
+{
+  if (size_frames.empty())
+    return;
+  if (size_frames.back().first)
+    size_frames.back().second = max (size_frames.back().second, bytes);
+  else
+    size_frames.back().second += bytes;
+}
+
+// Declare a group of overlaid locals as one anonymous union, so they
+// are still referred to by their own names.
+void
+c_tmpcounter::emit_overlay_slot (const vector<vardecl*>& slot)
+{
+  translator_output *o = parent->o;
+  o->newline() << "union {";
+  o->indent(1);
+  for (unsigned i=0; i<slot.size(); i++)
+    o->newline() << c_typename (slot[i]->type) << " "
+                 << c_localname (slot[i]->name) << ";";
+  o->newline(-1) << "};";
+  add_size (type_size (slot[0]->type));
+  parent->overlay_saved_size += (slot.size() - 1) * type_size (slot[0]->type);
+}
+
 void
 c_tmpcounter::emit_function (functiondecl* fd)
 {
@@ -2457,15 +3191,26 @@ c_tmpcounter::emit_function (functiondecl* fd)
   // indent the dummy output as if we were already in a block
   this->o->indent (1);
 
+  local_overlay ov;
+  if (!fd->mangle_oldstyle)
+    compute_local_overlay (*session, fd->body, fd->locals, ov);
+
   o->newline() << "struct " << c_funcname (fd->name) << "_locals {";
   o->indent(1);
+  push_size_frame (false);
 
   for (unsigned j=0; j<fd->locals.size(); j++)
     {
       vardecl* v = fd->locals[j];
       try
 	{
-	  if (fd->mangle_oldstyle)
+	  if (ov.slot_of.count (v))
+	    {
+	      const vector<vardecl*>& slot = ov.slots[ov.slot_of[v]];
+	      if (slot[0] == v)
+		emit_overlay_slot (slot);
+	    }
+	  else if (fd->mangle_oldstyle)
 	    {
 	      // PR14524: retain old way of referring to the locals
 	      o->newline() << "union { "
@@ -2478,6 +3223,7 @@ c_tmpcounter::emit_function (functiondecl* fd)
 	    {
 	      o->newline() << c_typename (v->type) << " "
 			   << c_localname (v->name) << ";";
+	      add_size (type_size (v->type));
 	    }
 	} catch (const semantic_error& e) {
 	  semantic_error e2 (e);
@@ -2512,6 +3258,7 @@ c_tmpcounter::emit_function (functiondecl* fd)
 	      o->newline() << (v->char_ptr_arg ? "const char *" : c_typename (v->type))
 			   << " " << c_localname (v->name) << ";";
 	    }
+	  add_size (v->char_ptr_arg ? 8 : type_size (v->type));
 	} catch (const semantic_error& e) {
 	  semantic_error e2 (e);
 	  if (e2.tok1 == 0) e2.tok1 = v->tok;
@@ -2531,9 +3278,13 @@ c_tmpcounter::emit_function (functiondecl* fd)
 		   fd->unmangled_name.to_string().c_str()) << endl;
       o->newline() << (as_charp ? "char *" : c_typename (fd->type))
 		   << " __retvalue;";
+      add_size (as_charp ? 8 : type_size (fd->type));
     }
   o->newline(-1) << "} " << c_funcname (fd->name) << ";";
 
+  unsigned long bytes = pop_size_frame ();
+  parent->function_locals_size = max (parent->function_locals_size, bytes);
+
   // finish dummy indentation
   this->o->indent (-1);
   this->o->assert_0_indent ();
@@ -2597,16 +3348,21 @@ c_unparser::emit_function (functiondecl* v)
   o->newline() << "c->next = 0;";
   o->newline() << "#define STAP_NEXT do { c->next = 1; goto out; } while(0)";
 
-  // initialize locals
+  // initialize locals, except overlaid ones (see emit_overlay_inits)
   // XXX: optimization: use memset instead
+  local_overlay ov;
+  if (!v->mangle_oldstyle)
+    compute_local_overlay (*session, v->body, v->locals, ov);
   for (unsigned i=0; i<v->locals.size(); i++)
     {
       if (v->locals[i]->index_types.size() > 0) // array?
 	throw SEMANTIC_ERROR (_("array locals not supported, missing global declaration?"),
                               v->locals[i]->tok);
 
-      o->newline() << getvar (v->locals[i]).init();
+      if (!ov.slot_of.count (v->locals[i]))
+        o->newline() << getvar (v->locals[i]).init();
     }
+  overlay_inits = ov.inits;
 
   // initialize return value, if any
   if (v->type != pe_unknown)
@@ -2649,6 +3405,7 @@ c_unparser::emit_function (functiondecl* v)
     }
 
   v->body->visit (this);
+  overlay_inits.clear();
   o->newline() << "#undef return";
   o->newline() << "#undef STAP_PRINTF";
   o->newline() << "#undef STAP_ERROR";
@@ -2698,15 +3455,29 @@ c_tmpcounter::emit_probe (derived_probe* dp)
       // indent the dummy output as if we were already in a block
       this->o->indent (1);
 
+      local_overlay ov;
+      compute_local_overlay (*session, dp->body, dp->locals, ov);
+
       o->newline() << "struct " << dp->name() << "_locals {";
       o->indent(1);
+      push_size_frame (false);
       for (unsigned j=0; j<dp->locals.size(); j++)
 	{
 	  vardecl* v = dp->locals[j];
 	  try
 	    {
-	      o->newline() << c_typename (v->type) << " "
-			   << c_localname (v->name) << ";";
+	      if (ov.slot_of.count (v))
+		{
+		  const vector<vardecl*>& slot = ov.slots[ov.slot_of[v]];
+		  if (slot[0] == v)
+		    emit_overlay_slot (slot);
+		}
+	      else
+		{
+		  o->newline() << c_typename (v->type) << " "
+			       << c_localname (v->name) << ";";
+		  add_size (type_size (v->type));
+		}
 	    } catch (const semantic_error& e) {
 	    semantic_error e2 (e);
 	    if (e2.tok1 == 0) e2.tok1 = v->tok;
@@ -2728,6 +3499,9 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 
       o->newline(-1) << "} " << dp->name() << ";";
 
+      unsigned long bytes = pop_size_frame ();
+      parent->probe_locals_size = max (parent->probe_locals_size, bytes);
+
       // finish dummy indentation
       this->o->indent (-1);
       this->o->assert_0_indent ();
@@ -2738,11 +3512,54 @@ c_tmpcounter::emit_probe (derived_probe* dp)
   this->already_checked_action_count = false;
 }
 
+void
+c_unparser::emit_local_init (vardecl* v)
+{
+  if (v->type == pe_long)
+    o->newline() << "l->" << c_localname (v->name) << " = 0;";
+  else if (v->type == pe_string)
+    o->newline() << "l->" << c_localname (v->name) << "[0] = '\\0';";
+  else
+    throw SEMANTIC_ERROR (_("unsupported local variable type"), v->tok);
+}
+
+// Initialize the overlaid locals which come to life at this statement.
+void
+c_unparser::emit_overlay_inits (statement* s)
+{
+  map<statement*, vector<vardecl*> >::const_iterator it = overlay_inits.find (s);
+  if (it == overlay_inits.end())
+    return;
+  for (unsigned i=0; i<it->second.size(); i++)
+    emit_local_init (it->second[i]);
+}
+
 #define DUPMETHOD_CALL 0
 #define DUPMETHOD_ALIAS 0
 #define DUPMETHOD_RENAME 1
 
 
+// The swap of a foreach snapshot writes its live array, which the
+// probe body no longer mentions, so note that for emit_lock_decls.
+struct snapshot_swap_collector: public traversing_visitor
+{
+  varuse_collecting_visitor& vut;
+  set<vardecl*> lives;
+  snapshot_swap_collector (varuse_collecting_visitor& v): vut(v) {}
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    if (s->snapshot_of)
+      {
+        vut.read.insert (s->snapshot_of->referent);
+        vut.written.insert (s->snapshot_of->referent);
+        lives.insert (s->snapshot_of->referent);
+      }
+    traversing_visitor::visit_foreach_loop (s);
+  }
+};
+
+
 void
 c_unparser::emit_probe (derived_probe* v)
 {
@@ -2751,6 +3568,7 @@ c_unparser::emit_probe (derived_probe* v)
   this->tmpvar_counter = 0;
   this->action_counter = 0;
   this->already_checked_action_count = false;
+  this->snapshot_locks.clear();
 
   // If we about to emit a probe that is exactly the same as another
   // probe previously emitted, make the second probe just call the
@@ -2761,8 +3579,9 @@ c_unparser::emit_probe (derived_probe* v)
       // NB: Elision of context variable structs is a separate
       // operation which has already taken place by now.
       if (session->verbose > 1)
-        clog << _F("%s elided, duplicates %s\n",
-		   v->name().c_str(), dupe->name().c_str());
+        clog << _F("%s elided, duplicates %s%s\n",
+		   v->name().c_str(), dupe->name().c_str(),
+                   probe_thunks.count (v) ? _(" with its own thunks") : "");
 
 #if DUPMETHOD_CALL
       // This one emits a direct call to the first copy.
@@ -2817,6 +3636,14 @@ c_unparser::emit_probe (derived_probe* v)
               (*it)->sole_location()->condition->visit (& vut);
             }
 
+          // Each live array of a foreach snapshot is write-locked
+          // along with the rest, and let go of once swapped out.
+          snapshot_swap_collector ssc (vut);
+          v->body->visit (& ssc);
+          for (set<vardecl*>::const_iterator it = ssc.lives.begin();
+               it != ssc.lives.end(); ++it)
+            snapshot_locks[*it] = -1;
+
           emit_lock_decls (vut);
         }
 
@@ -2838,7 +3665,9 @@ c_unparser::emit_probe (derived_probe* v)
       if (v->needs_global_locks ())
         emit_locks ();
 
-      // initialize locals
+      // initialize locals, except overlaid ones (see emit_overlay_inits)
+      local_overlay ov;
+      compute_local_overlay (*session, v->body, v->locals, ov);
       for (unsigned j=0; j<v->locals.size(); j++)
         {
 	  if (v->locals[j]->synthetic)
@@ -2846,16 +3675,10 @@ c_unparser::emit_probe (derived_probe* v)
 	  if (v->locals[j]->index_types.size() > 0) // array?
             throw SEMANTIC_ERROR (_("array locals not supported, missing global declaration?"),
                                   v->locals[j]->tok);
-	  else if (v->locals[j]->type == pe_long)
-	    o->newline() << "l->" << c_localname (v->locals[j]->name)
-			 << " = 0;";
-	  else if (v->locals[j]->type == pe_string)
-	    o->newline() << "l->" << c_localname (v->locals[j]->name)
-			 << "[0] = '\\0';";
-	  else
-	    throw SEMANTIC_ERROR (_("unsupported local variable type"),
-				  v->locals[j]->tok);
+	  else if (!ov.slot_of.count (v->locals[j]))
+	    emit_local_init (v->locals[j]);
         }
+      overlay_inits = ov.inits;
 
       v->initialize_probe_context_vars (o);
 
@@ -2875,6 +3698,7 @@ c_unparser::emit_probe (derived_probe* v)
 
 
       v->body->visit (this);
+      overlay_inits.clear();
 
       record_actions(0, v->body->tok, true);
 
@@ -2898,7 +3722,7 @@ c_unparser::emit_probe (derived_probe* v)
 
       // XXX: do this flush only if the body included a
       // print/printf/etc. routine!
-      o->newline() << "_stp_print_flush();";
+      o->newline() << "_stp_print_flush_batched();";
       o->newline(-1) << "}\n";
     }
 
@@ -2986,14 +3810,9 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       if (!written_p && read_p && !write_p)
         continue;
 
-      o->newline() << "{";
-      o->newline(1) << ".lock = global_lock(" + c_globalname(v->name) + "),";
-      o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
-      o->newline() << "#ifdef STP_TIMING";
-      o->newline() << ".skipped = global_skipped(" << c_globalname (v->name) << "),";
-      o->newline() << ".contention = global_contended(" << c_globalname (v->name) << "),";
-      o->newline() << "#endif";
-      o->newline(-1) << "},";
+      emit_lock_entry (v, write_p);
+      if (snapshot_locks.count (v))
+        snapshot_locks[v] = numvars;
 
       numvars ++;
       if (session->verbose > 1)
@@ -3002,6 +3821,14 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
     }
 
   o->newline(-1) << "};";
+  num_locks = numvars;
+
+  for (map<vardecl*, int>::const_iterator it = snapshot_locks.begin();
+       it != snapshot_locks.end(); ++it)
+    {
+      assert (it->second >= 0);
+      o->newline() << "int snapshot_unlocked_" << it->second << " = 0;";
+    }
 
   if (session->verbose > 1)
     {
@@ -3012,6 +3839,25 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
 }
 
 
+void
+c_unparser::emit_lock_entry(vardecl* v, bool write_p)
+{
+  o->newline() << "{";
+  o->newline(1) << ".lock = global_lock(" + c_globalname(v->name) + "),";
+  o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
+  o->newline() << "#ifdef STP_TIMING";
+  if (session->runtime_usermode_p())
+    {
+      o->newline() << ".skipped = global_skipped(" << c_globalname (v->name) << "),";
+      o->newline() << ".contention = global_contended(" << c_globalname (v->name) << "),";
+    }
+  else
+    o->newline() << ".stats = global_lock_stats(" << c_globalname (v->name) << "),";
+  o->newline() << "#endif";
+  o->newline(-1) << "},";
+}
+
+
 void
 c_unparser::emit_locks()
 {
@@ -3024,20 +3870,72 @@ c_unparser::emit_locks()
 void
 c_unparser::emit_unlocks()
 {
-  o->newline() << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
+  if (snapshot_locks.empty())
+    {
+      o->newline() << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
+      return;
+    }
+
+  // Still in reverse order, but skip the live arrays of foreach
+  // snapshots that were already let go of.
+  set<int> skips;
+  for (map<vardecl*, int>::const_iterator it = snapshot_locks.begin();
+       it != snapshot_locks.end(); ++it)
+    skips.insert (it->second);
+
+  unsigned end = num_locks;
+  for (set<int>::const_reverse_iterator it = skips.rbegin();
+       it != skips.rend(); ++it)
+    {
+      unsigned i = *it;
+      if (end > i + 1)
+        o->newline() << "stp_unlock_probe(&locks[" << i + 1 << "], "
+                     << end - (i + 1) << ");";
+      o->newline() << "if (!snapshot_unlocked_" << i << ")";
+      o->newline(1) << "stp_unlock_probe(&locks[" << i << "], 1);";
+      o->indent(-1);
+      end = i;
+    }
+  if (end > 0)
+    o->newline() << "stp_unlock_probe(locks, " << end << ");";
+}
+
+
+// Swap the live array of a foreach snapshot (see
+// semantic_pass_snapshot_arrays) into its spare, and let go of the
+// live array's lock, which the probe took in order with the rest.
+// The spare is only left with rows by a loop that errored out, which
+// ends the session, but drop them anyway lest they show up in this
+// snapshot.
+void
+c_unparser::emit_snapshot_swap(vardecl* live, vardecl* spare)
+{
+  assert (snapshot_locks.count (live) && snapshot_locks[live] >= 0);
+  int i = snapshot_locks[live];
+
+  string clear = (spare->type == pe_stats) ? "_stp_pmap_clear" : "_stp_map_clear";
+  string size = (spare->type == pe_stats) ? "_stp_pmap_size" : "_stp_map_size";
+  o->newline() << "if (unlikely(" << size << "(global(" << c_globalname (spare->name)
+               << ")) != 0))";
+  o->newline(1) << clear << "(global(" << c_globalname (spare->name) << "));";
+  o->newline(-1) << "global_swap(" << c_globalname (live->name) << ", "
+               << c_globalname (spare->name) << ");";
+  o->newline() << "stp_unlock_probe(&locks[" << i << "], 1);";
+  o->newline() << "snapshot_unlocked_" << i << " = 1;";
 }
 
 
 void
 c_unparser::collect_map_index_types(vector<vardecl *> const & vars,
-				    set< pair<vector<exp_type>, exp_type> > & types)
+				    map<string, vardecl*> & types)
 {
   for (unsigned i = 0; i < vars.size(); ++i)
     {
       vardecl *v = vars[i];
       if (v->arity > 0)
 	{
-	  types.insert(make_pair(v->index_types, v->type));
+	  // one representative of each instantiation
+	  types.insert(make_pair(map_keytypes(v), v));
 	}
     }
 }
@@ -3100,7 +3998,7 @@ c_unparser::map_keytypes(vardecl* v)
           result += 'i';
           break;
         case pe_string:
-          result += 's';
+          result += map_string_varlen (v) ? 'v' : 's';
           break;
         case pe_stats:
           result += 'x';
@@ -3113,10 +4011,36 @@ c_unparser::map_keytypes(vardecl* v)
   return result;
 }
 
+// Whether to instantiate a map with MAP_STRING_VARLEN, storing its
+// string keys and values in power-of-two chunks of a per-map arena
+// (see runtime/map-str.c), rather than in MAP_STRING_LENGTH arrays.
+bool
+c_unparser::map_string_varlen (vardecl* v)
+{
+  // The nodes then hold plain pointers, which won't do for the dyninst
+  // shared memory maps, nor for the pmap nodes copied on aggregation.
+  if (session->runtime_mode != systemtap_session::kernel_runtime
+      || v->type == pe_stats)
+    return false;
+  if (v->type != pe_string
+      && find (v->index_types.begin(), v->index_types.end(), pe_string)
+         == v->index_types.end())
+    return false;
+
+  // The arena can run out before the map has MAXMAPENTRIES rows, so it
+  // is opt-in with -DMAP_STRING_ARENA_AVG=<bytes>, and only worth it
+  // when that budget is well below the inline size.
+  unsigned long avg = 0, len = 512;
+  c_macro_value (*session, "MAP_STRING_ARENA_AVG", avg);
+  if (!c_macro_value (*session, "MAP_STRING_LENGTH", len))
+    c_macro_value (*session, "MAXSTRINGLEN", len);
+  return avg > 0 && len >= 2 * avg;
+}
+
 void
 c_unparser::emit_map_type_instantiations ()
 {
-  set< pair<vector<exp_type>, exp_type> > types;
+  map<string, vardecl*> types;
 
   collect_map_index_types(session->globals, types);
 
@@ -3129,22 +4053,26 @@ c_unparser::emit_map_type_instantiations ()
   if (!types.empty())
     o->newline() << "#include \"alloc.c\"";
 
-  for (set< pair<vector<exp_type>, exp_type> >::const_iterator i = types.begin();
-       i != types.end(); ++i)
+  for (map<string, vardecl*>::const_iterator it = types.begin();
+       it != types.end(); ++it)
     {
-      o->newline() << "#define VALUE_TYPE " << mapvar::value_typename(i->second);
-      for (unsigned j = 0; j < i->first.size(); ++j)
+      vardecl* v = it->second;
+      o->newline() << "#define VALUE_TYPE " << mapvar::value_typename(v->type);
+      for (unsigned j = 0; j < v->index_types.size(); ++j)
 	{
-	  string ktype = mapvar::key_typename(i->first.at(j));
+	  string ktype = mapvar::key_typename(v->index_types.at(j));
 	  o->newline() << "#define KEY" << (j+1) << "_TYPE " << ktype;
 	}
       /* For statistics, flag map-gen to pull in nested pmap-gen too.  */
-      if (i->second == pe_stats)
+      if (v->type == pe_stats)
 	o->newline() << "#define MAP_DO_PMAP 1";
+      if (map_string_varlen (v))
+	o->newline() << "#define MAP_STRING_VARLEN 1";
       o->newline() << "#include \"map-gen.c\"";
+      o->newline() << "#undef MAP_STRING_VARLEN";
       o->newline() << "#undef MAP_DO_PMAP";
       o->newline() << "#undef VALUE_TYPE";
-      for (unsigned j = 0; j < i->first.size(); ++j)
+      for (unsigned j = 0; j < v->index_types.size(); ++j)
 	{
 	  o->newline() << "#undef KEY" << (j+1) << "_TYPE";
 	}
@@ -3659,7 +4587,46 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap, map_string_varlen (v),
+      map_sortn_p (v));
+}
+
+
+// Collects the arrays iterated by a sorted foreach with a limit.
+struct sortn_map_collector: public traversing_visitor
+{
+  set<vardecl*>& maps;
+  sortn_map_collector (set<vardecl*>& maps): maps (maps) {}
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol *array;
+    hist_op *hist;
+    classify_indexable (s->base, array, hist);
+    if (array && array->referent && s->sort_direction && s->limit)
+      maps.insert (array->referent);
+    traversing_visitor::visit_foreach_loop (s);
+  }
+};
+
+
+// Whether an array is created with KEY_SORTN, giving it a heap for
+// picking the top entries of a foreach limit in O(n log k), instead of
+// sorting the whole array (see runtime/map.c, _stp_map_sortn).
+bool
+c_unparser::map_sortn_p (vardecl* v)
+{
+  if (!sortn_maps_collected)
+    {
+      sortn_map_collector smc (sortn_maps);
+      for (unsigned i = 0; i < session->probes.size(); ++i)
+        session->probes[i]->body->visit (&smc);
+      for (map<string,functiondecl*>::iterator it = session->functions.begin();
+           it != session->functions.end(); it++)
+        it->second->body->visit (&smc);
+      sortn_maps_collected = true;
+    }
+  return sortn_maps.count (v) > 0;
 }
 
 
@@ -3717,6 +4684,7 @@ c_unparser::visit_block (block *s)
     {
       try
         {
+          emit_overlay_inits (s->statements[i]);
           wrap_compound_visit (s->statements[i]);
 	  o->newline();
         }
@@ -3889,6 +4857,7 @@ c_tmpcounter::start_struct_def (std::ostream::pos_type &before,
                << ":" << lex_cast(tok->location.line) << " */";
   o->indent(1);
   after = o->tellp();
+  push_size_frame (false);
 }
 
 void
@@ -3897,6 +4866,7 @@ c_tmpcounter::close_struct_def (std::ostream::pos_type before,
 {
   // meant to be used with ::start_struct_def. remove the struct if empty.
   translator_output *o = parent->o;
+  pop_size_frame ();
   o->indent(-1);
   if (after == o->tellp())
     o->seekp(before);
@@ -3913,12 +4883,14 @@ c_tmpcounter::start_compound_statement (const char* tag, statement *s)
                << loc.file->name << ":"
                << lex_cast(loc.line) << " */";
   o->indent(1);
+  push_size_frame (true);
 }
 
 void
 c_tmpcounter::close_compound_statement (const char*, statement *)
 {
   translator_output *o = parent->o;
+  pop_size_frame ();
   o->newline(-1) << "};";
 }
 
@@ -4118,6 +5090,9 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
       mapvar mv = getmap (array->referent, s->tok);
       vector<var> keys;
 
+      if (s->snapshot_of)
+        emit_snapshot_swap (s->snapshot_of->referent, array->referent);
+
       // NB: structure parallels for_loop
 
       // initialization
@@ -5729,23 +6704,46 @@ c_unparser::visit_functioncall (functioncall* e)
                        << ".__retvalue = &" << tmp_ret.value() << "[0];";
         }
 
-      // call function
-      o->newline() << c_funcname (r->name) << " (c);";
+      // call function, or this probe's own thunk in a shared handler
+      map<const functioncall*, thunk_slot>::const_iterator thunk =
+        current_probe ? thunk_slots.find (e) : thunk_slots.end();
+      if (thunk != thunk_slots.end())
+        o->newline() << tmp_ret.value() << " = (*c->probe->thunks["
+                     << thunk->second.index << "]) (c);";
+      else
+        o->newline() << c_funcname (r->name) << " (c);";
       o->newline() << "if (unlikely(c->last_error)) goto out;";
 
       if (!already_checked_action_count && !session->suppress_time_limits
           && !session->unoptimized)
         {
-          max_action_info mai (*session);
-          r->body->visit(&mai);
+          // count the costliest of the thunks that may be called here
+          set<functiondecl*> callees;
+          if (thunk != thunk_slots.end())
+            callees = thunk->second.functions;
+          else
+            callees.insert (r);
+
+          bool finite = true;
+          unsigned statement_count = 0;
+          for (set<functiondecl*>::iterator it = callees.begin();
+               it != callees.end() && finite; ++it)
+            {
+              max_action_info mai (*session);
+              (*it)->body->visit(&mai);
+              finite = mai.statement_count_finite();
+              statement_count = max (statement_count, mai.statement_count);
+            }
           // if an unoptimized function/probe called an optimized function, then
           // increase the counter, since the subtraction isn't done within an
           // optimized function
-          if(mai.statement_count_finite())
-            record_actions (mai.statement_count, e->tok, true);
+          if(finite)
+            record_actions (statement_count, e->tok, true);
         }
 
-      if (r->type == pe_unknown || tmp_ret.is_overridden())
+      if (thunk != thunk_slots.end())
+        yield = true; // the thunk returned the value directly
+      else if (r->type == pe_unknown || tmp_ret.is_overridden())
         // If we passed typechecking with pe_unknown, or if we directly assigned
         // the functioncall retval, then nothing will use this return value
         yield = false;
@@ -7966,6 +8964,16 @@ translate_pass (systemtap_session& s)
 
       s.up->emit_common_header (); // context etc.
 
+      if (s.verbose > 0)
+        {
+          // NB: an estimate, ignoring alignment and the common fields
+          unsigned long fn_size = cup.function_locals_size * (nesting + 1);
+          clog << _F("Pass 3: estimated context locals size %lu bytes per cpu "
+                     "(probes %lu, functions %lu), %lu bytes saved by overlaying locals",
+                     cup.probe_locals_size + fn_size, cup.probe_locals_size,
+                     fn_size, cup.overlay_saved_size) << endl;
+        }
+
       if (s.need_unwind)
 	s.op->newline() << "#include \"stack.c\"";
 
@@ -8017,6 +9025,8 @@ translate_pass (systemtap_session& s)
       s.op->newline() << "#include \"common_session_state.h\"";
 
       s.op->newline() << "#include \"probe_lock.h\" ";
+      if (!s.runtime_usermode_p())
+        cup.emit_lock_stats_table ();
 
       s.op->newline() << "#ifdef STAP_NEED_GETTIMEOFDAY";
       s.op->newline() << "#include \"time.c\"";  // Don't we all need more?
@@ -8089,6 +9099,10 @@ translate_pass (systemtap_session& s)
       s.op->newline(1) << "const size_t index;";
       s.op->newline() << "void (* const ph) (struct context*);";
       s.op->newline() << "unsigned cond_enabled:1;"; // just one bit required
+      s.op->newline() << "int64_t (* const * const thunks) (struct context*);";
+      s.op->newline() << "#ifdef STP_OVERLOAD_GOVERNOR";
+      s.op->newline() << "atomic_t sample_shift;"; // see overload.h
+      s.op->newline() << "#endif";
       s.op->newline() << "#if defined(STP_TIMING) || defined(STP_ALIBI)";
       CALCIT(location);
       CALCIT(derivation);
@@ -8104,8 +9118,9 @@ translate_pass (systemtap_session& s)
       s.op->newline() << "#else";
       s.op->newline() << "#define STAP_PROBE_INIT_NAME(PN)";
       s.op->newline() << "#endif";
-      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, PP, PN, L, D) "
-                      << "{ .index=(I), .ph=(PH), .cond_enabled=1, .pp=(PP), "
+      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, TH, PP, PN, L, D) "
+                      << "{ .index=(I), .ph=(PH), .cond_enabled=1, .thunks=(TH), "
+                      << ".pp=(PP), "
                       << "STAP_PROBE_INIT_NAME(PN) "
                       << "STAP_PROBE_INIT_TIMING(L, D) "
                       << "}";
@@ -8113,6 +9128,9 @@ translate_pass (systemtap_session& s)
       s.op->assert_0_indent();
 #undef CALCIT
 
+      if (!s.runtime_usermode_p())
+        s.op->newline() << "#include \"overload.h\"";
+
       // Run a varuse_collecting_visitor over probes that need global
       // variable locks.  We'll use this information later in
       // emit_locks()/emit_unlocks().
@@ -8121,10 +9139,15 @@ translate_pass (systemtap_session& s)
         assert_no_interrupts();
         s.probes[i]->session_index = i;
         if (s.probes[i]->needs_global_locks())
+	  {
 	    s.probes[i]->body->visit (&cup.vcv_needs_global_locks);
+	    snapshot_swap_collector ssc (cup.vcv_needs_global_locks);
+	    s.probes[i]->body->visit (&ssc);
+	  }
 	}
       s.op->assert_0_indent();
 
+      cup.find_shared_probes ();
       for (unsigned i=0; i<s.probes.size(); i++)
         {
           assert_no_interrupts();
@@ -8132,12 +9155,15 @@ translate_pass (systemtap_session& s)
         }
       s.op->assert_0_indent();
 
+      cup.emit_probe_thunks ();
       s.op->newline() << "static struct stap_probe stap_probes[] = {";
       s.op->indent(1);
       for (unsigned i=0; i<s.probes.size(); ++i)
         {
           derived_probe* p = s.probes[i];
           s.op->newline() << "STAP_PROBE_INIT(" << i << ", &" << p->name() << ", "
+                          << (cup.probe_thunks.count (p)
+                              ? "stap_probe_thunks_" + lex_cast (i) : "NULL") << ", "
                           << lex_cast_qstring (*p->sole_location()) << ", "
                           << lex_cast_qstring (*p->script_location()) << ", "
                           << lex_cast_qstring (p->tok->location) << ", "
@@ -103,6 +103,10 @@ int prepare_translate_pass (systemtap_session& s);
 
 int translate_pass (systemtap_session& s);
 
+// Look up the numeric value of a -D macro, if it was given as one.
+bool c_macro_value (systemtap_session& s, const std::string& name,
+                    unsigned long& value);
+
 #endif // TRANSLATE_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */